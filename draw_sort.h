@@ -0,0 +1,134 @@
+#ifndef DRAW_SORT
+
+/*
+ * Back to front ordering of the particle draw buffer.
+ *
+ * A key is 64 bits: the view space depth in the high word and the buffer index of the particle in the
+ * low word. The depth is mapped to an unsigned integer with the same order as the float and cut to its
+ * top depth_bits bits, so keys that compare equal draw in buffer order. Fewer bits sort faster, 16 keep
+ * 7 bits of mantissa (the precision of the old 32-bit keys), 32 sort exactly.
+ *
+ * draw_sort is a least significant digit radix sort over the depth bytes only: the sort is stable and the
+ * indices are ascending already, so the index bytes need no passes. The keys and all the histograms are
+ * built in one SSE2 pass over the depths, passes whose byte is the same for every key are skipped.
+ * Define DRAW_SORT_IMPL in one translation unit.
+ */
+
+#include <cstdint>
+
+enum { DRAW_SORT_MIN_DEPTH_BITS = 8, DRAW_SORT_MAX_DEPTH_BITS = 32, DRAW_SORT_DEFAULT_DEPTH_BITS = 24 };
+
+inline uint32_t draw_sort_index(uint64_t key) { return (uint32_t)key; }
+
+// Sorts the particles by ascending depth (view space z, the camera looks down -z so that is back to front).
+// keys and tmp hold n keys each. Returns whichever of the two has the sorted keys.
+uint64_t *draw_sort(const float *depth, int n, int depth_bits, uint64_t *keys, uint64_t *tmp);
+
+#ifdef DRAW_SORT_IMPL
+
+#include <emmintrin.h>
+
+enum { DRAW_SORT_RADIX = 256, DRAW_SORT_MAX_PASSES = 4 };
+
+static inline uint32_t draw_sort_depth_mask(int depth_bits)
+{
+    return (depth_bits >= 32) ? 0xffffffffu : ~(0xffffffffu >> depth_bits);
+}
+
+// Flips all the bits of negative floats and the sign bit of positive ones, unsigned order is then float order.
+static inline uint32_t draw_sort_float_key(float f)
+{
+    union {
+        float f;
+        uint32_t u;
+    } v;
+    v.f = f;
+    uint32_t sign = (uint32_t)((int32_t)v.u >> 31);
+    return v.u ^ (sign | 0x80000000u);
+}
+
+uint64_t *draw_sort(const float *depth, int n, int depth_bits, uint64_t *keys, uint64_t *tmp)
+{
+    if (depth_bits < DRAW_SORT_MIN_DEPTH_BITS) depth_bits = DRAW_SORT_MIN_DEPTH_BITS;
+    if (depth_bits > DRAW_SORT_MAX_DEPTH_BITS) depth_bits = DRAW_SORT_MAX_DEPTH_BITS;
+    uint32_t mask = draw_sort_depth_mask(depth_bits);
+    int first_pass = (32 - depth_bits) / 8;
+
+    // Four copies of every histogram, one per SIMD lane, so consecutive keys do not wait on each
+    // other's increments.
+    static thread_local uint32_t lane_hist[DRAW_SORT_MAX_PASSES][4][DRAW_SORT_RADIX];
+    for (int p = first_pass; p < DRAW_SORT_MAX_PASSES; p++)
+    {
+        for (int l = 0; l < 4; l++)
+        {
+            for (int d = 0; d < DRAW_SORT_RADIX; d++) lane_hist[p][l][d] = 0;
+        }
+    }
+
+    const __m128i sign_bit = _mm_set1_epi32((int)0x80000000u);
+    const __m128i depth_mask = _mm_set1_epi32((int)mask);
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128i index_step = _mm_set1_epi32(4);
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i u = _mm_castps_si128(_mm_loadu_ps(depth + i));
+        __m128i flip = _mm_or_si128(_mm_srai_epi32(u, 31), sign_bit);
+        __m128i d = _mm_and_si128(_mm_xor_si128(u, flip), depth_mask);
+
+        _mm_storeu_si128((__m128i*)(keys + i), _mm_unpacklo_epi32(index, d));
+        _mm_storeu_si128((__m128i*)(keys + i + 2), _mm_unpackhi_epi32(index, d));
+        index = _mm_add_epi32(index, index_step);
+
+        for (int p = first_pass; p < DRAW_SORT_MAX_PASSES; p++)
+        {
+            alignas(16) uint32_t digits[4];
+            _mm_store_si128((__m128i*)digits, _mm_and_si128(_mm_srli_epi32(d, p * 8), byte_mask));
+            lane_hist[p][0][digits[0]]++;
+            lane_hist[p][1][digits[1]]++;
+            lane_hist[p][2][digits[2]]++;
+            lane_hist[p][3][digits[3]]++;
+        }
+    }
+    for (; i < n; i++)
+    {
+        uint32_t d = draw_sort_float_key(depth[i]) & mask;
+        keys[i] = ((uint64_t)d << 32) | (uint32_t)i;
+        for (int p = first_pass; p < DRAW_SORT_MAX_PASSES; p++) lane_hist[p][0][(d >> (p * 8)) & 0xff]++;
+    }
+
+    uint64_t *src = keys;
+    uint64_t *dst = tmp;
+    for (int p = first_pass; p < DRAW_SORT_MAX_PASSES; p++)
+    {
+        uint32_t offset[DRAW_SORT_RADIX];
+        uint32_t sum = 0;
+        bool trivial = false;
+        for (int d = 0; d < DRAW_SORT_RADIX; d++)
+        {
+            uint32_t count = lane_hist[p][0][d] + lane_hist[p][1][d] + lane_hist[p][2][d] + lane_hist[p][3][d];
+            if (count == (uint32_t)n) trivial = true;
+            offset[d] = sum;
+            sum += count;
+        }
+        if (trivial) continue;
+
+        int shift = 32 + p * 8;
+        for (int k = 0; k < n; k++)
+        {
+            uint64_t key = src[k];
+            dst[offset[(key >> shift) & 0xff]++] = key;
+        }
+        uint64_t *t = src;
+        src = dst;
+        dst = t;
+    }
+    return src;
+}
+
+#endif // DRAW_SORT_IMPL
+
+#define DRAW_SORT
+#endif
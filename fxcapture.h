@@ -0,0 +1,256 @@
+#ifndef FXVM_CAPTURE
+
+/*
+ * Capture of a single VM dispatch: the bytecode, the uniform slots, the random number generator state and
+ * the attribute data of an instance range, together with the results of running it. Captures are written
+ * to a binary .fxcap file and replayed by fxvm-replay, so dispatches from real scenes can be benchmarked
+ * and compared offline.
+ *
+ * Only the attributes loaded by the bytecode are stored, with their original stride. Instance indices are
+ * rebased, a replay runs instances [0, instance_count). Define FXVM_CAPTURE_IMPL in one translation unit,
+ * together with FXVM_IMPL.
+ */
+
+#include "fxvm.h"
+
+#include <cstdint>
+
+struct FXVM_Capture
+{
+    enum { MAX_ATTRIBUTES = FXVM_AttributeBindings::MAX_ATTRIBUTES };
+
+    int code_len;
+    uint8_t *code;
+    float uniform_slots[FXVM_Program::MAX_UNIFORM_SLOTS];
+    pcg32_random_t rng;
+
+    int instance_first; // of the captured dispatch, for reference
+    int instance_count;
+
+    uint32_t attribute_mask;
+    int attr_stride[MAX_ATTRIBUTES];
+    int attr_bytes[MAX_ATTRIBUTES];
+    uint8_t *attr_data[MAX_ATTRIBUTES];
+
+    // The first output_width components of register 0 of every instance, after the dispatch.
+    int output_width;
+    float *outputs;
+};
+
+// Snapshots the dispatch of program over [first, first + count) with the bindings and the generator of
+// vm, and runs it on a copy of vm to record the outputs. output_width is the number of components the
+// caller uses (1..4). vm is not changed.
+void fxvm_capture(FXVM_Capture *capture, const FXVM_Machine *vm, const FXVM_Program *program, int first, int count, int output_width);
+void fxvm_capture_free(FXVM_Capture *capture);
+// Both print the error and return false on failure.
+bool fxvm_capture_write(const FXVM_Capture *capture, const char *filename);
+bool fxvm_capture_read(FXVM_Capture *capture, const char *filename);
+// Sets up a machine, its bindings and a program to replay the capture. They point into the capture.
+void fxvm_capture_bind(FXVM_Capture *capture, FXVM_Machine *vm, FXVM_AttributeBindings *bindings, FXVM_Program *program);
+
+#ifdef FXVM_CAPTURE_IMPL
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+enum { FXVM_CAPTURE_MAGIC = 0x50435846, FXVM_CAPTURE_VERSION = 1 }; // "FXCP"
+
+// File header, followed by the bytecode, the attributes in index order (stride, bytes, data) and the outputs.
+struct FXVM_Capture_Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rng_state;
+    uint64_t rng_inc;
+    int32_t instance_first;
+    int32_t instance_count;
+    int32_t output_width;
+    int32_t code_len;
+    uint32_t attribute_mask;
+    float uniform_slots[FXVM_Program::MAX_UNIFORM_SLOTS];
+};
+
+static uint32_t fxvm_capture_attributes(const FXVM_Bytecode *bytecode)
+{
+    uint32_t mask = 0;
+    const uint8_t *end = (uint8_t*)bytecode->code + bytecode->len;
+    const uint8_t *p = (uint8_t*)bytecode->code;
+    while (p < end)
+    {
+        int size = fxvm_instruction_size(p);
+        if (size == 0) break;
+        if ((p[0] & 0x3f) == FXOP_LOAD_ATTRIBUTE && p[2] < FXVM_Capture::MAX_ATTRIBUTES) mask |= 1u << p[2];
+        p += size;
+    }
+    return mask;
+}
+
+void fxvm_capture(FXVM_Capture *capture, const FXVM_Machine *vm, const FXVM_Program *program, int first, int count, int output_width)
+{
+    *capture = { };
+    capture->code_len = program->bytecode.len;
+    capture->code = (uint8_t*)mem_alloc(MEM_OTHER, program->bytecode.len);
+    memcpy(capture->code, program->bytecode.code, program->bytecode.len);
+    memcpy(capture->uniform_slots, program->uniform_slots, sizeof(capture->uniform_slots));
+    capture->rng = vm->rng;
+    capture->instance_first = first;
+    capture->instance_count = count;
+    capture->output_width = output_width;
+
+    capture->attribute_mask = (count > 0) ? fxvm_capture_attributes(&program->bytecode) : 0;
+    for (int a = 0; a < FXVM_Capture::MAX_ATTRIBUTES; a++)
+    {
+        if (!(capture->attribute_mask & (1u << a))) continue;
+        int stride = vm->bindings->attr_stride[a];
+        // Registers are always loaded whole.
+        int bytes = (count - 1) * stride + (int)sizeof(Reg);
+        capture->attr_stride[a] = stride;
+        capture->attr_bytes[a] = bytes;
+        capture->attr_data[a] = (uint8_t*)mem_alloc(MEM_OTHER, bytes);
+        memcpy(capture->attr_data[a], (const uint8_t*)vm->bindings->attr_ptr[a] + (size_t)first * stride, bytes);
+    }
+
+    capture->outputs = (float*)mem_alloc(MEM_OTHER, sizeof(float) * output_width * (count > 0 ? count : 1));
+    FXVM_Machine replay_vm = *vm;
+    FXVM_AttributeBindings bindings;
+    FXVM_Program replay_program;
+    fxvm_capture_bind(capture, &replay_vm, &bindings, &replay_program);
+    enum { GROUP = 16 };
+    for (int i = 0; i < count; i += GROUP)
+    {
+        int n = (count - i < GROUP) ? count - i : GROUP;
+        FXVM_State S[GROUP] = { };
+        exec<GROUP>(&replay_vm, S, i, n, &replay_program);
+        for (int k = 0; k < n; k++) memcpy(&capture->outputs[(i + k) * output_width], S[k].r[0].v, sizeof(float) * output_width);
+    }
+}
+
+void fxvm_capture_free(FXVM_Capture *capture)
+{
+    mem_free(capture->code);
+    for (int a = 0; a < FXVM_Capture::MAX_ATTRIBUTES; a++) mem_free(capture->attr_data[a]);
+    mem_free(capture->outputs);
+    *capture = { };
+}
+
+bool fxvm_capture_write(const FXVM_Capture *capture, const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        printf("Error: could not write %s\n", filename);
+        return false;
+    }
+
+    FXVM_Capture_Header header = { };
+    header.magic = FXVM_CAPTURE_MAGIC;
+    header.version = FXVM_CAPTURE_VERSION;
+    header.rng_state = capture->rng.state;
+    header.rng_inc = capture->rng.inc;
+    header.instance_first = capture->instance_first;
+    header.instance_count = capture->instance_count;
+    header.output_width = capture->output_width;
+    header.code_len = capture->code_len;
+    header.attribute_mask = capture->attribute_mask;
+    memcpy(header.uniform_slots, capture->uniform_slots, sizeof(header.uniform_slots));
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(capture->code, 1, capture->code_len, fp) == (size_t)capture->code_len;
+    for (int a = 0; a < FXVM_Capture::MAX_ATTRIBUTES && ok; a++)
+    {
+        if (!(capture->attribute_mask & (1u << a))) continue;
+        int32_t sizes[2] = { capture->attr_stride[a], capture->attr_bytes[a] };
+        ok = fwrite(sizes, sizeof(sizes), 1, fp) == 1;
+        ok = ok && fwrite(capture->attr_data[a], 1, capture->attr_bytes[a], fp) == (size_t)capture->attr_bytes[a];
+    }
+    size_t output_num = (size_t)capture->instance_count * capture->output_width;
+    ok = ok && fwrite(capture->outputs, sizeof(float), output_num, fp) == output_num;
+    fclose(fp);
+
+    if (!ok) printf("Error: could not write %s\n", filename);
+    return ok;
+}
+
+bool fxvm_capture_read(FXVM_Capture *capture, const char *filename)
+{
+    *capture = { };
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        printf("Error: could not read %s\n", filename);
+        return false;
+    }
+
+    FXVM_Capture_Header header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1;
+    if (ok && (header.magic != FXVM_CAPTURE_MAGIC || header.version != FXVM_CAPTURE_VERSION))
+    {
+        printf("Error: %s is not a version %d capture\n", filename, FXVM_CAPTURE_VERSION);
+        fclose(fp);
+        return false;
+    }
+    ok = ok && header.code_len >= 0 && header.instance_count >= 0 && header.output_width >= 1 && header.output_width <= 4;
+
+    if (ok)
+    {
+        capture->code_len = header.code_len;
+        capture->code = (uint8_t*)mem_alloc(MEM_OTHER, header.code_len);
+        memcpy(capture->uniform_slots, header.uniform_slots, sizeof(capture->uniform_slots));
+        capture->rng.state = header.rng_state;
+        capture->rng.inc = header.rng_inc;
+        capture->instance_first = header.instance_first;
+        capture->instance_count = header.instance_count;
+        capture->output_width = header.output_width;
+        capture->attribute_mask = header.attribute_mask;
+        ok = fread(capture->code, 1, header.code_len, fp) == (size_t)header.code_len;
+    }
+    for (int a = 0; a < FXVM_Capture::MAX_ATTRIBUTES && ok; a++)
+    {
+        if (!(capture->attribute_mask & (1u << a))) continue;
+        int32_t sizes[2];
+        ok = fread(sizes, sizeof(sizes), 1, fp) == 1;
+        // The last instance loads a whole register.
+        ok = ok && sizes[0] >= 0 && sizes[1] >= (capture->instance_count - 1) * sizes[0] + (int)sizeof(Reg);
+        if (!ok) break;
+        capture->attr_stride[a] = sizes[0];
+        capture->attr_bytes[a] = sizes[1];
+        capture->attr_data[a] = (uint8_t*)mem_alloc(MEM_OTHER, sizes[1]);
+        ok = fread(capture->attr_data[a], 1, sizes[1], fp) == (size_t)sizes[1];
+    }
+    if (ok)
+    {
+        size_t output_num = (size_t)capture->instance_count * capture->output_width;
+        capture->outputs = (float*)mem_alloc(MEM_OTHER, sizeof(float) * (output_num ? output_num : 1));
+        ok = fread(capture->outputs, sizeof(float), output_num, fp) == output_num;
+    }
+    fclose(fp);
+
+    if (!ok)
+    {
+        printf("Error: %s is truncated or corrupt\n", filename);
+        fxvm_capture_free(capture);
+    }
+    return ok;
+}
+
+void fxvm_capture_bind(FXVM_Capture *capture, FXVM_Machine *vm, FXVM_AttributeBindings *bindings, FXVM_Program *program)
+{
+    *bindings = { };
+    for (int a = 0; a < FXVM_Capture::MAX_ATTRIBUTES; a++)
+    {
+        if (!(capture->attribute_mask & (1u << a))) continue;
+        bindings->attr_ptr[a] = capture->attr_data[a];
+        bindings->attr_stride[a] = capture->attr_stride[a];
+    }
+    vm->bindings = bindings;
+    vm->rng = capture->rng;
+
+    *program = fxvm_program_new(FXVM_Bytecode{ capture->code_len, capture->code });
+    memcpy(program->uniform_slots, capture->uniform_slots, sizeof(program->uniform_slots));
+}
+
+#endif // FXVM_CAPTURE_IMPL
+
+#define FXVM_CAPTURE
+#endif
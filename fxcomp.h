@@ -59,6 +59,9 @@ struct FXVM_Compiler
 
     int error_num;
     void (*report_error)(const char *);
+
+    // Set by a successful compile.
+    FXVM_Cost cost;
 };
 
 void register_constant(FXVM_Compiler *compiler, const char *name, float *value, int width);
@@ -69,6 +72,8 @@ int register_global_input_variable(FXVM_Compiler *compiler, const char *name, FX
 int register_attribute(FXVM_Compiler *compiler, const char *name, FXVM_Type type);
 
 bool compile(FXVM_Compiler *compiler, const char *source, const char *source_end);
+// Frees everything but the bytecode in codegen.buffer, which is owned by the program made from it.
+void free_compiler(FXVM_Compiler *compiler);
 
 #ifdef FXVM_COMPILER_IMPL
 
@@ -125,7 +130,7 @@ void ensure_token_fits(FXVM_Compiler *compiler)
     if (compiler->token_num + 1 > compiler->token_cap)
     {
         int new_cap = compiler->token_cap + 32;
-        compiler->tokens = (FXVM_Token*)realloc(compiler->tokens, new_cap * sizeof(FXVM_Token));
+        compiler->tokens = (FXVM_Token*)mem_realloc(MEM_COMPILER, compiler->tokens, new_cap * sizeof(FXVM_Token));
         compiler->token_cap = new_cap;
     }
 }
@@ -384,7 +389,7 @@ FXVM_Ast* alloc_node(FXVM_Compiler *compiler, FXVM_AstKind kind)
 {
     (void)compiler;
     // TODO: use pool allocator, with growing number of pools, to guarantee stable memory location for nodes.
-    auto *node = (FXVM_Ast*)malloc(sizeof(FXVM_Ast));
+    auto *node = (FXVM_Ast*)mem_alloc(MEM_COMPILER, sizeof(FXVM_Ast));
     *node = { kind, { }, { } };
     return node;
 }
@@ -394,7 +399,7 @@ void ensure_node_fits(FXAST_Nodes *root)
     if (root->node_num + 1 > root->node_cap)
     {
         int new_cap = root->node_cap + 32;
-        root->nodes = (FXVM_Ast**)realloc(root->nodes, new_cap * sizeof(FXVM_Ast*));
+        root->nodes = (FXVM_Ast**)mem_realloc(MEM_COMPILER, root->nodes, new_cap * sizeof(FXVM_Ast*));
         root->node_cap = new_cap;
     }
 }
@@ -1024,6 +1029,8 @@ FXVM_Type type_check_binary(FXVM_Compiler *compiler, FXVM_Ast *ast)
                     invalid_operand_types(compiler, ast->binary.op, type_left, type_right);
                     return ast->type = FXTYP_NONE;
                 }
+                // Component-wise, of the same type.
+                return ast->type = type_left;
             }
             return ast->type = FXTYP_NONE;
         }
@@ -1044,6 +1051,8 @@ FXVM_Type type_check_binary(FXVM_Compiler *compiler, FXVM_Ast *ast)
                     invalid_operand_types(compiler, ast->binary.op, type_left, type_right);
                     return ast->type = FXTYP_NONE;
                 }
+                // Component-wise, of the same type.
+                return ast->type = type_left;
             }
             return ast->type = FXTYP_NONE;
         }
@@ -1057,12 +1066,8 @@ FXVM_Type type_check_swizzle(FXVM_Compiler *compiler, FXVM_Ast *ast)
 {
     FXVM_Type oper_type = type_check(compiler, ast->swizzle.operand);
     (void)oper_type;
-    uint32_t mask = ast->swizzle.mask;
-    int len = ((mask & 0xc0) > 0 ? 1 : 0)
-            + ((mask & 0x30) > 0 ? 1 : 0)
-            + ((mask & 0x0c) > 0 ? 1 : 0)
-            + ((mask & 0x03) > 0 ? 1 : 0);
-    FXVM_Type result_type = (FXVM_Type)len;
+    // The length can not be derived from the mask, x is encoded as 0.
+    FXVM_Type result_type = (FXVM_Type)ast->swizzle.len;
     return ast->type = result_type;
 }
 
@@ -1334,7 +1339,7 @@ void ensure_il_instr_fits(FXVM_ILContext *ctx)
     if (ctx->instr_num + 1 > ctx->instr_cap)
     {
         int new_cap = ctx->instr_cap + 32;
-        ctx->instructions = (FXVM_ILInstr*)realloc(ctx->instructions, new_cap * sizeof(FXVM_ILInstr));
+        ctx->instructions = (FXVM_ILInstr*)mem_realloc(MEM_COMPILER, ctx->instructions, new_cap * sizeof(FXVM_ILInstr));
         ctx->instr_cap = new_cap;
     }
 }
@@ -1875,6 +1880,8 @@ struct Registers
     int span_num;
     Span *spans;
 
+    int peak_used;
+
     bool is_last_instr; // For special casing
 };
 
@@ -1901,6 +1908,9 @@ int allocate_register(FXVM_Codegen *gen, Registers *regs, FXIL_Reg pseudo_reg, i
         {
             regs->used[i] = true;
             regs->spans[pseudo_reg.index].allocated_reg = i;
+            int used_num = 0;
+            for (int r = 0; r < Registers::MAX_REGS; r++) used_num += regs->used[r];
+            if (used_num > regs->peak_used) regs->peak_used = used_num;
             return i;
         }
     }
@@ -1919,22 +1929,17 @@ void ensure_bytes_fit(FXVM_Codegen *gen, int n)
     if (gen->buffer_len + n > gen->buffer_cap)
     {
         int new_cap = gen->buffer_len + ((n > 32) ? n : 32);
-        gen->buffer = (uint8_t*)realloc(gen->buffer, new_cap * sizeof(uint8_t));
+        gen->buffer = (uint8_t*)mem_realloc(MEM_BYTECODE, gen->buffer, new_cap * sizeof(uint8_t));
         gen->buffer_cap = new_cap;
     }
 }
 
-void write_op(FXVM_Codegen *gen, FXVM_BytecodeOp op)
-{
-    ensure_bytes_fit(gen, 1);
-    gen->buffer[gen->buffer_len] = (uint8_t)op;
-    gen->buffer_len++;
-}
-
+// width is the number of components the instruction works on, stored as width - 1 in the top two bits.
 void write_op(FXVM_Codegen *gen, FXVM_BytecodeOp op, int width)
 {
     ensure_bytes_fit(gen, 1);
-    gen->buffer[gen->buffer_len] = (uint8_t)op | (width << 6);
+    int width_bits = (width >= 1 && width <= 4) ? width - 1 : 3;
+    gen->buffer[gen->buffer_len] = (uint8_t)op | (uint8_t)(width_bits << 6);
     gen->buffer_len++;
 }
 
@@ -1970,26 +1975,26 @@ void write_input_index(FXVM_Codegen *gen, int index)
 
 void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
 {
+    int width = (int)instr->target.type;
     switch (instr->op)
     {
     case FXIL_LOAD_CONST:
         {
             int reg = allocate_register(gen, regs, instr->target);
-            write_op(gen, FXOP_LOAD_CONST);
+            write_op(gen, FXOP_LOAD_CONST, width);
             write_regs(gen, reg);
             write_const(gen, instr->constant_load.v);
         } break;
     case FXIL_LOAD_INPUT:
         {
             int reg = allocate_register(gen, regs, instr->target);
-            write_op(gen, FXOP_LOAD_GLOBAL_INPUT);
+            write_op(gen, FXOP_LOAD_GLOBAL_INPUT, width);
             write_regs(gen, reg);
             write_input_index(gen, instr->input_load.input_index);
         } break;
     case FXIL_LOAD_ATTRIB:
         {
             int reg = allocate_register(gen, regs, instr->target);
-            int width = (int)instr->target.type;
             write_op(gen, FXOP_LOAD_ATTRIBUTE, width);
             write_regs(gen, reg);
             write_input_index(gen, instr->input_load.input_index);
@@ -1998,7 +2003,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->swizzle.operand);
-            write_op(gen, FXOP_SWIZZLE);
+            write_op(gen, FXOP_SWIZZLE, width);
             write_regs(gen, target_reg, source_reg);
             write_input_index(gen, instr->swizzle.mask); // assuming 8 bytes
         } break;
@@ -2006,14 +2011,14 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_MOV);
+            write_op(gen, FXOP_MOV, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_MOV_X:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_MOV_X);
+            write_op(gen, FXOP_MOV_X, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_MOV_XY:
@@ -2021,7 +2026,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int target_reg = allocate_register(gen, regs, instr->target);
             int x_reg = get_register(regs, instr->read_operands[0]);
             int y_reg = get_register(regs, instr->read_operands[1]);
-            write_op(gen, FXOP_MOV_XY);
+            write_op(gen, FXOP_MOV_XY, width);
             write_regs(gen, target_reg, x_reg);
             write_regs(gen, y_reg);
         } break;
@@ -2031,7 +2036,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int x_reg = get_register(regs, instr->read_operands[0]);
             int y_reg = get_register(regs, instr->read_operands[1]);
             int z_reg = get_register(regs, instr->read_operands[2]);
-            write_op(gen, FXOP_MOV_XYZ);
+            write_op(gen, FXOP_MOV_XYZ, width);
             write_regs(gen, target_reg, x_reg);
             write_regs(gen, y_reg, z_reg);
         } break;
@@ -2042,7 +2047,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int y_reg = get_register(regs, instr->read_operands[1]);
             int z_reg = get_register(regs, instr->read_operands[2]);
             int w_reg = get_register(regs, instr->read_operands[3]);
-            write_op(gen, FXOP_MOV_XY);
+            write_op(gen, FXOP_MOV_XY, width);
             write_regs(gen, target_reg, x_reg);
             write_regs(gen, y_reg, z_reg);
             write_regs(gen, w_reg);
@@ -2051,7 +2056,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_NEG);
+            write_op(gen, FXOP_NEG, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_ADD:
@@ -2059,7 +2064,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int target_reg = allocate_register(gen, regs, instr->target);
             int a_reg = get_register(regs, instr->read_operands[0]);
             int b_reg = get_register(regs, instr->read_operands[1]);
-            write_op(gen, FXOP_ADD);
+            write_op(gen, FXOP_ADD, width);
             write_regs(gen, target_reg, a_reg);
             write_regs(gen, b_reg);
         } break;
@@ -2068,7 +2073,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int target_reg = allocate_register(gen, regs, instr->target);
             int a_reg = get_register(regs, instr->read_operands[0]);
             int b_reg = get_register(regs, instr->read_operands[1]);
-            write_op(gen, FXOP_SUB);
+            write_op(gen, FXOP_SUB, width);
             write_regs(gen, target_reg, a_reg);
             write_regs(gen, b_reg);
         } break;
@@ -2079,19 +2084,19 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int b_reg = get_register(regs, instr->read_operands[1]);
             if (instr->read_operands[0].type == FXTYP_F1 && instr->read_operands[1].type != FXTYP_F1)
             {
-                write_op(gen, FXOP_MUL_BY_SCALAR);
+                write_op(gen, FXOP_MUL_BY_SCALAR, width);
                 write_regs(gen, target_reg, b_reg);
                 write_regs(gen, a_reg);
             }
             else if (instr->read_operands[0].type != FXTYP_F1 && instr->read_operands[1].type == FXTYP_F1)
             {
-                write_op(gen, FXOP_MUL_BY_SCALAR);
+                write_op(gen, FXOP_MUL_BY_SCALAR, width);
                 write_regs(gen, target_reg, a_reg);
                 write_regs(gen, b_reg);
             }
             else
             {
-                write_op(gen, FXOP_MUL);
+                write_op(gen, FXOP_MUL, width);
                 write_regs(gen, target_reg, a_reg);
                 write_regs(gen, b_reg);
             }
@@ -2103,13 +2108,13 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int b_reg = get_register(regs, instr->read_operands[1]);
             if (instr->read_operands[0].type != FXTYP_F1 && instr->read_operands[1].type == FXTYP_F1)
             {
-                write_op(gen, FXOP_DIV_BY_SCALAR);
+                write_op(gen, FXOP_DIV_BY_SCALAR, width);
                 write_regs(gen, target_reg, a_reg);
                 write_regs(gen, b_reg);
             }
             else
             {
-                write_op(gen, FXOP_DIV);
+                write_op(gen, FXOP_DIV, width);
                 write_regs(gen, target_reg, a_reg);
                 write_regs(gen, b_reg);
             }
@@ -2118,77 +2123,77 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_NEG);
+            write_op(gen, FXOP_NEG, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_RSQRT:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_RSQRT);
+            write_op(gen, FXOP_RSQRT, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_SQRT:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_SQRT);
+            write_op(gen, FXOP_SQRT, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_SIN:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_SIN);
+            write_op(gen, FXOP_SIN, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_COS:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_COS);
+            write_op(gen, FXOP_COS, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_EXP:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_EXP);
+            write_op(gen, FXOP_EXP, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_EXP2:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_EXP2);
+            write_op(gen, FXOP_EXP2, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_EXP10:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_EXP10);
+            write_op(gen, FXOP_EXP10, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_TRUNC:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_TRUNC);
+            write_op(gen, FXOP_TRUNC, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_FRACT:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_FRACT);
+            write_op(gen, FXOP_FRACT, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_ABS:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_ABS);
+            write_op(gen, FXOP_ABS, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_MIN:
@@ -2196,7 +2201,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg1 = get_register(regs, instr->read_operands[0]);
             int source_reg2 = get_register(regs, instr->read_operands[1]);
-            write_op(gen, FXOP_MIN);
+            write_op(gen, FXOP_MIN, width);
             write_regs(gen, target_reg, source_reg1);
             write_regs(gen, source_reg2);
         } break;
@@ -2205,7 +2210,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg1 = get_register(regs, instr->read_operands[0]);
             int source_reg2 = get_register(regs, instr->read_operands[1]);
-            write_op(gen, FXOP_MAX);
+            write_op(gen, FXOP_MAX, width);
             write_regs(gen, target_reg, source_reg1);
             write_regs(gen, source_reg2);
         } break;
@@ -2214,8 +2219,8 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg1 = get_register(regs, instr->read_operands[0]);
             int source_reg2 = get_register(regs, instr->read_operands[1]);
-            int width = (int)instr->read_operands[0].type; // TODO: cleanup
-            write_op(gen, FXOP_DOT, width);
+            // The result is a float, the width is the one of the operands.
+            write_op(gen, FXOP_DOT, (int)instr->read_operands[0].type);
             write_regs(gen, target_reg, source_reg1);
             write_regs(gen, source_reg2);
         } break;
@@ -2223,15 +2228,14 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            int width = (int)instr->read_operands[0].type; // TODO: cleanup
-            write_op(gen, FXOP_NORMALIZE, width);
+            write_op(gen, FXOP_NORMALIZE, (int)instr->read_operands[0].type);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_CLAMP01:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
             int source_reg = get_register(regs, instr->read_operands[0]);
-            write_op(gen, FXOP_CLAMP01);
+            write_op(gen, FXOP_CLAMP01, width);
             write_regs(gen, target_reg, source_reg);
         } break;
     case FXIL_CLAMP:
@@ -2240,7 +2244,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int x_reg = get_register(regs, instr->read_operands[0]);
             int a_reg = get_register(regs, instr->read_operands[1]);
             int b_reg = get_register(regs, instr->read_operands[2]);
-            write_op(gen, FXOP_CLAMP);
+            write_op(gen, FXOP_CLAMP, width);
             write_regs(gen, target_reg, x_reg);
             write_regs(gen, a_reg, b_reg);
         } break;
@@ -2252,13 +2256,13 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
             int b_reg = get_register(regs, instr->read_operands[2]);
             if (instr->read_operands[0].type == FXTYP_F1 && instr->read_operands[1].type != FXTYP_F1)
             {
-                write_op(gen, FXOP_INTERP_BY_SCALAR);
+                write_op(gen, FXOP_INTERP_BY_SCALAR, width);
                 write_regs(gen, target_reg, t_reg);
                 write_regs(gen, a_reg, b_reg);
             }
             else
             {
-                write_op(gen, FXOP_INTERP);
+                write_op(gen, FXOP_INTERP, width);
                 write_regs(gen, target_reg, t_reg);
                 write_regs(gen, a_reg, b_reg);
             }
@@ -2266,7 +2270,7 @@ void write_instruction(FXVM_Codegen *gen, Registers *regs, FXVM_ILInstr *instr)
     case FXIL_RAND01:
         {
             int target_reg = allocate_register(gen, regs, instr->target);
-            write_op(gen, FXOP_RAND01);
+            write_op(gen, FXOP_RAND01, width);
             write_regs(gen, target_reg);
         } break;
     }
@@ -2289,7 +2293,7 @@ void initialize_spans(FXVM_Compiler *compiler, Registers *regs)
 {
     int span_num = compiler->il_context.reg_index;
     regs->span_num = span_num;
-    regs->spans = (Registers::Span*)malloc(span_num * sizeof(Registers::Span));
+    regs->spans = (Registers::Span*)mem_alloc(MEM_COMPILER, span_num * sizeof(Registers::Span));
     for (int i = 0; i < span_num; i++)
     {
         regs->spans[i] = { -1, -1, -1 };
@@ -2402,6 +2406,11 @@ bool write_bytecode(FXVM_Compiler *compiler)
         free_registers(&regs, last_instr_i);
     }
 
+    compiler->cost = fxvm_bytecode_cost(gen->buffer, gen->buffer_len);
+    compiler->cost.il_instructions = instr_num;
+    compiler->cost.live_registers = regs.peak_used;
+    mem_free(regs.spans);
+
 #if 0
     // Ensure the last write is returned in r0
     if (compiler->il_context.instr_num > 0)
@@ -2411,7 +2420,7 @@ bool write_bytecode(FXVM_Compiler *compiler)
         int target_reg = regs.spans[last_target.index].allocated_reg;
         if (target_reg != 0)
         {
-            write_op(gen, FXOP_MOV);
+            write_op(gen, FXOP_MOV, (int)last_target.type);
             write_regs(gen, 0, target_reg);
         }
     }
@@ -2555,6 +2564,44 @@ bool compile(FXVM_Compiler *compiler, const char *source, const char *source_end
         write_bytecode(compiler);
     return result;
 }
+
+static void free_ast(FXVM_Ast *ast)
+{
+    if (!ast) return;
+    switch (ast->kind)
+    {
+    case FXAST_ROOT:
+        for (int i = 0; i < ast->root.node_num; i++) free_ast(ast->root.nodes[i]);
+        mem_free(ast->root.nodes);
+        break;
+    case FXAST_EXPR_UNARY: free_ast(ast->unary.operand); break;
+    case FXAST_EXPR_BINARY:
+        free_ast(ast->binary.left);
+        free_ast(ast->binary.right);
+        break;
+    case FXAST_EXPR_SWIZZLE: free_ast(ast->swizzle.operand); break;
+    case FXAST_EXPR_CALL:
+        for (int i = 0; i < ast->call.params.node_num; i++) free_ast(ast->call.params.nodes[i]);
+        mem_free(ast->call.params.nodes);
+        break;
+    case FXAST_EXPR_VARIABLE:
+    case FXAST_EXPR_NUMBER:
+        break;
+    }
+    mem_free(ast);
+}
+
+void free_compiler(FXVM_Compiler *compiler)
+{
+    mem_free(compiler->tokens);
+    free_ast(compiler->ast);
+    mem_free(compiler->il_context.instructions);
+    free_symbols(&compiler->symbols);
+    compiler->token_num = compiler->token_cap = 0;
+    compiler->tokens = nullptr;
+    compiler->ast = nullptr;
+    compiler->il_context = { };
+}
 #endif
 
 #define FXVM_COMPILER
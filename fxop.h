@@ -48,9 +48,37 @@ enum FXVM_BytecodeOp
 };
 #undef FXOP
 
+#define FXOP(op) + 1
+enum { FXVM_OPCODE_NUM = 0 FXOPS(FXOP) };
+#undef FXOP
+
+#include <cstdint>
+
+// Static cost of a bytecode program.
+struct FXVM_Cost
+{
+    int il_instructions;    // only known to the compiler, 0 otherwise
+    int instructions;       // also executed per instance, there are no branches
+    int transcendentals;    // sin, cos, exp, exp2, exp10, sqrt, rsqrt and normalize
+    int registers;          // highest register written + 1, the allocator uses the lowest free register
+    int live_registers;     // most registers live at the same time, only known to the compiler, 0 otherwise
+    int constant_bytes;
+    float cycles;           // estimate per instance, the sum of fxvm_opcode_cycles
+};
+
+// Cycles (rdtsc) per instance of every opcode in the grouped exec, from fxvm-bench -calibrate.
+extern const float fxvm_opcode_cycles[FXVM_OPCODE_NUM];
+
+// Size in bytes of the instruction at p, 0 for an invalid opcode.
+int fxvm_instruction_size(const uint8_t *p);
+FXVM_Cost fxvm_bytecode_cost(const uint8_t *code, int len);
+void fxvm_print_cost(const FXVM_Cost *cost);
+
 
 #if defined(FXVM_IMPL) || defined(FXVM_COMPILER_IMPL)
 
+#include <cstdio>
+
 #define FXOP(op) #op,
 const char* fxvm_opcode_string[] =
 {
@@ -58,6 +86,143 @@ const char* fxvm_opcode_string[] =
 };
 #undef FXOP
 
+// fxvm-bench -calibrate -filter opcode/ -reps 7, x86-64 with -O2 -ffast-math.
+const float fxvm_opcode_cycles[FXVM_OPCODE_NUM] =
+{
+    1.98f,   // LOAD_CONST, not measured
+    1.98f,   // LOAD_GLOBAL_INPUT, not measured
+    1.98f,   // LOAD_ATTRIBUTE
+    25.63f,  // SWIZZLE
+    2.19f,   // MOV
+    1.98f,   // MOV_X, not measured
+    1.98f,   // MOV_XY, not measured
+    1.98f,   // MOV_XYZ, not measured
+    1.98f,   // MOV_XYZW, not measured
+    1.98f,   // MOV_MASK, not measured
+    2.18f,   // NEG
+    2.01f,   // ADD
+    2.32f,   // SUB
+    2.50f,   // MUL
+    3.21f,   // MUL_BY_SCALAR
+    3.85f,   // DIV
+    4.11f,   // DIV_BY_SCALAR
+    1.98f,   // RCP, not measured
+    2.41f,   // RSQRT
+    2.28f,   // SQRT
+    15.90f,  // SIN
+    15.78f,  // COS
+    44.60f,  // EXP
+    49.30f,  // EXP2
+    44.91f,  // EXP10
+    2.91f,   // TRUNC
+    3.02f,   // FRACT
+    2.87f,   // ABS
+    2.96f,   // MIN
+    3.70f,   // MAX
+    3.95f,   // DOT
+    4.07f,   // NORMALIZE
+    2.61f,   // CLAMP01
+    3.22f,   // CLAMP
+    3.39f,   // INTERP
+    4.32f,   // INTERP_BY_SCALAR
+    4.97f,   // RAND01
+};
+
+int fxvm_instruction_size(const uint8_t *p)
+{
+    switch ((FXVM_BytecodeOp)(p[0] & 0x3f))
+    {
+    case FXOP_LOAD_CONST:
+        return 16 + 2;
+    case FXOP_MOV_XYZW:
+        return 4;
+    case FXOP_LOAD_GLOBAL_INPUT:
+    case FXOP_LOAD_ATTRIBUTE:
+    case FXOP_SWIZZLE:
+    case FXOP_MOV_XY:
+    case FXOP_MOV_XYZ:
+    case FXOP_MOV_MASK:
+    case FXOP_ADD:
+    case FXOP_SUB:
+    case FXOP_MUL:
+    case FXOP_MUL_BY_SCALAR:
+    case FXOP_DIV:
+    case FXOP_DIV_BY_SCALAR:
+    case FXOP_MIN:
+    case FXOP_MAX:
+    case FXOP_DOT:
+    case FXOP_CLAMP:
+    case FXOP_INTERP:
+    case FXOP_INTERP_BY_SCALAR:
+        return 3;
+    case FXOP_MOV:
+    case FXOP_MOV_X:
+    case FXOP_NEG:
+    case FXOP_RCP:
+    case FXOP_RSQRT:
+    case FXOP_SQRT:
+    case FXOP_SIN:
+    case FXOP_COS:
+    case FXOP_EXP:
+    case FXOP_EXP2:
+    case FXOP_EXP10:
+    case FXOP_TRUNC:
+    case FXOP_FRACT:
+    case FXOP_ABS:
+    case FXOP_NORMALIZE:
+    case FXOP_CLAMP01:
+    case FXOP_RAND01:
+        return 2;
+    }
+    return 0;
+}
+
+FXVM_Cost fxvm_bytecode_cost(const uint8_t *code, int len)
+{
+    FXVM_Cost cost = { };
+    const uint8_t *end = code + len;
+    const uint8_t *p = code;
+    while (p < end)
+    {
+        int size = fxvm_instruction_size(p);
+        if (size == 0) break;
+
+        auto opcode = (FXVM_BytecodeOp)(p[0] & 0x3f);
+        switch (opcode)
+        {
+        case FXOP_SIN:
+        case FXOP_COS:
+        case FXOP_EXP:
+        case FXOP_EXP2:
+        case FXOP_EXP10:
+        case FXOP_SQRT:
+        case FXOP_RSQRT:
+        case FXOP_NORMALIZE:
+            cost.transcendentals++;
+            break;
+        case FXOP_LOAD_CONST:
+            cost.constant_bytes += 16;
+            break;
+        default:
+            break;
+        }
+        int target_reg = p[1] & 0xf;
+        if (target_reg + 1 > cost.registers) cost.registers = target_reg + 1;
+        cost.cycles += fxvm_opcode_cycles[opcode];
+        cost.instructions++;
+        p += size;
+    }
+    return cost;
+}
+
+void fxvm_print_cost(const FXVM_Cost *cost)
+{
+    if (cost->il_instructions) printf("il %d, ", cost->il_instructions);
+    printf("instructions %d, transcendentals %d, registers %d, ", cost->instructions, cost->transcendentals, cost->registers);
+    if (cost->live_registers) printf("live registers %d, ", cost->live_registers);
+    printf("constant bytes %d, ~%.0f cycles per instance\n", cost->constant_bytes, cost->cycles);
+}
+
 #endif
 
 
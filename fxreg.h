@@ -3,7 +3,11 @@
 #define USE_SSE
 
 #ifdef USE_SSE
+#ifdef _WIN32
 #include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
 #endif
 
 struct Reg
@@ -209,7 +213,7 @@ inline Reg reg_normalize3(Reg a)
 
 inline Reg reg_normalize4(Reg a)
 {
-    float len2 = reg_dot2(a, a);
+    float len2 = reg_dot4(a, a);
     float k = 1.0f / sqrt(len2);
     return { a.v[0] * k, a.v[1] * k, a.v[2] * k, a.v[3] * k };
 }
@@ -412,7 +416,7 @@ inline Reg reg_normalize3(Reg a)
 
 inline Reg reg_normalize4(Reg a)
 {
-    float len2 = reg_dot2(a, a);
+    float len2 = reg_dot4(a, a);
     __m128 k = _mm_rsqrt_ps(_mm_set1_ps(len2));
     return Reg{ .v4 = _mm_mul_ps(a.v4, k) };
 }
@@ -1,6 +1,7 @@
 #ifndef FXVM_SYMS
 
 #include "fxvm_types.h"
+#include "memtrack.h"
 #include <cstdlib>
 #include <cstring>
 
@@ -55,20 +56,37 @@ struct FXVM_Symbols
     int attribute_index;
 };
 
+int push_symbol(FXVM_Symbols *syms, const char *sym, const char *sym_end, FXVM_Type type);
+int push_symbol_builtin_constant(FXVM_Symbols *syms, const char *sym, const char *sym_end, float *value, int width);
+int symbols_find(FXVM_Symbols *syms, const char *start, const char *end);
+void free_symbols(FXVM_Symbols *syms);
+
+#ifdef FXVM_COMPILER_IMPL
+
 void ensure_symbol_fits(FXVM_Symbols *syms)
 {
     if (syms->symbol_num + 1 > syms->symbol_cap)
     {
         int new_cap = syms->symbol_cap + 32;
-        syms->names = (FXVM_Symbols::SymbolName*)realloc(syms->names, new_cap * sizeof(FXVM_Symbols::SymbolName));
-        syms->types = (FXVM_Type*)realloc(syms->types, new_cap * sizeof(FXVM_Type));
-        syms->sym_types = (FXVM_SymbolType*)realloc(syms->sym_types, new_cap * sizeof(FXVM_SymbolType));
-        syms->function_types = (FXVM_Symbols::FunctionType*)realloc(syms->function_types, new_cap * sizeof(FXVM_Symbols::FunctionType));
-        syms->additional_data = (FXVM_SymbolAdditionalData*)realloc(syms->additional_data, new_cap * sizeof(FXVM_SymbolAdditionalData));
+        syms->names = (FXVM_Symbols::SymbolName*)mem_realloc(MEM_SYMBOLS, syms->names, new_cap * sizeof(FXVM_Symbols::SymbolName));
+        syms->types = (FXVM_Type*)mem_realloc(MEM_SYMBOLS, syms->types, new_cap * sizeof(FXVM_Type));
+        syms->sym_types = (FXVM_SymbolType*)mem_realloc(MEM_SYMBOLS, syms->sym_types, new_cap * sizeof(FXVM_SymbolType));
+        syms->function_types = (FXVM_Symbols::FunctionType*)mem_realloc(MEM_SYMBOLS, syms->function_types, new_cap * sizeof(FXVM_Symbols::FunctionType));
+        syms->additional_data = (FXVM_SymbolAdditionalData*)mem_realloc(MEM_SYMBOLS, syms->additional_data, new_cap * sizeof(FXVM_SymbolAdditionalData));
         syms->symbol_cap = new_cap;
     }
 }
 
+void free_symbols(FXVM_Symbols *syms)
+{
+    mem_free(syms->names);
+    mem_free(syms->types);
+    mem_free(syms->sym_types);
+    mem_free(syms->function_types);
+    mem_free(syms->additional_data);
+    *syms = { };
+}
+
 int push_symbol(FXVM_Symbols *syms, const char *sym, const char *sym_end, FXVM_Type type)
 {
     ensure_symbol_fits(syms);
@@ -123,7 +141,7 @@ int symbols_find(FXVM_Symbols *syms, const char *start, const char *end)
     return -1;
 }
 
-
+#endif
 
 #define FXVM_SYMS
 #endif
@@ -2,6 +2,7 @@
 
 #include "fxreg.h"
 #include "fxop.h"
+#include "memtrack.h"
 
 struct FXVM_Bytecode
 {
@@ -39,13 +40,51 @@ void set_uniform_f4(FXVM_Program *program, int uniform_location, const float *da
 FXVM_Program fxvm_program_new(FXVM_Bytecode bytecode);
 void fxvm_program_free(FXVM_Program *program);
 
+#ifdef FXVM_STATS
+/*
+ * Instrumentation of the exec paths, compiled in with -DFXVM_STATS. The define changes the layout of
+ * FXVM_Machine, so every translation unit has to be built with the same setting.
+ *
+ * Instructions are counted per opcode and width, index 0..3 for 1..4 components, the width bits of the
+ * instruction. A dispatch is one call to exec, which runs the instructions once for each instance of the group.
+ */
+struct FXVM_ProgramStats
+{
+    const void *code; // nullptr for an unused slot
+    int len;
+    uint64_t dispatches;
+    uint64_t instances;
+    uint64_t cycles;
+};
+
+struct FXVM_Stats
+{
+    enum { MAX_OPCODES = 64, MAX_PROGRAMS = 64 };
+
+    uint64_t op_dispatches[MAX_OPCODES][4];
+    uint64_t op_instances[MAX_OPCODES][4];
+
+    // Open addressed on the bytecode pointer, copies of a program share their statistics.
+    FXVM_ProgramStats programs[MAX_PROGRAMS];
+    int program_num;
+    // Dispatches of programs that did not fit in the table.
+    uint64_t untracked_dispatches;
+    uint64_t untracked_cycles;
+};
+#endif
+
 struct FXVM_Machine
 {
     FXVM_AttributeBindings *bindings;
     pcg32_random_t rng;
+#ifdef FXVM_STATS
+    FXVM_Stats stats;
+#endif
 };
 
 FXVM_Machine fxvm_new();
+// Seeds the machine's random number generator, so that machines used concurrently produce different sequences.
+FXVM_Machine fxvm_new(uint64_t seed);
 
 struct FXVM_State
 {
@@ -63,10 +102,28 @@ void exec(FXVM_Machine *vm, FXVM_State &S, int instance_index, FXVM_Program *pro
 template <int MAX_GROUP>
 void exec(FXVM_Machine *vm, FXVM_State (&S)[MAX_GROUP], int instance_index, int instance_count, FXVM_Program *program);
 
+// Prints the instructions, followed by the cost of the program.
 void disassemble(FXVM_Bytecode *bytecode);
+// The bytecode has no branches, so this is also the number of instructions executed per instance.
+int fxvm_instruction_count(const FXVM_Bytecode *bytecode);
+FXVM_Cost fxvm_cost(const FXVM_Bytecode *bytecode);
+
+#ifdef FXVM_STATS
+const FXVM_Stats* fxvm_stats(const FXVM_Machine *vm);
+void fxvm_stats_reset(FXVM_Machine *vm);
+// Adds the counters of src to dest, e.g. to sum up the machines of all job workers.
+void fxvm_stats_merge(FXVM_Stats *dest, const FXVM_Stats *src);
+// Returns nullptr if the program has not been dispatched.
+const FXVM_ProgramStats* fxvm_stats_find_program(const FXVM_Stats *stats, const FXVM_Program *program);
+uint64_t fxvm_stats_total_instructions(const FXVM_Stats *stats);
+// Prints the opcodes sorted by instructions executed, at most max_rows rows.
+void fxvm_stats_print_opcodes(const FXVM_Stats *stats, int max_rows);
+#endif
 
 #ifdef FXVM_IMPL
 
+#include <cstring>
+
 void exec(FXVM_Machine *vm, FXVM_State &S, int instance_index, FXVM_Program *program)
 {
     exec(vm, S, program->uniform_slots, (float**)vm->bindings->attr_ptr, vm->bindings->attr_stride, instance_index, &program->bytecode);
@@ -86,6 +143,15 @@ FXVM_Machine fxvm_new()
     return result;
 }
 
+FXVM_Machine fxvm_new(uint64_t seed)
+{
+    FXVM_Machine result = fxvm_new();
+    // reg_random01 uses the multiplicative generator, which needs an odd state
+    result.rng.state ^= seed * 0x9e3779b97f4a7c15ULL;
+    result.rng.state |= 1;
+    return result;
+}
+
 void bind_attribute(FXVM_AttributeBindings *bindings, int attribute_index, FXVM_Type type, int stride_bytes, const void *data)
 {
     // assert type is one of [F1, F2, F3, F4]
@@ -123,12 +189,158 @@ FXVM_Program fxvm_program_new(FXVM_Bytecode bytecode)
 
 void fxvm_program_free(FXVM_Program *program)
 {
-    free(program->bytecode.code);
+    mem_free(program->bytecode.code);
     *program = { };
 }
 
 #include <cstdio>
 
+#ifdef FXVM_STATS
+
+static uint32_t fxvm_stats_slot(const void *code)
+{
+    uint64_t key = (uint64_t)(uintptr_t)code;
+    return (uint32_t)((key >> 4) * 0x9e3779b97f4a7c15ull >> 32) & (FXVM_Stats::MAX_PROGRAMS - 1);
+}
+
+static FXVM_ProgramStats* fxvm_stats_program(FXVM_Stats *stats, const void *code, int len)
+{
+    uint32_t slot = fxvm_stats_slot(code);
+    for (int i = 0; i < FXVM_Stats::MAX_PROGRAMS; i++)
+    {
+        FXVM_ProgramStats *ps = &stats->programs[(slot + i) & (FXVM_Stats::MAX_PROGRAMS - 1)];
+        if (ps->code == code)
+        {
+            return ps;
+        }
+        if (!ps->code)
+        {
+            ps->code = code;
+            ps->len = len;
+            stats->program_num++;
+            return ps;
+        }
+    }
+    return nullptr;
+}
+
+static void fxvm_stats_record_dispatch(FXVM_Stats *stats, const FXVM_Bytecode *bytecode, int instance_count, uint64_t cycles)
+{
+    FXVM_ProgramStats *ps = fxvm_stats_program(stats, bytecode->code, bytecode->len);
+    if (!ps)
+    {
+        stats->untracked_dispatches++;
+        stats->untracked_cycles += cycles;
+        return;
+    }
+    ps->dispatches++;
+    ps->instances += instance_count;
+    ps->cycles += cycles;
+}
+
+const FXVM_Stats* fxvm_stats(const FXVM_Machine *vm)
+{
+    return &vm->stats;
+}
+
+void fxvm_stats_reset(FXVM_Machine *vm)
+{
+    vm->stats = { };
+}
+
+void fxvm_stats_merge(FXVM_Stats *dest, const FXVM_Stats *src)
+{
+    for (int op = 0; op < FXVM_Stats::MAX_OPCODES; op++)
+    {
+        for (int w = 0; w < 4; w++)
+        {
+            dest->op_dispatches[op][w] += src->op_dispatches[op][w];
+            dest->op_instances[op][w] += src->op_instances[op][w];
+        }
+    }
+    for (int i = 0; i < FXVM_Stats::MAX_PROGRAMS; i++)
+    {
+        const FXVM_ProgramStats *s = &src->programs[i];
+        if (!s->code) continue;
+        FXVM_ProgramStats *d = fxvm_stats_program(dest, s->code, s->len);
+        if (!d)
+        {
+            dest->untracked_dispatches += s->dispatches;
+            dest->untracked_cycles += s->cycles;
+            continue;
+        }
+        d->dispatches += s->dispatches;
+        d->instances += s->instances;
+        d->cycles += s->cycles;
+    }
+    dest->untracked_dispatches += src->untracked_dispatches;
+    dest->untracked_cycles += src->untracked_cycles;
+}
+
+const FXVM_ProgramStats* fxvm_stats_find_program(const FXVM_Stats *stats, const FXVM_Program *program)
+{
+    const void *code = program->bytecode.code;
+    if (!code) return nullptr;
+    uint32_t slot = fxvm_stats_slot(code);
+    for (int i = 0; i < FXVM_Stats::MAX_PROGRAMS; i++)
+    {
+        const FXVM_ProgramStats *ps = &stats->programs[(slot + i) & (FXVM_Stats::MAX_PROGRAMS - 1)];
+        if (ps->code == code) return ps;
+        if (!ps->code) break;
+    }
+    return nullptr;
+}
+
+uint64_t fxvm_stats_total_instructions(const FXVM_Stats *stats)
+{
+    uint64_t total = 0;
+    for (int op = 0; op < FXVM_Stats::MAX_OPCODES; op++)
+    {
+        for (int w = 0; w < 4; w++) total += stats->op_instances[op][w];
+    }
+    return total;
+}
+
+void fxvm_stats_print_opcodes(const FXVM_Stats *stats, int max_rows)
+{
+    int rows[FXVM_OPCODE_NUM * 4];
+    int row_num = 0;
+    for (int i = 0; i < FXVM_OPCODE_NUM * 4; i++)
+    {
+        if (stats->op_dispatches[i / 4][i % 4]) rows[row_num++] = i;
+    }
+    // Insertion sort by instructions executed, there are at most a few hundred rows.
+    for (int i = 1; i < row_num; i++)
+    {
+        int row = rows[i];
+        uint64_t n = stats->op_instances[row / 4][row % 4];
+        int j = i;
+        for (; j > 0 && stats->op_instances[rows[j - 1] / 4][rows[j - 1] % 4] < n; j--) rows[j] = rows[j - 1];
+        rows[j] = row;
+    }
+
+    uint64_t total = fxvm_stats_total_instructions(stats);
+    printf("opcode                   width\t dispatches\t instructions\t %%\n");
+    for (int i = 0; i < row_num && i < max_rows; i++)
+    {
+        int op = rows[i] / 4;
+        int w = rows[i] % 4;
+        printf("%-24s f%d\t %llu\t %llu\t %.2f\n", fxvm_opcode_string[op], w + 1,
+                (unsigned long long)stats->op_dispatches[op][w],
+                (unsigned long long)stats->op_instances[op][w],
+                total ? 100.0 * stats->op_instances[op][w] / total : 0.0);
+    }
+}
+
+#define FXVM_STATS_BEGIN() uint64_t stats_start_cycles = __rdtsc()
+#define FXVM_STATS_OP(n) do { vm->stats.op_dispatches[opcode][p[0] >> 6]++; vm->stats.op_instances[opcode][p[0] >> 6] += (n); } while (0)
+#define FXVM_STATS_END(n) fxvm_stats_record_dispatch(&vm->stats, bytecode, (n), __rdtsc() - stats_start_cycles)
+#else
+#define FXVM_STATS_BEGIN()
+#define FXVM_STATS_OP(n)
+#define FXVM_STATS_END(n)
+#endif
+
 #ifdef TRACE_FXVM
 #define FXVM_TRACE_OP() printf("%-18s ", fxvm_opcode_string[opcode] + 5)
 #define FXVM_TRACE(fmt, ...) printf(fmt, ## __VA_ARGS__)
@@ -144,19 +356,22 @@ void fxvm_program_free(FXVM_Program *program)
  * w OP | s  t
  *
  * OP opcode (6 bits)
- * w  width: 1, 2, 3 or 4 components (2 bits)
+ * w  width: 1, 2, 3 or 4 components, stored as width - 1 (2 bits). Every instruction has it, the ones
+ *    working on all four lanes regardless only for the statistics (FXVM_STATS).
  * s  source: which register is the source (4 bits)
  * t  target: which register is the target (4 bits)
 */
 
 void exec(FXVM_Machine *vm, FXVM_State &S, float *global_input, float **instance_attributes, int *attribute_stride, int instance_index, FXVM_Bytecode *bytecode)
 {
+    FXVM_STATS_BEGIN();
     const uint8_t *end = (uint8_t*)bytecode->code + bytecode->len;
     const uint8_t *p = (uint8_t*)bytecode->code;
     while (p < end)
     {
         // ww opopop
         auto opcode = (FXVM_BytecodeOp)(p[0] & 0x3f);
+        FXVM_STATS_OP(1);
         switch (opcode)
         {
         case FXOP_LOAD_CONST:
@@ -184,8 +399,6 @@ void exec(FXVM_Machine *vm, FXVM_State &S, float *global_input, float **instance
             } break;
         case FXOP_LOAD_ATTRIBUTE:
             {
-                //uint8_t width = p[0] >> 6;
-                //if (width == 3) width = 4;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t input_attribute = p[2];
                 //float *attribute_data = instance_attributes[input_attribute];
@@ -545,7 +758,7 @@ void exec(FXVM_Machine *vm, FXVM_State &S, float *global_input, float **instance
             } break;
         case FXOP_DOT:
             {
-                uint8_t width = p[0] >> 6;
+                uint8_t width = (p[0] >> 6) + 1;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t a_reg = (p[1] >> 4) & 0xf;
                 uint8_t b_reg = p[2] & 0xf;
@@ -565,7 +778,7 @@ void exec(FXVM_Machine *vm, FXVM_State &S, float *global_input, float **instance
             } break;
         case FXOP_NORMALIZE:
             {
-                uint8_t width = p[0] >> 6;
+                uint8_t width = (p[0] >> 6) + 1;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t a_reg = (p[1] >> 4) & 0xf;
                 switch (width)
@@ -652,6 +865,7 @@ void exec(FXVM_Machine *vm, FXVM_State &S, float *global_input, float **instance
             return;
         }
     }
+    FXVM_STATS_END(1);
 }
 
 #undef FXVM_TRACE_REG
@@ -669,12 +883,14 @@ void exec(FXVM_Machine *vm, FXVM_State &S, float *global_input, float **instance
 template <int MAX_GROUP>
 void exec(FXVM_Machine *vm, FXVM_State (&S)[MAX_GROUP], float *global_input, float **instance_attributes, int *attribute_stride, int instance_index, int instance_count, FXVM_Bytecode *bytecode)
 {
+    FXVM_STATS_BEGIN();
     const uint8_t *end = (uint8_t*)bytecode->code + bytecode->len;
     const uint8_t *p = (uint8_t*)bytecode->code;
     while (p < end)
     {
         // ww opopop
         auto opcode = (FXVM_BytecodeOp)(p[0] & 0x3f);
+        FXVM_STATS_OP(instance_count);
         switch (opcode)
         {
         case FXOP_LOAD_CONST:
@@ -708,8 +924,6 @@ void exec(FXVM_Machine *vm, FXVM_State (&S)[MAX_GROUP], float *global_input, flo
             } break;
         case FXOP_LOAD_ATTRIBUTE:
             {
-                //uint8_t width = p[0] >> 6;
-                //if (width == 3) width = 4;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t input_attribute = p[2];
                 //float *attribute_data = instance_attributes[input_attribute];
@@ -1153,7 +1367,7 @@ void exec(FXVM_Machine *vm, FXVM_State (&S)[MAX_GROUP], float *global_input, flo
             } break;
         case FXOP_DOT:
             {
-                uint8_t width = p[0] >> 6;
+                uint8_t width = (p[0] >> 6) + 1;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t a_reg = (p[1] >> 4) & 0xf;
                 uint8_t b_reg = p[2] & 0xf;
@@ -1176,7 +1390,7 @@ void exec(FXVM_Machine *vm, FXVM_State (&S)[MAX_GROUP], float *global_input, flo
             } break;
         case FXOP_NORMALIZE:
             {
-                uint8_t width = p[0] >> 6;
+                uint8_t width = (p[0] >> 6) + 1;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t a_reg = (p[1] >> 4) & 0xf;
                 for (int i = 0; i < instance_count; i++)
@@ -1281,15 +1495,39 @@ void exec(FXVM_Machine *vm, FXVM_State (&S)[MAX_GROUP], float *global_input, flo
             return;
         }
     }
+    FXVM_STATS_END(instance_count);
 }
 
 #undef FXVM_TRACE_OP
 #undef FXVM_TRACE
 #undef FXVM_TRACE_REG
+#undef FXVM_STATS_BEGIN
+#undef FXVM_STATS_OP
+#undef FXVM_STATS_END
 
 #define FXVM_PRINT_OP() printf("%-18s ", fxvm_opcode_string[opcode] + 5)
 #define FXVM_PRINT(fmt, ...) printf(fmt, ## __VA_ARGS__)
 
+int fxvm_instruction_count(const FXVM_Bytecode *bytecode)
+{
+    const uint8_t *end = (uint8_t*)bytecode->code + bytecode->len;
+    const uint8_t *p = (uint8_t*)bytecode->code;
+    int count = 0;
+    while (p < end)
+    {
+        int size = fxvm_instruction_size(p);
+        if (size == 0) break;
+        p += size;
+        count++;
+    }
+    return count;
+}
+
+FXVM_Cost fxvm_cost(const FXVM_Bytecode *bytecode)
+{
+    return fxvm_bytecode_cost((const uint8_t*)bytecode->code, bytecode->len);
+}
+
 void disassemble(FXVM_Bytecode *bytecode)
 {
     const uint8_t *end = (uint8_t*)bytecode->code + bytecode->len;
@@ -1320,7 +1558,7 @@ void disassemble(FXVM_Bytecode *bytecode)
             } break;
         case FXOP_LOAD_ATTRIBUTE:
             {
-                uint8_t width = p[0] >> 6;
+                uint8_t width = (p[0] >> 6) + 1;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t input_attribute = p[2];
                 p += 3;
@@ -1589,7 +1827,7 @@ void disassemble(FXVM_Bytecode *bytecode)
             } break;
         case FXOP_DOT:
             {
-                uint8_t width = p[0] >> 6;
+                uint8_t width = (p[0] >> 6) + 1;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t a_reg = (p[1] >> 4) & 0xf;
                 uint8_t b_reg = p[2] & 0xf;
@@ -1600,7 +1838,7 @@ void disassemble(FXVM_Bytecode *bytecode)
             } break;
         case FXOP_NORMALIZE:
             {
-                uint8_t width = p[0] >> 6;
+                uint8_t width = (p[0] >> 6) + 1;
                 uint8_t target_reg = p[1] & 0xf;
                 uint8_t a_reg = (p[1] >> 4) & 0xf;
                 p += 2;
@@ -1663,6 +1901,8 @@ void disassemble(FXVM_Bytecode *bytecode)
             return;
         }
     }
+    FXVM_Cost cost = fxvm_cost(bytecode);
+    fxvm_print_cost(&cost);
 }
 
 #undef FXVM_TRACE_OP
@@ -0,0 +1,1704 @@
+//#define TRACE_FXVM
+#define FXVM_IMPL
+#define FXVM_COMPILER_IMPL
+#define FXVM_CAPTURE_IMPL
+#define JOB_SYSTEM_IMPL
+#define TRACE_IMPL
+#define PERF_COUNTERS_IMPL
+#define MEMTRACK_IMPL
+#define DRAW_SORT_IMPL
+#define PARTICLE_DRAW_IMPL
+#define PARTICLE_SIM_IMPL
+#include "particle_sim.h"
+#include "draw_sort.h"
+#include "particle_draw.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+/*
+ * Benchmark suite. Sections:
+ *   opcode/<op>/f<width>/<backend>   one opcode, chained OPCODE_CHAIN times, per exec backend
+ *   program/<psys>/<program>         every program of the shipped .psys files, grouped exec
+ *   simulate/<psys>/<particles>      simulate() over full emitters
+ *   closed_form/<psys>/<particles>   simulate() of the system in closed form, integrated as reference
+ *   scaling/<psys>/<particles>/t<n>  simulate_parallel() with n workers
+ *   sleep/<psys>/<emitters>          emitter_scheduler_step() of looping emitters that are idle most of the
+ *                                    time, simulate() of every emitter as reference, per emitter and step
+ *   prewarm/<psys>/<seconds>         prewarm_emitter() of a new emitter, simulate() in 60 Hz steps as
+ *                                    reference, per emitter
+ *   batch/<psys>/<emitters>          simulate_batch() of an Emitter_Batch, simulate() of as many separate
+ *                                    emitters as reference, per emitter and step
+ *   sort/<particles>/d<bits>         draw_sort() of random depths, std::sort of the same keys as reference
+ *   quads/<style>/<particles>        particle_expand_quads() and the indices, billboards, axis aligned and
+ *                                    stretched quads, culled billboards and billboards of closed form
+ *                                    particles, the one at a time expansion as reference
+ *
+ * Times are the best of -reps runs, in nanoseconds per instance (per particle and step for simulate). Every VM
+ * benchmark has a hand-written C++ reference doing the same work, ref_ns, so ns / ref_ns is the
+ * interpreter overhead.
+ *
+ * -json FILE writes the results, -compare FILE compares against results written earlier and exits
+ * with 1 if any benchmark got slower than -threshold percent. The JSON also records the memory use
+ * (memtrack.h) of the run per tag and per .psys file, these are not compared.
+ *
+ * -calibrate prints the fxvm_opcode_cycles table of the cost model (fxop.h), from the group16 opcode
+ * benchmarks, e.g. ./fxvm-bench -calibrate -filter opcode/
+ *
+ * -perf samples the hardware counters of the VM runs (not the references), reported per instance like
+ * the times. They count the benchmark thread only, so the scaling benchmarks have none.
+ */
+
+struct Bench_Result
+{
+    char name[96];
+    double ns;
+    double ref_ns;  // < 0 if the benchmark has no reference
+    bool has_perf;
+    double perf[PERF_COUNTER_NUM];
+};
+
+struct Bench_Results
+{
+    int result_num;
+    int result_cap;
+    Bench_Result *results;
+};
+
+struct Bench_Options
+{
+    const char *filter;
+    int reps;
+    int max_particles;
+    bool quick;
+};
+
+// Keeps the results of the benchmarked code alive.
+static volatile float bench_sink;
+
+// Open when running with -perf.
+static Perf_Counters bench_perf;
+static bool bench_perf_open;
+
+struct Bench_Perf
+{
+    bool valid;
+    double value[PERF_COUNTER_NUM];
+};
+
+// Counters per instance, of run minus base (base may be null).
+static Bench_Perf bench_perf_per_instance(const Bench_Perf *run, const Bench_Perf *base, double instances)
+{
+    Bench_Perf result = { };
+    if (!run->valid || (base && !base->valid)) return result;
+    result.valid = true;
+    for (int c = 0; c < PERF_COUNTER_NUM; c++)
+    {
+        result.value[c] = (run->value[c] - (base ? base->value[c] : 0.0)) / instances;
+    }
+    return result;
+}
+
+static bool bench_enabled(Bench_Options *options, const char *name)
+{
+    return !options->filter || strstr(name, options->filter);
+}
+
+static void add_result(Bench_Results *results, const char *name, double ns, double ref_ns, const Bench_Perf *perf = nullptr)
+{
+    if (results->result_num + 1 > results->result_cap)
+    {
+        int new_cap = results->result_cap + 64;
+        results->results = (Bench_Result*)realloc(results->results, sizeof(Bench_Result) * new_cap);
+        results->result_cap = new_cap;
+    }
+    Bench_Result *r = &results->results[results->result_num++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns = ns;
+    r->ref_ns = ref_ns;
+    r->has_perf = perf && perf->valid;
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) r->perf[c] = r->has_perf ? perf->value[c] : 0.0;
+
+    if (ref_ns > 0.0)
+    {
+        printf("%-44s %10.3f ns  ref %10.3f ns  x%.1f\n", name, ns, ref_ns, ns / ref_ns);
+    }
+    else
+    {
+        printf("%-44s %10.3f ns\n", name, ns);
+    }
+    if (r->has_perf)
+    {
+        printf("%-44s", "");
+        if (perf_counter_available(&bench_perf, PERF_CYCLES) && perf_counter_available(&bench_perf, PERF_INSTRUCTIONS) && r->perf[PERF_CYCLES] > 0.0)
+        {
+            printf(" ipc %.2f", r->perf[PERF_INSTRUCTIONS] / r->perf[PERF_CYCLES]);
+        }
+        for (int c = 0; c < PERF_COUNTER_NUM; c++)
+        {
+            if (perf_counter_available(&bench_perf, c)) printf("  %s %.3f", perf_counter_names[c], r->perf[c]);
+            else printf("  %s -", perf_counter_names[c]);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+// Best of reps runs of fn, in nanoseconds. perf (if not null) gets the counters of the best run.
+template <class FN>
+static double bench_min_ns(int reps, FN fn, Bench_Perf *perf = nullptr)
+{
+    typedef std::chrono::steady_clock Clock;
+    bool sample = perf && bench_perf_open;
+    if (perf) *perf = { };
+
+    double best = 1e30;
+    for (int r = 0; r < reps; r++)
+    {
+        Perf_Sample perf_start = { };
+        if (sample) perf_start = perf_counters_read(&bench_perf);
+        Clock::time_point start = Clock::now();
+        fn();
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        if (ns < best)
+        {
+            best = ns;
+            if (sample)
+            {
+                Perf_Sample delta = perf_sample_sub(perf_counters_read(&bench_perf), perf_start);
+                perf->valid = true;
+                for (int c = 0; c < PERF_COUNTER_NUM; c++) perf->value[c] = (double)delta.value[c];
+            }
+        }
+    }
+    return best;
+}
+
+static float bench_random(pcg32_random_t *rng, float lo, float hi)
+{
+    return lo + (hi - lo) * random01_float(rng);
+}
+
+static void bench_report_error(const char *err) { (void)err; }
+
+/*
+ * Opcode benchmarks. The program is "x = a; <body> x;" with the body repeated OPCODE_CHAIN times,
+ * a, b and c are attributes of the benchmarked width and s a scalar attribute. The time of the
+ * program without the body is subtracted, what is left is divided by the chain length.
+ */
+enum { OPCODE_CHAIN = 16, OPCODE_INSTANCES = 4096 };
+
+struct Opcode_Streams
+{
+    int count;
+    // 4 floats per instance for every width, the VM loads whole registers.
+    float *a;
+    float *b;
+    float *c;
+    float *s;
+    float *out;
+};
+
+struct Exec_Backend
+{
+    const char *name;
+    void (*run)(FXVM_Machine *vm, FXVM_Program *program, int count, float *out);
+};
+
+static void run_exec_single(FXVM_Machine *vm, FXVM_Program *program, int count, float *out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        FXVM_State S;
+        exec(vm, S, i, program);
+        out[i] = S.r[0].v[0];
+    }
+}
+
+static void run_exec_group16(FXVM_Machine *vm, FXVM_Program *program, int count, float *out)
+{
+    enum { GROUP = 16 };
+    FXVM_State S[GROUP];
+    for (int i = 0; i < count; i += GROUP)
+    {
+        int n = (count - i < GROUP) ? count - i : GROUP;
+        exec<GROUP>(vm, S, i, n, program);
+        for (int k = 0; k < n; k++) out[i + k] = S[k].r[0].v[0];
+    }
+}
+
+// New backends are added here.
+static Exec_Backend exec_backends[] = {
+    {"single", run_exec_single},
+    {"group16", run_exec_group16},
+};
+
+static pcg32_random_t ref_rng = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
+
+#define COMPONENTWISE_OP(NAME, EXPR)\
+    struct NAME\
+    {\
+        template <int W> static inline void apply(float *x, const float *b, const float *c, float s)\
+        {\
+            (void)b; (void)c; (void)s;\
+            for (int k = 0; k < W; k++) x[k] = EXPR;\
+        }\
+    };
+
+COMPONENTWISE_OP(Op_Nop, x[k])
+COMPONENTWISE_OP(Op_Load, b[k])
+COMPONENTWISE_OP(Op_Neg, -x[k])
+COMPONENTWISE_OP(Op_Add, x[k] + b[k])
+COMPONENTWISE_OP(Op_Sub, x[k] - b[k])
+COMPONENTWISE_OP(Op_Mul, x[k] * b[k])
+COMPONENTWISE_OP(Op_Div, x[k] / b[k])
+COMPONENTWISE_OP(Op_MulScalar, x[k] * s)
+COMPONENTWISE_OP(Op_DivScalar, x[k] / s)
+COMPONENTWISE_OP(Op_Rcp, 1.0f / x[k])
+COMPONENTWISE_OP(Op_Rsqrt, 1.0f / sqrtf(x[k]))
+COMPONENTWISE_OP(Op_Sqrt, sqrtf(x[k]))
+COMPONENTWISE_OP(Op_Sin, sinf(x[k]))
+COMPONENTWISE_OP(Op_Cos, cosf(x[k]))
+COMPONENTWISE_OP(Op_Exp, expf(x[k]))
+COMPONENTWISE_OP(Op_Exp2, exp2f(x[k]))
+COMPONENTWISE_OP(Op_Exp10, powf(10.0f, x[k]))
+COMPONENTWISE_OP(Op_Trunc, truncf(x[k]))
+COMPONENTWISE_OP(Op_Fract, x[k] - floorf(x[k]))
+COMPONENTWISE_OP(Op_Abs, fabsf(x[k]))
+COMPONENTWISE_OP(Op_Min, fminf(x[k], b[k]))
+COMPONENTWISE_OP(Op_Max, fmaxf(x[k], b[k]))
+COMPONENTWISE_OP(Op_Clamp01, fminf(fmaxf(x[k], 0.0f), 1.0f))
+COMPONENTWISE_OP(Op_Clamp, fminf(fmaxf(x[k], b[k]), c[k]))
+COMPONENTWISE_OP(Op_Lerp, x[k] * (1.0f - s) + b[k] * s)
+COMPONENTWISE_OP(Op_Rand01, random01_float(&ref_rng))
+
+#undef COMPONENTWISE_OP
+
+// dot is measured as x = x * dot(x, b), so that the chain depends on it.
+struct Op_Dot
+{
+    template <int W> static inline void apply(float *x, const float *b, const float *c, float s)
+    {
+        (void)c; (void)s;
+        float d = 0.0f;
+        for (int k = 0; k < W; k++) d += x[k] * b[k];
+        for (int k = 0; k < W; k++) x[k] *= d;
+    }
+};
+
+struct Op_Normalize
+{
+    template <int W> static inline void apply(float *x, const float *b, const float *c, float s)
+    {
+        (void)b; (void)c; (void)s;
+        float d = 0.0f;
+        for (int k = 0; k < W; k++) d += x[k] * x[k];
+        float L = 1.0f / sqrtf(d);
+        for (int k = 0; k < W; k++) x[k] *= L;
+    }
+};
+
+// Same patterns as swizzle_patterns below.
+struct Op_Swizzle
+{
+    template <int W> static inline void apply(float *x, const float *b, const float *c, float s)
+    {
+        (void)b; (void)c; (void)s;
+        float t[4] = {x[0], x[1], x[2], x[3]};
+        if (W == 2) { x[0] = t[1]; x[1] = t[0]; }
+        if (W == 3) { x[0] = t[2]; x[1] = t[0]; x[2] = t[1]; }
+        if (W == 4) { x[0] = t[3]; x[1] = t[2]; x[2] = t[1]; x[3] = t[0]; }
+    }
+};
+
+static const char *swizzle_patterns[5] = { "", "x", "yx", "zxy", "wzyx" };
+
+template <class OP, int W>
+static void ref_opcode_chain(Opcode_Streams *S, int chain)
+{
+    for (int i = 0; i < S->count; i++)
+    {
+        float x[4], b[4], c[4];
+        for (int k = 0; k < 4; k++)
+        {
+            x[k] = S->a[i * 4 + k];
+            b[k] = S->b[i * 4 + k];
+            c[k] = S->c[i * 4 + k];
+        }
+        float s = S->s[i * 4];
+        for (int r = 0; r < chain; r++)
+        {
+            OP::template apply<W>(x, b, c, s);
+        }
+        S->out[i] = x[0];
+    }
+}
+
+template <class OP>
+static void ref_opcode(Opcode_Streams *S, int width, int chain)
+{
+    switch (width)
+    {
+    case 1: ref_opcode_chain<OP, 1>(S, chain); break;
+    case 2: ref_opcode_chain<OP, 2>(S, chain); break;
+    case 3: ref_opcode_chain<OP, 3>(S, chain); break;
+    case 4: ref_opcode_chain<OP, 4>(S, chain); break;
+    }
+}
+
+struct Opcode_Bench
+{
+    const char *name;
+    // One link of the chain; %s is replaced with the swizzle pattern of the width.
+    const char *body;
+    int min_width;
+    int max_width;
+    void (*ref)(Opcode_Streams *S, int width, int chain);
+};
+
+static Opcode_Bench opcode_benches[] = {
+    {"mov", "x = x;", 1, 4, ref_opcode<Op_Nop>},
+    {"load_attribute", "x = b;", 1, 4, ref_opcode<Op_Load>},
+    {"neg", "x = -x;", 1, 4, ref_opcode<Op_Neg>},
+    {"add", "x = x + b;", 1, 4, ref_opcode<Op_Add>},
+    {"sub", "x = x - b;", 1, 4, ref_opcode<Op_Sub>},
+    {"mul", "x = x * b;", 1, 4, ref_opcode<Op_Mul>},
+    {"div", "x = x / b;", 1, 4, ref_opcode<Op_Div>},
+    {"mul_by_scalar", "x = x * s;", 2, 4, ref_opcode<Op_MulScalar>},
+    {"div_by_scalar", "x = x / s;", 2, 4, ref_opcode<Op_DivScalar>},
+    {"rcp", "x = rcp(x);", 1, 4, ref_opcode<Op_Rcp>},
+    {"rsqrt", "x = rsqrt(x);", 1, 4, ref_opcode<Op_Rsqrt>},
+    {"sqrt", "x = sqrt(x);", 1, 4, ref_opcode<Op_Sqrt>},
+    {"sin", "x = sin(x);", 1, 4, ref_opcode<Op_Sin>},
+    {"cos", "x = cos(x);", 1, 4, ref_opcode<Op_Cos>},
+    {"exp", "x = exp(x);", 1, 4, ref_opcode<Op_Exp>},
+    {"exp2", "x = exp2(x);", 1, 4, ref_opcode<Op_Exp2>},
+    {"exp10", "x = exp10(x);", 1, 4, ref_opcode<Op_Exp10>},
+    {"trunc", "x = trunc(x);", 1, 4, ref_opcode<Op_Trunc>},
+    {"fract", "x = fract(x);", 1, 4, ref_opcode<Op_Fract>},
+    {"abs", "x = abs(x);", 1, 4, ref_opcode<Op_Abs>},
+    {"min", "x = min(x, b);", 1, 4, ref_opcode<Op_Min>},
+    {"max", "x = max(x, b);", 1, 4, ref_opcode<Op_Max>},
+    {"dot", "x = x * dot(x, b);", 2, 4, ref_opcode<Op_Dot>},
+    {"normalize", "x = normalize(x);", 2, 4, ref_opcode<Op_Normalize>},
+    {"clamp01", "x = clamp01(x);", 1, 4, ref_opcode<Op_Clamp01>},
+    {"clamp", "x = clamp(x, b, c);", 1, 4, ref_opcode<Op_Clamp>},
+    {"lerp", "x = lerp(x, b, s);", 1, 4, ref_opcode<Op_Lerp>},
+    {"swizzle", "x = x.%s;", 2, 4, ref_opcode<Op_Swizzle>},
+    {"rand01", "x = rand01();", 1, 1, ref_opcode<Op_Rand01>},
+};
+
+static bool compile_opcode_program(FXVM_Program *program, const char *body, int width, int chain)
+{
+    static const FXVM_Type types[5] = { FXTYP_NONE, FXTYP_F1, FXTYP_F2, FXTYP_F3, FXTYP_F4 };
+
+    char link[64];
+    snprintf(link, sizeof(link), body, swizzle_patterns[width]);
+
+    char source[2048];
+    int len = snprintf(source, sizeof(source), "x = a;\n");
+    for (int i = 0; i < chain; i++)
+    {
+        len += snprintf(source + len, sizeof(source) - len, "%s\n", link);
+    }
+    len += snprintf(source + len, sizeof(source) - len, "x;\n");
+
+    FXVM_Compiler compiler = { };
+    compiler.report_error = bench_report_error;
+    register_attribute(&compiler, "a", types[width]);
+    register_attribute(&compiler, "b", types[width]);
+    register_attribute(&compiler, "c", types[width]);
+    register_attribute(&compiler, "s", FXTYP_F1);
+
+    bool ok = compile(&compiler, source, source + len) && compiler.error_num == 0;
+    if (!ok)
+    {
+        mem_free(compiler.codegen.buffer);
+        free_compiler(&compiler);
+        return false;
+    }
+
+    FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
+    *program = fxvm_program_new(bytecode);
+    free_compiler(&compiler);
+    return true;
+}
+
+/*
+ * Calibration of the cost model. Each opcode benchmark gives the cycles of one link of its chain, which
+ * may contain more than one opcode (e.g. the move to x and the attribute load of b). Opcodes are solved
+ * from the links where all other opcodes are already known, starting with the mov chain, and averaged
+ * over the widths.
+ */
+struct Opcode_Calibration
+{
+    enum { MAX_SAMPLES = 256 };
+
+    double tsc_per_ns;
+    int sample_num;
+    struct
+    {
+        double counts[FXVM_OPCODE_NUM];
+        double cycles;
+    } samples[MAX_SAMPLES];
+};
+
+static double bench_tsc_per_ns()
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    uint64_t start_tsc = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    uint64_t tsc = __rdtsc() - start_tsc;
+    return tsc / std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static void count_opcodes(const FXVM_Program *program, double *counts, double scale)
+{
+    const uint8_t *p = (uint8_t*)program->bytecode.code;
+    const uint8_t *end = p + program->bytecode.len;
+    while (p < end)
+    {
+        int size = fxvm_instruction_size(p);
+        if (size == 0) break;
+        counts[p[0] & 0x3f] += scale;
+        p += size;
+    }
+}
+
+static void print_opcode_cycles(Opcode_Calibration *cal)
+{
+    double cycles[FXVM_OPCODE_NUM];
+    for (int op = 0; op < FXVM_OPCODE_NUM; op++) cycles[op] = -1.0;
+
+    bool progress = true;
+    while (progress)
+    {
+        progress = false;
+        double sum[FXVM_OPCODE_NUM] = { };
+        int n[FXVM_OPCODE_NUM] = { };
+        for (int i = 0; i < cal->sample_num; i++)
+        {
+            int unknown = -1;
+            int unknown_num = 0;
+            double known_cycles = 0.0;
+            for (int op = 0; op < FXVM_OPCODE_NUM; op++)
+            {
+                double n = cal->samples[i].counts[op];
+                if (n < 0.5) continue;
+                if (cycles[op] < 0.0)
+                {
+                    unknown = op;
+                    unknown_num++;
+                }
+                else
+                {
+                    known_cycles += n * cycles[op];
+                }
+            }
+            if (unknown_num != 1) continue;
+            double c = (cal->samples[i].cycles - known_cycles) / cal->samples[i].counts[unknown];
+            sum[unknown] += (c > 0.0) ? c : 0.0;
+            n[unknown]++;
+        }
+        for (int op = 0; op < FXVM_OPCODE_NUM; op++)
+        {
+            if (n[op] == 0) continue;
+            cycles[op] = sum[op] / n[op];
+            progress = true;
+        }
+    }
+
+    // Loads and moves without a benchmark of their own cost about as much as an attribute load.
+    double fallback = (cycles[FXOP_LOAD_ATTRIBUTE] >= 0.0) ? cycles[FXOP_LOAD_ATTRIBUTE] : 1.0;
+    printf("\nconst float fxvm_opcode_cycles[FXVM_OPCODE_NUM] =\n{\n");
+    for (int op = 0; op < FXVM_OPCODE_NUM; op++)
+    {
+        bool measured = cycles[op] >= 0.0;
+        char value[32];
+        snprintf(value, sizeof(value), "%.2ff,", measured ? cycles[op] : fallback);
+        printf("    %-8s // %s%s\n", value, fxvm_opcode_string[op] + 5, measured ? "" : ", not measured");
+    }
+    printf("};\n");
+}
+
+static void bench_opcodes(Bench_Results *results, Bench_Options *options, Opcode_Calibration *cal)
+{
+    pcg32_random_t rng = { 0x1234567ULL, 0x9abcdefULL };
+
+    Opcode_Streams S = { };
+    S.count = OPCODE_INSTANCES;
+    S.a = (float*)malloc(sizeof(float) * 4 * S.count);
+    S.b = (float*)malloc(sizeof(float) * 4 * S.count);
+    S.c = (float*)malloc(sizeof(float) * 4 * S.count);
+    S.s = (float*)malloc(sizeof(float) * 4 * S.count);
+    S.out = (float*)malloc(sizeof(float) * S.count);
+    for (int i = 0; i < 4 * S.count; i++)
+    {
+        // Inputs stay in a range where none of the chains overflow or produce NaNs.
+        S.a[i] = bench_random(&rng, 0.5f, 1.0f);
+        S.b[i] = bench_random(&rng, 0.9f, 1.1f);
+        S.c[i] = bench_random(&rng, 1.5f, 2.0f);
+        S.s[i] = bench_random(&rng, 0.9f, 1.1f);
+    }
+
+    FXVM_AttributeBindings bindings = { };
+    bind_attribute(&bindings, 0, FXTYP_F4, 4 * sizeof(float), S.a);
+    bind_attribute(&bindings, 1, FXTYP_F4, 4 * sizeof(float), S.b);
+    bind_attribute(&bindings, 2, FXTYP_F4, 4 * sizeof(float), S.c);
+    bind_attribute(&bindings, 3, FXTYP_F4, 4 * sizeof(float), S.s);
+
+    FXVM_Machine vm = fxvm_new();
+    vm.bindings = &bindings;
+
+    double instances = (double)S.count * OPCODE_CHAIN;
+
+    for (int w = 1; w <= 4; w++)
+    {
+        FXVM_Program base = { };
+        if (!compile_opcode_program(&base, "", w, 0)) continue;
+
+        double ref_base_ns = bench_min_ns(options->reps, [&]{ ref_opcode<Op_Nop>(&S, w, 0); });
+
+        for (Opcode_Bench &op : opcode_benches)
+        {
+            if (w < op.min_width || w > op.max_width) continue;
+
+            char name[96];
+            snprintf(name, sizeof(name), "opcode/%s/f%d", op.name, w);
+            if (!bench_enabled(options, name)) continue;
+
+            FXVM_Program program = { };
+            if (!compile_opcode_program(&program, op.body, w, OPCODE_CHAIN))
+            {
+                printf("%-44s does not compile\n", name);
+                continue;
+            }
+
+            double ref_ns = bench_min_ns(options->reps, [&]{ op.ref(&S, w, OPCODE_CHAIN); });
+            ref_ns = (ref_ns - ref_base_ns) / instances;
+            bench_sink = S.out[0];
+
+            for (Exec_Backend &backend : exec_backends)
+            {
+                char backend_name[128];
+                snprintf(backend_name, sizeof(backend_name), "%s/%s", name, backend.name);
+                if (!bench_enabled(options, backend_name)) continue;
+
+                Bench_Perf base_perf, perf;
+                double base_ns = bench_min_ns(options->reps, [&]{ backend.run(&vm, &base, S.count, S.out); }, &base_perf);
+                double ns = bench_min_ns(options->reps, [&]{ backend.run(&vm, &program, S.count, S.out); }, &perf);
+                bench_sink = S.out[0];
+
+                perf = bench_perf_per_instance(&perf, &base_perf, instances);
+                add_result(results, backend_name, (ns - base_ns) / instances, ref_ns, &perf);
+
+                if (cal && strcmp(backend.name, "group16") == 0 && cal->sample_num < Opcode_Calibration::MAX_SAMPLES)
+                {
+                    auto sample = &cal->samples[cal->sample_num++];
+                    *sample = { };
+                    count_opcodes(&program, sample->counts, 1.0 / OPCODE_CHAIN);
+                    count_opcodes(&base, sample->counts, -1.0 / OPCODE_CHAIN);
+                    sample->cycles = (ns - base_ns) / instances * cal->tsc_per_ns;
+                }
+            }
+            fxvm_program_free(&program);
+        }
+        fxvm_program_free(&base);
+    }
+
+    free(S.a);
+    free(S.b);
+    free(S.c);
+    free(S.s);
+    free(S.out);
+}
+
+/*
+ * Program benchmarks and hand-written references of the programs in the shipped .psys files.
+ * The references compute what the programs are meant to compute, statements whose value is
+ * discarded are left out (the VM still executes them).
+ */
+enum { PROGRAM_INSTANCES = 4096 };
+
+struct Program_Streams
+{
+    float emitter_life;
+
+    const float *life;
+    const vec3 *position;
+    const vec3 *velocity;
+    const vec3 *acceleration;
+    const vec4 *random;
+
+    float *out_f1;
+    vec3 *out_f3;
+    vec4 *out_f4;
+};
+
+typedef void (*Reference_Program)(Program_Streams *S, int first, int count);
+
+static const float BENCH_PI = 3.14159265f;
+
+static void ref_example_rate(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f1[i] = 200.0f;
+}
+
+static void ref_example_initial_life(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f1[i] = 1.05f;
+}
+
+static void ref_example_initial_position(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        float theta = random01_float(&ref_rng) * BENCH_PI * 4.0f;
+        float r = (2.0f + random01_float(&ref_rng)) * 0.5f * 5.0f * S->emitter_life;
+        S->out_f3[i] = vec3{sinf(theta), 0.0f, cosf(theta)} * r;
+    }
+}
+
+static void ref_example_initial_velocity(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        S->out_f3[i] = vec3{0.0f, 2.0f + 6.0f * random01_float(&ref_rng), 0.0f};
+    }
+}
+
+static void ref_zero_acceleration(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f3[i] = vec3{0.0f, 0.0f, 0.0f};
+}
+
+static inline vec4 ref_lerp(vec4 a, vec4 b, float t)
+{
+    return a * (1.0f - t) + b * t;
+}
+
+static void ref_example_color(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        S->out_f4[i] = ref_lerp(vec4{0.86f, 1.0f, 0.6f, 0.8f}, vec4{0.6f, 0.4f, 0.8f, 0.1f}, S->life[i]);
+    }
+}
+
+static void ref_example_size(Program_Streams *S, int first, int count)
+{
+    float e = fabsf(S->emitter_life - 0.5f) * 2.0f;
+    for (int i = first; i < first + count; i++)
+    {
+        float x = S->random[i].x;
+        float t = S->life[i];
+        S->out_f1[i] = 0.3f + 0.3f * x * t + (0.6f * (1.0f - e));
+    }
+}
+
+static void ref_explosion_rate(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f1[i] = 1000.0f;
+}
+
+static void ref_explosion_initial_life(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f1[i] = 1.0f + random01_float(&ref_rng) * 0.6f;
+}
+
+static void ref_explosion_initial_position(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f3[i] = vec3{0.0f, 0.0f, 0.0f};
+}
+
+static inline vec3 ref_random_direction()
+{
+    vec3 v = vec3{
+        2.0f * random01_float(&ref_rng) - 1.0f,
+        0.2f + 2.0f * random01_float(&ref_rng),
+        2.0f * random01_float(&ref_rng) - 1.0f};
+    return v * (1.0f / sqrtf(v.x * v.x + v.y * v.y + v.z * v.z));
+}
+
+static void ref_explosion_initial_velocity(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f3[i] = ref_random_direction() * 6.0f;
+}
+
+static void ref_explosion_acceleration(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f3[i] = vec3{0.0f, -0.2f, 0.0f};
+}
+
+static void ref_explosion_color(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        S->out_f4[i] = ref_lerp(vec4{1.0f, 0.8f, 0.2f, 1.0f}, vec4{0.5f, 0.4f, 0.5f, 0.0f}, S->life[i]);
+    }
+}
+
+static void ref_explosion_size(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f1[i] = 0.8f + S->random[i].x * S->life[i];
+}
+
+static void ref_sparks_initial_velocity(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        vec3 v = ref_random_direction() * 6.0f;
+        S->out_f3[i] = v * random01_float(&ref_rng);
+    }
+}
+
+static void ref_sparks_color(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        S->out_f4[i] = ref_lerp(vec4{1.0f, 0.8f, 0.2f, 1.0f}, vec4{0.8f, 0.4f, 0.2f, 0.0f}, S->life[i]);
+    }
+}
+
+static void ref_sparks_size(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f1[i] = 10.0f + S->random[i].x * S->life[i];
+}
+
+static void ref_simple_initial_velocity(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        float rx = random01_float(&ref_rng);
+        float rz = random01_float(&ref_rng);
+        S->out_f3[i] = vec3{rx - 1.0f, 2.0f, rz - 1.0f};
+    }
+}
+
+static void ref_simple_acceleration(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        S->out_f3[i] = vec3{1.0f, 0.2f, 0.2f} * (0.2f + S->life[i]);
+    }
+}
+
+static void ref_simple_color(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        S->out_f4[i] = ref_lerp(vec4{1.0f, 0.5f, 0.5f, 1.0f}, vec4{0.5f, 0.6f, 0.2f, 0.02f}, S->life[i]);
+    }
+}
+
+static void ref_simple_size(Program_Streams *S, int first, int count)
+{
+    for (int i = first; i < first + count; i++) S->out_f1[i] = 0.2f + (0.5f - 0.2f) * S->life[i];
+}
+
+struct Reference_System
+{
+    const char *name;
+    const char *filename;
+
+    Reference_Program rate;
+    Reference_Program initial_life;
+    Reference_Program initial_position;
+    Reference_Program initial_velocity;
+
+    Reference_Program acceleration;
+    Reference_Program color;
+    Reference_Program size;
+};
+
+static Reference_System reference_systems[] = {
+    {"example", "particle_systems/example.psys",
+        ref_example_rate, ref_example_initial_life, ref_example_initial_position, ref_example_initial_velocity,
+        ref_zero_acceleration, ref_example_color, ref_example_size},
+    {"explosion", "particle_systems/explosion.psys",
+        ref_explosion_rate, ref_explosion_initial_life, ref_explosion_initial_position, ref_explosion_initial_velocity,
+        ref_explosion_acceleration, ref_explosion_color, ref_explosion_size},
+    {"explosion_sparks", "particle_systems/explosion_sparks.psys",
+        ref_explosion_rate, ref_explosion_initial_life, ref_explosion_initial_position, ref_sparks_initial_velocity,
+        ref_explosion_acceleration, ref_sparks_color, ref_sparks_size},
+    {"simple", "particle_systems/simple.psys",
+        nullptr, nullptr, nullptr, ref_simple_initial_velocity,
+        ref_simple_acceleration, ref_simple_color, ref_simple_size},
+};
+
+enum { REFERENCE_SYSTEM_NUM = sizeof(reference_systems) / sizeof(reference_systems[0]) };
+
+static void bench_programs(Bench_Results *results, Bench_Options *options)
+{
+    pcg32_random_t rng = { 0x7654321ULL, 0xfedcbaULL };
+
+    int count = PROGRAM_INSTANCES;
+    float *life = (float*)malloc(sizeof(float) * (count + 4));
+    vec3 *position = (vec3*)malloc(sizeof(vec3) * count);
+    vec3 *velocity = (vec3*)malloc(sizeof(vec3) * count);
+    vec3 *acceleration = (vec3*)malloc(sizeof(vec3) * count);
+    vec4 *random = (vec4*)malloc(sizeof(vec4) * count);
+    float *out_f1 = (float*)malloc(sizeof(float) * count);
+    vec3 *out_f3 = (vec3*)malloc(sizeof(vec3) * count);
+    vec4 *out_f4 = (vec4*)malloc(sizeof(vec4) * count);
+    for (int i = 0; i < count; i++)
+    {
+        life[i] = random01_float(&rng);
+        position[i] = vec3{bench_random(&rng, -5, 5), bench_random(&rng, 0, 5), bench_random(&rng, -5, 5)};
+        velocity[i] = vec3{bench_random(&rng, -1, 1), bench_random(&rng, 0, 4), bench_random(&rng, -1, 1)};
+        acceleration[i] = vec3{0.0f, -0.2f, 0.0f};
+        random[i] = vec4{random01_float(&rng), random01_float(&rng), random01_float(&rng), random01_float(&rng)};
+    }
+
+    Program_Streams S = { };
+    S.emitter_life = 0.3f;
+    S.life = life;
+    S.position = position;
+    S.velocity = velocity;
+    S.acceleration = acceleration;
+    S.random = random;
+    S.out_f1 = out_f1;
+    S.out_f3 = out_f3;
+    S.out_f4 = out_f4;
+
+    FXVM_Machine vm = fxvm_new();
+
+    for (int s = 0; s < REFERENCE_SYSTEM_NUM; s++)
+    {
+        Reference_System *ref = &reference_systems[s];
+        Particle_System PS = load_particle_system(ref->filename);
+
+        FXVM_AttributeBindings bindings = { };
+        bind_attribute(&bindings, PS.attrib_life, FXTYP_F1, sizeof(float), life);
+        bind_attribute(&bindings, PS.attrib_position, FXTYP_F3, sizeof(vec3), position);
+        bind_attribute(&bindings, PS.attrib_velocity, FXTYP_F3, sizeof(vec3), velocity);
+        bind_attribute(&bindings, PS.attrib_acceleration, FXTYP_F3, sizeof(vec3), acceleration);
+        bind_attribute(&bindings, PS.attrib_particle_random, FXTYP_F4, sizeof(vec4), random);
+        FXVM_AttributeBindings spawn_bindings = { };
+
+        struct
+        {
+            const char *name;
+            FXVM_Program program;
+            int uniform_emitter_life;
+            FXVM_AttributeBindings *bindings;
+            int width;
+            Reference_Program ref;
+        } programs[] = {
+            {"rate", PS.emitter.rate_p, PS.emitter.life_i, &spawn_bindings, 1, ref->rate},
+            {"initial_life", PS.emitter.initial_life_p, PS.emitter.life_i, &spawn_bindings, 1, ref->initial_life},
+            {"initial_position", PS.emitter.initial_position_p, PS.emitter.life_i, &spawn_bindings, 3, ref->initial_position},
+            {"initial_velocity", PS.emitter.initial_velocity_p, PS.emitter.life_i, &spawn_bindings, 3, ref->initial_velocity},
+            {"acceleration", PS.acceleration_p, PS.emitter_life_i, &bindings, 3, ref->acceleration},
+            {"color", PS.color_p, PS.emitter_life_i, &bindings, 4, ref->color},
+            {"size", PS.size_p, PS.emitter_life_i, &bindings, 1, ref->size},
+        };
+
+        for (auto &p : programs)
+        {
+            if (!p.program.bytecode.code) continue;
+
+            char name[96];
+            snprintf(name, sizeof(name), "program/%s/%s", ref->name, p.name);
+            if (!bench_enabled(options, name)) continue;
+
+            FXVM_Program program = p.program;
+            set_uniform_f1(&program, p.uniform_emitter_life, &S.emitter_life);
+            vm.bindings = p.bindings;
+
+            Bench_Perf perf;
+            double ns = bench_min_ns(options->reps, [&]{
+                switch (p.width)
+                {
+                case 1: eval_f1_range<16>(&vm, out_f1, 0, count, &program); break;
+                case 3: eval_f3_range<16>(&vm, out_f3, 0, count, &program); break;
+                case 4: eval_f4_range<16>(&vm, out_f4, 0, count, &program); break;
+                }
+            }, &perf);
+            double ref_ns = -1.0;
+            if (p.ref)
+            {
+                ref_ns = bench_min_ns(options->reps, [&]{ p.ref(&S, 0, count); }) / count;
+            }
+            bench_sink = out_f1[0] + out_f3[0].x + out_f4[0].x;
+            perf = bench_perf_per_instance(&perf, nullptr, count);
+            add_result(results, name, ns / count, ref_ns, &perf);
+        }
+        free_particle_system(&PS);
+    }
+
+    free(life);
+    free(position);
+    free(velocity);
+    free(acceleration);
+    free(random);
+    free(out_f1);
+    free(out_f3);
+    free(out_f4);
+}
+
+/*
+ * simulate() benchmarks. The emitters are filled up with long living particles, so every step
+ * updates exactly Particles::MAX particles per emitter and nothing is emitted or compacted.
+ */
+enum { SIMULATE_STEPS_PER_RUN = 4 };
+
+static void fill_emitters(Emitter_Instance *E, int emitter_num)
+{
+    pcg32_random_t rng = { 0x2468aceULL, 0x13579bdULL };
+    for (int e = 0; e < emitter_num; e++)
+    {
+        E[e] = { };
+        E[e].particles_alive = Particles::MAX;
+        Particles *P = &E[e].P;
+        for (int i = 0; i < Particles::MAX; i++)
+        {
+            P->position[i] = vec3{bench_random(&rng, -5, 5), bench_random(&rng, 0, 5), bench_random(&rng, -5, 5)};
+            P->velocity[i] = vec3{bench_random(&rng, -1, 1), bench_random(&rng, 0, 4), bench_random(&rng, -1, 1)};
+            P->acceleration[i] = vec3{0.0f, 0.0f, 0.0f};
+            P->life_max[i] = 2e6f;
+            P->life_seconds[i] = 1e6f * (1.0f + random01_float(&rng));
+            P->life_01[i] = 0.0f;
+            P->size[i] = 1.0f;
+            P->color[i] = vec4{1, 1, 1, 1};
+            P->random[i] = vec4{random01_float(&rng), random01_float(&rng), random01_float(&rng), random01_float(&rng)};
+        }
+        grow_closed_form_spawn(&E[e].spawn, P, 0, Particles::MAX);
+    }
+}
+
+// Hand-written update_particles() with the reference programs.
+static void ref_simulate(Reference_System *ref, Particle_System *PS, Emitter_Instance *E, int emitter_num, float dt)
+{
+    float drag = PS->emitter.drag;
+    for (int e = 0; e < emitter_num; e++)
+    {
+        Particles *P = &E[e].P;
+        int count = E[e].particles_alive;
+
+        Program_Streams S = { };
+        S.emitter_life = get_emitter_life(&PS->emitter, &E[e]);
+        S.life = P->life_01;
+        S.position = P->position;
+        S.velocity = P->velocity;
+        S.acceleration = P->acceleration;
+        S.random = P->random;
+        S.out_f1 = P->size;
+        S.out_f3 = P->acceleration;
+        S.out_f4 = P->color;
+
+        if (ref->acceleration) ref->acceleration(&S, 0, count);
+        for (int i = 0; i < count; i++)
+        {
+            float life_seconds = P->life_seconds[i] - dt;
+            if (life_seconds < 0.0f) life_seconds = 0.0f;
+            P->life_seconds[i] = life_seconds;
+            P->life_01[i] = clamp01(1.0f - life_seconds / P->life_max[i]);
+
+            vec3 vel = P->velocity[i];
+            float speed = sqrtf(vel.x * vel.x + vel.y * vel.y + vel.z * vel.z);
+            vec3 acceleration = P->acceleration[i] - vel * (speed * drag);
+            vec3 velocity = vel + acceleration * dt;
+            P->acceleration[i] = acceleration;
+            P->velocity[i] = velocity;
+            P->position[i] = P->position[i] + velocity * dt;
+        }
+        if (ref->size) ref->size(&S, 0, count);
+        if (ref->color) ref->color(&S, 0, count);
+    }
+}
+
+static void bench_simulate(Bench_Results *results, Bench_Options *options, Emitter_Instance *E)
+{
+    static const int particle_counts[] = { 1000, 10000, 100000, 1000000 };
+    const float dt = 0.01666f;
+
+    FXVM_Machine vm = fxvm_new();
+    for (int s = 0; s < REFERENCE_SYSTEM_NUM; s++)
+    {
+        Reference_System *ref = &reference_systems[s];
+        Particle_System PS = load_particle_system(ref->filename);
+        // The references integrate, closed form systems have a section of their own.
+        PS.closed_form = false;
+
+        for (int particles : particle_counts)
+        {
+            if (particles > options->max_particles) break;
+
+            char name[96];
+            snprintf(name, sizeof(name), "simulate/%s/%d", ref->name, particles);
+            if (!bench_enabled(options, name)) continue;
+
+            int emitter_num = particles / Particles::MAX;
+            fill_emitters(E, emitter_num);
+
+            Bench_Perf perf;
+            double ns = bench_min_ns(options->reps, [&]{
+                for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++)
+                {
+                    for (int e = 0; e < emitter_num; e++)
+                    {
+                        simulate(&vm, &PS, &E[e], dt);
+                    }
+                }
+            }, &perf);
+
+            fill_emitters(E, emitter_num);
+            double ref_ns = bench_min_ns(options->reps, [&]{
+                for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++)
+                {
+                    ref_simulate(ref, &PS, E, emitter_num, dt);
+                }
+            });
+            bench_sink = E[0].P.position[0].x;
+
+            double per_particle = (double)particles * SIMULATE_STEPS_PER_RUN;
+            perf = bench_perf_per_instance(&perf, nullptr, per_particle);
+            add_result(results, name, ns / per_particle, ref_ns / per_particle, &perf);
+        }
+        free_particle_system(&PS);
+    }
+}
+
+static void bench_closed_form(Bench_Results *results, Bench_Options *options, Emitter_Instance *E)
+{
+    static const int particle_counts[] = { 10000, 100000 };
+    const float dt = 0.01666f;
+
+    FXVM_Machine vm = fxvm_new();
+    for (Reference_System &ref : reference_systems)
+    {
+        Particle_System PS = load_particle_system(ref.filename);
+        for (int particles : particle_counts)
+        {
+            if (particles > options->max_particles) break;
+
+            char name[96];
+            snprintf(name, sizeof(name), "closed_form/%s/%d", ref.name, particles);
+            if (!bench_enabled(options, name)) continue;
+
+            int emitter_num = particles / Particles::MAX;
+            auto run = [&]{
+                for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++)
+                {
+                    for (int e = 0; e < emitter_num; e++) simulate(&vm, &PS, &E[e], dt);
+                }
+            };
+            PS.closed_form = true;
+            fill_emitters(E, emitter_num);
+            Bench_Perf perf;
+            double ns = bench_min_ns(options->reps, run, &perf);
+            PS.closed_form = false;
+            fill_emitters(E, emitter_num);
+            double ref_ns = bench_min_ns(options->reps, run);
+            bench_sink = E[0].P.position[0].x;
+
+            double per_particle = (double)particles * SIMULATE_STEPS_PER_RUN;
+            perf = bench_perf_per_instance(&perf, nullptr, per_particle);
+            add_result(results, name, ns / per_particle, ref_ns / per_particle, &perf);
+        }
+        free_particle_system(&PS);
+    }
+}
+
+static void bench_scaling(Bench_Results *results, Bench_Options *options, Emitter_Instance *E)
+{
+    const float dt = 0.01666f;
+    Reference_System *ref = &reference_systems[0];
+
+    int particles = (options->max_particles < 1000000) ? options->max_particles : 1000000;
+    int emitter_num = particles / Particles::MAX;
+    if (emitter_num <= 0) return;
+    particles = emitter_num * Particles::MAX;
+
+    int hardware_threads = (int)std::thread::hardware_concurrency();
+    if (hardware_threads <= 0) hardware_threads = 1;
+
+    Particle_System PS = load_particle_system(ref->filename);
+    Simulate_Job *jobs = new Simulate_Job[emitter_num];
+    for (int e = 0; e < emitter_num; e++)
+    {
+        jobs[e].PS = &PS;
+        jobs[e].E = &E[e];
+        jobs[e].dt = dt;
+    }
+
+    double single_ns = 0.0;
+    for (int threads = 1; ; threads = (threads * 2 < hardware_threads) ? threads * 2 : hardware_threads)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "scaling/%s/%d/t%d", ref->name, particles, threads);
+        if (bench_enabled(options, name))
+        {
+            Job_System js;
+            job_system_init(&js, threads);
+            fill_emitters(E, emitter_num);
+
+            double ns = bench_min_ns(options->reps, [&]{
+                for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++)
+                {
+                    simulate_parallel(&js, jobs, emitter_num);
+                }
+            });
+            job_system_shutdown(&js);
+
+            ns /= (double)particles * SIMULATE_STEPS_PER_RUN;
+            if (threads == 1) single_ns = ns;
+            add_result(results, name, ns, -1.0);
+            if (single_ns > 0.0) printf("%-44s speedup %.2f\n", "", single_ns / ns);
+        }
+        if (threads == hardware_threads) break;
+    }
+
+    delete[] jobs;
+    free_particle_system(&PS);
+}
+
+// Ambient emitters: a short emission, a long cooldown, started at spread out times.
+static void bench_sleep(Bench_Results *results, Bench_Options *options, Emitter_Instance *E, int max_emitters)
+{
+    const float dt = 0.01666f;
+    const float cooldown = 10.0f;
+    const int warmup_steps = 600;
+    int emitter_num = (max_emitters < 1000) ? max_emitters : 1000;
+
+    char name[96];
+    snprintf(name, sizeof(name), "sleep/simple/%d", emitter_num);
+    if (!bench_enabled(options, name)) return;
+
+    Particle_System PS = load_particle_system("particle_systems/simple.psys");
+    PS.emitter.life = 0.25f;
+    PS.emitter.cooldown = cooldown;
+    FXVM_Machine vm = fxvm_new();
+    auto start_emitters = [&]{
+        for (int e = 0; e < emitter_num; e++)
+        {
+            E[e] = new_emitter(&PS, vec3{(float)(e % 32), 0.0f, (float)(e / 32)});
+            E[e].life = -cooldown * e / emitter_num;
+        }
+    };
+
+    start_emitters();
+    Emitter_Scheduler S = new_emitter_scheduler(dt);
+    for (int e = 0; e < emitter_num; e++) emitter_scheduler_add(&S, &PS, &E[e]);
+    for (int step = 0; step < warmup_steps; step++) emitter_scheduler_step(&S, &vm);
+    double ns = bench_min_ns(options->reps, [&]{
+        for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++) emitter_scheduler_step(&S, &vm);
+    });
+    int awake_num = S.awake_num;
+    free_emitter_scheduler(&S);
+
+    start_emitters();
+    for (int step = 0; step < warmup_steps; step++)
+    {
+        for (int e = 0; e < emitter_num; e++) simulate(&vm, &PS, &E[e], dt);
+    }
+    double ref_ns = bench_min_ns(options->reps, [&]{
+        for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++)
+        {
+            for (int e = 0; e < emitter_num; e++) simulate(&vm, &PS, &E[e], dt);
+        }
+    });
+    bench_sink = E[0].life;
+
+    double per_emitter = (double)emitter_num * SIMULATE_STEPS_PER_RUN;
+    add_result(results, name, ns / per_emitter, ref_ns / per_emitter);
+    printf("%-44s %d of %d emitters awake\n", "", awake_num, emitter_num);
+    free_particle_system(&PS);
+}
+
+// Starting a new emitter a few seconds into its life.
+static void bench_prewarm(Bench_Results *results, Bench_Options *options, Emitter_Instance *E)
+{
+    const float dt = 0.01666f;
+    const float seconds = 3.0f;
+    const int steps = (int)(seconds / dt + 0.5f);
+
+    for (Reference_System &ref : reference_systems)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "prewarm/%s/%ds", ref.name, (int)seconds);
+        if (!bench_enabled(options, name)) continue;
+
+        Particle_System PS = load_particle_system(ref.filename);
+        FXVM_Machine vm = fxvm_new();
+        double ns = bench_min_ns(options->reps, [&]{
+            *E = new_emitter(&PS, vec3{0.0f, 0.0f, 0.0f});
+            prewarm_emitter(&vm, &PS, E, steps * dt, dt);
+        });
+        bench_sink = E->life;
+        double ref_ns = bench_min_ns(options->reps, [&]{
+            *E = new_emitter(&PS, vec3{0.0f, 0.0f, 0.0f});
+            for (int step = 0; step < steps; step++) simulate(&vm, &PS, E, dt);
+        });
+        bench_sink = E->life;
+
+        add_result(results, name, ns, ref_ns);
+        free_particle_system(&PS);
+    }
+}
+
+static void bench_batch(Bench_Results *results, Bench_Options *options, Emitter_Instance *E, int max_emitters)
+{
+    const float dt = 0.01666f;
+    const int warmup_steps = 120;
+    int emitter_num = (max_emitters < 256) ? max_emitters : 256;
+
+    for (Reference_System &ref : reference_systems)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "batch/%s/%d", ref.name, emitter_num);
+        if (!bench_enabled(options, name)) continue;
+
+        Particle_System PS = load_particle_system(ref.filename);
+        FXVM_Machine vm = fxvm_new();
+        // Starts spread over one cycle, so that some emitters spawn and some are in their cooldown.
+        auto start_time = [&](int e) { return -(PS.emitter.life + PS.emitter.cooldown) * e / emitter_num; };
+
+        Emitter_Batch B = new_emitter_batch(&PS);
+        for (int e = 0; e < emitter_num; e++)
+        {
+            add_batch_emitter(&B, vec3{(float)(e % 16), 0.0f, (float)(e / 16)});
+            B.emitter_time[e] = start_time(e);
+        }
+        for (int step = 0; step < warmup_steps; step++) simulate_batch(&vm, &B, dt);
+        double ns = bench_min_ns(options->reps, [&]{
+            for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++) simulate_batch(&vm, &B, dt);
+        });
+        bench_sink = (float)B.particles_alive;
+        free_emitter_batch(&B);
+
+        for (int e = 0; e < emitter_num; e++)
+        {
+            E[e] = new_emitter(&PS, vec3{(float)(e % 16), 0.0f, (float)(e / 16)});
+            E[e].life = start_time(e);
+        }
+        for (int step = 0; step < warmup_steps; step++)
+        {
+            for (int e = 0; e < emitter_num; e++) simulate(&vm, &PS, &E[e], dt);
+        }
+        double ref_ns = bench_min_ns(options->reps, [&]{
+            for (int step = 0; step < SIMULATE_STEPS_PER_RUN; step++)
+            {
+                for (int e = 0; e < emitter_num; e++) simulate(&vm, &PS, &E[e], dt);
+            }
+        });
+        bench_sink = (float)E[0].particles_alive;
+
+        double per_emitter = (double)emitter_num * SIMULATE_STEPS_PER_RUN;
+        add_result(results, name, ns / per_emitter, ref_ns / per_emitter);
+        free_particle_system(&PS);
+    }
+}
+
+static void bench_sort(Bench_Results *results, Bench_Options *options)
+{
+    static const int particle_counts[] = { 10000, 100000, 1000000 };
+    static const int depth_bits[] = { 16, 24, 32 };
+
+    int max_n = 0;
+    for (int n : particle_counts) if (n <= options->max_particles) max_n = n;
+    if (max_n == 0) return;
+
+    float *depth = (float*)malloc(sizeof(float) * max_n);
+    uint64_t *keys = (uint64_t*)malloc(sizeof(uint64_t) * max_n);
+    uint64_t *tmp = (uint64_t*)malloc(sizeof(uint64_t) * max_n);
+    uint64_t *ref_keys = (uint64_t*)malloc(sizeof(uint64_t) * max_n);
+    pcg32_random_t rng = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
+    for (int i = 0; i < max_n; i++) depth[i] = bench_random(&rng, -20.0f, -0.5f);
+
+    for (int n : particle_counts)
+    {
+        if (n > max_n) break;
+        for (int bits : depth_bits)
+        {
+            char name[96];
+            snprintf(name, sizeof(name), "sort/%d/d%d", n, bits);
+            if (!bench_enabled(options, name)) continue;
+
+            uint64_t *sorted = nullptr;
+            Bench_Perf perf;
+            double ns = bench_min_ns(options->reps, [&]{
+                sorted = draw_sort(depth, n, bits, keys, tmp);
+            }, &perf);
+
+            uint32_t mask = draw_sort_depth_mask(bits);
+            double ref_ns = bench_min_ns(options->reps, [&]{
+                for (int i = 0; i < n; i++) ref_keys[i] = ((uint64_t)(draw_sort_float_key(depth[i]) & mask) << 32) | (uint32_t)i;
+                std::sort(ref_keys, ref_keys + n);
+            });
+            if (memcmp(sorted, ref_keys, sizeof(uint64_t) * n) != 0) printf("Error: %s differs from std::sort\n", name);
+
+            perf = bench_perf_per_instance(&perf, nullptr, n);
+            add_result(results, name, ns / n, ref_ns / n, &perf);
+        }
+    }
+
+    free(depth);
+    free(keys);
+    free(tmp);
+    free(ref_keys);
+}
+
+// Largest difference of the vertex positions, or 1e30 if texture coordinates or colors differ.
+static float diff_quads(const Particle_Vertex *a, const Particle_Vertex *b, int n)
+{
+    float max_diff = 0.0f;
+    for (int i = 0; i < n * PARTICLE_QUAD_VERTICES; i++)
+    {
+        if (a[i].u != b[i].u || a[i].v != b[i].v || a[i].color != b[i].color) return 1e30f;
+        float d = fmaxf(fabsf(a[i].x - b[i].x), fmaxf(fabsf(a[i].y - b[i].y), fabsf(a[i].z - b[i].z)));
+        if (!(d <= max_diff)) max_diff = d;
+    }
+    return max_diff;
+}
+
+static void bench_quads(Bench_Results *results, Bench_Options *options)
+{
+    static const int particle_counts[] = { 10000, 100000 };
+    static const char *style_names[] = { "billboard", "axis", "stretch", "cull", "closed_form" };
+
+    int max_n = 0;
+    for (int n : particle_counts) if (n <= options->max_particles) max_n = n;
+    if (max_n == 0) return;
+
+    vec3 *position = (vec3*)malloc(sizeof(vec3) * max_n);
+    vec3 *velocity = (vec3*)malloc(sizeof(vec3) * max_n);
+    float *size = (float*)malloc(sizeof(float) * max_n);
+    vec4 *color = (vec4*)malloc(sizeof(vec4) * max_n);
+    vec3 *acceleration = (vec3*)malloc(sizeof(vec3) * max_n);
+    float *life_seconds = (float*)malloc(sizeof(float) * max_n);
+    float *life_max = (float*)malloc(sizeof(float) * max_n);
+    float *depth = (float*)malloc(sizeof(float) * max_n);
+    float *ref_depth = (float*)malloc(sizeof(float) * max_n);
+    Particle_Vertex *vertices = (Particle_Vertex*)malloc(sizeof(Particle_Vertex) * PARTICLE_QUAD_VERTICES * max_n);
+    Particle_Vertex *ref_vertices = (Particle_Vertex*)malloc(sizeof(Particle_Vertex) * PARTICLE_QUAD_VERTICES * max_n);
+    uint32_t *indices = (uint32_t*)malloc(sizeof(uint32_t) * PARTICLE_QUAD_INDICES * max_n);
+    pcg32_random_t rng = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
+    for (int i = 0; i < max_n; i++)
+    {
+        position[i] = { bench_random(&rng, -5.0f, 5.0f), bench_random(&rng, 0.0f, 5.0f), bench_random(&rng, -5.0f, 5.0f) };
+        velocity[i] = { bench_random(&rng, -2.0f, 2.0f), bench_random(&rng, -2.0f, 2.0f), bench_random(&rng, -2.0f, 2.0f) };
+        size[i] = bench_random(&rng, 0.1f, 1.0f);
+        color[i] = { bench_random(&rng, -0.1f, 1.1f), bench_random(&rng, 0.0f, 1.0f), bench_random(&rng, 0.0f, 1.0f), bench_random(&rng, 0.0f, 1.0f) };
+        acceleration[i] = { 0.0f, bench_random(&rng, -2.0f, 0.0f), 0.0f };
+        life_max[i] = 2.0f;
+        life_seconds[i] = bench_random(&rng, 0.0f, 2.0f);
+    }
+    Particle_Quad_Streams streams = { };
+    streams.position = position;
+    streams.velocity = velocity;
+    streams.size = size;
+    streams.color = color;
+    Particle_Quad_Streams closed_form_streams = streams;
+    closed_form_streams.acceleration = acceleration;
+    closed_form_streams.life_seconds = life_seconds;
+    closed_form_streams.life_max = life_max;
+    closed_form_streams.drag = 1.5f;
+
+    // The default camera of particles.cpp, looking down at the floor.
+    mat4 view_mat = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, 0.94f, 0.34f, -2.6f,
+        0.0f, -0.34f, 0.94f, -6.9f,
+        0.0f, 0.0f, 0.0f, 1.0f,
+    };
+    Particle_View view = particle_view(view_mat);
+    // A narrower view than the default one, that and the size threshold cull about a fifth of the particles.
+    mat4 projection = Perspective_lh(40.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+
+    for (int n : particle_counts)
+    {
+        if (n > max_n) break;
+        for (int s = 0; s < 5; s++)
+        {
+            char name[96];
+            snprintf(name, sizeof(name), "quads/%s/%d", style_names[s], n);
+            if (!bench_enabled(options, name)) continue;
+
+            Particle_Quad_Style style = { };
+            style.stretch = (s == 2);
+            style.align_to_axis = (s == 1);
+            style.align_axis = { 0.0f, 1.0f, 0.0f };
+            style.u0 = 0.25f;
+            style.v0 = 1.0f;
+            style.u1 = 0.5f;
+            style.v1 = 0.75f;
+
+            Particle_Cull cull_simd = particle_cull(projection, view_mat, 720, 40.0f);
+            Particle_Cull cull_scalar = cull_simd;
+            Particle_Cull *cull = (s == 3) ? &cull_simd : nullptr;
+            Particle_Cull *ref_cull = (s == 3) ? &cull_scalar : nullptr;
+            int drawn = 0;
+            int ref_drawn = 0;
+            const Particle_Quad_Streams *P = (s == 4) ? &closed_form_streams : &streams;
+
+            Bench_Perf perf;
+            double ns = bench_min_ns(options->reps, [&]{
+                drawn = particle_expand_quads(P, n, &view, &style, cull, vertices, depth);
+                particle_quad_indices(indices, 0, drawn, 0);
+            }, &perf);
+            double ref_ns = bench_min_ns(options->reps, [&]{
+                ref_drawn = particle_expand_quads_scalar(P, 0, n, &view, &style, ref_cull, ref_vertices, ref_depth);
+                particle_quad_indices(indices, 0, ref_drawn, 0);
+            });
+
+            if (drawn != ref_drawn || cull_simd.outside != cull_scalar.outside || cull_simd.small != cull_scalar.small)
+            {
+                printf("Error: %s draws %d quads, the scalar expansion %d\n", name, drawn, ref_drawn);
+            }
+            if (drawn > ref_drawn) drawn = ref_drawn;
+            float max_diff = diff_quads(vertices, ref_vertices, drawn);
+            for (int i = 0; i < drawn; i++)
+            {
+                float d = fabsf(depth[i] - ref_depth[i]);
+                if (!(d <= max_diff)) max_diff = d;
+            }
+            if (!(max_diff <= 1e-4f)) printf("Error: %s differs from the scalar expansion by %g\n", name, max_diff);
+
+            perf = bench_perf_per_instance(&perf, nullptr, n);
+            add_result(results, name, ns / n, ref_ns / n, &perf);
+        }
+    }
+
+    free(position);
+    free(velocity);
+    free(size);
+    free(color);
+    free(acceleration);
+    free(life_seconds);
+    free(life_max);
+    free(depth);
+    free(ref_depth);
+    free(vertices);
+    free(ref_vertices);
+    free(indices);
+}
+
+static bool write_json(Bench_Results *results, const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+    {
+        printf("Error: could not write %s\n", filename);
+        return false;
+    }
+    fprintf(fp, "{\n  \"benchmarks\": [\n");
+    for (int i = 0; i < results->result_num; i++)
+    {
+        Bench_Result *r = &results->results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"ns\": %.6f", r->name, r->ns);
+        if (r->ref_ns > 0.0) fprintf(fp, ", \"ref_ns\": %.6f", r->ref_ns);
+        for (int c = 0; r->has_perf && c < PERF_COUNTER_NUM; c++)
+        {
+            if (perf_counter_available(&bench_perf, c)) fprintf(fp, ", \"%s\": %.6f", perf_counter_names[c], r->perf[c]);
+        }
+        fprintf(fp, "}%s\n", (i + 1 < results->result_num) ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
+
+    // Peaks over the whole run, per memtrack tag and per loaded .psys file.
+    fprintf(fp, "  \"memory\": [\n");
+    for (int tag = 0; tag < MEM_TAG_NUM; tag++)
+    {
+        Mem_Usage u = mem_usage(tag);
+        fprintf(fp, "    {\"tag\": \"%s\", \"peak\": %lld, \"live\": %lld, \"allocs\": %lld},\n",
+                mem_tag_names[tag], (long long)u.peak, (long long)u.live, (long long)u.allocs);
+    }
+    for (int effect = 0; effect < mem_effect_num(); effect++)
+    {
+        Mem_Usage u = mem_effect_usage(effect, MEM_TAG_NUM);
+        fprintf(fp, "    {\"effect\": \"%s\", \"peak\": %lld, \"live\": %lld, \"allocs\": %lld},\n",
+                mem_effect_name(effect), (long long)u.peak, (long long)u.live, (long long)u.allocs);
+    }
+    Mem_Usage total = mem_usage(MEM_TAG_NUM);
+    fprintf(fp, "    {\"tag\": \"total\", \"peak\": %lld, \"live\": %lld, \"allocs\": %lld}\n",
+            (long long)total.peak, (long long)total.live, (long long)total.allocs);
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    return true;
+}
+
+// Reads the results written by write_json. Only the name and ns fields are used.
+static bool read_json(Bench_Results *results, const char *filename)
+{
+    int len = 0;
+    const char *file_str = read_file(filename, &len);
+    if (!file_str)
+    {
+        printf("Error: could not read %s\n", filename);
+        return false;
+    }
+    char *s = (char*)malloc(len + 1);
+    memcpy(s, file_str, len);
+    s[len] = '\0';
+    mem_free((void*)file_str);
+
+    const char *p = s;
+    while ((p = strstr(p, "\"name\": \"")))
+    {
+        p += strlen("\"name\": \"");
+        const char *name_end = strchr(p, '"');
+        const char *ns = name_end ? strstr(name_end, "\"ns\": ") : nullptr;
+        if (!ns) break;
+
+        char name[96];
+        int name_len = (int)(name_end - p);
+        if (name_len > (int)sizeof(name) - 1) name_len = sizeof(name) - 1;
+        memcpy(name, p, name_len);
+        name[name_len] = '\0';
+
+        if (results->result_num + 1 > results->result_cap)
+        {
+            int new_cap = results->result_cap + 64;
+            results->results = (Bench_Result*)realloc(results->results, sizeof(Bench_Result) * new_cap);
+            results->result_cap = new_cap;
+        }
+        Bench_Result *r = &results->results[results->result_num++];
+        memcpy(r->name, name, name_len + 1);
+        r->ns = strtod(ns + strlen("\"ns\": "), nullptr);
+        r->ref_ns = -1.0;
+        p = ns;
+    }
+    free(s);
+    return true;
+}
+
+// Returns the number of benchmarks that are slower than the baseline by more than threshold percent.
+static int compare_results(Bench_Results *results, Bench_Results *baseline, double threshold)
+{
+    int regressions = 0;
+    printf("\n%-44s %12s %12s %9s\n", "benchmark", "baseline", "current", "change");
+    for (int i = 0; i < results->result_num; i++)
+    {
+        Bench_Result *r = &results->results[i];
+        Bench_Result *b = nullptr;
+        for (int j = 0; j < baseline->result_num; j++)
+        {
+            if (strcmp(baseline->results[j].name, r->name) == 0)
+            {
+                b = &baseline->results[j];
+                break;
+            }
+        }
+        if (!b || b->ns <= 0.0)
+        {
+            printf("%-44s %12s %12.3f %9s\n", r->name, "-", r->ns, "new");
+            continue;
+        }
+        double change = (r->ns - b->ns) / b->ns * 100.0;
+        bool regression = (change > threshold);
+        regressions += regression;
+        printf("%-44s %12.3f %12.3f %+8.1f%%%s\n", r->name, b->ns, r->ns, change, regression ? "  REGRESSION" : "");
+    }
+    printf("%d regression(s) above %.1f%%\n", regressions, threshold);
+    return regressions;
+}
+
+static void print_usage(const char *exe)
+{
+    printf("usage: %s [options]\n", exe);
+    printf("  -filter STR         only run the benchmarks whose name contains STR\n");
+    printf("  -reps N             runs per benchmark, the best one is reported (default 5)\n");
+    printf("  -max-particles N    largest simulate benchmark (default 1000000)\n");
+    printf("  -quick              fewer runs and at most 100000 particles\n");
+    printf("  -json FILE          write the results to FILE\n");
+    printf("  -compare FILE       compare against results written with -json\n");
+    printf("  -threshold PCT      slowdown reported as a regression by -compare (default 10)\n");
+    printf("  -calibrate          print the cost model's opcode cycles table from the opcode benchmarks\n");
+    printf("  -perf               sample hardware performance counters (Linux perf_event_open)\n");
+}
+
+int main(int argc, char **argv)
+{
+    Bench_Options options = { };
+    options.reps = 5;
+    options.max_particles = 1000000;
+
+    const char *json_filename = nullptr;
+    const char *compare_filename = nullptr;
+    double threshold = 10.0;
+    bool perf = false;
+    bool calibrate = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+        if (strcmp(argv[i], "-filter") == 0 && has_value) options.filter = argv[++i];
+        else if (strcmp(argv[i], "-reps") == 0 && has_value) options.reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-max-particles") == 0 && has_value) options.max_particles = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-json") == 0 && has_value) json_filename = argv[++i];
+        else if (strcmp(argv[i], "-compare") == 0 && has_value) compare_filename = argv[++i];
+        else if (strcmp(argv[i], "-threshold") == 0 && has_value) threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-quick") == 0) options.quick = true;
+        else if (strcmp(argv[i], "-perf") == 0) perf = true;
+        else if (strcmp(argv[i], "-calibrate") == 0) calibrate = true;
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.quick)
+    {
+        if (options.reps > 3) options.reps = 3;
+        if (options.max_particles > 100000) options.max_particles = 100000;
+    }
+    if (options.reps < 1) options.reps = 1;
+
+    if (perf)
+    {
+        bench_perf_open = perf_counters_open(&bench_perf);
+        if (!bench_perf_open) printf("hardware counters unavailable, %s\n", bench_perf.error);
+    }
+
+    Bench_Results results = { };
+
+    Opcode_Calibration *cal = nullptr;
+    if (calibrate)
+    {
+        cal = (Opcode_Calibration*)calloc(1, sizeof(Opcode_Calibration));
+        cal->tsc_per_ns = bench_tsc_per_ns();
+    }
+    bench_opcodes(&results, &options, cal);
+    if (cal)
+    {
+        print_opcode_cycles(cal);
+        free(cal);
+    }
+    bench_programs(&results, &options);
+
+    int max_emitters = options.max_particles / Particles::MAX;
+    if (max_emitters > 0)
+    {
+        Emitter_Instance *E = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, max_emitters, sizeof(Emitter_Instance));
+        bench_simulate(&results, &options, E);
+        bench_closed_form(&results, &options, E);
+        bench_scaling(&results, &options, E);
+        bench_sleep(&results, &options, E, max_emitters);
+        bench_prewarm(&results, &options, E);
+        bench_batch(&results, &options, E, max_emitters);
+        mem_free(E);
+    }
+    bench_sort(&results, &options);
+    bench_quads(&results, &options);
+
+    int exit_code = 0;
+    if (json_filename && !write_json(&results, json_filename)) exit_code = 1;
+    if (compare_filename)
+    {
+        Bench_Results baseline = { };
+        if (!read_json(&baseline, compare_filename)) exit_code = 1;
+        else if (compare_results(&results, &baseline, threshold) > 0) exit_code = 1;
+        free(baseline.results);
+    }
+
+    if (bench_perf_open) perf_counters_close(&bench_perf);
+    free(results.results);
+    return exit_code;
+}
@@ -0,0 +1,193 @@
+#define FXVM_IMPL
+#define FXVM_CAPTURE_IMPL
+#define MEMTRACK_IMPL
+#include "fxcapture.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Replays dispatches captured with fxvm_capture (e.g. particles-headless -capture) on the exec backends.
+ * Prints the best time of -reps runs per instance and compares the outputs of every backend with the
+ * outputs recorded at capture time (with exec<16>). Programs using rand() draw their numbers in a
+ * different order on the other group sizes, so their differences there are only reported, marked rand.
+ * Exits with 1 if a file can not be read, or with -strict if any output that has to match differs.
+ */
+
+struct Replay_Backend
+{
+    const char *name;
+    void (*run)(FXVM_Machine *vm, FXVM_Program *program, int count, int width, float *out);
+    bool capture_order; // draws rand() in the order of the capture
+};
+
+static void run_exec_single(FXVM_Machine *vm, FXVM_Program *program, int count, int width, float *out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        FXVM_State S = { };
+        exec(vm, S, i, program);
+        memcpy(&out[i * width], S.r[0].v, sizeof(float) * width);
+    }
+}
+
+template <int GROUP>
+static void run_exec_group(FXVM_Machine *vm, FXVM_Program *program, int count, int width, float *out)
+{
+    for (int i = 0; i < count; i += GROUP)
+    {
+        int n = (count - i < GROUP) ? count - i : GROUP;
+        FXVM_State S[GROUP] = { };
+        exec<GROUP>(vm, S, i, n, program);
+        for (int k = 0; k < n; k++) memcpy(&out[(i + k) * width], S[k].r[0].v, sizeof(float) * width);
+    }
+}
+
+static Replay_Backend replay_backends[] = {
+    {"single", run_exec_single, false},
+    {"group4", run_exec_group<4>, false},
+    {"group16", run_exec_group<16>, true},
+    {"group64", run_exec_group<64>, false},
+};
+
+static bool uses_rand(const FXVM_Bytecode *bytecode)
+{
+    const uint8_t *end = (uint8_t*)bytecode->code + bytecode->len;
+    const uint8_t *p = (uint8_t*)bytecode->code;
+    while (p < end)
+    {
+        int size = fxvm_instruction_size(p);
+        if (size == 0) break;
+        if ((p[0] & 0x3f) == FXOP_RAND01) return true;
+        p += size;
+    }
+    return false;
+}
+
+static void print_usage(const char *exe)
+{
+    printf("usage: %s [-reps N] [-backend NAME] [-disasm] [-strict] file.fxcap ...\n", exe);
+    printf("  -reps N        runs per backend, the best is reported (default 20)\n");
+    printf("  -backend NAME  run only this backend:");
+    for (Replay_Backend &backend : replay_backends) printf(" %s", backend.name);
+    printf("\n");
+    printf("  -disasm        print the bytecode of every capture\n");
+    printf("  -strict        exit with 1 if any output differs from the capture, except rand() programs\n");
+    printf("                 on the backends that draw in another order\n");
+}
+
+// Instances with any component different from the capture, and the largest difference.
+static int diff_outputs(const FXVM_Capture *capture, const float *out, float *max_diff)
+{
+    int width = capture->output_width;
+    int differ = 0;
+    *max_diff = 0.0f;
+    for (int i = 0; i < capture->instance_count; i++)
+    {
+        bool instance_differs = false;
+        for (int c = 0; c < width; c++)
+        {
+            float a = capture->outputs[i * width + c];
+            float b = out[i * width + c];
+            if (memcmp(&a, &b, sizeof(float)) == 0) continue;
+            instance_differs = true;
+            float d = fabsf(a - b);
+            if (!(d <= *max_diff)) *max_diff = d; // NaN sticks
+        }
+        if (instance_differs) differ++;
+    }
+    return differ;
+}
+
+int main(int argc, char **argv)
+{
+    int reps = 20;
+    const char *backend_name = nullptr;
+    bool disasm = false;
+    bool strict = false;
+    int exit_code = 0;
+
+    int file_num = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc) reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-backend") == 0 && i + 1 < argc) backend_name = argv[++i];
+        else if (strcmp(argv[i], "-disasm") == 0) disasm = true;
+        else if (strcmp(argv[i], "-strict") == 0) strict = true;
+        else if (argv[i][0] == '-')
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else file_num++;
+    }
+    if (file_num == 0 || reps < 1)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    printf("%-32s %-8s %9s %12s %12s %10s\n", "capture", "backend", "instances", "ns/instance", "ns/instr", "differ");
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] == '-')
+        {
+            if (strcmp(argv[i], "-reps") == 0 || strcmp(argv[i], "-backend") == 0) i++;
+            continue;
+        }
+        const char *filename = argv[i];
+
+        FXVM_Capture capture;
+        if (!fxvm_capture_read(&capture, filename))
+        {
+            exit_code = 1;
+            continue;
+        }
+
+        FXVM_Machine vm = fxvm_new();
+        FXVM_AttributeBindings bindings;
+        FXVM_Program program;
+        fxvm_capture_bind(&capture, &vm, &bindings, &program);
+        if (disasm) disassemble(&program.bytecode);
+        int instructions = fxvm_instruction_count(&program.bytecode);
+        bool has_rand = uses_rand(&program.bytecode);
+
+        int count = capture.instance_count;
+        int width = capture.output_width;
+        float *out = (float*)malloc(sizeof(float) * width * (count > 0 ? count : 1));
+
+        for (Replay_Backend &backend : replay_backends)
+        {
+            if (backend_name && strcmp(backend_name, backend.name) != 0) continue;
+
+            typedef std::chrono::steady_clock Clock;
+            double best = 1e30;
+            for (int r = 0; r < reps; r++)
+            {
+                // Every run sees the generator state of the capture, so the outputs can be compared.
+                vm.rng = capture.rng;
+                Clock::time_point start = Clock::now();
+                backend.run(&vm, &program, count, width, out);
+                double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+                if (ns < best) best = ns;
+            }
+
+            float max_diff;
+            int differ = diff_outputs(&capture, out, &max_diff);
+            double per_instance = (count > 0) ? best / count : 0.0;
+            printf("%-32s %-8s %9d %12.3f %12.3f %10d", filename, backend.name, count, per_instance,
+                    (instructions > 0) ? per_instance / instructions : 0.0, differ);
+            bool expected = has_rand && !backend.capture_order;
+            if (differ) printf("  max diff %g%s", max_diff, expected ? " (rand)" : "");
+            printf("\n");
+            if (differ && !expected && strict) exit_code = 1;
+        }
+
+        free(out);
+        fxvm_capture_free(&capture);
+    }
+    return exit_code;
+}
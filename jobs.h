@@ -0,0 +1,298 @@
+#ifndef JOB_SYSTEM
+
+#include "fxvm.h"
+#include "trace.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+enum { JOB_CACHE_LINE = 64 };
+
+struct Job_Worker;
+
+struct Job
+{
+    void (*fn)(Job_Worker *worker, Job *job);
+    void *data;
+    int first;
+    int count;
+};
+
+/*
+ * Each worker owns a deque of jobs. The owner pushes and pops at the bottom (newest first, the data is
+ * likely still in cache) and idle workers steal from the top (oldest first). Workers are cache line
+ * aligned, so that the deque of one worker never shares a line with another worker's state.
+ */
+struct alignas(JOB_CACHE_LINE) Job_Worker
+{
+    enum { MAX_JOBS = 4096 };
+
+    std::atomic_flag lock;
+    // Only written with the lock held; read without it to skip empty deques when stealing.
+    std::atomic<int> top;
+    std::atomic<int> bottom;
+    Job jobs[MAX_JOBS];
+
+    struct Job_System *system;
+    int index;
+    uint32_t steal_seed;
+
+    // Each worker has its own machine: its own RNG and attribute bindings.
+    alignas(JOB_CACHE_LINE) FXVM_Machine vm;
+};
+
+struct Job_System
+{
+    int worker_num;
+    Job_Worker *workers;
+    std::thread *threads;
+    int submit_index;
+
+    alignas(JOB_CACHE_LINE) std::atomic<int> pending;
+    alignas(JOB_CACHE_LINE) std::atomic<bool> running;
+
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+};
+
+// Starts worker_num - 1 threads; the calling thread is worker 0 and runs jobs in job_system_wait.
+// If worker_num <= 0, one worker per hardware thread is used.
+void job_system_init(Job_System *js, int worker_num);
+void job_system_shutdown(Job_System *js);
+
+// Submits a job from outside of the job system (worker 0's thread, between frames).
+void job_system_submit(Job_System *js, Job job);
+// Pushes a job from inside a running job to the worker's own deque.
+void job_push(Job_Worker *worker, Job job);
+// Runs jobs on the calling thread until all submitted jobs, and the jobs they pushed, have finished.
+void job_system_wait(Job_System *js);
+
+#ifdef JOB_SYSTEM_IMPL
+
+#include <cstdio>
+
+static void job_lock(Job_Worker *worker)
+{
+    while (worker->lock.test_and_set(std::memory_order_acquire))
+    {
+        std::this_thread::yield();
+    }
+}
+
+static void job_unlock(Job_Worker *worker)
+{
+    worker->lock.clear(std::memory_order_release);
+}
+
+static bool job_deque_push(Job_Worker *worker, Job job)
+{
+    job_lock(worker);
+    int top = worker->top.load(std::memory_order_relaxed);
+    int bottom = worker->bottom.load(std::memory_order_relaxed);
+    bool fits = (bottom - top < Job_Worker::MAX_JOBS);
+    if (fits)
+    {
+        worker->jobs[bottom % Job_Worker::MAX_JOBS] = job;
+        worker->bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+    job_unlock(worker);
+    return fits;
+}
+
+static bool job_deque_pop(Job_Worker *worker, Job *job)
+{
+    job_lock(worker);
+    int top = worker->top.load(std::memory_order_relaxed);
+    int bottom = worker->bottom.load(std::memory_order_relaxed);
+    bool found = (bottom > top);
+    if (found)
+    {
+        bottom--;
+        *job = worker->jobs[bottom % Job_Worker::MAX_JOBS];
+    }
+    if (bottom == top)
+    {
+        // Empty, rewind so that the indices never overflow.
+        worker->top.store(0, std::memory_order_relaxed);
+        bottom = 0;
+    }
+    worker->bottom.store(bottom, std::memory_order_relaxed);
+    job_unlock(worker);
+    return found;
+}
+
+static bool job_deque_steal(Job_Worker *victim, Job *job)
+{
+    // Cheap unlocked check first, so that idle workers do not hammer the locks of empty deques.
+    if (victim->bottom.load(std::memory_order_relaxed) <= victim->top.load(std::memory_order_relaxed)) return false;
+
+    job_lock(victim);
+    int top = victim->top.load(std::memory_order_relaxed);
+    bool found = (victim->bottom.load(std::memory_order_relaxed) > top);
+    if (found)
+    {
+        *job = victim->jobs[top % Job_Worker::MAX_JOBS];
+        victim->top.store(top + 1, std::memory_order_relaxed);
+    }
+    job_unlock(victim);
+    return found;
+}
+
+static bool job_next(Job_Worker *worker, Job *job)
+{
+    if (job_deque_pop(worker, job)) return true;
+
+    Job_System *js = worker->system;
+    // xorshift32 to pick the first victim
+    uint32_t x = worker->steal_seed;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    worker->steal_seed = x;
+
+    int start = (int)(x % (uint32_t)js->worker_num);
+    for (int i = 0; i < js->worker_num; i++)
+    {
+        Job_Worker *victim = &js->workers[(start + i) % js->worker_num];
+        if (victim == worker) continue;
+        if (job_deque_steal(victim, job)) return true;
+    }
+    return false;
+}
+
+static void job_run(Job_Worker *worker, Job *job)
+{
+    TRACE_ZONE("job");
+    job->fn(worker, job);
+    worker->system->pending.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+static void job_worker_main(Job_Worker *worker)
+{
+    Job_System *js = worker->system;
+
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "job worker %d", worker->index);
+    trace_set_thread_name(thread_name);
+
+    while (js->running.load(std::memory_order_acquire))
+    {
+        Job job;
+        if (job_next(worker, &job))
+        {
+            job_run(worker, &job);
+        }
+        else if (js->pending.load(std::memory_order_acquire) > 0)
+        {
+            // Work is in flight, but none to steal right now.
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(js->wake_mutex);
+            js->wake.wait(lock, [js]{
+                return !js->running.load() || js->pending.load() > 0;
+            });
+        }
+    }
+}
+
+void job_system_init(Job_System *js, int worker_num)
+{
+    if (worker_num <= 0) worker_num = (int)std::thread::hardware_concurrency();
+    if (worker_num <= 0) worker_num = 1;
+
+    js->worker_num = worker_num;
+    js->workers = new Job_Worker[worker_num];
+    js->submit_index = 0;
+    js->pending.store(0);
+    js->running.store(true);
+
+    for (int i = 0; i < worker_num; i++)
+    {
+        Job_Worker *worker = &js->workers[i];
+        worker->lock.clear();
+        worker->top.store(0);
+        worker->bottom.store(0);
+        worker->system = js;
+        worker->index = i;
+        worker->steal_seed = 0x9e3779b9u * (uint32_t)(i + 1);
+        worker->vm = fxvm_new((uint64_t)i);
+    }
+
+    js->threads = new std::thread[worker_num];
+    for (int i = 1; i < worker_num; i++)
+    {
+        js->threads[i] = std::thread(job_worker_main, &js->workers[i]);
+    }
+}
+
+void job_system_shutdown(Job_System *js)
+{
+    {
+        std::lock_guard<std::mutex> lock(js->wake_mutex);
+        js->running.store(false);
+    }
+    js->wake.notify_all();
+
+    for (int i = 1; i < js->worker_num; i++)
+    {
+        js->threads[i].join();
+    }
+    delete[] js->threads;
+    delete[] js->workers;
+    js->threads = nullptr;
+    js->workers = nullptr;
+    js->worker_num = 0;
+}
+
+void job_push(Job_Worker *worker, Job job)
+{
+    worker->system->pending.fetch_add(1, std::memory_order_acq_rel);
+    if (!job_deque_push(worker, job))
+    {
+        // Deque is full, run the job right away.
+        job_run(worker, &job);
+    }
+}
+
+void job_system_submit(Job_System *js, Job job)
+{
+    js->pending.fetch_add(1, std::memory_order_acq_rel);
+
+    // Spread the submitted jobs over the workers, so that they do not all start by stealing from worker 0.
+    Job_Worker *worker = &js->workers[js->submit_index];
+    js->submit_index = (js->submit_index + 1) % js->worker_num;
+    if (!job_deque_push(worker, job))
+    {
+        job_run(&js->workers[0], &job);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(js->wake_mutex);
+    }
+    js->wake.notify_all();
+}
+
+void job_system_wait(Job_System *js)
+{
+    Job_Worker *worker = &js->workers[0];
+    while (js->pending.load(std::memory_order_acquire) > 0)
+    {
+        Job job;
+        if (job_next(worker, &job))
+        {
+            job_run(worker, &job);
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+#endif
+
+#define JOB_SYSTEM
+#endif
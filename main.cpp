@@ -1,5 +1,8 @@
 
+#define FXVM_IMPL
+#define MEMTRACK_IMPL
 #include "fxvm.h"
+#define FXVM_COMPILER_IMPL
 #include "fxcomp.h"
 #include <cstdio>
 #include <cstring>
@@ -79,6 +82,19 @@ void print_ast_call_expr(FXVM_Ast *expr, int indentation)
     }
 }
 
+void print_ast_swizzle_expr(FXVM_Ast *expr, int indentation)
+{
+    print_indentation(indentation);
+    char buf[5];
+    for (int i = 0; i < expr->swizzle.len; i++)
+    {
+        buf[i] = "xyzw"[(expr->swizzle.mask >> (i * 2)) & 3];
+    }
+    buf[expr->swizzle.len] = '\0';
+    printf("swizzle .%s [%s]\n", buf, type_to_string(expr->type));
+    print_ast(expr->swizzle.operand, indentation + 1);
+}
+
 void print_ast(FXVM_Ast *ast, int indentation)
 {
     switch (ast->kind)
@@ -89,6 +105,7 @@ void print_ast(FXVM_Ast *ast, int indentation)
     case FXAST_EXPR_VARIABLE: print_ast_variable_expr(ast, indentation); break;
     case FXAST_EXPR_NUMBER: print_ast_number_expr(ast, indentation); break;
     case FXAST_EXPR_CALL: print_ast_call_expr(ast, indentation); break;
+    case FXAST_EXPR_SWIZZLE: print_ast_swizzle_expr(ast, indentation); break;
     }
 }
 
@@ -198,7 +215,7 @@ int main(int argc, char **argv)
     compiler.report_error = report_compile_error;
 
     register_constant(&compiler, "PI", 3.1415f);
-    register_input_variable(&compiler, "Particle_life_time", FXTYP_F1);
+    register_global_input_variable(&compiler, "Particle_life_time", FXTYP_F1);
 
     compile(&compiler, source, source + strlen(source));
 
@@ -209,13 +226,16 @@ int main(int argc, char **argv)
         print_ast(compiler.ast, 0);
         printf("---\n");
         print_il(&compiler.il_context);
+        printf("---\n");
+        fxvm_print_cost(&compiler.cost);
     }
 
     {
         float input[16] = {10.0f, 10.0f, 12.0f, 15.0f, 0.0f};
         FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
+        FXVM_Machine vm = fxvm_new();
         FXVM_State state = { };
-        exec(state, (uint8_t*)input, &bytecode);
+        exec(&vm, state, input, nullptr, nullptr, 0, &bytecode);
 
         printf("---\n");
         Reg r0 = state.r[0];
@@ -0,0 +1,272 @@
+#ifndef MEMTRACK
+
+/*
+ * Tagged heap allocations with usage telemetry.
+ *
+ *     Mem_Effect_Scope scope(mem_effect_id("particle_systems/example.psys"));
+ *     float *life = (float*)mem_alloc(MEM_PARTICLES, sizeof(float) * n);
+ *     ...
+ *     mem_free(life);
+ *
+ * Every block is allocated with a small header recording its size, its tag and the effect that was
+ * current on the allocating thread. Live bytes, peak bytes, live blocks and the number of allocations
+ * are counted per tag and per effect, with atomics, so any thread can allocate and query at any time.
+ * A block keeps its tag and effect when it is reallocated.
+ *
+ * The memory itself comes from the allocator set with mem_set_allocator, libc realloc/free by default.
+ * Set it before the first allocation, blocks must be freed by the allocator that made them.
+ *
+ * Blocks from mem_alloc must only be freed with mem_free. Memory that is not allocated here (stack and
+ * by value Emitter_Instances, the job system, ImGui) is not counted. Define MEMTRACK_IMPL in one
+ * translation unit.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+enum Mem_Tag
+{
+    MEM_COMPILER,  // tokens, AST, IL and register spans, freed after each compile
+    MEM_SYMBOLS,
+    MEM_BYTECODE,
+    MEM_PARTICLES, // particle streams of emitter batches
+    MEM_EMITTERS,  // emitter instances and batch emitter streams
+    MEM_SNAPSHOTS,
+    MEM_DRAW,
+    MEM_FILES,
+    MEM_OTHER,
+    MEM_TAG_NUM
+};
+
+extern const char *mem_tag_names[MEM_TAG_NUM];
+
+enum { MEM_MAX_EFFECTS = 64, MEM_EFFECT_NAME_LEN = 64 };
+
+struct Mem_Allocator
+{
+    // realloc(user, nullptr, size) allocates, returns nullptr on failure.
+    void *(*realloc)(void *user, void *p, size_t size);
+    void (*free)(void *user, void *p);
+    void *user;
+};
+
+struct Mem_Usage
+{
+    int64_t live;   // bytes
+    int64_t peak;
+    int64_t blocks; // live
+    int64_t allocs; // allocations and reallocations so far
+};
+
+void mem_set_allocator(const Mem_Allocator *allocator);
+
+void *mem_alloc(Mem_Tag tag, size_t size);
+void *mem_calloc(Mem_Tag tag, size_t num, size_t size);
+// Allocates with tag when p is nullptr, frees and returns nullptr when size is 0.
+void *mem_realloc(Mem_Tag tag, void *p, size_t size);
+void mem_free(void *p);
+
+// Id of the effect with this name, registered on first use. -1 if the table is full.
+int mem_effect_id(const char *name);
+int mem_effect_num();
+const char *mem_effect_name(int effect);
+
+// tag MEM_TAG_NUM gives the totals over all tags.
+Mem_Usage mem_usage(int tag);
+Mem_Usage mem_effect_usage(int effect, int tag);
+void mem_print_usage();
+
+// Effect that allocations of this thread are attributed to, -1 for none.
+extern thread_local int mem_current_effect;
+
+struct Mem_Effect_Scope
+{
+    int previous;
+
+    explicit Mem_Effect_Scope(int effect) : previous(mem_current_effect) { mem_current_effect = effect; }
+    ~Mem_Effect_Scope() { mem_current_effect = previous; }
+    Mem_Effect_Scope(const Mem_Effect_Scope &) = delete;
+    Mem_Effect_Scope &operator=(const Mem_Effect_Scope &) = delete;
+};
+
+#ifdef MEMTRACK_IMPL
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+const char *mem_tag_names[MEM_TAG_NUM] = {
+    "compiler", "symbols", "bytecode", "particles", "emitters", "snapshots", "draw", "files", "other",
+};
+
+thread_local int mem_current_effect = -1;
+
+// 16 bytes, keeps the alignment of the blocks the allocator returns.
+struct Mem_Header
+{
+    uint64_t size;
+    int32_t tag;
+    int32_t effect;
+};
+
+struct Mem_Counters
+{
+    std::atomic<int64_t> live;
+    std::atomic<int64_t> peak;
+    std::atomic<int64_t> blocks;
+    std::atomic<int64_t> allocs;
+};
+
+static void *mem_libc_realloc(void *user, void *p, size_t size) { (void)user; return realloc(p, size); }
+static void mem_libc_free(void *user, void *p) { (void)user; free(p); }
+
+static Mem_Allocator mem_allocator = { mem_libc_realloc, mem_libc_free, nullptr };
+
+// Index MEM_TAG_NUM holds the totals.
+static Mem_Counters mem_tag_counters[MEM_TAG_NUM + 1];
+static Mem_Counters mem_effect_counters[MEM_MAX_EFFECTS][MEM_TAG_NUM + 1];
+
+static std::mutex mem_effect_mutex;
+static std::atomic<int> mem_effect_count;
+static char mem_effect_names[MEM_MAX_EFFECTS][MEM_EFFECT_NAME_LEN];
+
+void mem_set_allocator(const Mem_Allocator *allocator)
+{
+    mem_allocator = *allocator;
+}
+
+static void mem_count(Mem_Counters *c, int64_t bytes, int64_t blocks, bool alloc)
+{
+    int64_t live = c->live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    int64_t peak = c->peak.load(std::memory_order_relaxed);
+    while (live > peak && !c->peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+    if (blocks) c->blocks.fetch_add(blocks, std::memory_order_relaxed);
+    if (alloc) c->allocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void mem_count_block(const Mem_Header *h, int64_t bytes, int64_t blocks, bool alloc)
+{
+    mem_count(&mem_tag_counters[h->tag], bytes, blocks, alloc);
+    mem_count(&mem_tag_counters[MEM_TAG_NUM], bytes, blocks, alloc);
+    if (h->effect >= 0)
+    {
+        mem_count(&mem_effect_counters[h->effect][h->tag], bytes, blocks, alloc);
+        mem_count(&mem_effect_counters[h->effect][MEM_TAG_NUM], bytes, blocks, alloc);
+    }
+}
+
+void *mem_realloc(Mem_Tag tag, void *p, size_t size)
+{
+    if (size == 0)
+    {
+        mem_free(p);
+        return nullptr;
+    }
+
+    Mem_Header *old = p ? (Mem_Header*)p - 1 : nullptr;
+    Mem_Header header = old ? *old : Mem_Header{ 0, (int32_t)tag, (int32_t)mem_current_effect };
+
+    Mem_Header *h = (Mem_Header*)mem_allocator.realloc(mem_allocator.user, old, sizeof(Mem_Header) + size);
+    if (!h)
+    {
+        printf("Error: out of memory allocating %zu bytes for %s\n", size, mem_tag_names[header.tag]);
+        return nullptr;
+    }
+
+    mem_count_block(&header, (int64_t)size - (int64_t)header.size, old ? 0 : 1, true);
+    header.size = size;
+    *h = header;
+    return h + 1;
+}
+
+void *mem_alloc(Mem_Tag tag, size_t size)
+{
+    return mem_realloc(tag, nullptr, size ? size : 1);
+}
+
+void *mem_calloc(Mem_Tag tag, size_t num, size_t size)
+{
+    size_t bytes = num * size;
+    void *p = mem_alloc(tag, bytes);
+    if (p) memset(p, 0, bytes);
+    return p;
+}
+
+void mem_free(void *p)
+{
+    if (!p) return;
+    Mem_Header *h = (Mem_Header*)p - 1;
+    mem_count_block(h, -(int64_t)h->size, -1, false);
+    mem_allocator.free(mem_allocator.user, h);
+}
+
+int mem_effect_id(const char *name)
+{
+    std::lock_guard<std::mutex> lock(mem_effect_mutex);
+    int num = mem_effect_count.load(std::memory_order_relaxed);
+    for (int i = 0; i < num; i++)
+    {
+        if (strncmp(mem_effect_names[i], name, MEM_EFFECT_NAME_LEN - 1) == 0) return i;
+    }
+    if (num == MEM_MAX_EFFECTS) return -1;
+    snprintf(mem_effect_names[num], MEM_EFFECT_NAME_LEN, "%s", name);
+    mem_effect_count.store(num + 1, std::memory_order_release);
+    return num;
+}
+
+int mem_effect_num()
+{
+    return mem_effect_count.load(std::memory_order_acquire);
+}
+
+const char *mem_effect_name(int effect)
+{
+    return (effect >= 0 && effect < mem_effect_num()) ? mem_effect_names[effect] : "";
+}
+
+static Mem_Usage mem_read(const Mem_Counters *c)
+{
+    Mem_Usage usage;
+    usage.live = c->live.load(std::memory_order_relaxed);
+    usage.peak = c->peak.load(std::memory_order_relaxed);
+    usage.blocks = c->blocks.load(std::memory_order_relaxed);
+    usage.allocs = c->allocs.load(std::memory_order_relaxed);
+    return usage;
+}
+
+Mem_Usage mem_usage(int tag)
+{
+    if (tag < 0 || tag > MEM_TAG_NUM) return Mem_Usage{ };
+    return mem_read(&mem_tag_counters[tag]);
+}
+
+Mem_Usage mem_effect_usage(int effect, int tag)
+{
+    if (effect < 0 || effect >= mem_effect_num() || tag < 0 || tag > MEM_TAG_NUM) return Mem_Usage{ };
+    return mem_read(&mem_effect_counters[effect][tag]);
+}
+
+void mem_print_usage()
+{
+    printf("%-40s %12s %12s %8s %8s\n", "memory", "live", "peak", "blocks", "allocs");
+    for (int tag = 0; tag <= MEM_TAG_NUM; tag++)
+    {
+        Mem_Usage u = mem_usage(tag);
+        if (u.allocs == 0 && tag < MEM_TAG_NUM) continue;
+        printf("%-40s %12lld %12lld %8lld %8lld\n", (tag < MEM_TAG_NUM) ? mem_tag_names[tag] : "total",
+                (long long)u.live, (long long)u.peak, (long long)u.blocks, (long long)u.allocs);
+    }
+    for (int effect = 0; effect < mem_effect_num(); effect++)
+    {
+        Mem_Usage u = mem_effect_usage(effect, MEM_TAG_NUM);
+        printf("%-40s %12lld %12lld %8lld %8lld\n", mem_effect_name(effect),
+                (long long)u.live, (long long)u.peak, (long long)u.blocks, (long long)u.allocs);
+    }
+}
+
+#endif // MEMTRACK_IMPL
+
+#define MEMTRACK
+#endif
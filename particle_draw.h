@@ -0,0 +1,550 @@
+#ifndef PARTICLE_DRAW
+
+/*
+ * Expansion of particles to camera facing quads, for any renderer.
+ *
+ *     Particle_View view = particle_view(camera_matrix(camera));
+ *     Particle_Quad_Style style = particle_quad_style(PS, tile_w, tile_h);
+ *     Particle_Quad_Streams streams = { P->position, P->velocity, P->size, P->color };
+ *     Particle_Cull cull = particle_cull(projection, camera_matrix(camera), viewport_height, 1.0f);
+ *     int drawn = particle_expand_quads(&streams, n, &view, &style, &cull, vertices, depth);
+ *     particle_quad_indices(indices, 0, drawn, 0);
+ *
+ * Every particle becomes 4 vertices: position, texture coordinates and RGBA8 color (red in the lowest
+ * byte, GL_UNSIGNED_BYTE order), 24 bytes each, and 6 indices for the triangles (0, 1, 2) and (0, 2, 3).
+ * The particles are expanded 4 at a time in SSE2 lanes (view depth, billboard or stretched corners,
+ * colors), transposed in registers to the 16-byte rows of the vertices, and the last few one at a time
+ * with the same math as particle_math.h. Indices are written apart
+ * from the vertices, so a sorted draw only rewrites the indices in the order of the sort keys.
+ *
+ * With a Particle_Cull the quads are tested against the view frustum and a projected size threshold in
+ * the same lanes, with a bounding sphere of radius |h0| + |h1| around the quad center. Only the quads
+ * that pass are written, packed, so culled particles never get a sort key or vertices. Whole emitters are
+ * culled first with particle_cull_bounds, from the Particle_Bounds the simulation keeps.
+ * Closed form streams are moved to their current position here, before the expansion, so their positions
+ * are only ever computed for the frames that are drawn.
+ * Define PARTICLE_DRAW_IMPL in one translation unit.
+ */
+
+#include "particle_sim.h"
+
+#include <cstdint>
+
+enum { PARTICLE_QUAD_VERTICES = 4, PARTICLE_QUAD_INDICES = 6, PARTICLE_QUAD_LANES = 4 };
+
+struct Particle_Vertex
+{
+    float x, y, z;
+    float u, v;
+    uint32_t color;
+};
+static_assert(sizeof(Particle_Vertex) == 24, "particle_expand_quads writes the vertices as rows of 4 floats");
+
+// Camera basis in world space.
+struct Particle_View
+{
+    mat4 view;          // world to view, as camera_matrix
+    vec3 position;
+    vec3 right;
+    vec3 up;
+    vec3 look;
+};
+
+struct Particle_Quad_Style
+{
+    bool stretch;       // along the velocity, the distance of one 60 Hz frame
+    bool align_to_axis;
+    vec3 align_axis;
+    float u0, v0;       // texture coordinates of the first corner
+    float u1, v1;       // and of the opposite corner
+};
+
+struct Particle_Quad_Streams
+{
+    const vec3 *position;
+    const vec3 *velocity; // only read by stretched styles
+    const float *size;
+    const vec4 *color;
+
+    // Closed form particles (Particle_System::closed_form): with acceleration set, position and velocity
+    // are the spawn state and are evaluated at the age life_max - life_seconds with particle_closed_form.
+    const vec3 *acceleration;
+    const float *life_seconds;
+    const float *life_max;
+    float drag;
+};
+
+// Frustum and projected size culling, with counters of what it culled (the caller resets them).
+struct Particle_Cull
+{
+    vec4 planes[6];         // world space, normalized, inside where dot(xyz, p) + w >= 0
+    float pixels_per_unit;  // projected size in pixels of 1 unit at view distance 1
+    float min_pixels;       // quads with a smaller projected diameter are culled, 0 keeps them all
+
+    int tested;
+    int outside;            // of the frustum
+    int small;              // inside, but smaller than min_pixels
+    int emitters_tested;
+    int emitters_outside;
+};
+
+Particle_View particle_view(mat4 view);
+// projection and view as in particles.cpp, row major with the vector on the right, -z forward.
+Particle_Cull particle_cull(mat4 projection, mat4 view, int viewport_height, float min_pixels);
+// The sheet tile of the system, tile_w and tile_h are the size of a tile in texture coordinates.
+Particle_Quad_Style particle_quad_style(const Particle_System *PS, float tile_w, float tile_h);
+
+// Whether any quad of the style around particles within bounds can be inside the frustum.
+bool particle_cull_bounds(Particle_Cull *cull, const Particle_Bounds *bounds, const Particle_Quad_Style *style);
+
+// Writes the 4 vertices of the particles [0, num) that pass cull (all if cull is null) to vertices and,
+// if depth is not null, their view space z. Returns the number of quads written.
+int particle_expand_quads(const Particle_Quad_Streams *P, int num, const Particle_View *view,
+        const Particle_Quad_Style *style, Particle_Cull *cull, Particle_Vertex *vertices, float *depth);
+// One particle at a time, the tail of particle_expand_quads and its reference. Particles [first, first + num)
+// are written from vertices[0] and depth[0] on.
+int particle_expand_quads_scalar(const Particle_Quad_Streams *P, int first, int num, const Particle_View *view,
+        const Particle_Quad_Style *style, Particle_Cull *cull, Particle_Vertex *vertices, float *depth);
+
+// Indices of the quads [first, first + num), the vertices of quad q start at base_vertex + 4 * q.
+void particle_quad_indices(uint32_t *indices, int first, int num, uint32_t base_vertex);
+// Indices of num quads in the order of the sort keys of draw_sort.h.
+void particle_quad_indices_sorted(uint32_t *indices, const uint64_t *sorted, int num, uint32_t base_vertex);
+
+#ifdef PARTICLE_DRAW_IMPL
+
+#include "draw_sort.h"
+
+#include <cmath>
+#include <emmintrin.h>
+
+static const float particle_stretch_dt = 0.016f; // 1/60 s delta time * speed = delta distance
+
+Particle_View particle_view(mat4 view)
+{
+    Particle_View result;
+    result.view = view;
+    mat4 camera_w = invert_affine(view);
+    result.position = {camera_w[3], camera_w[7], camera_w[11]};
+    result.right = {view[0], view[1], view[2]};
+    result.up = {view[4], view[5], view[6]};
+    result.look = {view[8], view[9], view[10]};
+    return result;
+}
+
+Particle_Cull particle_cull(mat4 projection, mat4 view, int viewport_height, float min_pixels)
+{
+    // Gribb and Hartmann: the planes are sums of the rows of the clip matrix, -w <= x, y, z <= w.
+    mat4 clip = projection * view;
+    vec4 row[4];
+    for (int r = 0; r < 4; r++) row[r] = vec4{clip[r * 4 + 0], clip[r * 4 + 1], clip[r * 4 + 2], clip[r * 4 + 3]};
+
+    Particle_Cull result = { };
+    for (int r = 0; r < 3; r++)
+    {
+        result.planes[r * 2 + 0] = row[3] + row[r];
+        result.planes[r * 2 + 1] = row[3] - row[r];
+    }
+    for (vec4 &plane : result.planes)
+    {
+        float L = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+        if (L > 0.0f) plane = plane * (1.0f / L);
+    }
+    result.pixels_per_unit = projection[5] * viewport_height * 0.5f;
+    result.min_pixels = min_pixels;
+    return result;
+}
+
+static inline bool particle_cull_sphere(Particle_Cull *cull, vec3 p, float radius, float view_z)
+{
+    cull->tested++;
+    for (const vec4 &plane : cull->planes)
+    {
+        if (plane.x * p.x + plane.y * p.y + plane.z * p.z + plane.w < -radius)
+        {
+            cull->outside++;
+            return true;
+        }
+    }
+    if (2.0f * radius * cull->pixels_per_unit < cull->min_pixels * -view_z)
+    {
+        cull->small++;
+        return true;
+    }
+    return false;
+}
+
+bool particle_cull_bounds(Particle_Cull *cull, const Particle_Bounds *bounds, const Particle_Quad_Style *style)
+{
+    // Largest distance of a quad corner from its particle, see particle_expand_quads_scalar.
+    float half = bounds->max_size * 0.5f;
+    float radius = 2.0f * half;
+    if (style->stretch) radius = half * particle_stretch_dt * (2.0f * bounds->max_speed + 1.0f);
+
+    cull->emitters_tested++;
+    for (const vec4 &plane : cull->planes)
+    {
+        // The corner of the box furthest along the plane normal.
+        float x = (plane.x >= 0.0f) ? bounds->max.x : bounds->min.x;
+        float y = (plane.y >= 0.0f) ? bounds->max.y : bounds->min.y;
+        float z = (plane.z >= 0.0f) ? bounds->max.z : bounds->min.z;
+        if (plane.x * x + plane.y * y + plane.z * z + plane.w < -radius)
+        {
+            cull->emitters_outside++;
+            return false;
+        }
+    }
+    return true;
+}
+
+Particle_Quad_Style particle_quad_style(const Particle_System *PS, float tile_w, float tile_h)
+{
+    Particle_Quad_Style result;
+    result.stretch = PS->stretch;
+    result.align_to_axis = PS->align_to_axis;
+    result.align_axis = PS->align_axis;
+    result.u0 = tile_w * PS->sheet_tile_x;
+    result.u1 = result.u0 + tile_w;
+    result.v0 = 1.0f - tile_h * PS->sheet_tile_y;
+    result.v1 = result.v0 - tile_h;
+    return result;
+}
+
+// Components clamped to [0, 1] and rounded to 0..255, in 32-bit lanes.
+static inline __m128i particle_color_255(const vec4 *c)
+{
+    __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(&c->x), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    return _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+}
+
+static inline uint32_t particle_pack_color(const vec4 *c)
+{
+    __m128i i = particle_color_255(c);
+    i = _mm_packs_epi32(i, i);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+}
+
+static inline void particle_write_quad(Particle_Vertex *v, vec3 p, vec3 h0, vec3 h1, uint32_t color,
+        const Particle_Quad_Style *style)
+{
+    vec3 c0 = p - h0 - h1;
+    vec3 c1 = p - h0 + h1;
+    vec3 c2 = p + h0 + h1;
+    vec3 c3 = p + h0 - h1;
+    v[0] = {c0.x, c0.y, c0.z, style->u0, style->v0, color};
+    v[1] = {c1.x, c1.y, c1.z, style->u0, style->v1, color};
+    v[2] = {c2.x, c2.y, c2.z, style->u1, style->v1, color};
+    v[3] = {c3.x, c3.y, c3.z, style->u1, style->v0, color};
+}
+
+int particle_expand_quads_scalar(const Particle_Quad_Streams *P, int first, int num, const Particle_View *view,
+        const Particle_Quad_Style *style, Particle_Cull *cull, Particle_Vertex *vertices, float *depth)
+{
+    const mat4 &m = view->view;
+    int out = 0;
+    for (int i = first; i < first + num; i++)
+    {
+        float size = P->size[i] * 0.5f;
+        vec3 w_pos = P->position[i];
+        vec3 w_vel = style->stretch ? P->velocity[i] : vec3{0.0f, 0.0f, 0.0f};
+        if (P->acceleration)
+        {
+            particle_closed_form(w_pos, P->velocity[i], P->acceleration[i], P->drag, P->life_max[i] - P->life_seconds[i],
+                    &w_pos, &w_vel);
+        }
+        vec3 h0, h1;
+
+        if (style->stretch)
+        {
+            vec3 v = normalize(w_vel);
+            float len = sqrtf(dot(w_vel, w_vel));
+            h0 = v * size * len * particle_stretch_dt;
+            h1 = normalize(cross(v, view->look)) * size * particle_stretch_dt;
+            w_pos = w_pos + h0;
+        }
+        else if (style->align_to_axis)
+        {
+            vec3 right = normalize(cross(style->align_axis, normalize(w_pos - view->position)));
+            h0 = right * size;
+            h1 = style->align_axis * size;
+        }
+        else
+        {
+            h0 = view->right * size;
+            h1 = view->up * size;
+        }
+
+        // right hand coordinate system, where negative z is forward
+        float z = m[8] * w_pos.x + m[9] * w_pos.y + m[10] * w_pos.z + m[11];
+        if (cull && particle_cull_sphere(cull, w_pos, sqrtf(dot(h0, h0)) + sqrtf(dot(h1, h1)), z)) continue;
+
+        if (depth) depth[out] = z;
+        particle_write_quad(&vertices[out * PARTICLE_QUAD_VERTICES], w_pos, h0, h1, particle_pack_color(&P->color[i]), style);
+        out++;
+    }
+    return out;
+}
+
+// Four particles, one per lane.
+struct Particle_Lanes
+{
+    __m128 x, y, z;
+};
+
+static inline Particle_Lanes particle_lanes_set(vec3 a)
+{
+    return { _mm_set1_ps(a.x), _mm_set1_ps(a.y), _mm_set1_ps(a.z) };
+}
+
+static inline Particle_Lanes particle_lanes_load(const vec3 *a)
+{
+#ifdef USE_SSE
+    __m128 r0 = a[0].v4, r1 = a[1].v4, r2 = a[2].v4, r3 = a[3].v4;
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    return { r0, r1, r2 };
+#else
+    return {
+        _mm_setr_ps(a[0].x, a[1].x, a[2].x, a[3].x),
+        _mm_setr_ps(a[0].y, a[1].y, a[2].y, a[3].y),
+        _mm_setr_ps(a[0].z, a[1].z, a[2].z, a[3].z),
+    };
+#endif
+}
+
+static inline Particle_Lanes particle_lanes_add(Particle_Lanes a, Particle_Lanes b)
+{
+    return { _mm_add_ps(a.x, b.x), _mm_add_ps(a.y, b.y), _mm_add_ps(a.z, b.z) };
+}
+
+static inline Particle_Lanes particle_lanes_sub(Particle_Lanes a, Particle_Lanes b)
+{
+    return { _mm_sub_ps(a.x, b.x), _mm_sub_ps(a.y, b.y), _mm_sub_ps(a.z, b.z) };
+}
+
+static inline Particle_Lanes particle_lanes_scale(Particle_Lanes a, __m128 s)
+{
+    return { _mm_mul_ps(a.x, s), _mm_mul_ps(a.y, s), _mm_mul_ps(a.z, s) };
+}
+
+static inline __m128 particle_lanes_dot(Particle_Lanes a, Particle_Lanes b)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z));
+}
+
+static inline Particle_Lanes particle_lanes_cross(Particle_Lanes a, Particle_Lanes b)
+{
+    return {
+        _mm_sub_ps(_mm_mul_ps(a.y, b.z), _mm_mul_ps(a.z, b.y)),
+        _mm_sub_ps(_mm_mul_ps(a.z, b.x), _mm_mul_ps(a.x, b.z)),
+        _mm_sub_ps(_mm_mul_ps(a.x, b.y), _mm_mul_ps(a.y, b.x)),
+    };
+}
+
+// normalize of particle_math.h, {1, 0, 0} for short vectors.
+static inline Particle_Lanes particle_lanes_normalize(Particle_Lanes a)
+{
+    __m128 L2 = particle_lanes_dot(a, a);
+    __m128 ok = _mm_cmpgt_ps(L2, _mm_set1_ps(0.001f));
+#ifdef USE_SSE
+    __m128 inv = _mm_rsqrt_ps(_mm_max_ps(L2, _mm_set1_ps(0.001f)));
+#else
+    __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(_mm_max_ps(L2, _mm_set1_ps(0.001f))));
+#endif
+    __m128 x = _mm_and_ps(ok, _mm_mul_ps(a.x, inv));
+    return {
+        _mm_or_ps(x, _mm_andnot_ps(ok, _mm_set1_ps(1.0f))),
+        _mm_and_ps(ok, _mm_mul_ps(a.y, inv)),
+        _mm_and_ps(ok, _mm_mul_ps(a.z, inv)),
+    };
+}
+
+// particle_closed_form of 4 particles.
+static inline void particle_lanes_closed_form(Particle_Lanes *p, Particle_Lanes *v, Particle_Lanes a, float drag, __m128 t)
+{
+    if (drag == 0.0f)
+    {
+        __m128 half_t2 = _mm_mul_ps(_mm_mul_ps(t, t), _mm_set1_ps(0.5f));
+        *p = particle_lanes_add(*p, particle_lanes_add(particle_lanes_scale(*v, t), particle_lanes_scale(a, half_t2)));
+        *v = particle_lanes_add(*v, particle_lanes_scale(a, t));
+        return;
+    }
+    alignas(16) float age[PARTICLE_QUAD_LANES];
+    alignas(16) float decay[PARTICLE_QUAD_LANES];
+    _mm_store_ps(age, t);
+    for (int k = 0; k < PARTICLE_QUAD_LANES; k++) decay[k] = expf(-drag * age[k]);
+    __m128 d = _mm_load_ps(decay);
+    __m128 inv_drag = _mm_set1_ps(1.0f / drag);
+    Particle_Lanes terminal = particle_lanes_scale(a, inv_drag);
+    Particle_Lanes rel = particle_lanes_sub(*v, terminal);
+    __m128 moved = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(1.0f), d), inv_drag);
+    *p = particle_lanes_add(*p, particle_lanes_add(particle_lanes_scale(terminal, t), particle_lanes_scale(rel, moved)));
+    *v = particle_lanes_add(terminal, particle_lanes_scale(rel, d));
+}
+
+// Number of set bits of a 4 lane mask.
+static const uint8_t particle_lane_count[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+int particle_expand_quads(const Particle_Quad_Streams *P, int num, const Particle_View *view,
+        const Particle_Quad_Style *style, Particle_Cull *cull, Particle_Vertex *vertices, float *depth)
+{
+    const mat4 &m = view->view;
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 dt = _mm_set1_ps(particle_stretch_dt);
+    const Particle_Lanes cam_pos = particle_lanes_set(view->position);
+    const Particle_Lanes look = particle_lanes_set(view->look);
+    const Particle_Lanes axis = particle_lanes_set(style->align_axis);
+    const Particle_Lanes right = particle_lanes_set(view->right);
+    const Particle_Lanes up = particle_lanes_set(view->up);
+    const __m128 u0 = _mm_set1_ps(style->u0);
+    const __m128 v0 = _mm_set1_ps(style->v0);
+    const __m128 u1 = _mm_set1_ps(style->u1);
+    const __m128 v1 = _mm_set1_ps(style->v1);
+
+    Particle_Lanes plane_n[6];
+    __m128 plane_w[6];
+    for (int k = 0; cull && k < 6; k++)
+    {
+        plane_n[k] = particle_lanes_set(vec3{cull->planes[k].x, cull->planes[k].y, cull->planes[k].z});
+        plane_w[k] = _mm_set1_ps(cull->planes[k].w);
+    }
+
+    int i = 0;
+    int out = 0;
+    for (; i + PARTICLE_QUAD_LANES <= num; i += PARTICLE_QUAD_LANES)
+    {
+        __m128 size = _mm_mul_ps(_mm_loadu_ps(&P->size[i]), half);
+        Particle_Lanes p = particle_lanes_load(&P->position[i]);
+        Particle_Lanes w_vel = p;
+        if (style->stretch || P->acceleration) w_vel = particle_lanes_load(&P->velocity[i]);
+        if (P->acceleration)
+        {
+            __m128 age = _mm_sub_ps(_mm_loadu_ps(&P->life_max[i]), _mm_loadu_ps(&P->life_seconds[i]));
+            particle_lanes_closed_form(&p, &w_vel, particle_lanes_load(&P->acceleration[i]), P->drag, age);
+        }
+        Particle_Lanes h0, h1;
+
+        if (style->stretch)
+        {
+            Particle_Lanes v = particle_lanes_normalize(w_vel);
+            __m128 len = _mm_sqrt_ps(particle_lanes_dot(w_vel, w_vel));
+            __m128 s = _mm_mul_ps(size, dt);
+            h0 = particle_lanes_scale(v, _mm_mul_ps(s, len));
+            h1 = particle_lanes_scale(particle_lanes_normalize(particle_lanes_cross(v, look)), s);
+            p = particle_lanes_add(p, h0);
+        }
+        else if (style->align_to_axis)
+        {
+            Particle_Lanes to_cam = particle_lanes_normalize(particle_lanes_sub(p, cam_pos));
+            h0 = particle_lanes_scale(particle_lanes_normalize(particle_lanes_cross(axis, to_cam)), size);
+            h1 = particle_lanes_scale(axis, size);
+        }
+        else
+        {
+            h0 = particle_lanes_scale(right, size);
+            h1 = particle_lanes_scale(up, size);
+        }
+
+        __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[8]), p.x), _mm_mul_ps(_mm_set1_ps(m[9]), p.y));
+        z = _mm_add_ps(z, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[10]), p.z), _mm_set1_ps(m[11])));
+
+        int keep = 0xf;
+        if (cull)
+        {
+            __m128 radius = _mm_add_ps(_mm_sqrt_ps(particle_lanes_dot(h0, h0)), _mm_sqrt_ps(particle_lanes_dot(h1, h1)));
+            __m128 neg_radius = _mm_sub_ps(_mm_setzero_ps(), radius);
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int k = 0; k < 6; k++)
+            {
+                __m128 d = _mm_add_ps(particle_lanes_dot(p, plane_n[k]), plane_w[k]);
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(d, neg_radius));
+            }
+            __m128 pixels = _mm_mul_ps(radius, _mm_set1_ps(2.0f * cull->pixels_per_unit));
+            __m128 small = _mm_cmplt_ps(pixels, _mm_mul_ps(_mm_set1_ps(-cull->min_pixels), z));
+            int inside_mask = _mm_movemask_ps(inside);
+            keep = _mm_movemask_ps(_mm_andnot_ps(small, inside));
+            cull->tested += PARTICLE_QUAD_LANES;
+            cull->outside += PARTICLE_QUAD_LANES - particle_lane_count[inside_mask];
+            cull->small += particle_lane_count[inside_mask & ~keep];
+            if (!keep) continue;
+        }
+        alignas(16) float view_z[PARTICLE_QUAD_LANES];
+        _mm_store_ps(view_z, z);
+
+        // Corners 0 to 3 of the 4 quads, one register per corner and component.
+        Particle_Lanes a = particle_lanes_sub(p, h0);
+        Particle_Lanes b = particle_lanes_add(p, h0);
+        Particle_Lanes c0 = particle_lanes_sub(a, h1);
+        Particle_Lanes c1 = particle_lanes_add(a, h1);
+        Particle_Lanes c2 = particle_lanes_add(b, h1);
+        Particle_Lanes c3 = particle_lanes_sub(b, h1);
+
+        __m128i c01 = _mm_packs_epi32(particle_color_255(&P->color[i + 0]), particle_color_255(&P->color[i + 1]));
+        __m128i c23 = _mm_packs_epi32(particle_color_255(&P->color[i + 2]), particle_color_255(&P->color[i + 3]));
+        __m128 color = _mm_castsi128_ps(_mm_packus_epi16(c01, c23));
+
+        // The 4 vertices of a quad are 6 rows of 4 floats, e.g. row 1 is (v0, color, x1, y1). Each row is
+        // the transpose of 4 lane registers, which leaves the row of quad k in register k.
+        __m128 r0[4] = { c0.x, c0.y, c0.z, u0 };
+        __m128 r1[4] = { v0, color, c1.x, c1.y };
+        __m128 r2[4] = { c1.z, u0, v1, color };
+        __m128 r3[4] = { c2.x, c2.y, c2.z, u1 };
+        __m128 r4[4] = { v1, color, c3.x, c3.y };
+        __m128 r5[4] = { c3.z, u1, v0, color };
+        _MM_TRANSPOSE4_PS(r0[0], r0[1], r0[2], r0[3]);
+        _MM_TRANSPOSE4_PS(r1[0], r1[1], r1[2], r1[3]);
+        _MM_TRANSPOSE4_PS(r2[0], r2[1], r2[2], r2[3]);
+        _MM_TRANSPOSE4_PS(r3[0], r3[1], r3[2], r3[3]);
+        _MM_TRANSPOSE4_PS(r4[0], r4[1], r4[2], r4[3]);
+        _MM_TRANSPOSE4_PS(r5[0], r5[1], r5[2], r5[3]);
+
+        for (int k = 0; k < PARTICLE_QUAD_LANES; k++)
+        {
+            if (!(keep & (1 << k))) continue;
+            if (depth) depth[out] = view_z[k];
+            float *v = &vertices[out * PARTICLE_QUAD_VERTICES].x;
+            out++;
+            _mm_storeu_ps(v + 0, r0[k]);
+            _mm_storeu_ps(v + 4, r1[k]);
+            _mm_storeu_ps(v + 8, r2[k]);
+            _mm_storeu_ps(v + 12, r3[k]);
+            _mm_storeu_ps(v + 16, r4[k]);
+            _mm_storeu_ps(v + 20, r5[k]);
+        }
+    }
+
+    return out + particle_expand_quads_scalar(P, i, num - i, view, style, cull,
+            &vertices[out * PARTICLE_QUAD_VERTICES], depth ? &depth[out] : nullptr);
+}
+
+void particle_quad_indices(uint32_t *indices, int first, int num, uint32_t base_vertex)
+{
+    uint32_t v = base_vertex + (uint32_t)first * PARTICLE_QUAD_VERTICES;
+    for (int i = 0; i < num; i++, v += PARTICLE_QUAD_VERTICES, indices += PARTICLE_QUAD_INDICES)
+    {
+        indices[0] = v + 0;
+        indices[1] = v + 1;
+        indices[2] = v + 2;
+        indices[3] = v + 0;
+        indices[4] = v + 2;
+        indices[5] = v + 3;
+    }
+}
+
+void particle_quad_indices_sorted(uint32_t *indices, const uint64_t *sorted, int num, uint32_t base_vertex)
+{
+    for (int i = 0; i < num; i++, indices += PARTICLE_QUAD_INDICES)
+    {
+        uint32_t v = base_vertex + draw_sort_index(sorted[i]) * PARTICLE_QUAD_VERTICES;
+        indices[0] = v + 0;
+        indices[1] = v + 1;
+        indices[2] = v + 2;
+        indices[3] = v + 0;
+        indices[4] = v + 2;
+        indices[5] = v + 3;
+    }
+}
+
+#endif // PARTICLE_DRAW_IMPL
+
+#define PARTICLE_DRAW
+#endif
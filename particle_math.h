@@ -0,0 +1,291 @@
+#ifndef PARTICLE_MATH
+
+#include "fxreg.h"
+#include <cmath>
+#include <cstdlib>
+
+inline float random01()
+{
+    return (float)rand() / RAND_MAX;
+}
+
+inline float clamp01(float x)
+{
+    return (x > 1.0f) ? 1.0f : ((x < 0.0f) ? 0.0f : x);
+}
+
+struct vec3
+{
+#ifdef USE_SSE
+    union
+    {
+        struct { float x, y, z; };
+        __m128 v4;
+    };
+#else
+    float x, y, z;
+#endif
+};
+
+struct vec4
+{
+#ifdef USE_SSE
+    union
+    {
+        struct { float x, y, z, w; };
+        __m128 v4;
+    };
+#else
+    float x, y, z, w;
+#endif
+};
+
+#ifndef USE_SSE
+inline vec3 operator - (vec3 a) { return {-a.x, -a.y, -a.z}; }
+inline vec3 operator + (vec3 a, vec3 b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+inline vec3 operator - (vec3 a, vec3 b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+inline vec3 operator * (vec3 a, vec3 b) { return {a.x * b.x, a.y * b.y, a.z * b.z}; }
+inline vec3 operator / (vec3 a, vec3 b) { return {a.x / b.x, a.y / b.y, a.z / b.z}; }
+inline vec3 operator * (vec3 a, float t) { return {a.x * t, a.y * t, a.z * t}; }
+inline vec3 operator / (vec3 a, float t) { return {a.x / t, a.y / t, a.z / t}; }
+
+inline float dot(vec3 a, vec3 b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline vec3 cross(vec3 a, vec3 b)
+{
+    return {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x};
+}
+
+// Component-wise
+inline vec3 vmin(vec3 a, vec3 b) { return {fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z)}; }
+inline vec3 vmax(vec3 a, vec3 b) { return {fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z)}; }
+
+inline vec3 normalize(vec3 a)
+{
+    float L2 = dot(a, a);
+    if (L2 <= 0.001f)
+    {
+        return vec3{1.0f, 0.0f, 0.0f};
+    }
+    float L = sqrt(L2);
+    return a / L;
+}
+
+inline vec4 operator - (vec4 a) { return {-a.x, -a.y, -a.z, -a.w}; }
+inline vec4 operator + (vec4 a, vec4 b) { return {a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w}; }
+inline vec4 operator - (vec4 a, vec4 b) { return {a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w}; }
+inline vec4 operator * (vec4 a, vec4 b) { return {a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w}; }
+inline vec4 operator / (vec4 a, vec4 b) { return {a.x / b.x, a.y / b.y, a.z / b.z, a.w / b.w}; }
+inline vec4 operator * (vec4 a, float t) { return {a.x * t, a.y * t, a.z * t, a.w * t}; }
+inline vec4 operator / (vec4 a, float t) { return {a.x / t, a.y / t, a.z / t, a.w / t}; }
+
+inline float dot(vec4 a, vec4 b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+
+inline vec4 normalize(vec4 a)
+{
+    float L2 = dot(a, a);
+    float L = sqrt(L2);
+    return a / L;
+}
+
+#else
+// USE_SSE
+
+inline vec3 operator - (vec3 a) { return vec3{ .v4 = _mm_xor_ps(a.v4, _mm_set1_ps(-0.0f)) }; }
+inline vec3 operator + (vec3 a, vec3 b) { return vec3{ .v4 = _mm_add_ps(a.v4, b.v4) }; }
+inline vec3 operator - (vec3 a, vec3 b) { return vec3{ .v4 = _mm_sub_ps(a.v4, b.v4) }; }
+inline vec3 operator * (vec3 a, vec3 b) { return vec3{ .v4 = _mm_mul_ps(a.v4, b.v4) }; }
+inline vec3 operator / (vec3 a, vec3 b) { return vec3{ .v4 = _mm_div_ps(a.v4, b.v4) }; }
+inline vec3 operator * (vec3 a, float t) { return vec3{ .v4 = _mm_mul_ps(a.v4, _mm_set1_ps(t)) }; }
+inline vec3 operator / (vec3 a, float t) { return vec3{ .v4 = _mm_div_ps(a.v4, _mm_set1_ps(t)) }; }
+
+inline float dot(vec3 a, vec3 b)
+{
+    //vec3 r = vec3{ .v4 = _mm_mul_ps(a.v4, b.v4) };
+    //return r.x + r.y + r.z;
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline vec3 cross(vec3 a, vec3 b)
+{
+    return {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x};
+}
+
+// Component-wise
+inline vec3 vmin(vec3 a, vec3 b) { return vec3{ .v4 = _mm_min_ps(a.v4, b.v4) }; }
+inline vec3 vmax(vec3 a, vec3 b) { return vec3{ .v4 = _mm_max_ps(a.v4, b.v4) }; }
+
+inline vec3 normalize(vec3 a)
+{
+    float L2 = dot(a, a);
+    if (L2 <= 0.001f)
+    {
+        return vec3{ 1.0f, 0.0f, 0.0f };
+    }
+    __m128 L = _mm_rsqrt_ps(_mm_set1_ps(L2));
+    return vec3{ .v4 = _mm_mul_ps(a.v4, L) };
+}
+
+inline vec3 lerp(vec3 a, vec3 b, float t)
+{
+    return a * (1.0f - t) + b * t;
+}
+
+inline vec4 operator - (vec4 a) { return vec4{ .v4 = _mm_xor_ps(a.v4, _mm_set1_ps(-0.0f)) }; }
+inline vec4 operator + (vec4 a, vec4 b) { return vec4{ .v4 = _mm_add_ps(a.v4, b.v4) }; }
+inline vec4 operator - (vec4 a, vec4 b) { return vec4{ .v4 = _mm_sub_ps(a.v4, b.v4) }; }
+inline vec4 operator * (vec4 a, vec4 b) { return vec4{ .v4 = _mm_mul_ps(a.v4, b.v4) }; }
+inline vec4 operator / (vec4 a, vec4 b) { return vec4{ .v4 = _mm_div_ps(a.v4, b.v4) }; }
+inline vec4 operator * (vec4 a, float t) { return vec4{ .v4 = _mm_mul_ps(a.v4, _mm_set1_ps(t)) }; }
+inline vec4 operator / (vec4 a, float t) { return vec4{ .v4 = _mm_div_ps(a.v4, _mm_set1_ps(t)) }; }
+
+inline float dot(vec4 a, vec4 b)
+{
+    vec4 r = vec4{ .v4 = _mm_mul_ps(a.v4, b.v4) };
+    return r.x + r.y + r.z + r.w;
+}
+
+inline vec4 normalize(vec4 a)
+{
+    float L2 = dot(a, a);
+    __m128 L = _mm_rsqrt_ps(_mm_set1_ps(L2));
+    return vec4{ .v4 = _mm_mul_ps(a.v4, L) };
+}
+#endif
+
+struct mat4
+{
+    float m[16];
+
+    float operator[](int i) const { return m[i]; }
+};
+
+inline mat4 transpose(mat4 m)
+{
+    return {
+        m[0], m[4],  m[8], m[12],
+        m[1], m[5],  m[9], m[13],
+        m[2], m[6], m[10], m[14],
+        m[3], m[7], m[11], m[15]
+    };
+}
+
+inline mat4 rotation_y(float theta)
+{
+    float s = sin(theta);
+    float c = cos(theta);
+    return {
+        c,  0, -s, 0,
+        0,  1,  0, 0,
+        s,  0,  c, 0,
+        0,  0,  0, 1
+    };
+}
+
+inline mat4 rotation_x(float theta)
+{
+    float s = sin(theta);
+    float c = cos(theta);
+    return {
+        1,  0,  0, 0,
+        0,  c,  s, 0,
+        0, -s,  c, 0,
+        0,  0,  0, 1
+    };
+}
+
+inline mat4 translation(vec3 v)
+{
+    return {
+        1, 0, 0, v.x,
+        0, 1, 0, v.y,
+        0, 0, 1, v.z,
+        0, 0, 0,   1
+    };
+}
+
+inline mat4 operator * (mat4 a, mat4 b)
+{
+    // Rows
+    vec4 a0 = vec4{a[0],  a[1],  a[2],  a[3]};
+    vec4 a1 = vec4{a[4],  a[5],  a[6],  a[7]};
+    vec4 a2 = vec4{a[8],  a[9],  a[10], a[11]};
+    vec4 a3 = vec4{a[12], a[13], a[14], a[15]};
+    // Columns
+    vec4 b0 = vec4{b[0], b[4], b[8],  b[12]};
+    vec4 b1 = vec4{b[1], b[5], b[9],  b[13]};
+    vec4 b2 = vec4{b[2], b[6], b[10], b[14]};
+    vec4 b3 = vec4{b[3], b[7], b[11], b[15]};
+    return {
+        dot(a0, b0), dot(a0, b1), dot(a0, b2), dot(a0, b3),
+        dot(a1, b0), dot(a1, b1), dot(a1, b2), dot(a1, b3),
+        dot(a2, b0), dot(a2, b1), dot(a2, b2), dot(a2, b3),
+        dot(a3, b0), dot(a3, b1), dot(a3, b2), dot(a3, b3),
+    };
+}
+
+inline mat4 PerspectiveOffCenter_lh(float left, float right,
+                             float bottom, float top,
+                             float nearZ, float farZ)
+{
+    const float X = (2.0f * nearZ) / (right - left);
+    const float Y = (2.0f * nearZ) / (top - bottom);
+
+    const float A = (right + left) / (right - left);
+    const float B = (top + bottom) / (top - bottom);
+    const float C = -(farZ + nearZ) / (farZ - nearZ);
+    const float D = (-2.0f * farZ * nearZ) / (farZ - nearZ);
+
+    return mat4{
+        X,    0.0f, A,    0.0f,
+        0.0f, Y,    B,    0.0f,
+        0.0f, 0.0f, C,    D,
+        0.0f, 0.0f, -1.0f, 0.0f
+    };
+}
+
+inline mat4 Perspective_lh(float fov_y, float aspect_ratio, float near, float far)
+{
+    const float deg2rad = 3.14159265358f / 180.0f;
+    const float tan_half_fov_y = std::tan(fov_y * 0.5f * deg2rad);
+    const float y = near * tan_half_fov_y;
+    const float x = y * aspect_ratio;
+    return PerspectiveOffCenter_lh(-x, x, -y, y, near, far);
+}
+
+inline mat4 invert_affine(mat4 m)
+{
+    vec3 inv_rot_0 = vec3{m[0], m[4], m[8]};
+    vec3 inv_rot_1 = vec3{m[1], m[5], m[9]};
+    vec3 inv_rot_2 = vec3{m[2], m[6], m[10]};
+    vec3 x = vec3{m[3], m[7], m[11]};
+    vec3 v = -vec3{dot(inv_rot_0, x), dot(inv_rot_1, x), dot(inv_rot_2, x)};
+    return {
+        inv_rot_0.x, inv_rot_0.y, inv_rot_0.z, v.x,
+        inv_rot_1.x, inv_rot_1.y, inv_rot_1.z, v.y,
+        inv_rot_2.x, inv_rot_2.y, inv_rot_2.z, v.z,
+        0.0f, 0.0f, 0.0f, 1.0f
+    };
+}
+
+inline vec4 transform(mat4 tr, vec4 p)
+{
+    // | 0  1  2  3|   |x|
+    // | 4  5  6  7| x |y| = |0x+1y+2z+3w, 4x+5y+6z+7w, 8x+9y+10z+11w, 12x+13y+14z+15w|
+    // | 8  9 10 11|   |z|
+    // |12 13 14 15|   |w|
+    float x =  tr[0] * p.x +  tr[1] * p.y +  tr[2] * p.z +  tr[3] * p.w;
+    float y =  tr[4] * p.x +  tr[5] * p.y +  tr[6] * p.z +  tr[7] * p.w;
+    float z =  tr[8] * p.x +  tr[9] * p.y + tr[10] * p.z + tr[11] * p.w;
+    float w = tr[12] * p.x + tr[13] * p.y + tr[14] * p.z + tr[15] * p.w;
+    return {x, y, z, w};
+}
+
+#define PARTICLE_MATH
+#endif
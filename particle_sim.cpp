@@ -0,0 +1,14 @@
+//#define TRACE_FXVM
+#define FXVM_IMPL
+#define FXVM_COMPILER_IMPL
+#define FXVM_CAPTURE_IMPL
+#define JOB_SYSTEM_IMPL
+#define TRACE_IMPL
+#define PERF_COUNTERS_IMPL
+#define MEMTRACK_IMPL
+#define DRAW_SORT_IMPL
+#define PARTICLE_DRAW_IMPL
+#define PARTICLE_SIM_IMPL
+#include "particle_sim.h"
+#include "draw_sort.h"
+#include "particle_draw.h"
@@ -0,0 +1,2994 @@
+#ifndef PARTICLE_SIM
+
+/*
+ * Particle simulation: particle systems, emitters and their update on the FXVM, and the .psys loader.
+ * Does not depend on any window or graphics code. Define PARTICLE_SIM_IMPL in one translation unit,
+ * together with FXVM_IMPL, FXVM_COMPILER_IMPL, FXVM_CAPTURE_IMPL, JOB_SYSTEM_IMPL, TRACE_IMPL,
+ * PERF_COUNTERS_IMPL and MEMTRACK_IMPL.
+ */
+
+#include "fxcapture.h"
+#include "fxvm.h"
+#include "jobs.h"
+#include "particle_math.h"
+#include "trace.h"
+
+#include <cstdint>
+
+struct Particles
+{
+    enum { MAX = 1000 };
+    vec3 position[MAX];
+    vec3 velocity[MAX];
+    vec3 acceleration[MAX];
+    float life_seconds[MAX];
+    float life_max[MAX];
+    float life_01[MAX];
+    float size[MAX];
+    vec4 color[MAX];
+    vec4 random[MAX];
+};
+
+
+/*
+ * Conservative bounds of the particles of an emitter after its last update: the box around the
+ * particle positions and the spawn origin, and the largest particle size and speed, from which the
+ * renderer pads the box by the extent of its quads (stretched quads grow with the speed).
+ * Computed by the integration loop, so they cost one min/max per particle. Closed form systems grow the
+ * box of the spawn positions by how far the fastest spawned particle can have moved in the age of the
+ * oldest one (see Closed_Form_Spawn), which is looser.
+ */
+struct Particle_Bounds
+{
+    vec3 min;
+    vec3 max;
+    float max_size;
+    float max_speed;
+};
+
+// The bounds of just the point p.
+Particle_Bounds point_particle_bounds(vec3 p);
+void merge_particle_bounds(Particle_Bounds *a, const Particle_Bounds *b);
+
+// What the particles of a closed form emitter spawned with: the box of their positions, and their largest
+// initial speed and acceleration, squared. Kept for two generations of particles on a clock advanced every
+// step: once the previous generation is surely dead (its end has passed) the current one takes its place
+// and a new one starts, so a moving emitter is bounded by about two particle lives of its path.
+struct Closed_Form_Spawn
+{
+    struct Generation
+    {
+        vec3 min;
+        vec3 max;
+        float max_speed2;
+        float max_acceleration2;
+        float end;  // time when the last of its particles dies
+    };
+    Generation current;
+    Generation previous;
+    float time;     // seconds emitted since the current generation started
+};
+
+// Position and velocity t seconds after p0 and v0, with the constant acceleration a and the drag of the
+// integration, -drag v. The velocity decays exponentially towards the terminal velocity a / drag. Inline,
+// the renderer evaluates it for every closed form particle it draws.
+inline void particle_closed_form(vec3 p0, vec3 v0, vec3 a, float drag, float t, vec3 *p, vec3 *v)
+{
+    if (drag * t < 1e-4f)
+    {
+        *p = p0 + v0 * t + a * (0.5f * t * t);
+        *v = v0 + a * t;
+        return;
+    }
+    vec3 terminal = a * (1.0f / drag);
+    float decay = expf(-drag * t);
+    *p = p0 + terminal * t + (v0 - terminal) * ((1.0f - decay) / drag);
+    *v = terminal + (v0 - terminal) * decay;
+}
+
+struct Emitter_Instance
+{
+    float fractional_particles;
+    float life;
+    vec3 position;
+    Particle_Bounds bounds;
+    int lod; // tier of Particle_System::lod the emitter is simulated at, set by the caller
+    // Set by the caller from a Particle_Governor_Action, 0 for none.
+    float rate_throttle;    // fraction of the emission rate dropped
+    int particle_limit;     // the oldest particles over it are evicted, and no more are emitted
+
+    int particles_alive;
+    // Particles found dead by the last update sweep, compact() is skipped when there are none.
+    int particles_dead;
+    Closed_Form_Spawn spawn; // closed form systems only
+    Particles P;
+};
+
+struct Emitter_Parameters
+{
+    float life;
+    float cooldown;
+    bool loop;
+
+    float rate;
+    FXVM_Program rate_p;
+
+    vec3 acceleration;
+
+    float initial_life;
+    FXVM_Program initial_life_p;
+
+    vec3 initial_position;
+    FXVM_Program initial_position_p;
+
+    vec3 initial_velocity;
+    FXVM_Program initial_velocity_p;
+
+    float drag;
+    FXVM_Program drag_p;
+
+    int life_i;
+    int random_i;
+};
+
+/*
+ * Cycles spent in each stage of simulating a particle system, summed over all of its emitters and the
+ * threads simulating them. The spawn program stages run inside emit, so they are included in its time.
+ */
+enum Sim_Stage
+{
+    SIM_STAGE_EMIT,
+    SIM_STAGE_COMPACT,
+    SIM_STAGE_RATE_P,
+    SIM_STAGE_INITIAL_LIFE_P,
+    SIM_STAGE_INITIAL_POSITION_P,
+    SIM_STAGE_INITIAL_VELOCITY_P,
+    SIM_STAGE_ACCELERATION_P,
+    SIM_STAGE_INTEGRATE,
+    SIM_STAGE_SIZE_P,
+    SIM_STAGE_COLOR_P,
+    SIM_STAGE_NUM
+};
+
+// Also the names of the stages' trace zones.
+extern const char *sim_stage_names[SIM_STAGE_NUM];
+
+struct Particle_System_Stats
+{
+    std::atomic<uint64_t> stage_cycles[SIM_STAGE_NUM];
+    std::atomic<uint64_t> particle_updates;
+};
+
+/*
+ * Distance level of detail of a particle system, declared in its .psys file:
+ *
+ *     lod_distance = vec3(15, 30, 60)     // where tiers 1, 2 and 3 start, one component per tier
+ *     lod_rate = vec3(0.5, 0.25, 0.1)     // scale of the emission rate
+ *     lod_step = vec3(2, 4, 8)            // the emitter is stepped every lod_step steps, with their time
+ *     lod_min_pixels = vec3(1, 2, 4)      // projected particle size below which particles are not drawn
+ *     lod_programs = 2                    // first tier that runs the lod_ programs
+ *     lod_color = {{ ... }}               // also lod_acceleration and lod_size
+ *
+ * Tier 0 is the full detail one. The tier of an emitter is picked from the distance of the camera to
+ * its bounds with particle_lod_tier and given to the simulation in Emitter_Instance::lod (or with
+ * async_simulation_set_lod), the step divider only applies to the asynchronous simulation.
+ */
+enum { PARTICLE_LOD_MAX_TIERS = 5 };
+
+struct Particle_LOD_Tier
+{
+    float distance;
+    float rate_scale;
+    int step_divider;
+    float min_pixels;
+};
+
+struct Particle_System
+{
+    Emitter_Parameters emitter;
+    bool stretch;
+    bool additive;
+    bool align_to_axis;
+    vec3 align_axis;
+    // .psys "closed_form = true": the particles keep their spawn position and velocity, the acceleration
+    // program runs once at spawn and there is no integration. Whoever reads the positions evaluates them
+    // at the age of the particle with particle_closed_form, the renderer does it while expanding the quads.
+    // The update programs see the spawn state in position and velocity. load_particle_system rejects
+    // acceleration programs that read particle attributes other than particle_random.
+    bool closed_form;
+    int sheet_tile_x;
+    int sheet_tile_y;
+
+    vec3 acceleration;
+    FXVM_Program acceleration_p;
+
+    vec4 color;
+    FXVM_Program color_p;
+
+    float size;
+    FXVM_Program size_p;
+
+    int priority;       // see Particle_Governor
+
+    int lod_tier_num;   // 1 without lod_distance
+    Particle_LOD_Tier lod[PARTICLE_LOD_MAX_TIERS];
+    int lod_program_tier;
+    // Cheaper variants of the update programs, the full ones are run for the stages that have none.
+    FXVM_Program lod_acceleration_p;
+    FXVM_Program lod_size_p;
+    FXVM_Program lod_color_p;
+
+    int attrib_life;
+    int attrib_position;
+    int attrib_velocity;
+    int attrib_acceleration;
+    int attrib_particle_random;
+
+    int random_i;
+    int emitter_life_i;
+
+    // Estimated by load_particle_system from the cost of the programs, see fxvm_bytecode_cost.
+    float spawn_cycles;     // per spawned particle
+    float update_cycles;    // per particle and update
+
+    // Allocated by load_particle_system, the stages are not counted when this is null. Owned like the
+    // programs: copies share it, so only one copy may be freed, and copies that outlive it set it to null.
+    Particle_System_Stats *stats;
+    // memtrack effect of the programs, batches and snapshots of this system, named after the file.
+    int mem_effect;
+
+    // Variants of the programs for instanced emitters (Emitter_Batch). These read emitter_life
+    // from a per-particle (or per-emitter for rate) attribute stream instead of a uniform.
+    struct Instanced_Programs
+    {
+        FXVM_Program rate_p;
+        FXVM_Program initial_life_p;
+        FXVM_Program initial_position_p;
+        FXVM_Program initial_velocity_p;
+
+        FXVM_Program acceleration_p;
+        FXVM_Program color_p;
+        FXVM_Program size_p;
+
+        int emitter_attrib_life;
+        int attrib_emitter_life;
+    } instanced;
+};
+
+// Frees the programs and the stats of ps and clears it. Copies of ps share them, free only one.
+void free_particle_system(Particle_System *ps);
+Emitter_Instance new_emitter(Particle_System *PS, vec3 position);
+float get_emitter_life(Emitter_Parameters *EP, Emitter_Instance *E);
+// The tier of PS for particles within bounds seen from eye, by the distance to the nearest point of the box.
+int particle_lod_tier(const Particle_System *PS, const Particle_Bounds *bounds, vec3 eye);
+
+/*
+ * Frame budget governor: compares the particle cost of every frame (simulation and drawing) with a
+ * budget and raises a pressure level one at a time while the frames are over it:
+ *   levels 1-3  emission rates throttled by 25, 50 and 75%
+ *   levels 4-5  one and two LOD tiers coarser, up to the last tier of the system
+ *   levels 6-8  at most 500, 250 and 100 particles per emitter, the oldest ones are evicted
+ * A system with priority p (.psys "priority = p", 0 by default) is treated as if the level were p lower,
+ * so important systems degrade later and recover first. The level goes up after escalate_frames frames
+ * over the budget (at once if a frame costs twice the budget) and down after recover_frames frames under
+ * recover_fraction of it, so it does not flip around the budget.
+ */
+enum { PARTICLE_GOVERNOR_MAX_LEVEL = 8 };
+
+struct Particle_Governor
+{
+    float budget_us;
+    float recover_fraction;
+    int escalate_frames;
+    int recover_frames;
+
+    int level;
+    int frames_over;
+    int frames_under;
+};
+
+struct Particle_Governor_Action
+{
+    float rate_throttle;
+    int lod_bias;
+    int particle_limit;
+};
+
+Particle_Governor new_particle_governor(float budget_us);
+void particle_governor_update(Particle_Governor *G, float frame_us);
+Particle_Governor_Action particle_governor_action(const Particle_Governor *G, const Particle_System *PS);
+
+void compact(Emitter_Instance *E);
+void emit(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt);
+// Compacts, emits and advances the emitter life; does not update the particles.
+void simulate_emitter(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt);
+// Updates the particles [first, first + count) and returns the number of them that died. bounds (if
+// not null) gets the bounds of the range, without the spawn origin.
+int simulate_particles(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt, int first, int count,
+        Particle_Bounds *bounds = nullptr);
+// Also updates E->bounds.
+void simulate(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt);
+// Advances E by seconds, rounded to steps of dt, in sub-steps of at most max_step, to start emitters mid-life
+// without simulating every step up to there. dt is the step simulate() continues with: the sub-steps are
+// whole steps, and the emission starts, stops and loops on the steps simulate() would. The particles of a
+// sub-step are spread over its steps, spawned with the emitter_life and aged from the step they would spawn
+// in, and all of them move in closed form with the acceleration they have at its start (closed form systems
+// only age). The size and color programs run once, for the final state. Matches simulate() statistically,
+// not particle for particle.
+void prewarm_emitter(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float seconds, float dt, float max_step = 0.1f);
+
+// Particles of an emitter simulated by one job, a multiple of the exec group size so that only the
+// last chunk of an emitter has a partial group.
+enum { SIMULATE_CHUNK_SIZE = 256, SIMULATE_MAX_CHUNKS = (Particles::MAX + SIMULATE_CHUNK_SIZE - 1) / SIMULATE_CHUNK_SIZE };
+
+struct alignas(JOB_CACHE_LINE) Simulate_Job
+{
+    Particle_System *PS;
+    Emitter_Instance *E;
+    float dt;
+    bool resting = false; // not simulated this (sub-)step, see async_simulation_set_offscreen_policy
+
+    std::atomic<int> particles_dead;
+    Particle_Bounds chunk_bounds[SIMULATE_MAX_CHUNKS];
+
+    // Set by the renderer, read by the simulation thread.
+    std::atomic<bool> visible{true};
+    std::atomic<int> lod{0};
+    std::atomic<float> rate_throttle{0.0f};
+    std::atomic<int> particle_limit{0};
+    // Simulation thread only.
+    float offscreen_seconds = 0.0f;
+    float banked_dt = 0.0f; // time of the steps it rested
+    int rest_steps = 0;
+    int sub_steps = 0;      // of length dt this step, more than one when it catches up
+};
+
+// Simulates all of the emitters with the job system, one job per emitter and chunk of particles.
+void simulate_parallel(Job_System *js, Simulate_Job *jobs, int job_num);
+
+/*
+ * Emitter scheduler: steps only the emitters that can change. An emitter without particles in its
+ * cooldown sleeps in a hierarchical timer wheel until the step its next cycle starts, one that finished
+ * for good (not looping) sleeps until emitter_scheduler_spawn. A step costs the awake emitters and the
+ * timers that expire or move down a level, not the sleeping emitters.
+ *
+ *     Emitter_Scheduler S = new_emitter_scheduler(sim_dt);
+ *     int id = emitter_scheduler_add(&S, PS, E);
+ *     emitter_scheduler_step(&S, vm);
+ *
+ * or, to simulate the awake emitters some other way (e.g. simulate_parallel), emitter_scheduler_begin_step,
+ * simulate the emitters S.awake[0, S.awake_num) with S.dt, then emitter_scheduler_end_step.
+ * Level l of the wheel has EMITTER_WHEEL_SLOTS slots of 64^l steps each, timers further away than the
+ * last level are re-armed when they reach it.
+ */
+enum { EMITTER_WHEEL_BITS = 6, EMITTER_WHEEL_SLOTS = 1 << EMITTER_WHEEL_BITS, EMITTER_WHEEL_LEVELS = 4 };
+
+struct Emitter_Scheduler
+{
+    float dt;
+    uint64_t tick;          // the step being simulated, or the next one
+
+    int emitter_num;
+    int emitter_cap;
+    Particle_System **PS;
+    Emitter_Instance **E;
+    bool *sleeping;
+    uint64_t *sleep_tick;   // first step skipped
+    uint64_t *wake_tick;    // UINT64_MAX without a timer
+    int *timer_next;
+    int *timer_prev;
+    int *timer_slot;        // level * EMITTER_WHEEL_SLOTS + slot, -1 if not in the wheel
+
+    int awake_num;
+    int *awake;
+
+    int slot_head[EMITTER_WHEEL_LEVELS * EMITTER_WHEEL_SLOTS];
+};
+
+Emitter_Scheduler new_emitter_scheduler(float dt);
+void free_emitter_scheduler(Emitter_Scheduler *S);
+// Adds an awake emitter, returns its id.
+int emitter_scheduler_add(Emitter_Scheduler *S, Particle_System *PS, Emitter_Instance *E);
+// Restarts the emission cycle of the emitter from the next step, waking it if it sleeps. Not during a step.
+void emitter_scheduler_spawn(Emitter_Scheduler *S, int id);
+// Wakes the emitters whose timers expire at this step.
+void emitter_scheduler_begin_step(Emitter_Scheduler *S);
+// Puts the awake emitters that became idle to sleep and advances the wheel.
+void emitter_scheduler_end_step(Emitter_Scheduler *S);
+void emitter_scheduler_step(Emitter_Scheduler *S, FXVM_Machine *vm);
+
+/*
+ * Instanced emitters: every emitter instance of one particle system shares a single particle store,
+ * so each program runs as one batched dispatch over all of the particles, in full groups.
+ * Per-emitter values the programs read (emitter_life) are gathered into per-particle streams and
+ * read as attributes by the instanced program variants.
+ */
+struct Particle_Streams
+{
+    int cap;
+
+    vec3 *position;
+    vec3 *velocity;
+    vec3 *acceleration;
+    float *life_seconds;
+    float *life_max;
+    float *life_01;
+    float *size;
+    vec4 *color;
+    vec4 *random;
+
+    int *emitter_index;
+    float *emitter_life;
+};
+
+struct Emitter_Batch
+{
+    Particle_System *PS;
+
+    // Per-emitter streams
+    int emitter_num;
+    int emitter_cap;
+    vec3 *emitter_position;
+    float *emitter_time;            // same as Emitter_Instance::life
+    float *emitter_life;            // emitter_time normalized to [0, 1], the emitter_life program input
+    float *emitter_rate;
+    float *fractional_particles;
+    int *emitter_particles_alive;
+    int *emitter_remap;             // scratch of retire_batch_emitters, the new index of every emitter
+
+    int particles_alive;
+    int particles_dead;
+    Closed_Form_Spawn spawn; // of all the emitters, closed form systems only
+    Particle_Streams P;
+    Particle_Bounds bounds; // of all the emitters of the batch
+};
+
+Emitter_Batch new_emitter_batch(Particle_System *PS);
+void free_emitter_batch(Emitter_Batch *B);
+int add_batch_emitter(Emitter_Batch *B, vec3 position);
+void simulate_batch(FXVM_Machine *vm, Emitter_Batch *B, float dt);
+
+/*
+ * Asynchronous simulation: the simulation runs the fixed steps on its own thread and copies the
+ * streams needed for drawing into one of two snapshots. The render thread draws the last completed
+ * snapshot. The handoff is a single atomic slot index: the simulation publishes the snapshot it just
+ * wrote, the renderer takes it by exchanging the slot with -1, which also frees the snapshot it drew
+ * before. The simulation never waits while simulating, only before writing a snapshot when the
+ * previous one has not been taken yet, so it runs at most one frame ahead of the renderer.
+ */
+struct Emitter_Snapshot
+{
+    Particle_System *PS;
+    int particles_alive;
+    int cap;
+    int closed_form_cap;
+
+    vec3 *position;
+    vec3 *velocity;
+    float *size;
+    vec4 *color;
+    // Only written for closed form systems, whose position and velocity are the spawn state.
+    vec3 *acceleration;
+    float *life_seconds;
+    float *life_max;
+    Particle_Bounds bounds;
+};
+
+struct Simulation_Snapshot
+{
+    int emitter_num;
+    Emitter_Snapshot *emitters;
+
+    // Statistics of the steps that produced this snapshot, the emit and compact
+    // cycles are the totals of their trace zones over all threads.
+    int sim_steps;
+    uint64_t sim_cycles;
+    uint64_t emit_cycles;
+    uint64_t compact_cycles;
+};
+
+struct Async_Simulation
+{
+    Job_System *job_system;
+    Simulate_Job *jobs;
+    int job_num;
+    float sim_dt;
+
+    Simulation_Snapshot snapshots[2];
+    int write_index;    // simulation thread only
+    int front_index;    // render thread only, -1 until the first snapshot is taken
+
+    alignas(JOB_CACHE_LINE) std::atomic<int> published;
+    alignas(JOB_CACHE_LINE) std::atomic<float> time_scale;
+    std::atomic<float> offscreen_delay;
+    std::atomic<int> offscreen_step_divider;
+    std::atomic<bool> running;
+    std::atomic<bool> pause_requested;
+    std::atomic<bool> paused;
+
+    std::thread thread;
+};
+
+void async_simulation_start(Async_Simulation *sim, Job_System *js, Simulate_Job *jobs, int job_num, float sim_dt);
+void async_simulation_stop(Async_Simulation *sim);
+// Blocks until the simulation thread is idle, so that the particle systems can be modified.
+void async_simulation_pause(Async_Simulation *sim);
+void async_simulation_resume(Async_Simulation *sim);
+// Longest sub-step, in steps, of an emitter catching up the time it rested.
+enum { ASYNC_CATCH_UP_STEPS = 2 };
+// Emitters the renderer reports not visible for longer than delay_seconds are simulated only every
+// step_divider steps, with the time of the steps in between, so they keep their time and bounds. The first
+// step after they are visible again catches up the time they rested, in sub-steps of at most
+// ASYNC_CATCH_UP_STEPS steps, so the particles it missed spawn spread over that time rather than at once.
+// step_divider <= 1 turns it off (the default). Emitter e of the snapshots is job e.
+void async_simulation_set_offscreen_policy(Async_Simulation *sim, float delay_seconds, int step_divider);
+void async_simulation_set_visible(Async_Simulation *sim, int emitter, bool visible);
+// The LOD tier of the emitter from the next step on. Tiers with a step divider rest like the emitters
+// off screen, the larger of the two dividers applies.
+void async_simulation_set_lod(Async_Simulation *sim, int emitter, int tier);
+// The rate throttle and particle limit of the action from the next step on, the LOD bias is up to the caller.
+void async_simulation_set_governor_action(Async_Simulation *sim, int emitter, const Particle_Governor_Action *action);
+// Returns the latest completed snapshot, or nullptr if there is none yet. If new_snapshot is given,
+// it is set to whether the snapshot was not returned before. The snapshot stays valid until the next call.
+Simulation_Snapshot* async_simulation_acquire(Async_Simulation *sim, bool *new_snapshot = nullptr);
+
+// cost (if not null) gets the compiler's cost report of the program.
+FXVM_Program compile_particle_expr(Particle_System *PS, const char *source, int source_len, FXVM_Cost *cost = nullptr);
+FXVM_Program compile_particle_expr(Particle_System *PS, const char *source);
+FXVM_Program compile_emitter_expr(Particle_System *PS, const char *source, int source_len, FXVM_Cost *cost = nullptr);
+FXVM_Program compile_emitter_expr(Particle_System *PS, const char *source);
+
+// While prefix is not null, every program dispatch of the simulation is captured to <prefix><n>.fxcap
+// (see fxcapture.h), n counting up from 0. E.g. set it before one step and clear it after. Returns the
+// number of dispatches captured with the previous prefix.
+int sim_capture_dispatches(const char *prefix);
+
+const char* read_file(const char *filename, int *len);
+// Programs estimated to cost more cycles per instance than this are reported by load_particle_system.
+extern float sim_program_cycles_warning;
+// Returns an empty particle system and prints the error, if the file can not be read or parsed.
+Particle_System load_particle_system(const char *filename);
+
+#ifdef PARTICLE_SIM_IMPL
+
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+const char *sim_stage_names[SIM_STAGE_NUM] = {
+    "emit",
+    "compact",
+    "rate_p",
+    "initial_life_p",
+    "initial_position_p",
+    "initial_velocity_p",
+    "acceleration_p",
+    "integrate",
+    "size_p",
+    "color_p",
+};
+
+// A trace zone that also adds its cycles to the stage of the particle system.
+struct Sim_Stage_Scope
+{
+    Particle_System_Stats *stats;
+    int stage;
+    Trace_Scope scope;
+
+    Sim_Stage_Scope(Particle_System_Stats *stats, int stage, int zone) : stats(stats), stage(stage), scope(zone) { }
+    ~Sim_Stage_Scope()
+    {
+        uint64_t begin = scope.begin;
+        uint64_t end = scope.finish();
+        if (stats) stats->stage_cycles[stage].fetch_add(end - begin, std::memory_order_relaxed);
+    }
+};
+
+#define SIM_STAGE_ZONE(PS, stage)\
+    static const int TRACE_CONCAT(sim_stage_zone_, __LINE__) = trace_zone_id(sim_stage_names[stage]);\
+    Sim_Stage_Scope TRACE_CONCAT(sim_stage_scope_, __LINE__)((PS)->stats, stage, TRACE_CONCAT(sim_stage_zone_, __LINE__))
+
+void free_particle_system(Particle_System *ps)
+{
+    fxvm_program_free(&ps->emitter.rate_p);
+    fxvm_program_free(&ps->emitter.initial_life_p);
+    fxvm_program_free(&ps->emitter.initial_position_p);
+    fxvm_program_free(&ps->emitter.initial_velocity_p);
+    fxvm_program_free(&ps->emitter.drag_p);
+
+    fxvm_program_free(&ps->acceleration_p);
+    fxvm_program_free(&ps->color_p);
+    fxvm_program_free(&ps->size_p);
+
+    fxvm_program_free(&ps->lod_acceleration_p);
+    fxvm_program_free(&ps->lod_size_p);
+    fxvm_program_free(&ps->lod_color_p);
+
+    fxvm_program_free(&ps->instanced.rate_p);
+    fxvm_program_free(&ps->instanced.initial_life_p);
+    fxvm_program_free(&ps->instanced.initial_position_p);
+    fxvm_program_free(&ps->instanced.initial_velocity_p);
+    fxvm_program_free(&ps->instanced.acceleration_p);
+    fxvm_program_free(&ps->instanced.color_p);
+    fxvm_program_free(&ps->instanced.size_p);
+
+    delete ps->stats;
+    *ps = { };
+}
+
+Emitter_Instance new_emitter(Particle_System *PS, vec3 position)
+{
+    Emitter_Instance result = { };
+    result.position = position;
+    result.bounds = point_particle_bounds(position + PS->emitter.initial_position);
+    return result;
+}
+
+Particle_Bounds point_particle_bounds(vec3 p)
+{
+    return Particle_Bounds{ p, p, 0.0f, 0.0f };
+}
+
+void merge_particle_bounds(Particle_Bounds *a, const Particle_Bounds *b)
+{
+    a->min = vmin(a->min, b->min);
+    a->max = vmax(a->max, b->max);
+    a->max_size = fmaxf(a->max_size, b->max_size);
+    a->max_speed = fmaxf(a->max_speed, b->max_speed);
+}
+
+float get_emitter_life(Emitter_Parameters *EP, Emitter_Instance *E)
+{
+    float max_life = ((EP->life >= 0.001f) ? EP->life : 1.0f);
+    float life10 = E->life / max_life;
+    return clamp01(life10);
+}
+
+Particle_Governor new_particle_governor(float budget_us)
+{
+    Particle_Governor result = { };
+    result.budget_us = budget_us;
+    result.recover_fraction = 0.8f;
+    result.escalate_frames = 3;
+    result.recover_frames = 60;
+    return result;
+}
+
+void particle_governor_update(Particle_Governor *G, float frame_us)
+{
+    if (frame_us > G->budget_us)
+    {
+        G->frames_under = 0;
+        G->frames_over++;
+        if ((G->frames_over >= G->escalate_frames || frame_us > 2.0f * G->budget_us) && G->level < PARTICLE_GOVERNOR_MAX_LEVEL)
+        {
+            G->level++;
+            G->frames_over = 0;
+        }
+    }
+    else if (frame_us < G->recover_fraction * G->budget_us)
+    {
+        G->frames_over = 0;
+        G->frames_under++;
+        if (G->frames_under >= G->recover_frames && G->level > 0)
+        {
+            G->level--;
+            G->frames_under = 0;
+        }
+    }
+    else
+    {
+        G->frames_over = 0;
+        G->frames_under = 0;
+    }
+}
+
+Particle_Governor_Action particle_governor_action(const Particle_Governor *G, const Particle_System *PS)
+{
+    static const float rate_throttle[4] = { 0.0f, 0.25f, 0.5f, 0.75f };
+    static const int particle_limit[4] = { 0, 500, 250, 100 };
+
+    Particle_Governor_Action result = { };
+    int level = G->level - PS->priority;
+    if (level <= 0) return result;
+    result.rate_throttle = rate_throttle[(level < 3) ? level : 3];
+    result.lod_bias = (level > 5) ? 2 : (level > 3) ? level - 3 : 0;
+    result.particle_limit = (level > 5) ? particle_limit[level - 5] : 0;
+    return result;
+}
+
+int particle_lod_tier(const Particle_System *PS, const Particle_Bounds *bounds, vec3 eye)
+{
+    if (PS->lod_tier_num <= 1) return 0;
+    vec3 nearest = vmin(vmax(eye, bounds->min), bounds->max);
+    vec3 d = nearest - eye;
+    float distance2 = dot(d, d);
+    for (int tier = PS->lod_tier_num - 1; tier > 0; tier--)
+    {
+        if (distance2 >= PS->lod[tier].distance * PS->lod[tier].distance) return tier;
+    }
+    return 0;
+}
+
+static std::atomic<const char*> sim_capture_prefix;
+static std::atomic<int> sim_capture_num;
+
+int sim_capture_dispatches(const char *prefix)
+{
+    sim_capture_prefix = prefix;
+    return sim_capture_num.exchange(0);
+}
+
+static void sim_capture_dispatch(FXVM_Machine *vm, FXVM_Program *program, int first, int count, int width)
+{
+    const char *prefix = sim_capture_prefix.load(std::memory_order_relaxed);
+    if (!prefix) return;
+
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s%d.fxcap", prefix, sim_capture_num.fetch_add(1));
+    FXVM_Capture capture;
+    fxvm_capture(&capture, vm, program, first, count, width);
+    fxvm_capture_write(&capture, filename);
+    fxvm_capture_free(&capture);
+}
+
+float eval_f1(FXVM_Machine *vm, int instance_index, FXVM_Program *program)
+{
+    sim_capture_dispatch(vm, program, instance_index, 1, 1);
+    FXVM_State state = { };
+    exec(vm, state, instance_index, program);
+    return state.r[0].v[0];
+}
+
+vec3 eval_f3(FXVM_Machine *vm, int instance_index, FXVM_Program *program)
+{
+    sim_capture_dispatch(vm, program, instance_index, 1, 3);
+    FXVM_State state = { };
+    exec(vm, state, instance_index, program);
+    auto r = state.r[0];
+    return vec3{r.v[0], r.v[1], r.v[2]};
+}
+
+template <int MAX_GROUP>
+void eval_f1(FXVM_Machine *vm, float *dest, int instance_index, int instance_count, FXVM_Program *program)
+{
+    FXVM_State state[MAX_GROUP] = { };
+    exec(vm, state, instance_index, instance_count, program);
+    for (int i = 0; i < instance_count; i++)
+    {
+        auto r = state[i].r[0];
+        dest[i] = r.v[0];
+    }
+}
+
+template <int MAX_GROUP>
+void eval_f3(FXVM_Machine *vm, vec3 *dest, int instance_index, int instance_count, FXVM_Program *program)
+{
+    FXVM_State state[MAX_GROUP] = { };
+    exec(vm, state, instance_index, instance_count, program);
+    for (int i = 0; i < instance_count; i++)
+    {
+        auto r = state[i].r[0];
+        dest[i] = vec3{r.v[0], r.v[1], r.v[2]};
+    }
+}
+
+template <int MAX_GROUP>
+void eval_f4(FXVM_Machine *vm, vec4 *dest, int instance_index, int instance_count, FXVM_Program *program)
+{
+    FXVM_State state[MAX_GROUP] = { };
+    exec(vm, state, instance_index, instance_count, program);
+    for (int i = 0; i < instance_count; i++)
+    {
+        auto r = state[i].r[0];
+        dest[i] = vec4{r.v[0], r.v[1], r.v[2], r.v[3]};
+    }
+}
+
+// Evaluates the program for instances [first, first + count) in groups of MAX_GROUP,
+// writing the results to dest[first..first + count).
+template <int MAX_GROUP>
+void eval_f1_range(FXVM_Machine *vm, float *dest, int first, int count, FXVM_Program *program)
+{
+    sim_capture_dispatch(vm, program, first, count, 1);
+    int end = first + count;
+    int i = first;
+    for (; i + MAX_GROUP <= end; i += MAX_GROUP)
+    {
+        eval_f1<MAX_GROUP>(vm, &dest[i], i, MAX_GROUP, program);
+    }
+    if (i < end)
+    {
+        eval_f1<MAX_GROUP>(vm, &dest[i], i, end - i, program);
+    }
+}
+
+template <int MAX_GROUP>
+void eval_f3_range(FXVM_Machine *vm, vec3 *dest, int first, int count, FXVM_Program *program)
+{
+    sim_capture_dispatch(vm, program, first, count, 3);
+    int end = first + count;
+    int i = first;
+    for (; i + MAX_GROUP <= end; i += MAX_GROUP)
+    {
+        eval_f3<MAX_GROUP>(vm, &dest[i], i, MAX_GROUP, program);
+    }
+    if (i < end)
+    {
+        eval_f3<MAX_GROUP>(vm, &dest[i], i, end - i, program);
+    }
+}
+
+template <int MAX_GROUP>
+void eval_f4_range(FXVM_Machine *vm, vec4 *dest, int first, int count, FXVM_Program *program)
+{
+    sim_capture_dispatch(vm, program, first, count, 4);
+    int end = first + count;
+    int i = first;
+    for (; i + MAX_GROUP <= end; i += MAX_GROUP)
+    {
+        eval_f4<MAX_GROUP>(vm, &dest[i], i, MAX_GROUP, program);
+    }
+    if (i < end)
+    {
+        eval_f4<MAX_GROUP>(vm, &dest[i], i, end - i, program);
+    }
+}
+
+void compact(Emitter_Instance *E)
+{
+    if (E->particles_dead == 0) return;
+    E->particles_dead = 0;
+
+    Particles *P = &E->P;
+
+    int j = 0;
+    for (int i = 0; i < E->particles_alive; )
+    {
+        while ((i < E->particles_alive) && (P->life_seconds[i] <= 0.01f))
+        {
+            i++;
+        }
+        if ((i < E->particles_alive) &&
+            (P->life_seconds[i] > 0.01f))
+        {
+            P->life_seconds[j] = P->life_seconds[i];
+            P->life_max[j] = P->life_max[i];
+            P->life_01[j] = P->life_01[i];
+            P->position[j] = P->position[i];
+            P->velocity[j] = P->velocity[i];
+            P->acceleration[j] = P->acceleration[i];
+            P->size[j] = P->size[i];
+            P->color[j] = P->color[i];
+            P->random[j] = P->random[i];
+            i++, j++;
+        }
+    }
+    E->particles_alive = j;
+}
+
+struct Particle_Update_Programs
+{
+    FXVM_Program acceleration_p;
+    FXVM_Program size_p;
+    FXVM_Program color_p;
+};
+
+static void bind_particle_attributes(FXVM_AttributeBindings *bindings, Particle_System *PS, Particles *P)
+{
+    *bindings = { };
+    bind_attribute(bindings, PS->attrib_life, FXTYP_F1, sizeof(float), P->life_01);
+    bind_attribute(bindings, PS->attrib_position, FXTYP_F3, sizeof(vec3), P->position);
+    bind_attribute(bindings, PS->attrib_velocity, FXTYP_F3, sizeof(vec3), P->velocity);
+    bind_attribute(bindings, PS->attrib_acceleration, FXTYP_F3, sizeof(vec3), P->acceleration);
+    bind_attribute(bindings, PS->attrib_particle_random, FXTYP_F4, sizeof(vec4), P->random);
+}
+
+// Copies of the update programs of the LOD tier of E, with the uniforms of E.
+static Particle_Update_Programs emitter_update_programs(Particle_System *PS, Emitter_Instance *E)
+{
+    float emitter_life = get_emitter_life(&PS->emitter, E);
+
+    Particle_Update_Programs programs = { PS->acceleration_p, PS->size_p, PS->color_p };
+    if (E->lod > 0 && E->lod >= PS->lod_program_tier && E->lod < PS->lod_tier_num)
+    {
+        if (PS->lod_acceleration_p.bytecode.code) programs.acceleration_p = PS->lod_acceleration_p;
+        if (PS->lod_size_p.bytecode.code) programs.size_p = PS->lod_size_p;
+        if (PS->lod_color_p.bytecode.code) programs.color_p = PS->lod_color_p;
+    }
+    set_uniform_f1(&programs.acceleration_p, PS->emitter_life_i, &emitter_life);
+    set_uniform_f1(&programs.size_p, PS->emitter_life_i, &emitter_life);
+    set_uniform_f1(&programs.color_p, PS->emitter_life_i, &emitter_life);
+    return programs;
+}
+
+static const Closed_Form_Spawn::Generation closed_form_spawn_empty = {
+    vec3{FLT_MAX, FLT_MAX, FLT_MAX}, vec3{-FLT_MAX, -FLT_MAX, -FLT_MAX}, 0.0f, 0.0f, -FLT_MAX
+};
+
+// Advances the clock of S by a step, before its emission. Drops the previous generation once it is dead,
+// the times start over from the new generation.
+static void step_closed_form_spawn(Closed_Form_Spawn *S, float dt)
+{
+    S->time += dt;
+    if (S->time < S->previous.end) return;
+    S->previous = S->current;
+    S->previous.end -= S->time;
+    S->current = closed_form_spawn_empty;
+    S->time = 0.0f;
+}
+
+// Adds the particles spawned in [first, end) to the current generation of S, starting over when they are
+// the only ones.
+template <class PARTICLES>
+static void grow_closed_form_spawn(Closed_Form_Spawn *S, PARTICLES *P, int first, int end)
+{
+    if (first == 0) *S = Closed_Form_Spawn{ closed_form_spawn_empty, closed_form_spawn_empty, 0.0f };
+    Closed_Form_Spawn::Generation *G = &S->current;
+    for (int i = first; i < end; i++)
+    {
+        G->min = vmin(G->min, P->position[i]);
+        G->max = vmax(G->max, P->position[i]);
+        G->max_speed2 = fmaxf(G->max_speed2, dot(P->velocity[i], P->velocity[i]));
+        G->max_acceleration2 = fmaxf(G->max_acceleration2, dot(P->acceleration[i], P->acceleration[i]));
+        G->end = fmaxf(G->end, S->time + P->life_max[i]);
+    }
+}
+
+// The step of the steps the k-th of n particles spawned over them spawns in, the first ones in the first step.
+static inline int spawn_step(int k, int n, int steps)
+{
+    return (int)((int64_t)k * steps / n);
+}
+
+// emit() of steps steps of dt at once, with the rate of the middle step. With spawn_life (indexed like the
+// particles) the spawn programs see the emitter_life of the step each particle spawns in, through their
+// instanced variants.
+static void emit_steps(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt, int steps, float *spawn_life)
+{
+    SIM_STAGE_ZONE(PS, SIM_STAGE_EMIT);
+    Particles *P = &E->P;
+
+    // Spawn programs only read emitter_life when spread over steps, but exec expects the bindings to be valid.
+    FXVM_AttributeBindings spawn_bindings = { };
+    vm->bindings = &spawn_bindings;
+
+    // Uniforms are set on copies of the programs, so that emitters sharing the
+    // particle system can be simulated concurrently.
+    FXVM_Program rate_p = PS->emitter.rate_p;
+    FXVM_Program initial_position_p = PS->emitter.initial_position_p;
+    FXVM_Program initial_velocity_p = PS->emitter.initial_velocity_p;
+    FXVM_Program initial_life_p = PS->emitter.initial_life_p;
+
+    float max_life = (PS->emitter.life >= 0.001f) ? PS->emitter.life : 1.0f;
+    float emitter_life = clamp01((E->life + dt * (float)(steps - 1) * 0.5f) / max_life);
+    set_uniform_f1(&rate_p, PS->emitter.life_i, &emitter_life);
+
+    float rate = PS->emitter.rate;
+    if (rate_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_RATE_P);
+        rate = eval_f1(vm, 0, &rate_p);
+    }
+    if (E->lod > 0 && E->lod < PS->lod_tier_num) rate *= PS->lod[E->lod].rate_scale;
+    rate *= 1.0f - E->rate_throttle;
+
+    float num = rate * dt * (float)steps;
+    float to_emit = num + E->fractional_particles;
+    num = trunc(to_emit);
+    E->fractional_particles = to_emit - num;
+    int num_to_emit = (int)num;
+
+    //printf("num to emit %d, fractional_particles %f\n", num_to_emit, E->fractional_particles);
+    set_uniform_f1(&initial_position_p, PS->emitter.life_i, &emitter_life);
+    set_uniform_f1(&initial_velocity_p, PS->emitter.life_i, &emitter_life);
+    set_uniform_f1(&initial_life_p, PS->emitter.life_i, &emitter_life);
+
+    // Allocate the new slot range first, then fill each stream for the whole range.
+    int first = E->particles_alive;
+    int max_particles = (E->particle_limit > 0 && E->particle_limit < Particles::MAX) ? E->particle_limit : Particles::MAX;
+    if (num_to_emit > max_particles - first) num_to_emit = max_particles - first;
+    if (num_to_emit <= 0) return;
+
+    int end = first + num_to_emit;
+
+    if (steps > 1 && spawn_life)
+    {
+        for (int i = first; i < end; i++)
+        {
+            spawn_life[i] = clamp01((E->life + dt * (float)spawn_step(i - first, num_to_emit, steps)) / max_life);
+        }
+        bind_attribute(&spawn_bindings, PS->instanced.emitter_attrib_life, FXTYP_F1, sizeof(float), spawn_life);
+        if (PS->instanced.initial_position_p.bytecode.code) initial_position_p = PS->instanced.initial_position_p;
+        if (PS->instanced.initial_velocity_p.bytecode.code) initial_velocity_p = PS->instanced.initial_velocity_p;
+        if (PS->instanced.initial_life_p.bytecode.code) initial_life_p = PS->instanced.initial_life_p;
+    }
+
+    if (initial_position_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_INITIAL_POSITION_P);
+        eval_f3_range<16>(vm, P->position, first, num_to_emit, &initial_position_p);
+    }
+    else
+    {
+        for (int i = first; i < end; i++) P->position[i] = vec3{0.0f, 0.0f, 0.0f};
+    }
+    vec3 position_offset = E->position + PS->emitter.initial_position;
+    for (int i = first; i < end; i++)
+    {
+        P->position[i] = P->position[i] + position_offset;
+    }
+
+    if (initial_velocity_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_INITIAL_VELOCITY_P);
+        eval_f3_range<16>(vm, P->velocity, first, num_to_emit, &initial_velocity_p);
+    }
+    else
+    {
+        for (int i = first; i < end; i++) P->velocity[i] = PS->emitter.initial_velocity;
+    }
+
+    if (initial_life_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_INITIAL_LIFE_P);
+        eval_f1_range<16>(vm, P->life_seconds, first, num_to_emit, &initial_life_p);
+    }
+    else
+    {
+        for (int i = first; i < end; i++) P->life_seconds[i] = PS->emitter.initial_life;
+    }
+
+    for (int i = first; i < end; i++)
+    {
+        P->acceleration[i] = PS->emitter.acceleration;
+        P->life_max[i] = P->life_seconds[i];
+        P->life_01[i] = 0.0f;
+        P->size[i] = PS->size;
+        P->color[i] = PS->color;
+        P->random[i] = vec4{random01_float(&vm->rng), random01_float(&vm->rng), random01_float(&vm->rng), random01_float(&vm->rng)};
+    }
+
+    // Closed form particles keep the acceleration they spawn with.
+    Particle_Update_Programs programs = { };
+    if (PS->closed_form) programs = emitter_update_programs(PS, E);
+    if (programs.acceleration_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_ACCELERATION_P);
+        FXVM_AttributeBindings attr_bindings;
+        bind_particle_attributes(&attr_bindings, PS, P);
+        vm->bindings = &attr_bindings;
+        eval_f3_range<16>(vm, P->acceleration, first, num_to_emit, &programs.acceleration_p);
+    }
+    if (PS->closed_form) grow_closed_form_spawn(&E->spawn, P, first, end);
+    E->particles_alive = end;
+}
+
+void emit(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt)
+{
+    emit_steps(vm, PS, E, dt, 1, nullptr);
+}
+
+// Kills the count particles closest to the end of their life, picked with a histogram of life_01.
+static void evict_oldest_particles(Emitter_Instance *E, int count)
+{
+    enum { BUCKETS = 64 };
+    Particles *P = &E->P;
+    int histogram[BUCKETS] = { };
+    for (int i = 0; i < E->particles_alive; i++) histogram[(int)(P->life_01[i] * (BUCKETS - 1))]++;
+
+    // All of the buckets above the threshold go, and the first ones found in it.
+    int threshold = BUCKETS - 1;
+    int above = 0;
+    while (threshold > 0 && above + histogram[threshold] < count) above += histogram[threshold--];
+    int in_threshold = count - above;
+
+    for (int i = 0; i < E->particles_alive; i++)
+    {
+        int bucket = (int)(P->life_01[i] * (BUCKETS - 1));
+        if (bucket < threshold || (bucket == threshold && in_threshold-- <= 0)) continue;
+        P->life_seconds[i] = 0.0f;
+        E->particles_dead++;
+    }
+}
+
+// Compacts dead particles, emits new ones and advances the emitter life cycle.
+void simulate_emitter(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt)
+{
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_COMPACT);
+        compact(E);
+        if (E->particle_limit > 0 && E->particles_alive > E->particle_limit)
+        {
+            evict_oldest_particles(E, E->particles_alive - E->particle_limit);
+            compact(E);
+        }
+    }
+
+    //E->particles_alive = 0;
+    if (PS->closed_form) step_closed_form_spawn(&E->spawn, dt);
+    if (E->life >= 0.0f && E->life < PS->emitter.life)
+    {
+        emit(vm, PS, E, dt);
+    }
+    E->life += dt;
+    if (E->life >= PS->emitter.life && E->particles_alive == 0)
+    {
+        if (PS->emitter.loop) E->life = 0.0f - PS->emitter.cooldown;
+    }
+}
+
+// Number of particles run through all the update stages at a time. The streams of one tile
+// (~100 bytes per particle) stay in L1 from the acceleration program to the color program.
+enum { SIMULATE_TILE_SIZE = 256 };
+
+// Runs the update pipeline (acceleration program, integration, size and color programs) one tile
+// at a time over particles [first, first + count). The attributes must already be bound to vm.
+// Returns the number of particles in the range that are dead after the update, bounds gets their
+// bounds (min > max if count is 0). Closed form particles are only aged, and bounded from spawn, which
+// closed form systems must pass.
+template <class PARTICLES>
+int update_particles(FXVM_Machine *vm, Particle_System *PS, PARTICLES *P, Particle_Update_Programs *programs, float dt, int first, int count,
+        Particle_Bounds *bounds, const Closed_Form_Spawn *spawn = nullptr)
+{
+    float drag = PS->emitter.drag;
+    bool closed_form = PS->closed_form;
+    float oldest = 0.0f;
+    bool has_acceleration_p = (programs->acceleration_p.bytecode.code != nullptr) && !closed_form;
+    if (PS->stats) PS->stats->particle_updates.fetch_add(count, std::memory_order_relaxed);
+
+    vec3 lo = vec3{FLT_MAX, FLT_MAX, FLT_MAX};
+    vec3 hi = vec3{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    float max_speed2 = 0.0f;
+    float max_size = 0.0f;
+
+    int dead = 0;
+    int end = first + count;
+    for (int tile = first; tile < end; tile += SIMULATE_TILE_SIZE)
+    {
+        int tile_end = (tile + SIMULATE_TILE_SIZE < end) ? tile + SIMULATE_TILE_SIZE : end;
+        int tile_count = tile_end - tile;
+
+        if (has_acceleration_p)
+        {
+            SIM_STAGE_ZONE(PS, SIM_STAGE_ACCELERATION_P);
+            eval_f3_range<16>(vm, P->acceleration, tile, tile_count, &programs->acceleration_p);
+        }
+
+        {
+            SIM_STAGE_ZONE(PS, SIM_STAGE_INTEGRATE);
+            for (int i = tile; i < tile_end; i++)
+            {
+                float life_seconds = P->life_seconds[i] - dt;
+                if (life_seconds < 0.0f) life_seconds = 0.0f;
+                dead += (life_seconds <= 0.01f);
+
+                P->life_seconds[i] = life_seconds;
+                P->life_01[i] = clamp01(1.0f - life_seconds * (1.0f / P->life_max[i]));
+
+                if (closed_form)
+                {
+                    oldest = fmaxf(oldest, P->life_max[i] - life_seconds);
+                    continue;
+                }
+
+                vec3 acceleration = PS->emitter.acceleration;
+                if (has_acceleration_p) acceleration = P->acceleration[i];
+
+                vec3 vel = P->velocity[i];
+                float v2 = -sqrtf(dot(vel, vel));
+                vec3 Fd = normalize(vel) * v2 * drag;   // drag force
+                vec3 ad = Fd;                           // drag acceleration F = ma => a = F/m; m = 1.0f => ad = Fd
+                acceleration = acceleration + ad;
+
+                vec3 velocity = vel + acceleration * dt;
+                vec3 position = P->position[i] + velocity * dt;
+
+                P->acceleration[i] = acceleration;
+                P->velocity[i] = velocity;
+                P->position[i] = position;
+
+                lo = vmin(lo, position);
+                hi = vmax(hi, position);
+                max_speed2 = fmaxf(max_speed2, dot(velocity, velocity));
+            }
+        }
+
+        if (programs->size_p.bytecode.code)
+        {
+            SIM_STAGE_ZONE(PS, SIM_STAGE_SIZE_P);
+            eval_f1_range<16>(vm, P->size, tile, tile_count, &programs->size_p);
+        }
+        for (int i = tile; i < tile_end; i++) max_size = fmaxf(max_size, P->size[i]);
+        if (programs->color_p.bytecode.code)
+        {
+            SIM_STAGE_ZONE(PS, SIM_STAGE_COLOR_P);
+            eval_f4_range<16>(vm, P->color, tile, tile_count, &programs->color_p);
+        }
+    }
+    if (closed_form && count > 0)
+    {
+        // The spawn box grown by the furthest any particle can have moved. The drag limits the time the
+        // initial velocity carries it, and adds to the acceleration, to 1 / drag:
+        // |v0| min(t, 1 / drag) + |a| t min(t / 2, 1 / drag), which grows with t.
+        const Closed_Form_Spawn::Generation *a = &spawn->current;
+        const Closed_Form_Spawn::Generation *b = &spawn->previous;
+        float drag_time = (drag > 0.0f) ? 1.0f / drag : FLT_MAX;
+        float carry = fminf(oldest, drag_time);
+        float speed = sqrtf(fmaxf(a->max_speed2, b->max_speed2));
+        float accel = sqrtf(fmaxf(a->max_acceleration2, b->max_acceleration2));
+        float reach = speed * carry + accel * oldest * fminf(0.5f * oldest, drag_time);
+        lo = vmin(a->min, b->min) - vec3{reach, reach, reach};
+        hi = vmax(a->max, b->max) + vec3{reach, reach, reach};
+        speed += accel * carry;
+        max_speed2 = speed * speed;
+    }
+    *bounds = Particle_Bounds{ lo, hi, max_size, sqrtf(max_speed2) };
+    return dead;
+}
+
+// Runs the per-particle programs and integration for particles [first, first + count).
+// Disjoint ranges of the same emitter can be simulated concurrently with separate machines.
+// Returns the number of particles in the range that died.
+int simulate_particles(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt, int first, int count,
+        Particle_Bounds *bounds)
+{
+    Particles *P = &E->P;
+
+    FXVM_AttributeBindings attr_bindings;
+    bind_particle_attributes(&attr_bindings, PS, P);
+    vm->bindings = &attr_bindings;
+
+    Particle_Update_Programs programs = emitter_update_programs(PS, E);
+
+    Particle_Bounds range_bounds;
+    int dead = update_particles(vm, PS, P, &programs, dt, first, count, &range_bounds, &E->spawn);
+    if (bounds) *bounds = range_bounds;
+    return dead;
+}
+
+// The bounds start at the spawn origin, so that an emitter without particles is where they will appear.
+static Particle_Bounds emitter_origin_bounds(Particle_System *PS, Emitter_Instance *E)
+{
+    return point_particle_bounds(E->position + PS->emitter.initial_position);
+}
+
+void simulate(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt)
+{
+    simulate_emitter(vm, PS, E, dt);
+    Particle_Bounds bounds;
+    E->particles_dead = simulate_particles(vm, PS, E, dt, 0, E->particles_alive, &bounds);
+    E->bounds = emitter_origin_bounds(PS, E);
+    merge_particle_bounds(&E->bounds, &bounds);
+}
+
+// The steps of dt simulate() takes to count from up to to, at least one and at most max_steps. Counted
+// step by step, so that the float sums are the same.
+static int steps_until(float from, float to, float dt, int max_steps)
+{
+    int steps = 1;
+    for (from += dt; from < to && steps < max_steps; from += dt) steps++;
+    return steps;
+}
+
+void prewarm_emitter(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float seconds, float dt, float max_step)
+{
+    TRACE_ZONE("prewarm");
+    Particles *P = &E->P;
+    float drag = PS->emitter.drag;
+    if (dt <= 0.0f) return;
+    int max_steps = (max_step > dt) ? (int)(max_step / dt) : 1;
+
+    FXVM_AttributeBindings attr_bindings;
+    bind_particle_attributes(&attr_bindings, PS, P);
+    float spawn_life[Particles::MAX];
+
+    int remaining = (int)(seconds / dt + 0.5f);
+    while (remaining > 0)
+    {
+        // Sub-steps end on the step the emission starts or stops in.
+        int steps = (remaining < max_steps) ? remaining : max_steps;
+        if (E->life < 0.0f) steps = steps_until(E->life, 0.0f, dt, steps);
+        else if (E->life < PS->emitter.life) steps = steps_until(E->life, PS->emitter.life, dt, steps);
+
+        compact(E);
+        if (E->life >= PS->emitter.life && E->particles_alive > 0)
+        {
+            // Once the emission is over, end the sub-step on the step the last particle dies in so that
+            // looping emitters restart on time.
+            float last = 0.0f;
+            for (int i = 0; i < E->particles_alive; i++) last = fmaxf(last, P->life_seconds[i]);
+            steps = steps_until(-last, -0.01f, dt, steps);
+        }
+        remaining -= steps;
+        float h = dt * (float)steps;
+
+        int existing = E->particles_alive;
+        if (PS->closed_form) step_closed_form_spawn(&E->spawn, h);
+        if (E->life >= 0.0f && E->life < PS->emitter.life) emit_steps(vm, PS, E, dt, steps, spawn_life);
+        int alive = E->particles_alive;
+        int spawned = alive - existing;
+
+        Particle_Update_Programs programs = emitter_update_programs(PS, E);
+        bool has_acceleration_p = (programs.acceleration_p.bytecode.code != nullptr) && !PS->closed_form;
+        if (has_acceleration_p)
+        {
+            vm->bindings = &attr_bindings;
+            eval_f3_range<16>(vm, P->acceleration, 0, alive, &programs.acceleration_p);
+        }
+
+        int dead = 0;
+        for (int i = 0; i < alive; i++)
+        {
+            // The spawned particles age from the step they spawn in, like emit_steps spread them.
+            float t = (i < existing) ? h : h - dt * (float)spawn_step(i - existing, spawned, steps);
+
+            float life_seconds = P->life_seconds[i] - t;
+            if (life_seconds < 0.0f) life_seconds = 0.0f;
+            dead += (life_seconds <= 0.01f);
+            P->life_seconds[i] = life_seconds;
+            P->life_01[i] = clamp01(1.0f - life_seconds * (1.0f / P->life_max[i]));
+
+            if (PS->closed_form) continue;
+            vec3 a = has_acceleration_p ? P->acceleration[i] : PS->emitter.acceleration;
+            particle_closed_form(P->position[i], P->velocity[i], a, drag, t, &P->position[i], &P->velocity[i]);
+            P->acceleration[i] = a - P->velocity[i] * drag;
+        }
+        E->particles_dead = dead;
+
+        // simulate() restarts a loop on the step that finds no particles, one after the step the last
+        // one dies in.
+        for (int k = 0; k < steps; k++) E->life += dt;
+        if (E->life >= PS->emitter.life && E->particles_alive == dead && PS->emitter.loop)
+        {
+            E->life = 0.0f - PS->emitter.cooldown - ((alive > 0) ? dt : 0.0f);
+        }
+    }
+
+    compact(E);
+    Particle_Update_Programs programs = emitter_update_programs(PS, E);
+    vm->bindings = &attr_bindings;
+    if (programs.size_p.bytecode.code) eval_f1_range<16>(vm, P->size, 0, E->particles_alive, &programs.size_p);
+    if (programs.color_p.bytecode.code) eval_f4_range<16>(vm, P->color, 0, E->particles_alive, &programs.color_p);
+
+    E->bounds = emitter_origin_bounds(PS, E);
+    for (int i = 0; i < E->particles_alive; i++)
+    {
+        vec3 p = P->position[i];
+        vec3 v = P->velocity[i];
+        if (PS->closed_form) particle_closed_form(p, v, P->acceleration[i], drag, P->life_max[i] - P->life_seconds[i], &p, &v);
+        Particle_Bounds particle = { p, p, P->size[i], sqrtf(dot(v, v)) };
+        merge_particle_bounds(&E->bounds, &particle);
+    }
+}
+
+void simulate_chunk_job(Job_Worker *worker, Job *job)
+{
+    Simulate_Job *sim = (Simulate_Job*)job->data;
+    Particle_Bounds *bounds = &sim->chunk_bounds[job->first / SIMULATE_CHUNK_SIZE];
+    int dead = simulate_particles(&worker->vm, sim->PS, sim->E, sim->dt, job->first, job->count, bounds);
+    sim->particles_dead.fetch_add(dead, std::memory_order_relaxed);
+}
+
+void simulate_emitter_job(Job_Worker *worker, Job *job)
+{
+    Simulate_Job *sim = (Simulate_Job*)job->data;
+    simulate_emitter(&worker->vm, sim->PS, sim->E, sim->dt);
+
+    // Leave the chunks after the first one for other workers to steal, and run the first one here.
+    int particles_alive = sim->E->particles_alive;
+    for (int first = SIMULATE_CHUNK_SIZE; first < particles_alive; first += SIMULATE_CHUNK_SIZE)
+    {
+        int count = particles_alive - first;
+        if (count > SIMULATE_CHUNK_SIZE) count = SIMULATE_CHUNK_SIZE;
+        job_push(worker, Job{simulate_chunk_job, sim, first, count});
+    }
+    int count = (particles_alive < SIMULATE_CHUNK_SIZE) ? particles_alive : SIMULATE_CHUNK_SIZE;
+    int dead = simulate_particles(&worker->vm, sim->PS, sim->E, sim->dt, 0, count, &sim->chunk_bounds[0]);
+    sim->particles_dead.fetch_add(dead, std::memory_order_relaxed);
+}
+
+// Simulates all the emitters that are not resting on the job system and waits for them to finish.
+void simulate_parallel(Job_System *js, Simulate_Job *jobs, int job_num)
+{
+    for (int i = 0; i < job_num; i++)
+    {
+        if (jobs[i].resting) continue;
+        jobs[i].particles_dead.store(0, std::memory_order_relaxed);
+        job_system_submit(js, Job{simulate_emitter_job, &jobs[i], 0, 0});
+    }
+    job_system_wait(js);
+
+    for (int i = 0; i < job_num; i++)
+    {
+        Simulate_Job *sim = &jobs[i];
+        if (sim->resting) continue;
+        Emitter_Instance *E = sim->E;
+        E->particles_dead = sim->particles_dead.load(std::memory_order_relaxed);
+        E->bounds = emitter_origin_bounds(sim->PS, E);
+        int chunks = (E->particles_alive + SIMULATE_CHUNK_SIZE - 1) / SIMULATE_CHUNK_SIZE;
+        for (int c = 0; c < chunks; c++) merge_particle_bounds(&E->bounds, &sim->chunk_bounds[c]);
+    }
+}
+
+Emitter_Scheduler new_emitter_scheduler(float dt)
+{
+    Emitter_Scheduler result = { };
+    result.dt = dt;
+    for (int &head : result.slot_head) head = -1;
+    return result;
+}
+
+void free_emitter_scheduler(Emitter_Scheduler *S)
+{
+    mem_free(S->PS);
+    mem_free(S->E);
+    mem_free(S->sleeping);
+    mem_free(S->sleep_tick);
+    mem_free(S->wake_tick);
+    mem_free(S->timer_next);
+    mem_free(S->timer_prev);
+    mem_free(S->timer_slot);
+    mem_free(S->awake);
+    *S = { };
+}
+
+int emitter_scheduler_add(Emitter_Scheduler *S, Particle_System *PS, Emitter_Instance *E)
+{
+    if (S->emitter_num + 1 > S->emitter_cap)
+    {
+        int new_cap = (S->emitter_cap > 0) ? S->emitter_cap * 2 : 64;
+        S->PS = (Particle_System**)mem_realloc(MEM_EMITTERS, S->PS, sizeof(Particle_System*) * new_cap);
+        S->E = (Emitter_Instance**)mem_realloc(MEM_EMITTERS, S->E, sizeof(Emitter_Instance*) * new_cap);
+        S->sleeping = (bool*)mem_realloc(MEM_EMITTERS, S->sleeping, sizeof(bool) * new_cap);
+        S->sleep_tick = (uint64_t*)mem_realloc(MEM_EMITTERS, S->sleep_tick, sizeof(uint64_t) * new_cap);
+        S->wake_tick = (uint64_t*)mem_realloc(MEM_EMITTERS, S->wake_tick, sizeof(uint64_t) * new_cap);
+        S->timer_next = (int*)mem_realloc(MEM_EMITTERS, S->timer_next, sizeof(int) * new_cap);
+        S->timer_prev = (int*)mem_realloc(MEM_EMITTERS, S->timer_prev, sizeof(int) * new_cap);
+        S->timer_slot = (int*)mem_realloc(MEM_EMITTERS, S->timer_slot, sizeof(int) * new_cap);
+        S->awake = (int*)mem_realloc(MEM_EMITTERS, S->awake, sizeof(int) * new_cap);
+        S->emitter_cap = new_cap;
+    }
+    int id = S->emitter_num++;
+    S->PS[id] = PS;
+    S->E[id] = E;
+    S->sleeping[id] = false;
+    S->sleep_tick[id] = 0;
+    S->wake_tick[id] = UINT64_MAX;
+    S->timer_slot[id] = -1;
+    S->awake[S->awake_num++] = id;
+    return id;
+}
+
+static void emitter_timer_link(Emitter_Scheduler *S, int id)
+{
+    uint64_t expires = S->wake_tick[id];
+    uint64_t delta = expires - S->tick;
+    const uint64_t wheel_steps = 1ull << (EMITTER_WHEEL_BITS * EMITTER_WHEEL_LEVELS);
+    if (delta >= wheel_steps) expires = S->tick + wheel_steps - 1;
+
+    int level = 0;
+    while (level < EMITTER_WHEEL_LEVELS - 1 && delta >= (1ull << (EMITTER_WHEEL_BITS * (level + 1)))) level++;
+    int slot = level * EMITTER_WHEEL_SLOTS + (int)((expires >> (EMITTER_WHEEL_BITS * level)) & (EMITTER_WHEEL_SLOTS - 1));
+
+    int head = S->slot_head[slot];
+    S->timer_next[id] = head;
+    S->timer_prev[id] = -1;
+    if (head >= 0) S->timer_prev[head] = id;
+    S->slot_head[slot] = id;
+    S->timer_slot[id] = slot;
+}
+
+static void emitter_timer_unlink(Emitter_Scheduler *S, int id)
+{
+    int next = S->timer_next[id];
+    int prev = S->timer_prev[id];
+    if (prev >= 0) S->timer_next[prev] = next;
+    else S->slot_head[S->timer_slot[id]] = next;
+    if (next >= 0) S->timer_prev[next] = prev;
+    S->timer_slot[id] = -1;
+}
+
+static void emitter_scheduler_wake(Emitter_Scheduler *S, int id)
+{
+    // The emitter life advances as if it had been stepped, the steps in between changed nothing else.
+    S->E[id]->life += (float)(S->tick - S->sleep_tick[id]) * S->dt;
+    S->sleeping[id] = false;
+    S->awake[S->awake_num++] = id;
+}
+
+void emitter_scheduler_spawn(Emitter_Scheduler *S, int id)
+{
+    if (S->sleeping[id])
+    {
+        if (S->timer_slot[id] >= 0) emitter_timer_unlink(S, id);
+        emitter_scheduler_wake(S, id);
+    }
+    S->E[id]->life = 0.0f;
+    S->E[id]->fractional_particles = 0.0f;
+}
+
+void emitter_scheduler_begin_step(Emitter_Scheduler *S)
+{
+    int slot = (int)(S->tick & (EMITTER_WHEEL_SLOTS - 1));
+    int id = S->slot_head[slot];
+    S->slot_head[slot] = -1;
+    while (id >= 0)
+    {
+        int next = S->timer_next[id];
+        S->timer_slot[id] = -1;
+        if (S->wake_tick[id] <= S->tick) emitter_scheduler_wake(S, id);
+        else emitter_timer_link(S, id);
+        id = next;
+    }
+}
+
+void emitter_scheduler_end_step(Emitter_Scheduler *S)
+{
+    S->tick++;
+
+    // Every 64^l steps the timers of the next slot of level l move down to the levels below.
+    for (int level = 1; level < EMITTER_WHEEL_LEVELS; level++)
+    {
+        if (S->tick & ((1ull << (EMITTER_WHEEL_BITS * level)) - 1)) break;
+        int slot = level * EMITTER_WHEEL_SLOTS + (int)((S->tick >> (EMITTER_WHEEL_BITS * level)) & (EMITTER_WHEEL_SLOTS - 1));
+        int id = S->slot_head[slot];
+        S->slot_head[slot] = -1;
+        while (id >= 0)
+        {
+            int next = S->timer_next[id];
+            emitter_timer_link(S, id);
+            id = next;
+        }
+    }
+
+    int awake_num = 0;
+    for (int i = 0; i < S->awake_num; i++)
+    {
+        int id = S->awake[i];
+        Particle_System *PS = S->PS[id];
+        Emitter_Instance *E = S->E[id];
+        bool finished = (E->life >= PS->emitter.life) && !PS->emitter.loop;
+        if (E->particles_alive > 0 || !(E->life < 0.0f || finished))
+        {
+            S->awake[awake_num++] = id;
+            continue;
+        }
+
+        S->sleeping[id] = true;
+        S->sleep_tick[id] = S->tick;
+        if (finished)
+        {
+            S->wake_tick[id] = UINT64_MAX;
+            continue;
+        }
+        // The first step that starts with life >= 0 emits.
+        double steps = ceil(-(double)E->life / (double)S->dt);
+        S->wake_tick[id] = S->tick + ((steps > 1.0) ? (uint64_t)steps : 1);
+        emitter_timer_link(S, id);
+    }
+    S->awake_num = awake_num;
+}
+
+void emitter_scheduler_step(Emitter_Scheduler *S, FXVM_Machine *vm)
+{
+    emitter_scheduler_begin_step(S);
+    for (int i = 0; i < S->awake_num; i++)
+    {
+        int id = S->awake[i];
+        simulate(vm, S->PS[id], S->E[id], S->dt);
+    }
+    emitter_scheduler_end_step(S);
+}
+
+void ensure_emitters_fit(Emitter_Batch *B, int emitter_num)
+{
+    if (emitter_num <= B->emitter_cap) return;
+
+    Mem_Effect_Scope scope(B->PS->mem_effect);
+    int new_cap = (B->emitter_cap > 0) ? B->emitter_cap * 2 : 64;
+    while (new_cap < emitter_num) new_cap *= 2;
+    B->emitter_position = (vec3*)mem_realloc(MEM_EMITTERS, B->emitter_position, sizeof(vec3) * new_cap);
+    B->emitter_time = (float*)mem_realloc(MEM_EMITTERS, B->emitter_time, sizeof(float) * new_cap);
+    B->emitter_life = (float*)mem_realloc(MEM_EMITTERS, B->emitter_life, sizeof(float) * new_cap);
+    B->emitter_rate = (float*)mem_realloc(MEM_EMITTERS, B->emitter_rate, sizeof(float) * new_cap);
+    B->fractional_particles = (float*)mem_realloc(MEM_EMITTERS, B->fractional_particles, sizeof(float) * new_cap);
+    B->emitter_particles_alive = (int*)mem_realloc(MEM_EMITTERS, B->emitter_particles_alive, sizeof(int) * new_cap);
+    B->emitter_remap = (int*)mem_realloc(MEM_EMITTERS, B->emitter_remap, sizeof(int) * new_cap);
+    B->emitter_cap = new_cap;
+}
+
+void ensure_particles_fit(Emitter_Batch *B, int particle_num)
+{
+    Particle_Streams *P = &B->P;
+    if (particle_num <= P->cap) return;
+
+    Mem_Effect_Scope scope(B->PS->mem_effect);
+    int new_cap = (P->cap > 0) ? P->cap * 2 : 1024;
+    while (new_cap < particle_num) new_cap *= 2;
+    P->position = (vec3*)mem_realloc(MEM_PARTICLES, P->position, sizeof(vec3) * new_cap);
+    P->velocity = (vec3*)mem_realloc(MEM_PARTICLES, P->velocity, sizeof(vec3) * new_cap);
+    P->acceleration = (vec3*)mem_realloc(MEM_PARTICLES, P->acceleration, sizeof(vec3) * new_cap);
+    P->life_seconds = (float*)mem_realloc(MEM_PARTICLES, P->life_seconds, sizeof(float) * new_cap);
+    P->life_max = (float*)mem_realloc(MEM_PARTICLES, P->life_max, sizeof(float) * new_cap);
+    P->life_01 = (float*)mem_realloc(MEM_PARTICLES, P->life_01, sizeof(float) * new_cap);
+    P->size = (float*)mem_realloc(MEM_PARTICLES, P->size, sizeof(float) * new_cap);
+    P->color = (vec4*)mem_realloc(MEM_PARTICLES, P->color, sizeof(vec4) * new_cap);
+    P->random = (vec4*)mem_realloc(MEM_PARTICLES, P->random, sizeof(vec4) * new_cap);
+    P->emitter_index = (int*)mem_realloc(MEM_PARTICLES, P->emitter_index, sizeof(int) * new_cap);
+    P->emitter_life = (float*)mem_realloc(MEM_PARTICLES, P->emitter_life, sizeof(float) * new_cap);
+    P->cap = new_cap;
+}
+
+Emitter_Batch new_emitter_batch(Particle_System *PS)
+{
+    Emitter_Batch result = { };
+    result.PS = PS;
+    return result;
+}
+
+void free_emitter_batch(Emitter_Batch *B)
+{
+    mem_free(B->emitter_position);
+    mem_free(B->emitter_time);
+    mem_free(B->emitter_life);
+    mem_free(B->emitter_rate);
+    mem_free(B->fractional_particles);
+    mem_free(B->emitter_particles_alive);
+    mem_free(B->emitter_remap);
+
+    Particle_Streams *P = &B->P;
+    mem_free(P->position);
+    mem_free(P->velocity);
+    mem_free(P->acceleration);
+    mem_free(P->life_seconds);
+    mem_free(P->life_max);
+    mem_free(P->life_01);
+    mem_free(P->size);
+    mem_free(P->color);
+    mem_free(P->random);
+    mem_free(P->emitter_index);
+    mem_free(P->emitter_life);
+
+    *B = { };
+}
+
+int add_batch_emitter(Emitter_Batch *B, vec3 position)
+{
+    ensure_emitters_fit(B, B->emitter_num + 1);
+    int i = B->emitter_num;
+    B->emitter_position[i] = position;
+    B->emitter_time[i] = 0.0f;
+    B->emitter_life[i] = 0.0f;
+    B->emitter_rate[i] = 0.0f;
+    B->fractional_particles[i] = 0.0f;
+    B->emitter_particles_alive[i] = 0;
+    B->emitter_num = i + 1;
+    return i;
+}
+
+void compact_batch(Emitter_Batch *B)
+{
+    SIM_STAGE_ZONE(B->PS, SIM_STAGE_COMPACT);
+    if (B->particles_dead == 0) return;
+    B->particles_dead = 0;
+
+    Particle_Streams *P = &B->P;
+
+    int j = 0;
+    for (int i = 0; i < B->particles_alive; i++)
+    {
+        if (P->life_seconds[i] <= 0.01f)
+        {
+            B->emitter_particles_alive[P->emitter_index[i]]--;
+            continue;
+        }
+        if (i != j)
+        {
+            P->life_seconds[j] = P->life_seconds[i];
+            P->life_max[j] = P->life_max[i];
+            P->life_01[j] = P->life_01[i];
+            P->position[j] = P->position[i];
+            P->velocity[j] = P->velocity[i];
+            P->acceleration[j] = P->acceleration[i];
+            P->size[j] = P->size[i];
+            P->color[j] = P->color[i];
+            P->random[j] = P->random[i];
+            P->emitter_index[j] = P->emitter_index[i];
+        }
+        j++;
+    }
+    B->particles_alive = j;
+}
+
+// Removes emitters of non-looping systems, that have finished and have no particles left. The others
+// keep their order, and the particles are renumbered in one pass.
+void retire_batch_emitters(Emitter_Batch *B)
+{
+    Emitter_Parameters *EP = &B->PS->emitter;
+    if (EP->loop) return;
+
+    int j = 0;
+    for (int e = 0; e < B->emitter_num; e++)
+    {
+        if (B->emitter_time[e] >= EP->life && B->emitter_particles_alive[e] == 0)
+        {
+            B->emitter_remap[e] = -1;
+            continue;
+        }
+        B->emitter_remap[e] = j;
+        if (e != j)
+        {
+            B->emitter_position[j] = B->emitter_position[e];
+            B->emitter_time[j] = B->emitter_time[e];
+            B->emitter_life[j] = B->emitter_life[e];
+            B->emitter_rate[j] = B->emitter_rate[e];
+            B->fractional_particles[j] = B->fractional_particles[e];
+            B->emitter_particles_alive[j] = B->emitter_particles_alive[e];
+        }
+        j++;
+    }
+    if (j == B->emitter_num) return;
+    B->emitter_num = j;
+
+    // Retired emitters have no particles, so every particle has a new index.
+    Particle_Streams *P = &B->P;
+    for (int i = 0; i < B->particles_alive; i++) P->emitter_index[i] = B->emitter_remap[P->emitter_index[i]];
+}
+
+static void bind_batch_attributes(FXVM_AttributeBindings *bindings, Particle_System *PS, Particle_Streams *P)
+{
+    *bindings = { };
+    bind_attribute(bindings, PS->attrib_life, FXTYP_F1, sizeof(float), P->life_01);
+    bind_attribute(bindings, PS->attrib_position, FXTYP_F3, sizeof(vec3), P->position);
+    bind_attribute(bindings, PS->attrib_velocity, FXTYP_F3, sizeof(vec3), P->velocity);
+    bind_attribute(bindings, PS->attrib_acceleration, FXTYP_F3, sizeof(vec3), P->acceleration);
+    bind_attribute(bindings, PS->attrib_particle_random, FXTYP_F4, sizeof(vec4), P->random);
+    bind_attribute(bindings, PS->instanced.attrib_emitter_life, FXTYP_F1, sizeof(float), P->emitter_life);
+}
+
+void emit_batch(FXVM_Machine *vm, Emitter_Batch *B, float dt)
+{
+    SIM_STAGE_ZONE(B->PS, SIM_STAGE_EMIT);
+    Particle_System *PS = B->PS;
+    Emitter_Parameters *EP = &PS->emitter;
+    Particle_Streams *P = &B->P;
+
+    for (int e = 0; e < B->emitter_num; e++)
+    {
+        float max_life = ((EP->life >= 0.001f) ? EP->life : 1.0f);
+        B->emitter_life[e] = clamp01(B->emitter_time[e] / max_life);
+    }
+
+    // The rate program runs once per emitter, with the emitters as the instances.
+    FXVM_AttributeBindings emitter_bindings = { };
+    bind_attribute(&emitter_bindings, PS->instanced.emitter_attrib_life, FXTYP_F1, sizeof(float), B->emitter_life);
+    vm->bindings = &emitter_bindings;
+
+    FXVM_Program rate_p = PS->instanced.rate_p;
+    if (rate_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_RATE_P);
+        eval_f1_range<16>(vm, B->emitter_rate, 0, B->emitter_num, &rate_p);
+    }
+    else
+    {
+        for (int e = 0; e < B->emitter_num; e++) B->emitter_rate[e] = EP->rate;
+    }
+
+    // Allocate the new particles of all the emitters, then run the spawn programs over all of them at once.
+    int first = B->particles_alive;
+    int end = first;
+    for (int e = 0; e < B->emitter_num; e++)
+    {
+        float time = B->emitter_time[e];
+        if (time < 0.0f || time >= EP->life) continue;
+
+        float to_emit = B->emitter_rate[e] * dt + B->fractional_particles[e];
+        float num = trunc(to_emit);
+        B->fractional_particles[e] = to_emit - num;
+
+        int num_to_emit = (int)num;
+        int room = Particles::MAX - B->emitter_particles_alive[e];
+        if (num_to_emit > room) num_to_emit = room;
+        if (num_to_emit <= 0) continue;
+
+        ensure_particles_fit(B, end + num_to_emit);
+        float emitter_life = B->emitter_life[e];
+        for (int i = end; i < end + num_to_emit; i++)
+        {
+            P->emitter_index[i] = e;
+            P->emitter_life[i] = emitter_life;
+        }
+        B->emitter_particles_alive[e] += num_to_emit;
+        end += num_to_emit;
+    }
+
+    int num_to_emit = end - first;
+    if (num_to_emit <= 0) return;
+
+    FXVM_AttributeBindings spawn_bindings = { };
+    bind_attribute(&spawn_bindings, PS->instanced.emitter_attrib_life, FXTYP_F1, sizeof(float), P->emitter_life);
+    vm->bindings = &spawn_bindings;
+
+    FXVM_Program initial_position_p = PS->instanced.initial_position_p;
+    FXVM_Program initial_velocity_p = PS->instanced.initial_velocity_p;
+    FXVM_Program initial_life_p = PS->instanced.initial_life_p;
+
+    if (initial_position_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_INITIAL_POSITION_P);
+        eval_f3_range<16>(vm, P->position, first, num_to_emit, &initial_position_p);
+    }
+    else
+    {
+        for (int i = first; i < end; i++) P->position[i] = vec3{0.0f, 0.0f, 0.0f};
+    }
+    for (int i = first; i < end; i++)
+    {
+        P->position[i] = P->position[i] + B->emitter_position[P->emitter_index[i]] + EP->initial_position;
+    }
+
+    if (initial_velocity_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_INITIAL_VELOCITY_P);
+        eval_f3_range<16>(vm, P->velocity, first, num_to_emit, &initial_velocity_p);
+    }
+    else
+    {
+        for (int i = first; i < end; i++) P->velocity[i] = EP->initial_velocity;
+    }
+
+    if (initial_life_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_INITIAL_LIFE_P);
+        eval_f1_range<16>(vm, P->life_seconds, first, num_to_emit, &initial_life_p);
+    }
+    else
+    {
+        for (int i = first; i < end; i++) P->life_seconds[i] = EP->initial_life;
+    }
+
+    for (int i = first; i < end; i++)
+    {
+        P->acceleration[i] = EP->acceleration;
+        P->life_max[i] = P->life_seconds[i];
+        P->life_01[i] = 0.0f;
+        P->size[i] = PS->size;
+        P->color[i] = PS->color;
+        P->random[i] = vec4{random01_float(&vm->rng), random01_float(&vm->rng), random01_float(&vm->rng), random01_float(&vm->rng)};
+    }
+
+    // Closed form particles keep the acceleration they spawn with.
+    FXVM_Program acceleration_p = PS->instanced.acceleration_p;
+    if (PS->closed_form && acceleration_p.bytecode.code)
+    {
+        SIM_STAGE_ZONE(PS, SIM_STAGE_ACCELERATION_P);
+        FXVM_AttributeBindings attr_bindings;
+        bind_batch_attributes(&attr_bindings, PS, P);
+        vm->bindings = &attr_bindings;
+        eval_f3_range<16>(vm, P->acceleration, first, num_to_emit, &acceleration_p);
+    }
+    if (PS->closed_form) grow_closed_form_spawn(&B->spawn, P, first, end);
+    B->particles_alive = end;
+}
+
+// Compacts, emits and advances the life cycle of every emitter in the batch.
+void simulate_batch_emitters(FXVM_Machine *vm, Emitter_Batch *B, float dt)
+{
+    Emitter_Parameters *EP = &B->PS->emitter;
+
+    compact_batch(B);
+    if (B->PS->closed_form) step_closed_form_spawn(&B->spawn, dt);
+    emit_batch(vm, B, dt);
+
+    for (int e = 0; e < B->emitter_num; e++)
+    {
+        float time = B->emitter_time[e] + dt;
+        if (time >= EP->life && B->emitter_particles_alive[e] == 0)
+        {
+            if (EP->loop) time = 0.0f - EP->cooldown;
+        }
+        B->emitter_time[e] = time;
+
+        float max_life = ((EP->life >= 0.001f) ? EP->life : 1.0f);
+        B->emitter_life[e] = clamp01(time / max_life);
+    }
+    retire_batch_emitters(B);
+}
+
+// Runs the per-particle programs and integration for particles [first, first + count) of the batch,
+// each program as one dispatch over the particles of all the emitters. Returns the number of
+// particles in the range that died.
+int simulate_batch_particles(FXVM_Machine *vm, Emitter_Batch *B, float dt, int first, int count, Particle_Bounds *bounds)
+{
+    Particle_System *PS = B->PS;
+    Particle_Streams *P = &B->P;
+    int end = first + count;
+
+    for (int i = first; i < end; i++)
+    {
+        P->emitter_life[i] = B->emitter_life[P->emitter_index[i]];
+    }
+
+    FXVM_AttributeBindings attr_bindings;
+    bind_batch_attributes(&attr_bindings, PS, P);
+    vm->bindings = &attr_bindings;
+
+    Particle_Update_Programs programs = { PS->instanced.acceleration_p, PS->instanced.size_p, PS->instanced.color_p };
+    return update_particles(vm, PS, P, &programs, dt, first, count, bounds, &B->spawn);
+}
+
+void simulate_batch(FXVM_Machine *vm, Emitter_Batch *B, float dt)
+{
+    simulate_batch_emitters(vm, B, dt);
+    Particle_Bounds bounds;
+    B->particles_dead = simulate_batch_particles(vm, B, dt, 0, B->particles_alive, &bounds);
+    vec3 origin = B->PS->emitter.initial_position;
+    B->bounds = point_particle_bounds((B->emitter_num > 0) ? B->emitter_position[0] + origin : origin);
+    for (int e = 1; e < B->emitter_num; e++)
+    {
+        Particle_Bounds emitter_bounds = point_particle_bounds(B->emitter_position[e] + origin);
+        merge_particle_bounds(&B->bounds, &emitter_bounds);
+    }
+    merge_particle_bounds(&B->bounds, &bounds);
+}
+
+void write_emitter_snapshot(Emitter_Snapshot *ES, Particle_System *PS, Emitter_Instance *E)
+{
+    int n = E->particles_alive;
+    if (n > ES->cap)
+    {
+        Mem_Effect_Scope scope(PS->mem_effect);
+        ES->position = (vec3*)mem_realloc(MEM_SNAPSHOTS, ES->position, sizeof(vec3) * n);
+        ES->velocity = (vec3*)mem_realloc(MEM_SNAPSHOTS, ES->velocity, sizeof(vec3) * n);
+        ES->size = (float*)mem_realloc(MEM_SNAPSHOTS, ES->size, sizeof(float) * n);
+        ES->color = (vec4*)mem_realloc(MEM_SNAPSHOTS, ES->color, sizeof(vec4) * n);
+        ES->cap = n;
+    }
+    if (PS->closed_form && n > ES->closed_form_cap)
+    {
+        Mem_Effect_Scope scope(PS->mem_effect);
+        ES->acceleration = (vec3*)mem_realloc(MEM_SNAPSHOTS, ES->acceleration, sizeof(vec3) * n);
+        ES->life_seconds = (float*)mem_realloc(MEM_SNAPSHOTS, ES->life_seconds, sizeof(float) * n);
+        ES->life_max = (float*)mem_realloc(MEM_SNAPSHOTS, ES->life_max, sizeof(float) * n);
+        ES->closed_form_cap = n;
+    }
+    ES->PS = PS;
+    ES->particles_alive = n;
+    memcpy(ES->position, E->P.position, sizeof(vec3) * n);
+    memcpy(ES->velocity, E->P.velocity, sizeof(vec3) * n);
+    memcpy(ES->size, E->P.size, sizeof(float) * n);
+    memcpy(ES->color, E->P.color, sizeof(vec4) * n);
+    if (PS->closed_form)
+    {
+        memcpy(ES->acceleration, E->P.acceleration, sizeof(vec3) * n);
+        memcpy(ES->life_seconds, E->P.life_seconds, sizeof(float) * n);
+        memcpy(ES->life_max, E->P.life_max, sizeof(float) * n);
+    }
+    ES->bounds = E->bounds;
+}
+
+// Decides which emitters rest this step and the time step of the others, see async_simulation_set_offscreen_policy
+// and async_simulation_set_lod. Returns the most sub-steps of any emitter.
+static int async_simulation_schedule(Async_Simulation *sim, float dt)
+{
+    int max_sub_steps = 0;
+    float delay = sim->offscreen_delay.load(std::memory_order_relaxed);
+    int offscreen_divider = sim->offscreen_step_divider.load(std::memory_order_relaxed);
+    for (int i = 0; i < sim->job_num; i++)
+    {
+        Simulate_Job *job = &sim->jobs[i];
+        bool visible = job->visible.load(std::memory_order_relaxed);
+        job->offscreen_seconds = visible ? 0.0f : job->offscreen_seconds + dt;
+
+        // The systems may have been reloaded with fewer tiers since the renderer picked this one.
+        int lod = job->lod.load(std::memory_order_relaxed);
+        if (lod < 0 || lod >= job->PS->lod_tier_num) lod = 0;
+        job->E->lod = lod;
+        job->E->rate_throttle = job->rate_throttle.load(std::memory_order_relaxed);
+        job->E->particle_limit = job->particle_limit.load(std::memory_order_relaxed);
+
+        int divider = (lod > 0) ? job->PS->lod[lod].step_divider : 1;
+        if (job->offscreen_seconds > delay && offscreen_divider > divider) divider = offscreen_divider;
+        bool rest = (divider > 1) && (++job->rest_steps % divider != 0);
+        job->resting = rest;
+        if (rest)
+        {
+            job->banked_dt += dt;
+            job->sub_steps = 0;
+        }
+        else
+        {
+            float catch_up = job->banked_dt + dt;
+            job->sub_steps = (dt > 0.0f) ? (int)ceilf(catch_up / (ASYNC_CATCH_UP_STEPS * dt) - 0.001f) : 1;
+            if (job->sub_steps < 1) job->sub_steps = 1;
+            job->dt = catch_up / job->sub_steps;
+            job->banked_dt = 0.0f;
+            job->rest_steps = 0;
+        }
+        if (job->sub_steps > max_sub_steps) max_sub_steps = job->sub_steps;
+    }
+    return max_sub_steps;
+}
+
+// Returns false if the simulation was asked to pause or stop while waiting.
+static bool async_simulation_wait_for_free_snapshot(Async_Simulation *sim)
+{
+    while (sim->published.load(std::memory_order_acquire) != -1)
+    {
+        if (!sim->running.load() || sim->pause_requested.load()) return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+static void async_simulation_main(Async_Simulation *sim)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    trace_set_thread_name("simulation");
+    const int emit_zone = trace_zone_id("emit");
+    const int compact_zone = trace_zone_id("compact");
+
+    Clock::time_point last_time = Clock::now();
+    float time_accum = 0.0f;
+
+    int sim_steps = 0;
+    uint64_t sim_cycles = 0;
+    uint64_t last_emit_cycles = trace_zone_total_cycles(emit_zone);
+    uint64_t last_compact_cycles = trace_zone_total_cycles(compact_zone);
+
+    while (sim->running.load())
+    {
+        if (sim->pause_requested.load())
+        {
+            // Only async_simulation_resume() clears paused, so a pause right after it never sees the
+            // flag of the pause before.
+            sim->paused.store(true);
+            while (sim->paused.load() && sim->running.load())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            last_time = Clock::now();
+            continue;
+        }
+
+        Clock::time_point now = Clock::now();
+        time_accum += std::chrono::duration<float>(now - last_time).count();
+        last_time = now;
+        if (time_accum > 0.1f) time_accum = 0.1f;
+
+        if (time_accum < sim->sim_dt)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+            continue;
+        }
+
+        float dt = sim->sim_dt * sim->time_scale.load(std::memory_order_relaxed);
+        while (time_accum >= sim->sim_dt)
+        {
+            TRACE_ZONE("simulation step");
+            uint64_t start_cycles = __rdtsc();
+            int sub_steps = async_simulation_schedule(sim, dt);
+            for (int s = 0; s < sub_steps; s++)
+            {
+                // The emitters that catch up take more sub-steps, the others sit the rest out.
+                for (int i = 0; i < sim->job_num && s > 0; i++) sim->jobs[i].resting = (s >= sim->jobs[i].sub_steps);
+                simulate_parallel(sim->job_system, sim->jobs, sim->job_num);
+            }
+            sim_cycles += __rdtsc() - start_cycles;
+            sim_steps++;
+            time_accum -= sim->sim_dt;
+        }
+
+        if (!async_simulation_wait_for_free_snapshot(sim)) continue;
+
+        TRACE_ZONE("write snapshot");
+        Simulation_Snapshot *snapshot = &sim->snapshots[sim->write_index];
+        for (int i = 0; i < sim->job_num; i++)
+        {
+            write_emitter_snapshot(&snapshot->emitters[i], sim->jobs[i].PS, sim->jobs[i].E);
+        }
+        snapshot->sim_steps = sim_steps;
+        snapshot->sim_cycles = sim_cycles;
+        uint64_t emit_cycles = trace_zone_total_cycles(emit_zone);
+        uint64_t compact_cycles = trace_zone_total_cycles(compact_zone);
+        snapshot->emit_cycles = emit_cycles - last_emit_cycles;
+        snapshot->compact_cycles = compact_cycles - last_compact_cycles;
+        last_emit_cycles = emit_cycles;
+        last_compact_cycles = compact_cycles;
+        sim_steps = 0;
+        sim_cycles = 0;
+
+        sim->published.store(sim->write_index, std::memory_order_release);
+        sim->write_index = 1 - sim->write_index;
+    }
+}
+
+void async_simulation_start(Async_Simulation *sim, Job_System *js, Simulate_Job *jobs, int job_num, float sim_dt)
+{
+    sim->job_system = js;
+    sim->jobs = jobs;
+    sim->job_num = job_num;
+    sim->sim_dt = sim_dt;
+
+    for (int i = 0; i < 2; i++)
+    {
+        Simulation_Snapshot *snapshot = &sim->snapshots[i];
+        *snapshot = { };
+        snapshot->emitter_num = job_num;
+        snapshot->emitters = (Emitter_Snapshot*)mem_calloc(MEM_SNAPSHOTS, job_num, sizeof(Emitter_Snapshot));
+    }
+    sim->write_index = 0;
+    sim->front_index = -1;
+
+    sim->published.store(-1);
+    sim->time_scale.store(1.0f);
+    sim->offscreen_delay.store(0.0f);
+    sim->offscreen_step_divider.store(0);
+    for (int i = 0; i < job_num; i++)
+    {
+        jobs[i].resting = false;
+        jobs[i].visible.store(true);
+        jobs[i].lod.store(0);
+        jobs[i].rate_throttle.store(0.0f);
+        jobs[i].particle_limit.store(0);
+        jobs[i].offscreen_seconds = 0.0f;
+        jobs[i].banked_dt = 0.0f;
+        jobs[i].rest_steps = 0;
+        jobs[i].sub_steps = 0;
+    }
+    sim->pause_requested.store(false);
+    sim->paused.store(false);
+    sim->running.store(true);
+    sim->thread = std::thread(async_simulation_main, sim);
+}
+
+void async_simulation_stop(Async_Simulation *sim)
+{
+    sim->running.store(false);
+    sim->thread.join();
+
+    for (int i = 0; i < 2; i++)
+    {
+        Simulation_Snapshot *snapshot = &sim->snapshots[i];
+        for (int e = 0; e < snapshot->emitter_num; e++)
+        {
+            Emitter_Snapshot *ES = &snapshot->emitters[e];
+            mem_free(ES->position);
+            mem_free(ES->velocity);
+            mem_free(ES->size);
+            mem_free(ES->color);
+            mem_free(ES->acceleration);
+            mem_free(ES->life_seconds);
+            mem_free(ES->life_max);
+        }
+        mem_free(snapshot->emitters);
+        *snapshot = { };
+    }
+}
+
+void async_simulation_pause(Async_Simulation *sim)
+{
+    sim->pause_requested.store(true);
+    while (!sim->paused.load())
+    {
+        std::this_thread::yield();
+    }
+}
+
+void async_simulation_resume(Async_Simulation *sim)
+{
+    sim->pause_requested.store(false);
+    sim->paused.store(false);
+}
+
+void async_simulation_set_offscreen_policy(Async_Simulation *sim, float delay_seconds, int step_divider)
+{
+    sim->offscreen_delay.store(delay_seconds, std::memory_order_relaxed);
+    sim->offscreen_step_divider.store(step_divider, std::memory_order_relaxed);
+}
+
+void async_simulation_set_visible(Async_Simulation *sim, int emitter, bool visible)
+{
+    if (emitter >= 0 && emitter < sim->job_num) sim->jobs[emitter].visible.store(visible, std::memory_order_relaxed);
+}
+
+void async_simulation_set_lod(Async_Simulation *sim, int emitter, int tier)
+{
+    if (emitter >= 0 && emitter < sim->job_num) sim->jobs[emitter].lod.store(tier, std::memory_order_relaxed);
+}
+
+void async_simulation_set_governor_action(Async_Simulation *sim, int emitter, const Particle_Governor_Action *action)
+{
+    if (emitter < 0 || emitter >= sim->job_num) return;
+    sim->jobs[emitter].rate_throttle.store(action->rate_throttle, std::memory_order_relaxed);
+    sim->jobs[emitter].particle_limit.store(action->particle_limit, std::memory_order_relaxed);
+}
+
+Simulation_Snapshot* async_simulation_acquire(Async_Simulation *sim, bool *new_snapshot)
+{
+    int index = sim->published.exchange(-1, std::memory_order_acq_rel);
+    if (new_snapshot) *new_snapshot = (index != -1);
+    if (index != -1) sim->front_index = index;
+    return (sim->front_index != -1) ? &sim->snapshots[sim->front_index] : nullptr;
+}
+
+#include "fxcomp.h"
+
+void report_compile_error(const char *err) { printf("Error: %s\n", err); }
+
+FXVM_Program compile_particle_expr(Particle_System *PS, const char *source, int source_len, FXVM_Cost *cost)
+{
+    TRACE_ZONE("compile");
+    FXVM_Compiler compiler = { };
+    compiler.report_error = report_compile_error;
+
+    PS->random_i = register_global_input_variable(&compiler, "random01", FXTYP_F1);
+    PS->emitter_life_i = register_global_input_variable(&compiler, "emitter_life", FXTYP_F1);
+
+    PS->attrib_life = register_attribute(&compiler, "particle_life", FXTYP_F1);
+    PS->attrib_position = register_attribute(&compiler, "particle_position", FXTYP_F3);
+    PS->attrib_velocity = register_attribute(&compiler, "particle_velocity", FXTYP_F3);
+    PS->attrib_acceleration = register_attribute(&compiler, "particle_acceleration", FXTYP_F3);
+    PS->attrib_particle_random = register_attribute(&compiler, "particle_random", FXTYP_F1);
+
+    compile(&compiler, source, source + source_len);
+    if (cost) *cost = compiler.cost;
+    FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
+#if 0
+    printf("----\n");
+    printf("%s\n", source);
+    printf("====\n");
+    disassemble(&bytecode);
+    printf("----\n");
+#endif
+    FXVM_Program result = fxvm_program_new(bytecode);
+    free_compiler(&compiler);
+    return result;
+}
+
+FXVM_Program compile_particle_expr(Particle_System *PS, const char *source)
+{
+    return compile_particle_expr(PS, source, strlen(source));
+}
+
+FXVM_Program compile_emitter_expr(Particle_System *PS, const char *source, int source_len, FXVM_Cost *cost)
+{
+    TRACE_ZONE("compile");
+    FXVM_Compiler compiler = { };
+    compiler.report_error = report_compile_error;
+
+    PS->emitter.life_i = register_global_input_variable(&compiler, "emitter_life", FXTYP_F1);
+    PS->emitter.random_i = register_global_input_variable(&compiler, "random01", FXTYP_F1);
+
+    compile(&compiler, source, source + source_len);
+    if (cost) *cost = compiler.cost;
+    FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
+#if 0
+    printf("----\n");
+    printf("%s\n", source);
+    printf("====\n");
+    disassemble(&result);
+    printf("----\n");
+#endif
+    FXVM_Program result = fxvm_program_new(bytecode);
+    free_compiler(&compiler);
+    return result;
+}
+
+FXVM_Program compile_emitter_expr(Particle_System *PS, const char *source)
+{
+    return compile_emitter_expr(PS, source, strlen(source));
+}
+
+FXVM_Program compile_instanced_particle_expr(Particle_System *PS, const char *source, int source_len)
+{
+    TRACE_ZONE("compile");
+    FXVM_Compiler compiler = { };
+    compiler.report_error = report_compile_error;
+
+    register_global_input_variable(&compiler, "random01", FXTYP_F1);
+
+    // Same attribute indices as compile_particle_expr, emitter_life is appended as the last one.
+    register_attribute(&compiler, "particle_life", FXTYP_F1);
+    register_attribute(&compiler, "particle_position", FXTYP_F3);
+    register_attribute(&compiler, "particle_velocity", FXTYP_F3);
+    register_attribute(&compiler, "particle_acceleration", FXTYP_F3);
+    register_attribute(&compiler, "particle_random", FXTYP_F1);
+    PS->instanced.attrib_emitter_life = register_attribute(&compiler, "emitter_life", FXTYP_F1);
+
+    compile(&compiler, source, source + source_len);
+    FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
+    FXVM_Program result = fxvm_program_new(bytecode);
+    free_compiler(&compiler);
+    return result;
+}
+
+FXVM_Program compile_instanced_emitter_expr(Particle_System *PS, const char *source, int source_len)
+{
+    TRACE_ZONE("compile");
+    FXVM_Compiler compiler = { };
+    compiler.report_error = report_compile_error;
+
+    register_global_input_variable(&compiler, "random01", FXTYP_F1);
+    PS->instanced.emitter_attrib_life = register_attribute(&compiler, "emitter_life", FXTYP_F1);
+
+    compile(&compiler, source, source + source_len);
+    FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
+    FXVM_Program result = fxvm_program_new(bytecode);
+    free_compiler(&compiler);
+    return result;
+}
+
+const char* read_file(const char *filename, int *len)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return nullptr;
+
+    fseek(fp, 0, SEEK_END);
+    int file_len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *s = (char*)mem_alloc(MEM_FILES, file_len);
+    fread(s, 1, file_len, fp);
+
+    *len = file_len;
+    return s;
+}
+
+struct StringRef
+{
+    const char *s;
+    int len;
+};
+
+bool str_equals(StringRef str, const char *s2)
+{
+    int len = strlen(s2);
+    if (len != str.len) return false;
+
+    const char *s1 = str.s;
+    while (s2[0] != '\0')
+    {
+        if (s1[0] != s2[0]) return false;
+        s2++;
+        s1++;
+    }
+
+    return true;
+}
+
+bool skip_whitespace(const char *&p, const char *end)
+{
+    bool ws_found = false;
+    while (p < end)
+    {
+        switch (p[0])
+        {
+            case '\n': case '\r': case ' ': case '\t':
+                ws_found = true;
+                p++;
+                continue;
+        }
+        break;
+    }
+    return ws_found;
+}
+
+StringRef read_attribute(const char *&p, const char *end)
+{
+    if (p >= end) return { };
+    if (!isalpha(p[0])) return { };
+
+    const char *start = p;
+    while ((p < end) && (isalpha(p[0]) || p[0] == '_'))
+    {
+        p++;
+    }
+    int len = p - start;
+    return {start, len};
+}
+
+enum Attribute_ValueType
+{
+    ATTR_BOOLEAN,
+    ATTR_F1, ATTR_F2, ATTR_F3, ATTR_F4,
+    ATTR_PROGRAM,
+};
+
+bool convert_boolean(const char *s, int len)
+{
+    (void)len;
+    return s[0] == 't';
+}
+
+float convert_f1(const char *s, int len)
+{
+    char buf[32];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return atof(buf);
+}
+
+void convert_f2(float *v, const char *s, int len)
+{
+    (void)len;
+    s += 5; // vec2(
+    int i = 0;
+    while (s[0] != ')')
+    {
+        while (s[0] == ' ') s++;
+        const char *start = s;
+        while (s[0] != ',' && s[0] != ')' && s[0] != ' ') s++;
+
+        v[i] = convert_f1(start, s - start);
+
+        while (s[0] == ' ') s++;
+        if (s[0] == ',') s++;
+        i++;
+    }
+}
+
+void convert_f3(float *v, const char *s, int len)
+{
+    (void)len;
+    s += 5; // vec3(
+    int i = 0;
+    while (s[0] != ')')
+    {
+        while (s[0] == ' ') s++;
+        const char *start = s;
+        while (s[0] != ',' && s[0] != ')' && s[0] != ' ') s++;
+
+        v[i] = convert_f1(start, s - start);
+
+        while (s[0] == ' ') s++;
+        if (s[0] == ',') s++;
+        i++;
+    }
+}
+
+void convert_f4(float *v, const char *s, int len)
+{
+    (void)len;
+    s += 5; // vec4(
+    int i = 0;
+    while (s[0] != ')')
+    {
+        while (s[0] == ' ') s++;
+        const char *start = s;
+        while (s[0] != ',' && s[0] != ')' && s[0] != ' ') s++;
+
+        v[i] = convert_f1(start, s - start);
+
+        while (s[0] == ' ') s++;
+        if (s[0] == ',') s++;
+        i++;
+    }
+}
+
+StringRef read_value(const char *&p, const char *file_end, Attribute_ValueType *type)
+{
+    switch (p[0])
+    {
+    case 't':
+        {
+            *type = ATTR_BOOLEAN;
+            const char *start = p;
+            while (p < file_end)
+            {
+                if (p[0] == ' ' || p[0] == '\n' || p[0] == '\r' || p[0] == '\t')
+                {
+                    break;
+                }
+                p++;
+            }
+            int len = p - start;
+            StringRef result = {start, len};
+            if (!str_equals(result, "true"))
+            {
+                printf("Error: expected true value\n");
+                return { };
+            }
+            return result;
+        } break;
+    case 'f':
+        {
+            *type = ATTR_BOOLEAN;
+            const char *start = p;
+            while (p < file_end)
+            {
+                if (p[0] == ' ' || p[0] == '\n' || p[0] == '\r' || p[0] == '\t')
+                {
+                    break;
+                }
+                p++;
+            }
+            int len = p - start;
+            StringRef result = {start, len};
+            if (!str_equals(result, "false"))
+            {
+                printf("Error: expected false value\n");
+                return { };
+            }
+            return result;
+        } break;
+    case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+        {
+            *type = ATTR_F1;
+            const char *start = p;
+            while (p < file_end && isdigit(p[0])) p++;
+            if (p < file_end && p[0] == '.')
+            {
+                p++;
+                while (p < file_end && isdigit(p[0])) p++;
+                if (p < file_end && (p[0] == 'e' || p[0] == 'E'))
+                {
+                    p++;
+                    if (p < file_end && (p[0] == '-' || p[0] == '+')) p++;
+                    while (p < file_end && isdigit(p[0])) p++;
+                }
+            }
+            int len = p - start;
+            return {start, len};
+        } break;
+    case 'v':
+        {
+            const char *start = p;
+            if (p + 5 < file_end &&
+                (p[0] == 'v' && p[1] == 'e' && p[2] == 'c' && p[4] == '('))
+            {
+                p += 5;
+                switch (p[-2])
+                {
+                case '2':
+                    {
+                        *type = ATTR_F2;
+                    } break;
+                case '3':
+                    {
+                        *type = ATTR_F3;
+                    } break;
+                case '4':
+                    {
+                        *type = ATTR_F4;
+                    } break;
+                }
+
+                while (p < file_end && p[0] != ')') p++;
+                if (p == file_end)
+                {
+                    printf("Error: unexpected end of file\n");
+                    return { };
+                }
+                p++; // skip ')'
+            }
+            else
+            {
+                printf("Error: Expected vec2, vec3 or vec4\n");
+                return { };
+            }
+            int len = p - start;
+            return {start, len};
+        } break;
+    case '{':
+        {
+            if (p + 1 >= file_end || p[1] != '{')
+            {
+                printf("Error: Expected {{ to start expression\n");
+                return { };
+            }
+            p += 2;
+
+            *type = ATTR_PROGRAM;
+            const char *start = p;
+            while (p < file_end && p[0] != '}')
+            {
+                p++;
+            }
+
+            const char *end = p;
+            if (p + 1 >= file_end && p[1] != '}')
+            {
+                printf("Error: Expected }} to end expression\n");
+                return { };
+            }
+            p += 2;
+
+            int len = end - start;
+            return {start, len};
+        } break;
+    }
+    printf("ERROR: INVALID VALUE\n");
+    return { };
+}
+
+float sim_program_cycles_warning = 150.0f;
+
+static void warn_program_cost(const char *filename, const char *name, const FXVM_Cost *cost)
+{
+    if (cost->cycles <= sim_program_cycles_warning) return;
+    printf("Warning: %s: %s is expensive, ", filename, name);
+    fxvm_print_cost(cost);
+}
+
+static float program_cycles(const FXVM_Program *program)
+{
+    return fxvm_cost(&program->bytecode).cycles;
+}
+
+// The first particle attribute program reads that changes over the life of a closed form particle, or
+// nullptr. Closed form systems run the acceleration program once at spawn, so it may only read constants,
+// uniforms and particle_random, anything else would be frozen at its spawn value.
+static const char *closed_form_varying_attribute(const Particle_System *PS, const FXVM_Program *program)
+{
+    const uint8_t *end = (uint8_t*)program->bytecode.code + program->bytecode.len;
+    const uint8_t *p = (uint8_t*)program->bytecode.code;
+    while (p < end)
+    {
+        int size = fxvm_instruction_size(p);
+        if (size == 0) break;
+        if ((p[0] & 0x3f) == FXOP_LOAD_ATTRIBUTE)
+        {
+            int attribute = p[2];
+            if (attribute == PS->attrib_life) return "particle_life";
+            if (attribute == PS->attrib_position) return "particle_position";
+            if (attribute == PS->attrib_velocity) return "particle_velocity";
+            if (attribute == PS->attrib_acceleration) return "particle_acceleration";
+        }
+        p += size;
+    }
+    return nullptr;
+}
+
+Particle_System load_particle_system(const char *filename)
+{
+    TRACE_ZONE("load_particle_system");
+    Particle_System result = { };
+    result.stats = new Particle_System_Stats();
+    result.mem_effect = mem_effect_id(filename);
+    Mem_Effect_Scope mem_scope(result.mem_effect);
+    result.stretch = false;
+    result.additive = false;
+    result.emitter.life = 8.0f;
+    result.emitter.cooldown = 2.0f;
+    result.emitter.loop = true;
+    result.emitter.rate = 200.0f;
+    result.emitter.initial_life = 2.0f;
+    result.emitter.acceleration = vec3{0.0f, 0.0f, 0.0f};
+    result.emitter.drag = 0.95f;
+    result.emitter.initial_velocity = vec3{0.0f, 1.0f, 0.0f};
+    result.size = 0.2f;
+    result.color = vec4{1, 1, 1, 1};
+
+    //return result;
+
+    int file_len = 0;
+    const char *file_str = read_file(filename, &file_len);
+
+    if (!file_str) return result;
+
+    const char *file_end = file_str + file_len;
+    const char *p = file_str;
+
+    float sheet_tile_x = 0.0f;
+    float sheet_tile_y = 0.0f;
+    float lod_program_tier = 1.0f;
+    float priority = 0.0f;
+
+    enum { EMITTER_ATTRIBUTE_NUM = 15, PARTICLE_ATTRIBUTE_NUM = 6, LOD_ATTRIBUTE_NUM = 4 };
+    struct {
+        const char *name;
+        Attribute_ValueType type;
+        float *value;
+        FXVM_Program *p_value;
+        bool *b_value;
+        FXVM_Program *ip_value;
+    } emitter_attribute_map[EMITTER_ATTRIBUTE_NUM] = {
+        {"stretch", ATTR_BOOLEAN, nullptr, nullptr, &result.stretch, nullptr},
+        {"additive", ATTR_BOOLEAN, nullptr, nullptr, &result.additive, nullptr},
+        {"closed_form", ATTR_BOOLEAN, nullptr, nullptr, &result.closed_form, nullptr},
+        {"sheet_tile_x", ATTR_F1, &sheet_tile_x, nullptr, nullptr, nullptr},
+        {"sheet_tile_y", ATTR_F1, &sheet_tile_y, nullptr, nullptr, nullptr},
+        {"emitter_loop", ATTR_BOOLEAN, nullptr, nullptr, &result.emitter.loop, nullptr},
+        {"emitter_life", ATTR_F1, &result.emitter.life, nullptr, nullptr, nullptr},
+        {"emitter_cooldown", ATTR_F1, &result.emitter.cooldown, nullptr, nullptr, nullptr},
+        {"emitter_rate", ATTR_F1, &result.emitter.rate, &result.emitter.rate_p, nullptr, &result.instanced.rate_p},
+        {"drag", ATTR_F1, &result.emitter.drag, &result.emitter.drag_p, nullptr, nullptr},
+        {"initial_life", ATTR_F1, &result.emitter.initial_life, &result.emitter.initial_life_p, nullptr, &result.instanced.initial_life_p},
+        {"initial_position", ATTR_F3, &result.emitter.initial_position.x, &result.emitter.initial_position_p, nullptr, &result.instanced.initial_position_p},
+        {"initial_velocity", ATTR_F3, &result.emitter.initial_velocity.x, &result.emitter.initial_velocity_p, nullptr, &result.instanced.initial_velocity_p},
+        {"lod_programs", ATTR_F1, &lod_program_tier, nullptr, nullptr, nullptr},
+        {"priority", ATTR_F1, &priority, nullptr, nullptr, nullptr},
+    }, particle_attribute_map[PARTICLE_ATTRIBUTE_NUM] = {
+        {"acceleration", ATTR_F3, &result.acceleration.x, &result.acceleration_p, nullptr, &result.instanced.acceleration_p},
+        {"color", ATTR_F4, &result.color.x, &result.color_p, nullptr, &result.instanced.color_p},
+        {"size", ATTR_F1, &result.size, &result.size_p, nullptr, &result.instanced.size_p},
+        {"lod_acceleration", ATTR_F3, nullptr, &result.lod_acceleration_p, nullptr, nullptr},
+        {"lod_color", ATTR_F4, nullptr, &result.lod_color_p, nullptr, nullptr},
+        {"lod_size", ATTR_F1, nullptr, &result.lod_size_p, nullptr, nullptr},
+    };
+
+    // One value per tier after the first, as a scalar or a vector. The tiers are the components of lod_distance.
+    float lod_values[LOD_ATTRIBUTE_NUM][PARTICLE_LOD_MAX_TIERS - 1] = { };
+    int lod_value_num[LOD_ATTRIBUTE_NUM] = { };
+    const char *lod_attribute_names[LOD_ATTRIBUTE_NUM] = { "lod_distance", "lod_rate", "lod_step", "lod_min_pixels" };
+
+    while (p < file_end)
+    {
+        skip_whitespace(p, file_end);
+        if (p == file_end)
+        {
+            break;
+        }
+
+        StringRef attribute = read_attribute(p, file_end);
+        if (!attribute.s)
+        {
+            // TODO: line and column
+            printf("Error: was expecting for an attribute\n");
+            goto err;
+        }
+
+        skip_whitespace(p, file_end);
+        if (p == file_end || p[0] != '=')
+        {
+            // TODO: line and column
+            printf("Error: was expecting =\n");
+            goto err;
+        }
+
+        p++; // skip '='
+
+        skip_whitespace(p, file_end);
+        if (p == file_end)
+        {
+            printf("Error: unexpected end of file\n");
+            goto err;
+        }
+
+        Attribute_ValueType type;
+        StringRef value = read_value(p, file_end, &type);
+        if (!value.s)
+        {
+            goto err;
+        }
+
+        bool emitter_attrib_found = false;
+        for (int i = 0; i < EMITTER_ATTRIBUTE_NUM; i++)
+        {
+            auto attrib = emitter_attribute_map[i];
+            if (str_equals(attribute, attrib.name))
+            {
+                emitter_attrib_found = true;
+                switch (type)
+                {
+                case ATTR_BOOLEAN:
+                    {
+                        if (!attrib.b_value || attrib.type != type)
+                        {
+                            printf("Error: no boolean value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        *attrib.b_value = convert_boolean(value.s, value.len);
+                    } break;
+                case ATTR_F1:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no scalar value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        *attrib.value = convert_f1(value.s, value.len);
+                    } break;
+                case ATTR_F2:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no vec2 value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        convert_f2(attrib.value, value.s, value.len);
+                    } break;
+                case ATTR_F3:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no vec3 value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        convert_f3(attrib.value, value.s, value.len);
+                    } break;
+                case ATTR_F4:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no vec4 value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        convert_f4(attrib.value, value.s, value.len);
+                    } break;
+                case ATTR_PROGRAM:
+                    {
+                        if (!attrib.p_value) // TODO: type check
+                        {
+                            printf("Error: no program value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        FXVM_Cost cost;
+                        *attrib.p_value = compile_emitter_expr(&result, value.s, value.len, &cost);
+                        warn_program_cost(filename, attrib.name, &cost);
+                        if (attrib.ip_value)
+                        {
+                            *attrib.ip_value = compile_instanced_emitter_expr(&result, value.s, value.len);
+                        }
+                    } break;
+                }
+            }
+        }
+        if (emitter_attrib_found) continue;
+
+        bool particle_attrib_found = false;
+        for (int i = 0; i < PARTICLE_ATTRIBUTE_NUM; i++)
+        {
+            auto attrib = particle_attribute_map[i];
+            if (str_equals(attribute, attrib.name))
+            {
+                particle_attrib_found = true;
+                switch (type)
+                {
+                case ATTR_BOOLEAN:
+                    {
+                        if (!attrib.b_value || attrib.type != type)
+                        {
+                            printf("Error: no boolean value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        *attrib.b_value = convert_boolean(value.s, value.len);
+                    } break;
+                case ATTR_F1:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no scalar value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        *attrib.value = convert_f1(value.s, value.len);
+                    } break;
+                case ATTR_F2:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no vec2 value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        convert_f2(attrib.value, value.s, value.len);
+                    } break;
+                case ATTR_F3:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no vec3 value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        convert_f3(attrib.value, value.s, value.len);
+                    } break;
+                case ATTR_F4:
+                    {
+                        if (!attrib.value || attrib.type != type)
+                        {
+                            printf("Error: no vec4 value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        convert_f4(attrib.value, value.s, value.len);
+                    } break;
+                case ATTR_PROGRAM:
+                    {
+                        if (!attrib.p_value) // TODO: get the return type of the program, ensure compatible
+                        {
+                            printf("Error: no program value allowed for %s\n", attrib.name);
+                            goto err;
+                        }
+                        FXVM_Cost cost;
+                        *attrib.p_value = compile_particle_expr(&result, value.s, value.len, &cost);
+                        warn_program_cost(filename, attrib.name, &cost);
+                        if (attrib.ip_value)
+                        {
+                            *attrib.ip_value = compile_instanced_particle_expr(&result, value.s, value.len);
+                        }
+                    } break;
+                }
+            }
+        }
+        if (particle_attrib_found) continue;
+
+        bool lod_attrib_found = false;
+        for (int i = 0; i < LOD_ATTRIBUTE_NUM; i++)
+        {
+            if (!str_equals(attribute, lod_attribute_names[i])) continue;
+            lod_attrib_found = true;
+            switch (type)
+            {
+            case ATTR_F1: lod_values[i][0] = convert_f1(value.s, value.len); lod_value_num[i] = 1; break;
+            case ATTR_F2: convert_f2(lod_values[i], value.s, value.len); lod_value_num[i] = 2; break;
+            case ATTR_F3: convert_f3(lod_values[i], value.s, value.len); lod_value_num[i] = 3; break;
+            case ATTR_F4: convert_f4(lod_values[i], value.s, value.len); lod_value_num[i] = 4; break;
+            default:
+                printf("Error: %s needs a scalar or vector value, one component per tier\n", lod_attribute_names[i]);
+                goto err;
+            }
+        }
+        if (lod_attrib_found) continue;
+
+        char buf[64];
+        strncpy(buf, attribute.s, attribute.len);
+        buf[attribute.len] = '\0';
+        printf("Error: unknown attribute '%s'\n", buf);
+        goto err;
+    }
+
+    result.sheet_tile_x = (int)sheet_tile_x;
+    result.sheet_tile_y = (int)sheet_tile_y;
+
+    result.lod_tier_num = 1 + lod_value_num[0];
+    result.lod[0] = Particle_LOD_Tier{ 0.0f, 1.0f, 1, 0.0f };
+    for (int tier = 1; tier < result.lod_tier_num; tier++)
+    {
+        // Tiers without a value of their own keep the one of the tier before.
+        Particle_LOD_Tier *lod = &result.lod[tier];
+        *lod = result.lod[tier - 1];
+        lod->distance = lod_values[0][tier - 1];
+        if (tier <= lod_value_num[1]) lod->rate_scale = lod_values[1][tier - 1];
+        if (tier <= lod_value_num[2]) lod->step_divider = (int)lod_values[2][tier - 1];
+        if (tier <= lod_value_num[3]) lod->min_pixels = lod_values[3][tier - 1];
+        if (lod->step_divider < 1) lod->step_divider = 1;
+        if (lod->distance <= result.lod[tier - 1].distance)
+        {
+            printf("Error: %s: lod_distance must increase from tier to tier\n", filename);
+            goto err;
+        }
+    }
+    result.lod_program_tier = (int)lod_program_tier;
+    result.priority = (int)priority;
+
+    if (result.closed_form)
+    {
+        const char *varying = closed_form_varying_attribute(&result, &result.acceleration_p);
+        const char *program = "acceleration";
+        if (!varying)
+        {
+            varying = closed_form_varying_attribute(&result, &result.lod_acceleration_p);
+            program = "lod_acceleration";
+        }
+        if (varying)
+        {
+            printf("Error: %s: closed_form evaluates %s once at spawn, it can not read %s\n", filename, program, varying);
+            goto err;
+        }
+    }
+
+    result.spawn_cycles = program_cycles(&result.emitter.initial_life_p) +
+            program_cycles(&result.emitter.initial_position_p) +
+            program_cycles(&result.emitter.initial_velocity_p);
+    result.update_cycles = program_cycles(&result.size_p) +
+            program_cycles(&result.color_p);
+    // Closed form systems run the acceleration program once, at spawn.
+    if (result.closed_form) result.spawn_cycles += program_cycles(&result.acceleration_p);
+    else result.update_cycles += program_cycles(&result.acceleration_p);
+
+    mem_free((void*)file_str);
+    return result;
+
+err:
+    fflush(stdout);
+    mem_free((void*)file_str);
+    return { };
+}
+
+#endif
+
+#define PARTICLE_SIM
+#endif
@@ -212,654 +212,9 @@ void set_window_title(Window w, const char *title)
 }
 
 
-#include <cmath>
-
-//#define TRACE_FXVM
-#define FXVM_IMPL
-#include "fxvm.h"
-
-float random01()
-{
-    return (float)rand() / RAND_MAX;
-}
-
-float clamp01(float x)
-{
-    return (x > 1.0f) ? 1.0f : ((x < 0.0f) ? 0.0f : x);
-}
-
-struct vec3
-{
-#ifdef USE_SSE
-    union
-    {
-        struct { float x, y, z; };
-        __m128 v4;
-    };
-#else
-    float x, y, z;
-#endif
-};
-
-struct vec4
-{
-#ifdef USE_SSE
-    union
-    {
-        struct { float x, y, z, w; };
-        __m128 v4;
-    };
-#else
-    float x, y, z, w;
-#endif
-};
-
-#ifndef USE_SSE
-vec3 operator - (vec3 a) { return {-a.x, -a.y, -a.z}; }
-vec3 operator + (vec3 a, vec3 b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
-vec3 operator - (vec3 a, vec3 b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
-vec3 operator * (vec3 a, vec3 b) { return {a.x * b.x, a.y * b.y, a.z * b.z}; }
-vec3 operator / (vec3 a, vec3 b) { return {a.x / b.x, a.y / b.y, a.z / b.z}; }
-vec3 operator * (vec3 a, float t) { return {a.x * t, a.y * t, a.z * t}; }
-vec3 operator / (vec3 a, float t) { return {a.x / t, a.y / t, a.z / t}; }
-
-float dot(vec3 a, vec3 b)
-{
-    return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
-vec3 cross(vec3 a, vec3 b)
-{
-    return {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x};
-}
-
-vec3 normalize(vec3 a)
-{
-    float L2 = dot(a, a);
-    if (L2 <= 0.001f)
-    {
-        return vec3{1.0f, 0.0f, 0.0f};
-    }
-    float L = sqrt(L2);
-    return a / L;
-}
-
-vec4 operator - (vec4 a) { return {-a.x, -a.y, -a.z, -a.w}; }
-vec4 operator + (vec4 a, vec4 b) { return {a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w}; }
-vec4 operator - (vec4 a, vec4 b) { return {a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w}; }
-vec4 operator * (vec4 a, vec4 b) { return {a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w}; }
-vec4 operator / (vec4 a, vec4 b) { return {a.x / b.x, a.y / b.y, a.z / b.z, a.w / b.w}; }
-vec4 operator * (vec4 a, float t) { return {a.x * t, a.y * t, a.z * t, a.w * t}; }
-vec4 operator / (vec4 a, float t) { return {a.x / t, a.y / t, a.z / t, a.w / t}; }
-
-float dot(vec4 a, vec4 b)
-{
-    return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
-}
-
-vec4 normalize(vec4 a)
-{
-    float L2 = dot(a, a);
-    float L = sqrt(L2);
-    return a / L;
-}
-
-#else
-// USE_SSE
-
-vec3 operator - (vec3 a) { return vec3{ .v4 = _mm_xor_ps(a.v4, _mm_set1_ps(-0.0f)) }; }
-vec3 operator + (vec3 a, vec3 b) { return vec3{ .v4 = _mm_add_ps(a.v4, b.v4) }; }
-vec3 operator - (vec3 a, vec3 b) { return vec3{ .v4 = _mm_sub_ps(a.v4, b.v4) }; }
-vec3 operator * (vec3 a, vec3 b) { return vec3{ .v4 = _mm_mul_ps(a.v4, b.v4) }; }
-vec3 operator / (vec3 a, vec3 b) { return vec3{ .v4 = _mm_div_ps(a.v4, b.v4) }; }
-vec3 operator * (vec3 a, float t) { return vec3{ .v4 = _mm_mul_ps(a.v4, _mm_set1_ps(t)) }; }
-vec3 operator / (vec3 a, float t) { return vec3{ .v4 = _mm_div_ps(a.v4, _mm_set1_ps(t)) }; }
-
-float dot(vec3 a, vec3 b)
-{
-    //vec3 r = vec3{ .v4 = _mm_mul_ps(a.v4, b.v4) };
-    //return r.x + r.y + r.z;
-    return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
-vec3 cross(vec3 a, vec3 b)
-{
-    return {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x};
-}
-
-vec3 normalize(vec3 a)
-{
-    float L2 = dot(a, a);
-    if (L2 <= 0.001f)
-    {
-        return vec3{ 1.0f, 0.0f, 0.0f };
-    }
-    __m128 L = _mm_rsqrt_ps(_mm_set1_ps(L2));
-    return vec3{ .v4 = _mm_mul_ps(a.v4, L) };
-}
-
-vec3 lerp(vec3 a, vec3 b, float t)
-{
-    return a * (1.0f - t) + b * t;
-}
-
-vec4 operator - (vec4 a) { return vec4{ .v4 = _mm_xor_ps(a.v4, _mm_set1_ps(-0.0f)) }; }
-vec4 operator + (vec4 a, vec4 b) { return vec4{ .v4 = _mm_add_ps(a.v4, b.v4) }; }
-vec4 operator - (vec4 a, vec4 b) { return vec4{ .v4 = _mm_sub_ps(a.v4, b.v4) }; }
-vec4 operator * (vec4 a, vec4 b) { return vec4{ .v4 = _mm_mul_ps(a.v4, b.v4) }; }
-vec4 operator / (vec4 a, vec4 b) { return vec4{ .v4 = _mm_div_ps(a.v4, b.v4) }; }
-vec4 operator * (vec4 a, float t) { return vec4{ .v4 = _mm_mul_ps(a.v4, _mm_set1_ps(t)) }; }
-vec4 operator / (vec4 a, float t) { return vec4{ .v4 = _mm_div_ps(a.v4, _mm_set1_ps(t)) }; }
-
-float dot(vec4 a, vec4 b)
-{
-    vec4 r = vec4{ .v4 = _mm_mul_ps(a.v4, b.v4) };
-    return r.x + r.y + r.z + r.w;
-}
-
-vec4 normalize(vec4 a)
-{
-    float L2 = dot(a, a);
-    __m128 L = _mm_rsqrt_ps(_mm_set1_ps(L2));
-    return vec4{ .v4 = _mm_mul_ps(a.v4, L) };
-}
-#endif
-
-struct mat4
-{
-    float m[16];
-
-    float operator[](int i) const { return m[i]; }
-};
-
-mat4 transpose(mat4 m)
-{
-    return {
-        m[0], m[4],  m[8], m[12],
-        m[1], m[5],  m[9], m[13],
-        m[2], m[6], m[10], m[14],
-        m[3], m[7], m[11], m[15]
-    };
-}
-
-mat4 rotation_y(float theta)
-{
-    float s = sin(theta);
-    float c = cos(theta);
-    return {
-        c,  0, -s, 0,
-        0,  1,  0, 0,
-        s,  0,  c, 0,
-        0,  0,  0, 1
-    };
-}
-
-mat4 rotation_x(float theta)
-{
-    float s = sin(theta);
-    float c = cos(theta);
-    return {
-        1,  0,  0, 0,
-        0,  c,  s, 0,
-        0, -s,  c, 0,
-        0,  0,  0, 1
-    };
-}
-
-mat4 translation(vec3 v)
-{
-    return {
-        1, 0, 0, v.x,
-        0, 1, 0, v.y,
-        0, 0, 1, v.z,
-        0, 0, 0,   1
-    };
-}
-
-mat4 operator * (mat4 a, mat4 b)
-{
-    // Rows
-    vec4 a0 = vec4{a[0],  a[1],  a[2],  a[3]};
-    vec4 a1 = vec4{a[4],  a[5],  a[6],  a[7]};
-    vec4 a2 = vec4{a[8],  a[9],  a[10], a[11]};
-    vec4 a3 = vec4{a[12], a[13], a[14], a[15]};
-    // Columns
-    vec4 b0 = vec4{b[0], b[4], b[8],  b[12]};
-    vec4 b1 = vec4{b[1], b[5], b[9],  b[13]};
-    vec4 b2 = vec4{b[2], b[6], b[10], b[14]};
-    vec4 b3 = vec4{b[3], b[7], b[11], b[15]};
-    return {
-        dot(a0, b0), dot(a0, b1), dot(a0, b2), dot(a0, b3),
-        dot(a1, b0), dot(a1, b1), dot(a1, b2), dot(a1, b3),
-        dot(a2, b0), dot(a2, b1), dot(a2, b2), dot(a2, b3),
-        dot(a3, b0), dot(a3, b1), dot(a3, b2), dot(a3, b3),
-    };
-}
-
-mat4 PerspectiveOffCenter_lh(float left, float right,
-                             float bottom, float top,
-                             float nearZ, float farZ)
-{
-    const float X = (2.0f * nearZ) / (right - left);
-    const float Y = (2.0f * nearZ) / (top - bottom);
-
-    const float A = (right + left) / (right - left);
-    const float B = (top + bottom) / (top - bottom);
-    const float C = -(farZ + nearZ) / (farZ - nearZ);
-    const float D = (-2.0f * farZ * nearZ) / (farZ - nearZ);
-
-    return mat4{
-        X,    0.0f, A,    0.0f,
-        0.0f, Y,    B,    0.0f,
-        0.0f, 0.0f, C,    D,
-        0.0f, 0.0f, -1.0f, 0.0f
-    };
-}
-
-mat4 Perspective_lh(float fov_y, float aspect_ratio, float near, float far)
-{
-    const float deg2rad = 3.14159265358f / 180.0f;
-    const float tan_half_fov_y = std::tan(fov_y * 0.5f * deg2rad);
-    const float y = near * tan_half_fov_y;
-    const float x = y * aspect_ratio;
-    return PerspectiveOffCenter_lh(-x, x, -y, y, near, far);
-}
-
-mat4 invert_affine(mat4 m)
-{
-    vec3 inv_rot_0 = vec3{m[0], m[4], m[8]};
-    vec3 inv_rot_1 = vec3{m[1], m[5], m[9]};
-    vec3 inv_rot_2 = vec3{m[2], m[6], m[10]};
-    vec3 x = vec3{m[3], m[7], m[11]};
-    vec3 v = -vec3{dot(inv_rot_0, x), dot(inv_rot_1, x), dot(inv_rot_2, x)};
-    return {
-        inv_rot_0.x, inv_rot_0.y, inv_rot_0.z, v.x,
-        inv_rot_1.x, inv_rot_1.y, inv_rot_1.z, v.y,
-        inv_rot_2.x, inv_rot_2.y, inv_rot_2.z, v.z,
-        0.0f, 0.0f, 0.0f, 1.0f
-    };
-}
-
-vec4 transform(mat4 tr, vec4 p)
-{
-    // | 0  1  2  3|   |x|
-    // | 4  5  6  7| x |y| = |0x+1y+2z+3w, 4x+5y+6z+7w, 8x+9y+10z+11w, 12x+13y+14z+15w|
-    // | 8  9 10 11|   |z|
-    // |12 13 14 15|   |w|
-    float x =  tr[0] * p.x +  tr[1] * p.y +  tr[2] * p.z +  tr[3] * p.w;
-    float y =  tr[4] * p.x +  tr[5] * p.y +  tr[6] * p.z +  tr[7] * p.w;
-    float z =  tr[8] * p.x +  tr[9] * p.y + tr[10] * p.z + tr[11] * p.w;
-    float w = tr[12] * p.x + tr[13] * p.y + tr[14] * p.z + tr[15] * p.w;
-    return {x, y, z, w};
-}
-
-struct Particles
-{
-    enum { MAX = 1000 };
-    vec3 position[MAX];
-    vec3 velocity[MAX];
-    vec3 acceleration[MAX];
-    float life_seconds[MAX];
-    float life_max[MAX];
-    float life_01[MAX];
-    float size[MAX];
-    vec4 color[MAX];
-    vec4 random[MAX];
-};
-
-
-struct Emitter_Instance
-{
-    float fractional_particles;
-    float life;
-    vec3 position;
-
-    int particles_alive;
-    Particles P;
-};
-
-struct Emitter_Parameters
-{
-    float life;
-    float cooldown;
-    bool loop;
-
-    float rate;
-    FXVM_Program rate_p;
-
-    vec3 acceleration;
-
-    float initial_life;
-    FXVM_Program initial_life_p;
-
-    vec3 initial_position;
-    FXVM_Program initial_position_p;
-
-    vec3 initial_velocity;
-    FXVM_Program initial_velocity_p;
-
-    float drag;
-    FXVM_Program drag_p;
-
-    int life_i;
-    int random_i;
-};
-
-struct Particle_System
-{
-    Emitter_Parameters emitter;
-    bool stretch;
-    bool additive;
-    bool align_to_axis;
-    vec3 align_axis;
-    int sheet_tile_x;
-    int sheet_tile_y;
-
-    vec3 acceleration;
-    FXVM_Program acceleration_p;
-
-    vec4 color;
-    FXVM_Program color_p;
-
-    float size;
-    FXVM_Program size_p;
-
-    int attrib_life;
-    int attrib_position;
-    int attrib_velocity;
-    int attrib_acceleration;
-    int attrib_particle_random;
-
-    int random_i;
-    int emitter_life_i;
-};
-
-void free_particle_system(Particle_System *ps)
-{
-    fxvm_program_free(&ps->emitter.rate_p);
-    fxvm_program_free(&ps->emitter.initial_life_p);
-    fxvm_program_free(&ps->emitter.initial_position_p);
-    fxvm_program_free(&ps->emitter.initial_velocity_p);
-    fxvm_program_free(&ps->emitter.drag_p);
-
-    fxvm_program_free(&ps->acceleration_p);
-    fxvm_program_free(&ps->color_p);
-    fxvm_program_free(&ps->size_p);
-
-    *ps = { };
-}
-
-Emitter_Instance new_emitter(Particle_System *PS, vec3 position)
-{
-    (void)PS;
-    Emitter_Instance result = { };
-    result.position = position;
-    return result;
-}
-
-float get_emitter_life(Emitter_Parameters *EP, Emitter_Instance *E)
-{
-    float max_life = ((EP->life >= 0.001f) ? EP->life : 1.0f);
-    float life10 = E->life / max_life;
-    return clamp01(life10);
-}
-
-#include <intrin.h> // for rtdsc
-
-float eval_f1(FXVM_Machine *vm, int instance_index, FXVM_Program *program)
-{
-    FXVM_State state = { };
-    exec(vm, state, instance_index, program);
-    return state.r[0].v[0];
-}
-
-vec3 eval_f3(FXVM_Machine *vm, int instance_index, FXVM_Program *program)
-{
-    FXVM_State state = { };
-    exec(vm, state, instance_index, program);
-    auto r = state.r[0];
-    return vec3{r.v[0], r.v[1], r.v[2]};
-}
-
-template <int MAX_GROUP>
-void eval_f1(FXVM_Machine *vm, float *dest, int instance_index, int instance_count, FXVM_Program *program)
-{
-    FXVM_State state[MAX_GROUP] = { };
-    exec(vm, state, instance_index, instance_count, program);
-    for (int i = 0; i < instance_count; i++)
-    {
-        auto r = state[i].r[0];
-        dest[i] = r.v[0];
-    }
-}
-
-template <int MAX_GROUP>
-void eval_f3(FXVM_Machine *vm, vec3 *dest, int instance_index, int instance_count, FXVM_Program *program)
-{
-    FXVM_State state[MAX_GROUP] = { };
-    exec(vm, state, instance_index, instance_count, program);
-    for (int i = 0; i < instance_count; i++)
-    {
-        auto r = state[i].r[0];
-        dest[i] = vec3{r.v[0], r.v[1], r.v[2]};
-    }
-}
-
-template <int MAX_GROUP>
-void eval_f4(FXVM_Machine *vm, vec4 *dest, int instance_index, int instance_count, FXVM_Program *program)
-{
-    FXVM_State state[MAX_GROUP] = { };
-    exec(vm, state, instance_index, instance_count, program);
-    for (int i = 0; i < instance_count; i++)
-    {
-        auto r = state[i].r[0];
-        dest[i] = vec4{r.v[0], r.v[1], r.v[2], r.v[3]};
-    }
-}
-
-void compact(Emitter_Instance *E)
-{
-    Particles *P = &E->P;
-
-    int j = 0;
-    for (int i = 0; i < E->particles_alive; )
-    {
-        while (P->life_seconds[i] <= 0.01f)
-        {
-            i++;
-        }
-        if ((i < E->particles_alive) &&
-            (P->life_seconds[i] > 0.01f))
-        {
-            P->life_seconds[j] = P->life_seconds[i];
-            P->life_max[j] = P->life_max[i];
-            P->position[j] = P->position[i];
-            P->velocity[j] = P->velocity[i];
-            P->acceleration[j] = P->acceleration[i];
-            P->size[j] = P->size[i];
-            P->color[j] = P->color[i];
-            P->random[j] = P->random[i];
-            i++, j++;
-        }
-    }
-    E->particles_alive = j;
-}
-
-void emit(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt)
-{
-    Particles *P = &E->P;
-
-    float emitter_life = get_emitter_life(&PS->emitter, E);
-    set_uniform_f1(&PS->emitter.rate_p, PS->emitter.life_i, &emitter_life);
-
-    float rate = PS->emitter.rate;
-    if (PS->emitter.rate_p.bytecode.code)
-    {
-        rate = eval_f1(vm, 0, &PS->emitter.rate_p);
-    }
-
-    float num = rate * dt;
-    float to_emit = num + E->fractional_particles;
-    num = trunc(to_emit);
-    E->fractional_particles = to_emit - num;
-    int num_to_emit = (int)num;
-
-    //printf("num to emit %d, fractional_particles %f\n", num_to_emit, E->fractional_particles);
-    set_uniform_f1(&PS->emitter.initial_position_p, PS->emitter.life_i, &emitter_life);
-    set_uniform_f1(&PS->emitter.initial_velocity_p, PS->emitter.life_i, &emitter_life);
-
-    int index = E->particles_alive;
-    while (num_to_emit > 0 && index < Particles::MAX)
-    {
-        vec3 position = E->position + PS->emitter.initial_position;
-        if (PS->emitter.initial_position_p.bytecode.code)
-        {
-            position = position + eval_f3(vm, 0, &PS->emitter.initial_position_p);
-        }
-        P->position[index] = position;
-
-        P->velocity[index] = PS->emitter.initial_velocity;
-        if (PS->emitter.initial_velocity_p.bytecode.code)
-        {
-            P->velocity[index] = eval_f3(vm, 0, &PS->emitter.initial_velocity_p);
-        }
-        P->acceleration[index] = PS->emitter.acceleration;
-
-        float initial_life = PS->emitter.initial_life;
-        if (PS->emitter.initial_life_p.bytecode.code)
-        {
-            initial_life = eval_f1(vm, 0, &PS->emitter.initial_life_p);
-        }
-
-        P->life_seconds[index] = initial_life;
-        P->life_max[index] = initial_life;
-        P->life_01[index] = 0.0f;
-        P->size[index] = PS->size;
-        P->color[index] = PS->color;
-        P->random[index] = vec4{random01(), random01(), random01(), random01()};
-
-        num_to_emit--;
-        index++;
-    }
-    E->particles_alive = index;
-}
-
-void simulate(FXVM_Machine *vm, Particle_System *PS, Emitter_Instance *E, float dt, uint64_t *emit_cycles, uint64_t *compact_cycles)
-{
-    uint64_t start_cycles = __rdtsc();
-    compact(E);
-    uint64_t end_cycles = __rdtsc();
-    *compact_cycles += end_cycles - start_cycles;
-
-    //E->particles_alive = 0;
-    start_cycles = __rdtsc();
-    if (E->life >= 0.0f && E->life < PS->emitter.life)
-    {
-        emit(vm, PS, E, dt);
-    }
-    E->life += dt;
-    if (E->life >= PS->emitter.life && E->particles_alive == 0)
-    {
-        if (PS->emitter.loop) E->life = 0.0f - PS->emitter.cooldown;
-    }
-
-    end_cycles = __rdtsc();
-    *emit_cycles += end_cycles - start_cycles;
-
-    Particles *P = &E->P;
-
-    float drag = PS->emitter.drag;
-    float emitter_life = get_emitter_life(&PS->emitter, E);
-
-    FXVM_AttributeBindings attr_bindings = { };
-    bind_attribute(&attr_bindings, PS->attrib_life, FXTYP_F1, sizeof(float), P->life_01);
-    bind_attribute(&attr_bindings, PS->attrib_position, FXTYP_F3, sizeof(vec3), P->position);
-    bind_attribute(&attr_bindings, PS->attrib_velocity, FXTYP_F3, sizeof(vec3), P->velocity);
-    bind_attribute(&attr_bindings, PS->attrib_acceleration, FXTYP_F3, sizeof(vec3), P->acceleration);
-    bind_attribute(&attr_bindings, PS->attrib_particle_random, FXTYP_F4, sizeof(vec4), P->random);
-
-    vm->bindings = &attr_bindings;
-
-    if (PS->acceleration_p.bytecode.code)
-    {
-        set_uniform_f1(&PS->acceleration_p, PS->emitter_life_i, &emitter_life);
-        const int group_size = 16;
-        int i = 0;
-        for (; i + group_size - 1 < E->particles_alive; i += group_size)
-        {
-            //eval_f3<16>(vm, &P->acceleration[i], global_input, attributes, i, group_size, PS->acceleration);
-            eval_f3<16>(vm, &P->acceleration[i], i, group_size, &PS->acceleration_p);
-        }
-        if (i < E->particles_alive)
-        {
-            int last_group = E->particles_alive - i;
-            //eval_f3<16>(vm, &P->acceleration[i], global_input, attributes, i, last_group, PS->acceleration);
-            eval_f3<16>(vm, &P->acceleration[i], i, last_group, &PS->acceleration_p);
-        }
-    }
-
-    for (int i = 0; i < E->particles_alive; i++)
-    {
-        float life_seconds = P->life_seconds[i] - dt;
-        if (life_seconds < 0.0f) life_seconds = 0.0f;
-
-        P->life_seconds[i] = life_seconds;
-        P->life_01[i] = clamp01(1.0f - life_seconds * (1.0f / P->life_max[i]));
-
-        vec3 acceleration = PS->emitter.acceleration;
-        if (PS->acceleration_p.bytecode.code) acceleration = P->acceleration[i];
-
-        vec3 vel = P->velocity[i];
-        float v2 = -sqrtf(dot(vel, vel));
-        vec3 Fd = normalize(vel) * v2 * drag;   // drag force
-        vec3 ad = Fd;                           // drag acceleration F = ma => a = F/m; m = 1.0f => ad = Fd
-        acceleration = acceleration + ad;
-
-        vec3 velocity = vel + acceleration * dt;
-        vec3 position = P->position[i] + velocity * dt;
-
-        P->acceleration[i] = acceleration;
-        P->velocity[i] = velocity;
-        P->position[i] = position;
-    }
-    if (PS->size_p.bytecode.code)
-    {
-        set_uniform_f1(&PS->size_p, PS->emitter_life_i, &emitter_life);
-        const int group_size = 16;
-        int i = 0;
-        for (; i + group_size - 1 < E->particles_alive; i += group_size)
-        {
-            //eval_f1<16>(vm, &P->size[i], global_input, attributes, i, group_size, PS->size);
-            eval_f1<16>(vm, &P->size[i], i, group_size, &PS->size_p);
-        }
-        if (i < E->particles_alive)
-        {
-            int last_group = E->particles_alive - i;
-            //eval_f1<16>(vm, &P->size[i], global_input, attributes, i, last_group, PS->size);
-            eval_f1<16>(vm, &P->size[i], i, last_group, &PS->size_p);
-        }
-    }
-    if (PS->color_p.bytecode.code)
-    {
-        set_uniform_f1(&PS->color_p, PS->emitter_life_i, &emitter_life);
-        const int group_size = 16;
-        int i = 0;
-        for (; i + group_size - 1 < E->particles_alive; i += group_size)
-        {
-            //printf("-- color:\n");
-            //eval_f3<16>(vm, &P->color[i], global_input, attributes, i, group_size, PS->color);
-            eval_f4<16>(vm, &P->color[i], i, group_size, &PS->color_p);
-            //if (P->life_01[i] > 0.5f) exit(0);
-            //printf("--\n");
-        }
-        if (i < E->particles_alive)
-        {
-            int last_group = E->particles_alive - i;
-            //eval_f3<16>(vm, &P->color[i], global_input, attributes, i, last_group, PS->color);
-            eval_f4<16>(vm, &P->color[i], i, last_group, &PS->color_p);
-        }
-    }
-}
+#include "particle_sim.h"
+#include "draw_sort.h"
+#include "particle_draw.h"
 
 struct Camera
 {
@@ -888,69 +243,6 @@ void move_camera(Camera *camera, int delta_x, int delta_y)
     camera->position = vec3{pos.x,pos.y,pos.z};
 }
 
-#define FXVM_COMPILER_IMPL
-#include "fxcomp.h"
-
-void report_compile_error(const char *err) { printf("Error: %s\n", err); }
-
-FXVM_Program compile_particle_expr(Particle_System *PS, const char *source, int source_len)
-{
-    FXVM_Compiler compiler = { };
-    compiler.report_error = report_compile_error;
-
-    PS->random_i = register_global_input_variable(&compiler, "random01", FXTYP_F1);
-    PS->emitter_life_i = register_global_input_variable(&compiler, "emitter_life", FXTYP_F1);
-
-    PS->attrib_life = register_attribute(&compiler, "particle_life", FXTYP_F1);
-    PS->attrib_position = register_attribute(&compiler, "particle_position", FXTYP_F3);
-    PS->attrib_velocity = register_attribute(&compiler, "particle_velocity", FXTYP_F3);
-    PS->attrib_acceleration = register_attribute(&compiler, "particle_acceleration", FXTYP_F3);
-    PS->attrib_particle_random = register_attribute(&compiler, "particle_random", FXTYP_F1);
-
-    compile(&compiler, source, source + source_len);
-    FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
-#if 0
-    printf("----\n");
-    printf("%s\n", source);
-    printf("====\n");
-    disassemble(&bytecode);
-    printf("----\n");
-#endif
-    FXVM_Program result = fxvm_program_new(bytecode);
-    return result;
-}
-
-FXVM_Program compile_particle_expr(Particle_System *PS, const char *source)
-{
-    return compile_particle_expr(PS, source, strlen(source));
-}
-
-FXVM_Program compile_emitter_expr(Particle_System *PS, const char *source, int source_len)
-{
-    FXVM_Compiler compiler = { };
-    compiler.report_error = report_compile_error;
-
-    PS->emitter.life_i = register_global_input_variable(&compiler, "emitter_life", FXTYP_F1);
-    PS->emitter.random_i = register_global_input_variable(&compiler, "random01", FXTYP_F1);
-
-    compile(&compiler, source, source + source_len);
-    FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
-#if 0
-    printf("----\n");
-    printf("%s\n", source);
-    printf("====\n");
-    disassemble(&result);
-    printf("----\n");
-#endif
-    FXVM_Program result = fxvm_program_new(bytecode);
-    return result;
-}
-
-FXVM_Program compile_emitter_expr(Particle_System *PS, const char *source)
-{
-    return compile_emitter_expr(PS, source, strlen(source));
-}
-
 #define SOURCE(x) #x
 
 Particle_System load_psys()
@@ -1097,256 +389,221 @@ Particle_System create_psys3()
     return result;
 }
 
-struct Particle_DrawBuffer
+struct ParticleSheet
 {
+    GLuint texture;
+    int width;
+    int height;
+    int tile_size; // tiles are square
+};
+
+// Particles of one draw_particles_to_buffer call.
+struct Particle_DrawBatch
+{
+    int first;
+    int num;
+};
+
+// Quads expanded with particle_draw.h, 4 vertices and 6 indices per particle.
+struct Particle_DrawList
+{
+    bool sorted;        // only sorted lists store depths and keys
+
     int cap;
     int size;
+    float *depth;       // view space z
+    uint64_t *sort_key;
+    uint64_t *sort_tmp;
+    Particle_Vertex *vertices;
+    uint32_t *indices;  // in draw order
+
+    int batch_num;
+    int batch_cap;
+    Particle_DrawBatch *batches;
+};
+
+// Alpha blended particles are sorted back to front, additive blending does not depend on the order.
+struct Particle_DrawBuffer
+{
+    int depth_bits;     // of the sort keys, see draw_sort.h
+    float tile_w;       // size of a sheet tile in texture coordinates
+    float tile_h;
+    bool culling;       // frustum and projected size culling of the particles
+    float min_pixels;   // projected size below which particles are culled
+    Particle_Cull cull; // of the current frame, with its counters
 
-    uint32_t *sort_key;
-    vec3 *P;
-    vec3 *h0;
-    vec3 *h1;
-    vec4 *color;
-    uint16_t *sheet_tile_index;
-    bool *additive;
+    Particle_DrawList alpha;
+    Particle_DrawList additive;
 };
 
-int add_particle_buffer_particle(Particle_DrawBuffer *buffer)
+Particle_DrawBuffer new_particle_buffer(ParticleSheet sheet)
 {
-    if (buffer->size + 1 > buffer->cap)
+    Particle_DrawBuffer result = { };
+    result.depth_bits = DRAW_SORT_DEFAULT_DEPTH_BITS;
+    result.tile_w = (float)sheet.tile_size / (float)sheet.width;
+    result.tile_h = (float)sheet.tile_size / (float)sheet.height;
+    result.culling = true;
+    result.min_pixels = 0.5f;
+    result.alpha.sorted = true;
+    return result;
+}
+
+// Makes room for num more particles, returns the index of the first.
+int add_particle_buffer_particles(Particle_DrawList *list, int num)
+{
+    if (list->size + num > list->cap)
     {
-        int new_cap = buffer->size + 256;
-        buffer->sort_key = (uint32_t*)realloc(buffer->sort_key, sizeof(uint32_t) * new_cap);
-        buffer->P = (vec3*)realloc(buffer->P, sizeof(vec3) * new_cap);
-        buffer->h0 = (vec3*)realloc(buffer->h0, sizeof(vec3) * new_cap);
-        buffer->h1 = (vec3*)realloc(buffer->h1, sizeof(vec3) * new_cap);
-        buffer->color = (vec4*)realloc(buffer->color, sizeof(vec4) * new_cap);
-        buffer->sheet_tile_index = (uint16_t*)realloc(buffer->sheet_tile_index, sizeof(uint16_t) * new_cap);
-        buffer->additive = (bool*)realloc(buffer->additive, sizeof(bool) * new_cap);
-        buffer->cap = new_cap;
+        int new_cap = (list->cap > 0) ? list->cap * 2 : 1024;
+        while (new_cap < list->size + num) new_cap *= 2;
+        if (list->sorted)
+        {
+            list->depth = (float*)mem_realloc(MEM_DRAW, list->depth, sizeof(float) * new_cap);
+            list->sort_key = (uint64_t*)mem_realloc(MEM_DRAW, list->sort_key, sizeof(uint64_t) * new_cap);
+            list->sort_tmp = (uint64_t*)mem_realloc(MEM_DRAW, list->sort_tmp, sizeof(uint64_t) * new_cap);
+        }
+        list->vertices = (Particle_Vertex*)mem_realloc(MEM_DRAW, list->vertices, sizeof(Particle_Vertex) * PARTICLE_QUAD_VERTICES * new_cap);
+        list->indices = (uint32_t*)mem_realloc(MEM_DRAW, list->indices, sizeof(uint32_t) * PARTICLE_QUAD_INDICES * new_cap);
+        list->cap = new_cap;
     }
 
-    int i = buffer->size;
-    buffer->size += 1;
+    int i = list->size;
+    list->size += num;
     return i;
 }
 
-void emit_particle_buffer_particle(Particle_DrawBuffer *buffer,
-        Particle_System *PS, Particles *P, int i,
-        vec3 cam_pos, mat4 view_mat, vec3 right, vec3 up, vec3 look)
+Particle_DrawBatch* add_particle_buffer_batch(Particle_DrawList *list)
 {
-    bool stretch = PS->stretch;
-    bool additive = PS->additive;
-    int tile_x = PS->sheet_tile_x;
-    int tile_y = PS->sheet_tile_y;
-
-    int bi = add_particle_buffer_particle(buffer);
+    if (list->batch_num + 1 > list->batch_cap)
+    {
+        int new_cap = list->batch_cap + 16;
+        list->batches = (Particle_DrawBatch*)mem_realloc(MEM_DRAW, list->batches, sizeof(Particle_DrawBatch) * new_cap);
+        list->batch_cap = new_cap;
+    }
+    Particle_DrawBatch *batch = &list->batches[list->batch_num++];
+    batch->first = list->size;
+    batch->num = 0;
+    return batch;
+}
 
-    float size = P->size[i] * 0.5f;
+// Returns false if the emitter is culled as a whole. Tiers of PS with a larger min_pixels cull more.
+template <class PARTICLES>
+bool draw_particles_to_buffer(Particle_DrawBuffer *buffer, Camera camera, Particle_System *PS, PARTICLES *P, int particle_num,
+        const Particle_Bounds *bounds, int lod)
+{
+    TRACE_ZONE("draw_to_buffer");
+    Particle_Quad_Style style = particle_quad_style(PS, buffer->tile_w, buffer->tile_h);
+    if (buffer->culling && !particle_cull_bounds(&buffer->cull, bounds, &style)) return false;
 
-    vec3 w_pos = P->position[i];
-    vec3 h0, h1;
+    float min_pixels = buffer->cull.min_pixels;
+    if (lod > 0 && lod < PS->lod_tier_num && PS->lod[lod].min_pixels > min_pixels) buffer->cull.min_pixels = PS->lod[lod].min_pixels;
 
-    if (stretch)
+    Particle_View view = particle_view(camera_matrix(camera));
+    Particle_Quad_Streams streams = { P->position, P->velocity, P->size, P->color };
+    if (PS->closed_form)
     {
-        vec3 w_vel = P->velocity[i];
-
-        vec3 e3 = look;
-        vec3 v = normalize(w_vel);
-        //vec3 hh0 = normalize(w_vel - e3 * dot(w_vel, e3));
-        //vec3 hh1 = normalize(cross(hh0, e3));
-        vec3 hh0 = v; //normalize(w_vel - e3 * dot(w_vel, e3));
-        vec3 hh1 = normalize(cross(v, e3));
-#if 0
-        vec3 hh12 = normalize(cross(v, up));
-
-        float kk = dot(look, v);
-        kk *= kk;
-        kk *= kk;
-        kk *= kk;
-        hh1 = lerp(hh1, hh12, kk*kk);
-
-        h0 = hh0 * size;
-        h1 = hh1 * size;
-
-        float k = dot(look, v) * 0.9f;
-        k *= k;
-        k *= k;
-
-        k = 0.0f;
-
-        vec3 v_vel_x = w_vel - e3 * dot(w_vel, e3);
-        float t = dot(v_vel_x, v_vel_x);
-        vec3 v_vel = lerp(right, normalize(v_vel_x), t > 0.1f ? 1.0f : t * 10.0f);
-        vec3 vv0 = v_vel;
-        vec3 vv1 = normalize(cross(v_vel, e3));
-
-        vec3 v0 = vv0 * size;
-        vec3 v1 = vv1 * size;
-
-        h0 = lerp(h0, v0, k)*0.16f;
-        h1 = lerp(h1, v1, k)*0.16f;
-#else
-        float dt = 0.016f; // 1/60 s delta time * speed = delta distance
-        float len = sqrtf(dot(w_vel, w_vel));
-        h0 = hh0 * size * len * dt;
-        h1 = hh1 * size * dt;
-#endif
-
-        w_pos = w_pos + h0;
+        streams.acceleration = P->acceleration;
+        streams.life_seconds = P->life_seconds;
+        streams.life_max = P->life_max;
+        streams.drag = PS->emitter.drag;
     }
-    else if (PS->align_to_axis)
-    {
-        up = PS->align_axis;
-        vec3 v = normalize(w_pos - cam_pos);
-        right = normalize(cross(up, v));
-        //right = normalize(cross(up, normalize(w_pos - cam_pos)));
 
-        h0 = right * size;
-        h1 = up * size;
-    }
-    else
-    {
-        h0 = right * size;
-        h1 = up * size;
-    }
+    Particle_DrawList *list = PS->additive ? &buffer->additive : &buffer->alpha;
+    Particle_DrawBatch *batch = add_particle_buffer_batch(list);
+    int first = add_particle_buffer_particles(list, particle_num);
+    batch->num = particle_expand_quads(&streams, particle_num, &view, &style, buffer->culling ? &buffer->cull : nullptr,
+            &list->vertices[first * PARTICLE_QUAD_VERTICES], list->sorted ? &list->depth[first] : nullptr);
+    list->size = first + batch->num;
+    buffer->cull.min_pixels = min_pixels;
+    return true;
+}
 
-    vec4 v_pos = transform(view_mat, vec4{w_pos.x, w_pos.y, w_pos.z, 1.0f});
-    // right hand coordinate system, where negative z is forward
-    union {
-        float depth_f;
-        uint32_t depth_u;
-    };
-    depth_f = v_pos.z;
-
-    // 1  8        7
-    // s  eeeeeeee xxxxxxx
-    uint32_t depth = depth_u ^ 0xfffff000;
-    depth &= 0xffff0000;
-
-    buffer->sort_key[bi] = (uint32_t)depth | (uint32_t)bi;
-    buffer->additive[bi] = additive;
-    buffer->P[bi] = w_pos;
-    buffer->h0[bi] = h0;
-    buffer->h1[bi] = h1;
-    buffer->color[bi] = P->color[i];
-    buffer->sheet_tile_index[bi] = tile_x | (tile_y << 8);
+bool draw_to_buffer(Particle_DrawBuffer *buffer, Camera camera, Particle_System *PS, Emitter_Instance *E)
+{
+    return draw_particles_to_buffer(buffer, camera, PS, &E->P, E->particles_alive, &E->bounds, E->lod);
 }
 
-void draw_to_buffer(Particle_DrawBuffer *buffer, Camera camera, Particle_System *PS, Emitter_Instance *E)
+bool draw_batch_to_buffer(Particle_DrawBuffer *buffer, Camera camera, Emitter_Batch *B)
 {
-    Particles *P = &E->P;
+    return draw_particles_to_buffer(buffer, camera, B->PS, &B->P, B->particles_alive, &B->bounds, 0);
+}
 
-    mat4 view_mat = camera_matrix(camera);
-    //vec3 cam_pos = {view_mat[3], view_mat[7], view_mat[11]};
-    mat4 camera_w = invert_affine(view_mat);
-    vec3 cam_pos = {camera_w[3], camera_w[7], camera_w[11]};
-    vec3 right = {view_mat[0], view_mat[1], view_mat[2]};
-    vec3 up = {view_mat[4], view_mat[5], view_mat[6]};
-    vec3 look = {view_mat[8], view_mat[9], view_mat[10]};
-
-    for (int i = 0; i < E->particles_alive; i++)
-    {
-        emit_particle_buffer_particle(buffer, PS, P, i,
-                cam_pos, view_mat, right, up, look);
-    }
+bool draw_snapshot_to_buffer(Particle_DrawBuffer *buffer, Camera camera, Emitter_Snapshot *ES, int lod)
+{
+    return draw_particles_to_buffer(buffer, camera, ES->PS, ES, ES->particles_alive, &ES->bounds, lod);
 }
 
-void reset_particle_buffer(Particle_DrawBuffer *buffer)
+void free_particle_list(Particle_DrawList *list)
 {
-    buffer->size = 0;
+    mem_free(list->depth);
+    mem_free(list->sort_key);
+    mem_free(list->sort_tmp);
+    mem_free(list->vertices);
+    mem_free(list->indices);
+    mem_free(list->batches);
+    *list = { };
 }
 
-void draw_particle_buffer_particle(Particle_DrawBuffer *buffer, uint32_t i,
-        float tx0, float ty0, float tx1, float ty1)
+void free_particle_buffer(Particle_DrawBuffer *buffer)
 {
-    vec3 w_pos = buffer->P[i];
-    vec3 h0 = buffer->h0[i];
-    vec3 h1 = buffer->h1[i];
-    vec4 color = buffer->color[i];
-
-    vec3 w_pos0 = w_pos - h0 - h1;
-    vec3 w_pos1 = w_pos - h0 + h1;
-    vec3 w_pos2 = w_pos + h0 + h1;
-    vec3 w_pos3 = w_pos + h0 - h1;
-
-    glColor4f(color.x, color.y, color.z, color.w);
-    glTexCoord2f(tx0, ty0);
-    glVertex3fv(&w_pos0.x);
-    glTexCoord2f(tx0, ty1);
-    glVertex3fv(&w_pos1.x);
-    glTexCoord2f(tx1, ty1);
-    glVertex3fv(&w_pos2.x);
-    glTexCoord2f(tx0, ty0);
-    glVertex3fv(&w_pos0.x);
-    glTexCoord2f(tx1, ty1);
-    glVertex3fv(&w_pos2.x);
-    glTexCoord2f(tx1, ty0);
-    glVertex3fv(&w_pos3.x);
+    free_particle_list(&buffer->alpha);
+    free_particle_list(&buffer->additive);
 }
 
-struct ParticleSheet
+mat4 camera_projection(int width, int height)
 {
-    GLuint texture;
-    int width;
-    int height;
-    int tile_size; // tiles are square
-};
+    return Perspective_lh(90.0f, (float)width / (float)height, 0.1f, 1000.0f);
+}
 
-#include <algorithm>
+// Starts a frame, the particles drawn to the buffer are culled against this camera.
+void reset_particle_buffer(Particle_DrawBuffer *buffer, Camera camera, int width, int height)
+{
+    buffer->cull = particle_cull(camera_projection(width, height), camera_matrix(camera), height, buffer->min_pixels);
+    buffer->alpha.size = 0;
+    buffer->alpha.batch_num = 0;
+    buffer->additive.size = 0;
+    buffer->additive.batch_num = 0;
+}
 
-void draw_particle_buffer(Particle_DrawBuffer *buffer, ParticleSheet sheet)
+void draw_particle_list(Particle_DrawList *list)
 {
-    std::sort(buffer->sort_key, buffer->sort_key + buffer->size);
+    Particle_Vertex *v = list->vertices;
+    glVertexPointer(3, GL_FLOAT, sizeof(Particle_Vertex), &v->x);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(Particle_Vertex), &v->u);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Particle_Vertex), &v->color);
+    glDrawElements(GL_TRIANGLES, list->size * PARTICLE_QUAD_INDICES, GL_UNSIGNED_INT, list->indices);
+}
 
-    float tw = (float)sheet.tile_size / (float)sheet.width;
-    float th = (float)sheet.tile_size / (float)sheet.height;
+void draw_particle_buffer(Particle_DrawBuffer *buffer, ParticleSheet sheet)
+{
+    Particle_DrawList *alpha = &buffer->alpha;
+    Particle_DrawList *additive = &buffer->additive;
+    if (alpha->size > 0)
+    {
+        TRACE_ZONE("sort");
+        const uint64_t *sorted = draw_sort(alpha->depth, alpha->size, buffer->depth_bits, alpha->sort_key, alpha->sort_tmp);
+        // Back to front, the tiles of the systems are in the texture coordinates, so it is one draw.
+        particle_quad_indices_sorted(alpha->indices, sorted, alpha->size, 0);
+    }
+    particle_quad_indices(additive->indices, 0, additive->size, 0);
 
+    TRACE_ZONE("submit");
     glEnable(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, sheet.texture);
-
     glEnable(GL_BLEND);
-    //glBlendFunc(GL_ONE, GL_ONE);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-    bool additive_on = true;
-
-    glBegin(GL_TRIANGLES);
-    for (int i = 0; i < buffer->size; i++)
-    {
-        uint32_t key = buffer->sort_key[i];
-        uint32_t index = key & 0xffff;
-
-        uint16_t tile_index = buffer->sheet_tile_index[index];
-        uint8_t tile_x = tile_index & 0xff;
-        uint8_t tile_y = (tile_index >> 8) & 0xff;
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
 
-        float tx0 = tw * tile_x;
-        float ty0 = th * tile_y;
-        float tx1 = tx0 + tw;
-        float ty1 = ty0 + th;
-        ty0 = 1.0f - ty0;
-        ty1 = 1.0f - ty1;
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (alpha->size > 0) draw_particle_list(alpha);
 
-        if (buffer->additive[index] != additive_on)
-        {
-            glEnd();
-            if (buffer->additive[index])
-            {
-                //glBlendFunc(GL_ONE, GL_ONE);
-                glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-            }
-            else
-            {
-                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-            }
-            additive_on = buffer->additive[index];
-            glBegin(GL_TRIANGLES);
-        }
-
-        draw_particle_buffer_particle(buffer, index, tx0, ty0, tx1, ty1);
-    }
-    glEnd();
+    //glBlendFunc(GL_ONE, GL_ONE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+    if (additive->size > 0) draw_particle_list(additive);
 
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
     glDisable(GL_BLEND);
 }
 
@@ -1378,7 +635,7 @@ void draw_floor(GLuint texture)
 
 void draw(Particle_DrawBuffer *buffer, ParticleSheet particle_sheet, GLuint floor_tex, Camera camera, int width, int height)
 {
-    mat4 camera_proj = Perspective_lh(90.0f, (float)width / (float)height, 0.1f, 1000.0f);
+    mat4 camera_proj = camera_projection(width, height);
     camera_proj = transpose(camera_proj);
 
     glMatrixMode(GL_PROJECTION);
@@ -1410,537 +667,311 @@ void draw(Particle_DrawBuffer *buffer, ParticleSheet particle_sheet, GLuint floo
 }
 
 
-const char* read_file(const char *filename, int *len)
-{
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) return nullptr;
+/*
+ * Profiler window: rolling histories of the stage times of the selected particle system, taken from
+ * its Particle_System_Stats, and of the render stages, taken from the trace zone totals. The budgets
+ * are per particle system and frame, the systems that go over them are highlighted in the overview.
+ * The memory section shows the memtrack usage per tag and of the selected system, the culling section
+ * the particles the draw buffer culled.
+ */
+enum { PROFILER_HISTORY = 240, PROFILER_MAX_SYSTEMS = 16 };
 
-    fseek(fp, 0, SEEK_END);
-    int file_len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+enum Render_Stage
+{
+    RENDER_STAGE_DRAW_BUILD,
+    RENDER_STAGE_SORT,
+    RENDER_STAGE_SUBMIT,
+    RENDER_STAGE_NUM
+};
 
-    char *s = (char*)malloc(file_len);
-    fread(s, 1, file_len, fp);
+// The trace zones of the render stages.
+const char *render_stage_names[RENDER_STAGE_NUM] = { "draw_to_buffer", "sort", "submit" };
 
-    *len = file_len;
-    return s;
-}
+// The stages that do not run inside another one, their sum is the simulation time.
+const int sim_top_level_stages[] = {
+    SIM_STAGE_EMIT, SIM_STAGE_COMPACT, SIM_STAGE_ACCELERATION_P, SIM_STAGE_INTEGRATE, SIM_STAGE_SIZE_P, SIM_STAGE_COLOR_P
+};
 
-struct StringRef
+struct Profiler_System
 {
-    const char *s;
-    int len;
+    const char *name;
+    Particle_System *PS;
+    Particle_System_Stats *stats;   // reloading reallocates the stats, the counters start over then
+    uint64_t last_stage_cycles[SIM_STAGE_NUM];
+    uint64_t last_particle_updates;
+    uint64_t draw_cycles;           // draw build of the current frame
+
+    float stage_us[SIM_STAGE_NUM][PROFILER_HISTORY];
+    float sim_us[PROFILER_HISTORY];
+    float draw_us[PROFILER_HISTORY];
+    float particles[PROFILER_HISTORY];
+    float ns_per_particle[PROFILER_HISTORY];
+
+    // Averages over the history, these are compared to the budgets.
+    float avg_sim_us;
+    float avg_draw_us;
 };
 
-bool str_equals(StringRef str, const char *s2)
+struct Profiler
 {
-    int len = strlen(s2);
-    if (len != str.len) return false;
+    int frame;              // history index of the frame being recorded
+    double us_per_tick;
+    uint64_t last_ticks;
 
-    const char *s1 = str.s;
-    while (s2[0] != '\0')
-    {
-        if (s1[0] != s2[0]) return false;
-        s2++;
-        s1++;
-    }
+    float sim_budget_us;
+    float draw_budget_us;
 
-    return true;
-}
+    int render_zones[RENDER_STAGE_NUM];
+    uint64_t last_render_cycles[RENDER_STAGE_NUM];
+    float render_us[RENDER_STAGE_NUM][PROFILER_HISTORY];
+    float memory_kb[PROFILER_HISTORY];  // live, all tags
+    float cull_tested[PROFILER_HISTORY];
+    float cull_outside[PROFILER_HISTORY];
+    float cull_small[PROFILER_HISTORY];
+    float cull_emitters[PROFILER_HISTORY];
+    float particle_us[PROFILER_HISTORY];    // simulation and render stages of all the systems
+    float governor_level[PROFILER_HISTORY];
 
-bool skip_whitespace(const char *&p, const char *end)
+    int system_num;
+    Profiler_System systems[PROFILER_MAX_SYSTEMS];
+};
+
+void profiler_init(Profiler *prof, Particle_System **PS, const char **names, int ps_num)
 {
-    bool ws_found = false;
-    while (p < end)
+    *prof = { };
+    prof->sim_budget_us = 500.0f;
+    prof->draw_budget_us = 250.0f;
+    for (int i = 0; i < RENDER_STAGE_NUM; i++)
     {
-        switch (p[0])
-        {
-            case '\n': case '\r': case ' ': case '\t':
-                ws_found = true;
-                p++;
-                continue;
-        }
-        break;
+        prof->render_zones[i] = trace_zone_id(render_stage_names[i]);
+        prof->last_render_cycles[i] = trace_zone_total_cycles(prof->render_zones[i]);
     }
-    return ws_found;
-}
-
-StringRef read_attribute(const char *&p, const char *end)
-{
-    if (p >= end) return { };
-    if (!isalpha(p[0])) return { };
-
-    const char *start = p;
-    while ((p < end) && (isalpha(p[0]) || p[0] == '_'))
+    if (ps_num > PROFILER_MAX_SYSTEMS) ps_num = PROFILER_MAX_SYSTEMS;
+    prof->system_num = ps_num;
+    for (int i = 0; i < ps_num; i++)
     {
-        p++;
+        prof->systems[i].name = names[i];
+        prof->systems[i].PS = PS[i];
     }
-    int len = p - start;
-    return {start, len};
 }
 
-enum Attribute_ValueType
-{
-    ATTR_BOOLEAN,
-    ATTR_F1, ATTR_F2, ATTR_F3, ATTR_F4,
-    ATTR_PROGRAM,
-};
-
-bool convert_boolean(const char *s, int len)
+Profiler_System* profiler_find_system(Profiler *prof, Particle_System *PS)
 {
-    (void)len;
-    return s[0] == 't';
+    for (int i = 0; i < prof->system_num; i++)
+    {
+        if (prof->systems[i].PS == PS) return &prof->systems[i];
+    }
+    return nullptr;
 }
 
-float convert_f1(const char *s, int len)
+void profiler_add_draw(Profiler *prof, Particle_System *PS, uint64_t cycles)
 {
-    char buf[32];
-    memcpy(buf, s, len);
-    buf[len] = '\0';
-    return atof(buf);
+    Profiler_System *sys = profiler_find_system(prof, PS);
+    if (sys) sys->draw_cycles += cycles;
 }
 
-void convert_f2(float *v, const char *s, int len)
+float history_average(const float *values)
 {
-    (void)len;
-    s += 5; // vec2(
-    int i = 0;
-    while (s[0] != ')')
-    {
-        while (s[0] == ' ') s++;
-        const char *start = s;
-        while (s[0] != ',' && s[0] != ')' && s[0] != ' ') s++;
-
-        v[i] = convert_f1(start, s - start);
-
-        while (s[0] == ' ') s++;
-        if (s[0] == ',') s++;
-        i++;
-    }
+    float sum = 0.0f;
+    for (int i = 0; i < PROFILER_HISTORY; i++) sum += values[i];
+    return sum / PROFILER_HISTORY;
 }
 
-void convert_f3(float *v, const char *s, int len)
+// Records the frame into the histories, dt is the frame time in seconds. cull is null when culling is off.
+// Returns the particle cost of the frame in microseconds, the simulation and render stages of all the systems.
+float profiler_end_frame(Profiler *prof, Simulation_Snapshot *snapshot, const Particle_Cull *cull, int governor_level, float dt)
 {
-    (void)len;
-    s += 5; // vec3(
-    int i = 0;
-    while (s[0] != ')')
+    // rdtsc ticks to microseconds, calibrated against the frame timer.
+    uint64_t ticks = __rdtsc();
+    if (prof->last_ticks && ticks > prof->last_ticks && dt > 0.0f)
     {
-        while (s[0] == ' ') s++;
-        const char *start = s;
-        while (s[0] != ',' && s[0] != ')' && s[0] != ' ') s++;
-
-        v[i] = convert_f1(start, s - start);
-
-        while (s[0] == ' ') s++;
-        if (s[0] == ',') s++;
-        i++;
+        double us_per_tick = dt * 1e6 / (double)(ticks - prof->last_ticks);
+        prof->us_per_tick = (prof->us_per_tick > 0.0) ? prof->us_per_tick * 0.95 + us_per_tick * 0.05 : us_per_tick;
     }
-}
+    prof->last_ticks = ticks;
+    double us_per_tick = prof->us_per_tick;
+    int f = prof->frame;
+    float particle_us = 0.0f;
 
-void convert_f4(float *v, const char *s, int len)
-{
-    (void)len;
-    s += 5; // vec4(
-    int i = 0;
-    while (s[0] != ')')
+    for (int i = 0; i < RENDER_STAGE_NUM; i++)
     {
-        while (s[0] == ' ') s++;
-        const char *start = s;
-        while (s[0] != ',' && s[0] != ')' && s[0] != ' ') s++;
-
-        v[i] = convert_f1(start, s - start);
-
-        while (s[0] == ' ') s++;
-        if (s[0] == ',') s++;
-        i++;
+        uint64_t cycles = trace_zone_total_cycles(prof->render_zones[i]);
+        prof->render_us[i][f] = (float)((cycles - prof->last_render_cycles[i]) * us_per_tick);
+        prof->last_render_cycles[i] = cycles;
+        particle_us += prof->render_us[i][f];
     }
-}
 
-StringRef read_value(const char *&p, const char *file_end, Attribute_ValueType *type)
-{
-    switch (p[0])
+    for (int si = 0; si < prof->system_num; si++)
     {
-    case 't':
+        Profiler_System *sys = &prof->systems[si];
+        Particle_System_Stats *stats = sys->PS->stats;
+        if (stats != sys->stats)
         {
-            *type = ATTR_BOOLEAN;
-            const char *start = p;
-            while (p < file_end)
-            {
-                if (p[0] == ' ' || p[0] == '\n' || p[0] == '\r' || p[0] == '\t')
-                {
-                    break;
-                }
-                p++;
-            }
-            int len = p - start;
-            StringRef result = {start, len};
-            if (!str_equals(result, "true"))
-            {
-                printf("Error: expected true value\n");
-                return { };
-            }
-            return result;
-        } break;
-    case 'f':
-        {
-            *type = ATTR_BOOLEAN;
-            const char *start = p;
-            while (p < file_end)
-            {
-                if (p[0] == ' ' || p[0] == '\n' || p[0] == '\r' || p[0] == '\t')
-                {
-                    break;
-                }
-                p++;
-            }
-            int len = p - start;
-            StringRef result = {start, len};
-            if (!str_equals(result, "false"))
-            {
-                printf("Error: expected false value\n");
-                return { };
-            }
-            return result;
-        } break;
-    case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+            sys->stats = stats;
+            for (int i = 0; i < SIM_STAGE_NUM; i++) sys->last_stage_cycles[i] = 0;
+            sys->last_particle_updates = 0;
+        }
+
+        uint64_t stage_cycles[SIM_STAGE_NUM];
+        for (int i = 0; i < SIM_STAGE_NUM; i++)
         {
-            *type = ATTR_F1;
-            const char *start = p;
-            while (p < file_end && isdigit(p[0])) p++;
-            if (p < file_end && p[0] == '.')
-            {
-                p++;
-                while (p < file_end && isdigit(p[0])) p++;
-                if (p < file_end && (p[0] == 'e' || p[0] == 'E'))
-                {
-                    p++;
-                    if (p < file_end && (p[0] == '-' || p[0] == '+')) p++;
-                    while (p < file_end && isdigit(p[0])) p++;
-                }
-            }
-            int len = p - start;
-            return {start, len};
-        } break;
-    case 'v':
+            uint64_t cycles = stats ? stats->stage_cycles[i].load(std::memory_order_relaxed) : 0;
+            stage_cycles[i] = cycles - sys->last_stage_cycles[i];
+            sys->last_stage_cycles[i] = cycles;
+            sys->stage_us[i][f] = (float)(stage_cycles[i] * us_per_tick);
+        }
+        uint64_t sim_cycles = 0;
+        for (int stage : sim_top_level_stages)
         {
-            const char *start = p;
-            if (p + 5 < file_end &&
-                (p[0] == 'v' && p[1] == 'e' && p[2] == 'c' && p[4] == '('))
-            {
-                p += 5;
-                switch (p[-2])
-                {
-                case '2':
-                    {
-                        *type = ATTR_F2;
-                    } break;
-                case '3':
-                    {
-                        *type = ATTR_F3;
-                    } break;
-                case '4':
-                    {
-                        *type = ATTR_F4;
-                    } break;
-                }
+            sim_cycles += stage_cycles[stage];
+        }
+        uint64_t updates = stats ? stats->particle_updates.load(std::memory_order_relaxed) : 0;
+        uint64_t update_delta = updates - sys->last_particle_updates;
+        sys->last_particle_updates = updates;
 
-                while (p < file_end && p[0] != ')') p++;
-                if (p == file_end)
-                {
-                    printf("Error: unexpected end of file\n");
-                    return { };
-                }
-                p++; // skip ')'
-            }
-            else
-            {
-                printf("Error: Expected vec2, vec3 or vec4\n");
-                return { };
-            }
-            int len = p - start;
-            return {start, len};
-        } break;
-    case '{':
+        int particles = 0;
+        for (int i = 0; snapshot && i < snapshot->emitter_num; i++)
         {
-            if (p + 1 >= file_end || p[1] != '{')
-            {
-                printf("Error: Expected {{ to start expression\n");
-                return { };
-            }
-            p += 2;
+            if (snapshot->emitters[i].PS == sys->PS) particles += snapshot->emitters[i].particles_alive;
+        }
 
-            *type = ATTR_PROGRAM;
-            const char *start = p;
-            while (p < file_end && p[0] != '}')
-            {
-                p++;
-            }
+        sys->sim_us[f] = (float)(sim_cycles * us_per_tick);
+        particle_us += sys->sim_us[f];
+        sys->draw_us[f] = (float)(sys->draw_cycles * us_per_tick);
+        sys->particles[f] = (float)particles;
+        sys->ns_per_particle[f] = update_delta ? (float)(sim_cycles * us_per_tick * 1000.0 / update_delta) : 0.0f;
+        sys->draw_cycles = 0;
 
-            const char *end = p;
-            if (p + 1 >= file_end && p[1] != '}')
-            {
-                printf("Error: Expected }} to end expression\n");
-                return { };
-            }
-            p += 2;
-
-            int len = end - start;
-            return {start, len};
-        } break;
+        sys->avg_sim_us = history_average(sys->sim_us);
+        sys->avg_draw_us = history_average(sys->draw_us);
     }
-    printf("ERROR: INVALID VALUE\n");
-    return { };
+
+    prof->memory_kb[f] = (float)(mem_usage(MEM_TAG_NUM).live / 1024.0);
+    prof->cull_tested[f] = cull ? (float)cull->tested : 0.0f;
+    prof->cull_outside[f] = cull ? (float)cull->outside : 0.0f;
+    prof->cull_small[f] = cull ? (float)cull->small : 0.0f;
+    prof->cull_emitters[f] = cull ? (float)cull->emitters_outside : 0.0f;
+    prof->particle_us[f] = particle_us;
+    prof->governor_level[f] = (float)governor_level;
+    prof->frame = (f + 1) % PROFILER_HISTORY;
+    return particle_us;
 }
 
-Particle_System load_particle_system(const char *filename)
+int particle_update_instructions(Particle_System *PS)
 {
-    Particle_System result = { };
-    result.stretch = false;
-    result.additive = false;
-    result.emitter.life = 8.0f;
-    result.emitter.cooldown = 2.0f;
-    result.emitter.loop = true;
-    result.emitter.rate = 200.0f;
-    result.emitter.initial_life = 2.0f;
-    result.emitter.acceleration = vec3{0.0f, 0.0f, 0.0f};
-    result.emitter.drag = 0.95f;
-    result.emitter.initial_velocity = vec3{0.0f, 1.0f, 0.0f};
-    result.size = 0.2f;
-    result.color = vec4{1, 1, 1, 1};
-
-    //return result;
-
-    int file_len = 0;
-    const char *file_str = read_file(filename, &file_len);
-
-    if (!file_str) return result;
-
-    const char *file_end = file_str + file_len;
-    const char *p = file_str;
-
-    float sheet_tile_x = 0.0f;
-    float sheet_tile_y = 0.0f;
-
-    enum { EMITTER_ATTRIBUTE_NUM = 12, PARTICLE_ATTRIBUTE_NUM = 3 };
-    struct {
-        const char *name;
-        Attribute_ValueType type;
-        float *value;
-        FXVM_Program *p_value;
-        bool *b_value;
-    } emitter_attribute_map[EMITTER_ATTRIBUTE_NUM] = {
-        {"stretch", ATTR_BOOLEAN, nullptr, nullptr, &result.stretch},
-        {"additive", ATTR_BOOLEAN, nullptr, nullptr, &result.additive},
-        {"sheet_tile_x", ATTR_F1, &sheet_tile_x, nullptr, nullptr},
-        {"sheet_tile_y", ATTR_F1, &sheet_tile_y, nullptr, nullptr},
-        {"emitter_loop", ATTR_BOOLEAN, nullptr, nullptr, &result.emitter.loop},
-        {"emitter_life", ATTR_F1, &result.emitter.life, nullptr, nullptr},
-        {"emitter_cooldown", ATTR_F1, &result.emitter.cooldown, nullptr, nullptr},
-        {"emitter_rate", ATTR_F1, &result.emitter.rate, &result.emitter.rate_p, nullptr},
-        {"drag", ATTR_F1, &result.emitter.drag, &result.emitter.drag_p, nullptr},
-        {"initial_life", ATTR_F1, &result.emitter.initial_life, &result.emitter.initial_life_p, nullptr},
-        {"initial_position", ATTR_F3, &result.emitter.initial_position.x, &result.emitter.initial_position_p, nullptr},
-        {"initial_velocity", ATTR_F3, &result.emitter.initial_velocity.x, &result.emitter.initial_velocity_p, nullptr},
-    }, particle_attribute_map[PARTICLE_ATTRIBUTE_NUM] = {
-        {"acceleration", ATTR_F3, &result.acceleration.x, &result.acceleration_p, nullptr},
-        {"color", ATTR_F4, &result.color.x, &result.color_p, nullptr},
-        {"size", ATTR_F1, &result.size, &result.size_p, nullptr},
-    };
+    int count = 0;
+    if (PS->acceleration_p.bytecode.code) count += fxvm_instruction_count(&PS->acceleration_p.bytecode);
+    if (PS->size_p.bytecode.code) count += fxvm_instruction_count(&PS->size_p.bytecode);
+    if (PS->color_p.bytecode.code) count += fxvm_instruction_count(&PS->color_p.bytecode);
+    return count;
+}
 
-    while (p < file_end)
-    {
-        skip_whitespace(p, file_end);
-        if (p == file_end)
-        {
-            break;
-        }
+void plot_history(const char *label, const float *values, int frame, const char *unit)
+{
+    char overlay[64];
+    float last = values[(frame + PROFILER_HISTORY - 1) % PROFILER_HISTORY];
+    snprintf(overlay, sizeof(overlay), "%.1f %s (avg %.1f)", last, unit, history_average(values));
+    ImGui::PlotLines(label, values, PROFILER_HISTORY, frame, overlay, 0.0f, FLT_MAX, ImVec2(0, 40));
+}
 
-        StringRef attribute = read_attribute(p, file_end);
-        if (!attribute.s)
-        {
-            // TODO: line and column
-            printf("Error: was expecting for an attribute\n");
-            goto err;
-        }
+void profiler_window(Profiler *prof, int *selected)
+{
+    const ImVec4 over_budget_color = ImVec4(1.0f, 0.35f, 0.3f, 1.0f);
 
-        skip_whitespace(p, file_end);
-        if (p == file_end || p[0] != '=')
-        {
-            // TODO: line and column
-            printf("Error: was expecting =\n");
-            goto err;
-        }
+    ImGui::Begin("Profiler");
+    ImGui::SliderFloat("Sim budget", &prof->sim_budget_us, 10.0f, 5000.0f, "%.0f us", 2.0f);
+    ImGui::SliderFloat("Draw budget", &prof->draw_budget_us, 10.0f, 5000.0f, "%.0f us", 2.0f);
+    ImGui::Separator();
 
-        p++; // skip '='
+    ImGui::Columns(5, "systems");
+    ImGui::Text("System"); ImGui::NextColumn();
+    ImGui::Text("Particles"); ImGui::NextColumn();
+    ImGui::Text("Sim us"); ImGui::NextColumn();
+    ImGui::Text("Draw us"); ImGui::NextColumn();
+    ImGui::Text("ns/particle"); ImGui::NextColumn();
+    ImGui::Separator();
+    int last = (prof->frame + PROFILER_HISTORY - 1) % PROFILER_HISTORY;
+    for (int i = 0; i < prof->system_num; i++)
+    {
+        Profiler_System *sys = &prof->systems[i];
+        bool over_sim = sys->avg_sim_us > prof->sim_budget_us;
+        bool over_draw = sys->avg_draw_us > prof->draw_budget_us;
+
+        if (over_sim || over_draw) ImGui::PushStyleColor(ImGuiCol_Text, over_budget_color);
+        if (ImGui::Selectable(sys->name, *selected == i, ImGuiSelectableFlags_SpanAllColumns)) *selected = i;
+        ImGui::NextColumn();
+        ImGui::Text("%.0f", sys->particles[last]); ImGui::NextColumn();
+        ImGui::Text("%.1f", sys->avg_sim_us); ImGui::NextColumn();
+        ImGui::Text("%.1f", sys->avg_draw_us); ImGui::NextColumn();
+        ImGui::Text("%.1f", history_average(sys->ns_per_particle)); ImGui::NextColumn();
+        if (over_sim || over_draw) ImGui::PopStyleColor();
+    }
+    ImGui::Columns(1);
+    ImGui::Separator();
 
-        skip_whitespace(p, file_end);
-        if (p == file_end)
+    if (*selected >= 0 && *selected < prof->system_num)
+    {
+        Profiler_System *sys = &prof->systems[*selected];
+        ImGui::Text("%s", sys->name);
+        ImGui::Text("VM instructions per particle update: %d", particle_update_instructions(sys->PS));
+        if (!sys->stats) ImGui::Text("No stage timings, the system was not loaded from a file.");
+
+        if (sys->avg_sim_us > prof->sim_budget_us) ImGui::TextColored(over_budget_color, "Over the sim budget by %.1f us", sys->avg_sim_us - prof->sim_budget_us);
+        if (sys->avg_draw_us > prof->draw_budget_us) ImGui::TextColored(over_budget_color, "Over the draw budget by %.1f us", sys->avg_draw_us - prof->draw_budget_us);
+
+        plot_history("particles", sys->particles, prof->frame, "");
+        plot_history("ns/particle", sys->ns_per_particle, prof->frame, "ns");
+        plot_history("sim", sys->sim_us, prof->frame, "us");
+        for (int i = 0; i < SIM_STAGE_NUM; i++)
         {
-            printf("Error: unexpected end of file\n");
-            goto err;
+            plot_history(sim_stage_names[i], sys->stage_us[i], prof->frame, "us");
         }
+        plot_history("draw build", sys->draw_us, prof->frame, "us");
+    }
 
-        Attribute_ValueType type;
-        StringRef value = read_value(p, file_end, &type);
-        if (!value.s)
-        {
-            goto err;
-        }
+    ImGui::Separator();
+    ImGui::Text("Render, all systems");
+    for (int i = 0; i < RENDER_STAGE_NUM; i++)
+    {
+        plot_history(render_stage_names[i], prof->render_us[i], prof->frame, "us");
+    }
 
-        bool emitter_attrib_found = false;
-        for (int i = 0; i < EMITTER_ATTRIBUTE_NUM; i++)
-        {
-            auto attrib = emitter_attribute_map[i];
-            if (str_equals(attribute, attrib.name))
-            {
-                emitter_attrib_found = true;
-                switch (type)
-                {
-                case ATTR_BOOLEAN:
-                    {
-                        if (!attrib.b_value || attrib.type != type)
-                        {
-                            printf("Error: no boolean value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        *attrib.b_value = convert_boolean(value.s, value.len);
-                    } break;
-                case ATTR_F1:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no scalar value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        *attrib.value = convert_f1(value.s, value.len);
-                    } break;
-                case ATTR_F2:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no vec2 value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        convert_f2(attrib.value, value.s, value.len);
-                    } break;
-                case ATTR_F3:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no vec3 value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        convert_f3(attrib.value, value.s, value.len);
-                    } break;
-                case ATTR_F4:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no vec4 value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        convert_f4(attrib.value, value.s, value.len);
-                    } break;
-                case ATTR_PROGRAM:
-                    {
-                        if (!attrib.p_value) // TODO: type check
-                        {
-                            printf("Error: no program value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        *attrib.p_value = compile_emitter_expr(&result, value.s, value.len);
-                    } break;
-                }
-            }
-        }
-        if (emitter_attrib_found) continue;
+    plot_history("particles total", prof->particle_us, prof->frame, "us");
+    plot_history("governor level", prof->governor_level, prof->frame, "");
 
-        bool particle_attrib_found = false;
-        for (int i = 0; i < PARTICLE_ATTRIBUTE_NUM; i++)
+    if (ImGui::CollapsingHeader("Culling"))
+    {
+        plot_history("tested", prof->cull_tested, prof->frame, "");
+        plot_history("outside", prof->cull_outside, prof->frame, "");
+        plot_history("sub-pixel", prof->cull_small, prof->frame, "");
+        plot_history("emitters outside", prof->cull_emitters, prof->frame, "");
+    }
+
+    if (ImGui::CollapsingHeader("Memory"))
+    {
+        plot_history("live", prof->memory_kb, prof->frame, "KB");
+        int effect = (*selected >= 0 && *selected < prof->system_num) ? prof->systems[*selected].PS->mem_effect : -1;
+
+        ImGui::Columns(5, "memory");
+        ImGui::Text("Tag"); ImGui::NextColumn();
+        ImGui::Text("Live KB"); ImGui::NextColumn();
+        ImGui::Text("Peak KB"); ImGui::NextColumn();
+        ImGui::Text("Blocks"); ImGui::NextColumn();
+        ImGui::Text("Selected KB"); ImGui::NextColumn();
+        ImGui::Separator();
+        for (int tag = 0; tag <= MEM_TAG_NUM; tag++)
         {
-            auto attrib = particle_attribute_map[i];
-            if (str_equals(attribute, attrib.name))
-            {
-                particle_attrib_found = true;
-                switch (type)
-                {
-                case ATTR_BOOLEAN:
-                    {
-                        if (!attrib.b_value || attrib.type != type)
-                        {
-                            printf("Error: no boolean value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        *attrib.b_value = convert_boolean(value.s, value.len);
-                    } break;
-                case ATTR_F1:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no scalar value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        *attrib.value = convert_f1(value.s, value.len);
-                    } break;
-                case ATTR_F2:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no vec2 value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        convert_f2(attrib.value, value.s, value.len);
-                    } break;
-                case ATTR_F3:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no vec3 value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        convert_f3(attrib.value, value.s, value.len);
-                    } break;
-                case ATTR_F4:
-                    {
-                        if (!attrib.value || attrib.type != type)
-                        {
-                            printf("Error: no vec4 value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        convert_f4(attrib.value, value.s, value.len);
-                    } break;
-                case ATTR_PROGRAM:
-                    {
-                        if (!attrib.p_value) // TODO: get the return type of the program, ensure compatible
-                        {
-                            printf("Error: no program value allowed for %s\n", attrib.name);
-                            goto err;
-                        }
-                        *attrib.p_value = compile_particle_expr(&result, value.s, value.len);
-                    } break;
-                }
-            }
+            Mem_Usage u = mem_usage(tag);
+            Mem_Usage e = mem_effect_usage(effect, tag);
+            ImGui::Text("%s", (tag < MEM_TAG_NUM) ? mem_tag_names[tag] : "total"); ImGui::NextColumn();
+            ImGui::Text("%.1f", u.live / 1024.0); ImGui::NextColumn();
+            ImGui::Text("%.1f", u.peak / 1024.0); ImGui::NextColumn();
+            ImGui::Text("%lld", (long long)u.blocks); ImGui::NextColumn();
+            ImGui::Text("%.1f", e.live / 1024.0); ImGui::NextColumn();
         }
-        if (particle_attrib_found) continue;
-
-        char buf[64];
-        strncpy(buf, attribute.s, attribute.len);
-        buf[attribute.len] = '\0';
-        printf("Error: unknown attribute '%s'\n", buf);
-        goto err;
+        ImGui::Columns(1);
     }
-
-    result.sheet_tile_x = (int)sheet_tile_x;
-    result.sheet_tile_y = (int)sheet_tile_y;
-
-    free((void*)file_str);
-    return result;
-
-err:
-    fflush(stdout);
-    free((void*)file_str);
-    return { };
+    ImGui::End();
 }
 
 
@@ -2131,27 +1162,39 @@ int main(int argc, char **argv)
     //GLuint particle_tex = make_particle_texture();
     ParticleSheet sheet = load_particle_sheet("particlesheet02.png", 64);
 
+    // On the heap, counted under MEM_EMITTERS like the batch emitters.
+    Emitter_Instance *emitters = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, 4, sizeof(Emitter_Instance));
+
     //Particle_System PS1 = load_psys();
     Particle_System PS1 = load_particle_system("particle_systems/example.psys");
-    Emitter_Instance E1 = new_emitter(&PS1, vec3{0, 0, 0});
+    emitters[0] = new_emitter(&PS1, vec3{0, 0, 0});
 
     //Particle_System PS2 = create_psys2();
     Particle_System PS2 = load_particle_system("particle_systems/explosion.psys");
-    Emitter_Instance E2 = new_emitter(&PS2, vec3{2, 0, 0});
+    emitters[1] = new_emitter(&PS2, vec3{2, 0, 0});
 
     //Particle_System PS3 = create_psys3();
     Particle_System PS3 = load_particle_system("particle_systems/simple.psys");
-    Emitter_Instance E3 = new_emitter(&PS3, vec3{-2, 0, 0});
+    emitters[2] = new_emitter(&PS3, vec3{-2, 0, 0});
 
     Particle_System PS4 = load_particle_system("particle_systems/explosion_sparks.psys");
-    Emitter_Instance E4 = new_emitter(&PS4, vec3{2, 0, 0});
+    emitters[3] = new_emitter(&PS4, vec3{2, 0, 0});
 
-    FXVM_Machine vm = fxvm_new();
+    Job_System job_system;
+    job_system_init(&job_system, 0);
 
     Camera camera = { };
     camera.zoom = 5.0f;
 
     float time_scale = 1.0f;
+    // Emitters culled for longer than a second are stepped every offscreen_step_divider steps.
+    bool offscreen_slowdown = false;
+    int offscreen_step_divider = 8;
+    // Tiers of the systems with lod_distance, picked per emitter every frame.
+    bool distance_lod = true;
+    // Degrades the systems while the particle cost of the frames is over the budget.
+    bool governor_enabled = false;
+    Particle_Governor governor = new_particle_governor(2000.0f);
 
     MouseWheelData mwdata = { };
     mwdata.camera = &camera;
@@ -2164,14 +1207,13 @@ int main(int argc, char **argv)
     set_window_key_down(&window, key_down, keys);
     set_window_key_up(&window, key_up, keys);
 
-    float time_accum = 0.0f;
-
     float sim_dt = 0.01666f;
     uint64_t sim_ticks = 0;
     float sim_ticks_smooth = 0.0f;
     float sim_ticks_avg = 0.0f;
     uint64_t sim_count = 0;
     float avg_particles = 0;
+    int particles_alive = 0;
 
     uint64_t sim_emit_ticks = 0;
     uint64_t sim_compact_ticks = 0;
@@ -2184,7 +1226,7 @@ int main(int argc, char **argv)
 
     //LARGE_INTEGER start_time = counter;
 
-    Particle_DrawBuffer particle_buffer = { };
+    Particle_DrawBuffer particle_buffer = new_particle_buffer(sheet);
 
     bool last_R = false;
 
@@ -2198,9 +1240,33 @@ int main(int argc, char **argv)
 
     int ps_index = 0;
 
+    const char *ps_names[] = { "example", "explosion", "simple", "explosion_sparks" };
+    Profiler *profiler = (Profiler*)calloc(1, sizeof(Profiler));
+    profiler_init(profiler, PS, ps_names, max_particle_systems);
+
+    Simulate_Job sim_jobs[] = {
+        {&PS1, &emitters[0], 0.0f},
+        {&PS2, &emitters[1], 0.0f},
+        {&PS3, &emitters[2], 0.0f},
+        {&PS4, &emitters[3], 0.0f},
+    };
+    int sim_job_num = sizeof(sim_jobs) / sizeof(sim_jobs[0]);
+
+    // Start the effects already running instead of from an empty scene.
+    FXVM_Machine prewarm_vm = fxvm_new();
+    for (int i = 0; i < sim_job_num; i++) prewarm_emitter(&prewarm_vm, sim_jobs[i].PS, sim_jobs[i].E, 3.0f, sim_dt);
+
+    // From here on the emitters belong to the simulation thread, the render thread only reads snapshots.
+    Async_Simulation async_sim;
+    async_simulation_start(&async_sim, &job_system, sim_jobs, sim_job_num, sim_dt);
+
+    trace_set_thread_name("render");
+    const char *trace_file = "particles_trace.json";
+
     MSG msg = { };
     while (window.running)
     {
+        TRACE_ZONE("frame");
         while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE) > 0)
         {
             TranslateMessage(&msg);
@@ -2221,26 +1287,45 @@ int main(int argc, char **argv)
 
         gui_new_frame((HWND)window.hwnd, window.width, window.height);
 
-        if (!last_R && keys['R'])
-        {
-            free_particle_system(&PS1);
-            free_particle_system(&PS2);
-            free_particle_system(&PS3);
-            free_particle_system(&PS4);
-            PS1 = load_particle_system("particle_systems/example.psys");
-            PS2 = load_particle_system("particle_systems/explosion.psys");
-            PS3 = load_particle_system("particle_systems/simple.psys");
-            PS4 = load_particle_system("particle_systems/explosion_sparks.psys");
-        }
+        bool reload = (!last_R && keys['R']);
         last_R = keys['R'];
 
         ImGui::Begin("Settings");
         ImGui::Text("Simulation");
         ImGui::SliderFloat("Time scale", &time_scale, 0.0f, 5.0f);
+        if (!trace_capturing())
+        {
+            if (ImGui::Button("Start trace")) trace_capture_start();
+        }
+        else if (ImGui::Button("Stop and write trace"))
+        {
+            trace_capture_stop();
+            if (trace_write_chrome_json(trace_file)) printf("wrote trace %s\n", trace_file);
+        }
+        ImGui::SliderInt("Sort depth bits", &particle_buffer.depth_bits, DRAW_SORT_MIN_DEPTH_BITS, DRAW_SORT_MAX_DEPTH_BITS);
+        ImGui::Checkbox("Cull particles", &particle_buffer.culling);
+        ImGui::SliderFloat("Min pixels", &particle_buffer.min_pixels, 0.0f, 8.0f, "%.1f");
+        ImGui::Checkbox("Slow down off-screen emitters", &offscreen_slowdown);
+        ImGui::SliderInt("Off-screen step divider", &offscreen_step_divider, 2, 15);
+        ImGui::Checkbox("Distance LOD", &distance_lod);
+        ImGui::Checkbox("Frame budget governor", &governor_enabled);
+        if (governor_enabled)
+        {
+            ImGui::Indent();
+            ImGui::SliderFloat("Budget", &governor.budget_us, 100.0f, 10000.0f, "%.0f us", 2.0f);
+            ImGui::Text("Level %d of %d", governor.level, PARTICLE_GOVERNOR_MAX_LEVEL);
+            ImGui::Unindent();
+        }
         ImGui::Separator();
         ImGui::Text("Particle Systems");
         if (ImGui::Button("Reload"))
         {
+            reload = true;
+        }
+        if (reload)
+        {
+            // The simulation thread reads the programs, let it finish the current steps first.
+            async_simulation_pause(&async_sim);
             free_particle_system(&PS1);
             free_particle_system(&PS2);
             free_particle_system(&PS3);
@@ -2249,6 +1334,7 @@ int main(int argc, char **argv)
             PS2 = load_particle_system("particle_systems/explosion.psys");
             PS3 = load_particle_system("particle_systems/simple.psys");
             PS4 = load_particle_system("particle_systems/explosion_sparks.psys");
+            async_simulation_resume(&async_sim);
         }
         ImGui::SliderInt("Selected", &ps_index, 0, max_particle_systems - 1);
         ImGui::Separator();
@@ -2312,53 +1398,67 @@ int main(int argc, char **argv)
         QueryPerformanceCounter(&counter);
         LONGLONG tick_count = counter.QuadPart - last_counter.QuadPart;
         float dt = (float)tick_count / (float)freq.QuadPart;
-        time_accum += dt;
-
-        //LONGLONG total_ticks = counter.QuadPart - start_time.QuadPart;
-        //if (total_ticks / freq.QuadPart >= 10) break;
 
-        if (time_accum > 0.1f) time_accum = 0.1f;
+        async_sim.time_scale.store(time_scale, std::memory_order_relaxed);
+        async_simulation_set_offscreen_policy(&async_sim, 1.0f, offscreen_slowdown ? offscreen_step_divider : 0);
 
-        while (time_accum >= sim_dt)
+        bool new_snapshot = false;
+        Simulation_Snapshot *snapshot = async_simulation_acquire(&async_sim, &new_snapshot);
+        if (new_snapshot)
         {
-            float dt = sim_dt * time_scale;
-            uint64_t start_cycles = __rdtsc(), emit_cycles = 0, compact_cycles = 0;
-            simulate(&vm, &PS1, &E1, dt, &emit_cycles, &compact_cycles);
-            simulate(&vm, &PS2, &E2, dt, &emit_cycles, &compact_cycles);
-            simulate(&vm, &PS3, &E3, dt, &emit_cycles, &compact_cycles);
-            simulate(&vm, &PS4, &E4, dt, &emit_cycles, &compact_cycles);
-            uint64_t end_cycles = __rdtsc();
-
-            sim_emit_ticks = emit_cycles;
-            sim_compact_ticks = compact_cycles;
-
-            sim_ticks = end_cycles - start_cycles;
+            sim_emit_ticks = snapshot->emit_cycles;
+            sim_compact_ticks = snapshot->compact_cycles;
+            sim_ticks = snapshot->sim_cycles;
             sim_ticks_smooth = sim_ticks_smooth * 0.99f + sim_ticks * 0.01f;
             sim_ticks_avg += sim_ticks;
-            time_accum -= sim_dt;
 
-            avg_particles += (float)E1.particles_alive + (float)E2.particles_alive + (float)E3.particles_alive;
+            particles_alive = 0;
+            for (int i = 0; i < snapshot->emitter_num; i++)
+            {
+                particles_alive += snapshot->emitters[i].particles_alive;
+            }
+            avg_particles += particles_alive;
             sim_count++;
         }
+
         glClear(GL_COLOR_BUFFER_BIT);
 
-        reset_particle_buffer(&particle_buffer);
-        draw_to_buffer(&particle_buffer, camera, &PS1, &E1);
-        draw_to_buffer(&particle_buffer, camera, &PS2, &E2);
-        draw_to_buffer(&particle_buffer, camera, &PS3, &E3);
-        draw_to_buffer(&particle_buffer, camera, &PS4, &E4);
+        reset_particle_buffer(&particle_buffer, camera, window.width, window.height);
+        if (snapshot)
+        {
+            vec3 eye = particle_view(camera_matrix(camera)).position;
+            for (int i = 0; i < snapshot->emitter_num; i++)
+            {
+                uint64_t draw_start = __rdtsc();
+                Emitter_Snapshot *ES = &snapshot->emitters[i];
+                Particle_Governor_Action action = particle_governor_action(&governor, ES->PS);
+                int lod = distance_lod ? particle_lod_tier(ES->PS, &ES->bounds, eye) : 0;
+                lod += action.lod_bias;
+                if (lod >= ES->PS->lod_tier_num) lod = (ES->PS->lod_tier_num > 1) ? ES->PS->lod_tier_num - 1 : 0;
+                bool visible = draw_snapshot_to_buffer(&particle_buffer, camera, ES, lod);
+                async_simulation_set_visible(&async_sim, i, visible);
+                async_simulation_set_lod(&async_sim, i, lod);
+                async_simulation_set_governor_action(&async_sim, i, &action);
+                profiler_add_draw(profiler, ES->PS, __rdtsc() - draw_start);
+            }
+        }
         draw(&particle_buffer, sheet, floor_tex, camera, window.width, window.height);
 
-        //draw(camera, window.width, window.height, &PS1, &E1);
-        //draw(camera, window.width, window.height, &PS2, &E2);
-        //draw(camera, window.width, window.height, &PS3, &E3);
+        float particle_us = profiler_end_frame(profiler, snapshot, particle_buffer.culling ? &particle_buffer.cull : nullptr, governor.level, dt);
+        if (governor_enabled) particle_governor_update(&governor, particle_us);
+        else governor.level = 0;
+        profiler_window(profiler, &ps_index);
+
+        //draw(camera, window.width, window.height, &PS1, &emitters[0]);
+        //draw(camera, window.width, window.height, &PS2, &emitters[1]);
+        //draw(camera, window.width, window.height, &PS3, &emitters[2]);
 
         float fps = 1.0f / dt;
 
         char buf[256];
         snprintf(buf, 256, "FPS %6.3f; SIM %10.lld; sim cycles (tot %8.0f, emit %8.llu, compact %8.llu), particles alive %d. ts: %3.2f",
                 fps, sim_ticks, sim_ticks_smooth, sim_emit_ticks, sim_compact_ticks,
-                E1.particles_alive + E2.particles_alive + E3.particles_alive, time_scale);
+                particles_alive, time_scale);
         set_window_title(window, buf);
 
         ImGui::Render();
@@ -2381,6 +1481,12 @@ int main(int argc, char **argv)
     printf("avg ticks\t smooth\t avg particle\t avg ticks per particle\n");
     printf("%.0f\t %0.f\t  %.3f\t %.3f\n", sim_ticks_avg, sim_ticks_smooth, avg_particles, avg_ticks_per_particle);
 
+    async_simulation_stop(&async_sim);
+    job_system_shutdown(&job_system);
+    mem_free(emitters);
+    free_particle_buffer(&particle_buffer);
+    free(profiler);
+
     gui_deinit();
 
     wglMakeCurrent((HDC)window.hdc, nullptr);
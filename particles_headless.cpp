@@ -0,0 +1,437 @@
+#include "particle_sim.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Headless driver: loads particle systems, runs a fixed number of simulation steps without a window
+ * and prints timings. One emitter is created per .psys file given on the command line.
+ */
+
+static void print_usage(const char *exe)
+{
+    printf("usage: %s [-steps N] [-dt SECONDS] [-threads N] [-trace FILE] [-perf] [-capture STEP PREFIX] [-lod TIER] [-sleep] [-budget US] [-prewarm SECONDS] [-instances N] [file.psys ...]\n", exe);
+    printf("  -steps N     number of fixed steps to run (default 600)\n");
+    printf("  -dt SECONDS  length of one step (default 0.01666)\n");
+    printf("  -threads N   simulate with the job system on N threads, 0 for one per hardware thread\n");
+    printf("               (default: serial simulate on the calling thread)\n");
+    printf("  -trace FILE  capture the trace zones of the steps and write them as Chrome trace JSON\n");
+    printf("  -perf        sample the hardware performance counters in every trace zone (Linux)\n");
+    printf("  -capture STEP PREFIX\n");
+    printf("               write every VM dispatch of step STEP to PREFIX<n>.fxcap, for fxvm-replay\n");
+    printf("  -lod TIER    simulate every emitter at this LOD tier of its system, or its last one (default 0)\n");
+    printf("  -sleep       step the emitters with an Emitter_Scheduler, idle emitters are skipped\n");
+    printf("  -budget US   degrade the systems with a Particle_Governor while a step takes longer than US\n");
+    printf("  -prewarm SECONDS\n");
+    printf("               start the emitters this far into their life with prewarm_emitter\n");
+    printf("  -instances N simulate N emitters of every system as one Emitter_Batch (serial)\n");
+}
+
+// Hardware counters per step of every zone, - for the counters that could not be opened.
+static void print_zone_perf(const Perf_Counters *pc, const Perf_Sample *zone_perf, const uint64_t *zone_count, int zone_num, int steps)
+{
+    printf("\nzone                     ipc");
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) printf("\t %s", perf_counter_names[c]);
+    printf("\t (per step)\n");
+    for (int i = 0; i < zone_num; i++)
+    {
+        if (zone_count[i] == 0) continue;
+        const uint64_t *v = zone_perf[i].value;
+        printf("%-24s ", trace_zone_name(i));
+        if (perf_counter_available(pc, PERF_CYCLES) && perf_counter_available(pc, PERF_INSTRUCTIONS) && v[PERF_CYCLES])
+        {
+            printf("%.2f", (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES]);
+        }
+        else
+        {
+            printf("-");
+        }
+        for (int c = 0; c < PERF_COUNTER_NUM; c++)
+        {
+            if (perf_counter_available(pc, c)) printf("\t %.0f", (double)v[c] / steps);
+            else printf("\t -");
+        }
+        printf("\n");
+    }
+}
+
+#ifdef FXVM_STATS
+static void print_program_stats(const FXVM_Stats *stats, const char *file, const char *name, const FXVM_Program *program)
+{
+    const FXVM_ProgramStats *ps = fxvm_stats_find_program(stats, program);
+    if (!ps) return;
+    printf("%-40s %-20s %d\t %llu\t %llu\t %llu\t %.2f\n", file, name, ps->len,
+            (unsigned long long)ps->dispatches,
+            (unsigned long long)ps->instances,
+            (unsigned long long)ps->cycles,
+            ps->instances ? (double)ps->cycles / ps->instances : 0.0);
+}
+
+static void print_vm_stats(const FXVM_Stats *stats, Particle_System *PS, const char **files, int file_num)
+{
+    printf("\nvm instructions %llu\n", (unsigned long long)fxvm_stats_total_instructions(stats));
+    fxvm_stats_print_opcodes(stats, 20);
+
+    printf("\nsystem                                   program              bytes\t dispatches\t instances\t cycles\t cycles per instance\n");
+    for (int i = 0; i < file_num; i++)
+    {
+        print_program_stats(stats, files[i], "rate", &PS[i].emitter.rate_p);
+        print_program_stats(stats, files[i], "initial_life", &PS[i].emitter.initial_life_p);
+        print_program_stats(stats, files[i], "initial_position", &PS[i].emitter.initial_position_p);
+        print_program_stats(stats, files[i], "initial_velocity", &PS[i].emitter.initial_velocity_p);
+        print_program_stats(stats, files[i], "acceleration", &PS[i].acceleration_p);
+        print_program_stats(stats, files[i], "color", &PS[i].color_p);
+        print_program_stats(stats, files[i], "size", &PS[i].size_p);
+    }
+    if (stats->untracked_dispatches)
+    {
+        printf("untracked dispatches %llu, cycles %llu\n",
+                (unsigned long long)stats->untracked_dispatches, (unsigned long long)stats->untracked_cycles);
+    }
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    int steps = 600;
+    float sim_dt = 0.01666f;
+    bool parallel = false;
+    int thread_num = 0;
+    const char *trace_file = nullptr;
+    bool perf = false;
+    int capture_step = -1;
+    const char *capture_prefix = nullptr;
+    int lod = 0;
+    bool sleep = false;
+    float budget_us = 0.0f;
+    float prewarm_seconds = 0.0f;
+    int instances = 0;
+
+    const char *default_files[] = {
+        "particle_systems/example.psys",
+        "particle_systems/explosion.psys",
+        "particle_systems/simple.psys",
+        "particle_systems/explosion_sparks.psys",
+    };
+    const char **files = (const char**)malloc(sizeof(const char*) * (argc + 4));
+    int file_num = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-steps") == 0 && i + 1 < argc)
+        {
+            steps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-dt") == 0 && i + 1 < argc)
+        {
+            sim_dt = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+        {
+            parallel = true;
+            thread_num = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-perf") == 0)
+        {
+            perf = true;
+        }
+        else if (strcmp(argv[i], "-capture") == 0 && i + 2 < argc)
+        {
+            capture_step = atoi(argv[++i]);
+            capture_prefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "-lod") == 0 && i + 1 < argc)
+        {
+            lod = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-sleep") == 0)
+        {
+            sleep = true;
+        }
+        else if (strcmp(argv[i], "-budget") == 0 && i + 1 < argc)
+        {
+            budget_us = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-prewarm") == 0 && i + 1 < argc)
+        {
+            prewarm_seconds = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-instances") == 0 && i + 1 < argc)
+        {
+            instances = atoi(argv[++i]);
+        }
+        else if (argv[i][0] == '-')
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            files[file_num++] = argv[i];
+        }
+    }
+    if (file_num == 0)
+    {
+        for (int i = 0; i < 4; i++) files[file_num++] = default_files[i];
+    }
+    if (instances > 0 && (parallel || sleep || budget_us > 0.0f || prewarm_seconds > 0.0f))
+    {
+        printf("Error: -instances does not combine with -threads, -sleep, -budget or -prewarm\n");
+        return 1;
+    }
+
+    Particle_System *PS = (Particle_System*)calloc(file_num, sizeof(Particle_System));
+    Emitter_Instance *E = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, file_num, sizeof(Emitter_Instance));
+    for (int i = 0; i < file_num; i++)
+    {
+        PS[i] = load_particle_system(files[i]);
+        E[i] = new_emitter(&PS[i], vec3{2.0f * i - file_num + 1.0f, 0.0f, 0.0f});
+        E[i].lod = (lod < PS[i].lod_tier_num) ? lod : PS[i].lod_tier_num - 1;
+    }
+
+    // A row of instances behind the emitter of every system.
+    Emitter_Batch *batches = (Emitter_Batch*)calloc(file_num, sizeof(Emitter_Batch));
+    for (int i = 0; i < file_num && instances > 0; i++)
+    {
+        batches[i] = new_emitter_batch(&PS[i]);
+        for (int k = 0; k < instances; k++) add_batch_emitter(&batches[i], E[i].position + vec3{0.0f, 0.0f, -2.0f * k});
+    }
+
+    Job_System job_system;
+    Simulate_Job *sim_jobs = nullptr;
+    if (parallel)
+    {
+        job_system_init(&job_system, thread_num);
+        sim_jobs = new Simulate_Job[file_num];
+        for (int i = 0; i < file_num; i++)
+        {
+            sim_jobs[i].PS = &PS[i];
+            sim_jobs[i].E = &E[i];
+            sim_jobs[i].dt = sim_dt;
+        }
+    }
+    FXVM_Machine vm = fxvm_new();
+    if (prewarm_seconds > 0.0f)
+    {
+        auto prewarm_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < file_num; i++) prewarm_emitter(&vm, &PS[i], &E[i], prewarm_seconds, sim_dt);
+        double prewarm_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - prewarm_start).count();
+        printf("prewarmed %d emitters by %.2f s in %.3f ms\n", file_num, prewarm_seconds, prewarm_ms);
+    }
+    Emitter_Scheduler scheduler = new_emitter_scheduler(sim_dt);
+    if (sleep)
+    {
+        for (int i = 0; i < file_num; i++) emitter_scheduler_add(&scheduler, &PS[i], &E[i]);
+    }
+
+    trace_set_thread_name("main");
+    if (trace_file) trace_capture_start();
+    if (perf)
+    {
+        const char *perf_error = nullptr;
+        if (!trace_perf_counters_enable(true, &perf_error))
+        {
+            printf("hardware counters unavailable, %s\n", perf_error);
+            trace_perf_counters_enable(false, nullptr);
+            perf = false;
+        }
+    }
+
+    const int emit_zone = trace_zone_id("emit");
+    const int compact_zone = trace_zone_id("compact");
+
+    // Zone totals before the steps, the loading above is traced as well.
+    int zone_num_before = trace_zone_num();
+    uint64_t zone_cycles_before[TRACE_MAX_ZONES];
+    uint64_t zone_count_before[TRACE_MAX_ZONES];
+    Perf_Sample zone_perf_before[TRACE_MAX_ZONES];
+    for (int i = 0; i < zone_num_before; i++)
+    {
+        zone_cycles_before[i] = trace_zone_total_cycles(i);
+        zone_count_before[i] = trace_zone_total_count(i);
+        zone_perf_before[i] = trace_zone_total_perf(i);
+    }
+
+    uint64_t sim_ticks = 0;
+    double particle_steps = 0.0;
+    int max_particles = 0;
+
+    Particle_Governor governor = new_particle_governor(budget_us);
+    int governor_max_level = 0;
+    int steps_over_budget = 0;
+    double max_step_us = 0.0;
+
+    auto start_time = std::chrono::steady_clock::now();
+    for (int step = 0; step < steps; step++)
+    {
+        TRACE_ZONE("step");
+        if (step == capture_step) sim_capture_dispatches(capture_prefix);
+        auto step_start = std::chrono::steady_clock::now();
+        uint64_t start_ticks = __rdtsc();
+        if (sleep && parallel)
+        {
+            emitter_scheduler_begin_step(&scheduler);
+            for (int k = 0; k < scheduler.awake_num; k++)
+            {
+                int id = scheduler.awake[k];
+                sim_jobs[k].PS = scheduler.PS[id];
+                sim_jobs[k].E = scheduler.E[id];
+            }
+            simulate_parallel(&job_system, sim_jobs, scheduler.awake_num);
+            emitter_scheduler_end_step(&scheduler);
+        }
+        else if (sleep)
+        {
+            emitter_scheduler_step(&scheduler, &vm);
+        }
+        else if (parallel)
+        {
+            simulate_parallel(&job_system, sim_jobs, file_num);
+        }
+        else if (instances > 0)
+        {
+            for (int i = 0; i < file_num; i++)
+            {
+                simulate_batch(&vm, &batches[i], sim_dt);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < file_num; i++)
+            {
+                simulate(&vm, &PS[i], &E[i], sim_dt);
+            }
+        }
+        sim_ticks += __rdtsc() - start_ticks;
+        double step_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - step_start).count();
+        if (step_us > max_step_us) max_step_us = step_us;
+        if (budget_us > 0.0f)
+        {
+            steps_over_budget += (step_us > budget_us);
+            particle_governor_update(&governor, (float)step_us);
+            if (governor.level > governor_max_level) governor_max_level = governor.level;
+            for (int i = 0; i < file_num; i++)
+            {
+                Particle_Governor_Action action = particle_governor_action(&governor, &PS[i]);
+                int tier = lod + action.lod_bias;
+                E[i].lod = (tier < PS[i].lod_tier_num) ? tier : PS[i].lod_tier_num - 1;
+                E[i].rate_throttle = action.rate_throttle;
+                E[i].particle_limit = action.particle_limit;
+            }
+        }
+        if (step == capture_step)
+        {
+            printf("captured %d dispatches of step %d to %s*.fxcap\n", sim_capture_dispatches(nullptr), step, capture_prefix);
+        }
+
+        int particles_alive = 0;
+        for (int i = 0; i < file_num; i++)
+        {
+            particles_alive += (instances > 0) ? batches[i].particles_alive : E[i].particles_alive;
+        }
+        particle_steps += particles_alive;
+        if (particles_alive > max_particles) max_particles = particles_alive;
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    double total_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+
+    if (trace_file)
+    {
+        trace_capture_stop();
+        if (trace_write_chrome_json(trace_file)) printf("wrote trace %s\n", trace_file);
+    }
+
+    uint64_t zone_cycles[TRACE_MAX_ZONES];
+    uint64_t zone_count[TRACE_MAX_ZONES];
+    Perf_Sample zone_perf[TRACE_MAX_ZONES];
+    int zone_num = trace_zone_num();
+    for (int i = 0; i < zone_num; i++)
+    {
+        zone_cycles[i] = trace_zone_total_cycles(i) - ((i < zone_num_before) ? zone_cycles_before[i] : 0);
+        zone_count[i] = trace_zone_total_count(i) - ((i < zone_num_before) ? zone_count_before[i] : 0);
+        zone_perf[i] = trace_zone_total_perf(i);
+        if (i < zone_num_before) zone_perf[i] = perf_sample_sub(zone_perf[i], zone_perf_before[i]);
+    }
+    uint64_t sim_emit_ticks = zone_cycles[emit_zone];
+    uint64_t sim_compact_ticks = zone_cycles[compact_zone];
+
+    printf("systems %d, steps %d, dt %.5f, %s", file_num, steps, sim_dt, parallel ? "parallel" : "serial");
+    if (parallel) printf(" (%d workers)", job_system.worker_num);
+    if (instances > 0) printf(", %d instances per system", instances);
+    printf("\n");
+    for (int i = 0; i < file_num; i++)
+    {
+        printf("%-40s estimated cycles per spawn %.0f, per update %.0f\n", files[i], PS[i].spawn_cycles, PS[i].update_cycles);
+    }
+    if (steps > 0)
+    {
+        double avg_particles = particle_steps / steps;
+        printf("total ms\t ms per step\t avg particles\t max particles\n");
+        printf("%.3f\t %.4f\t %.1f\t %d\n", total_ms, total_ms / steps, avg_particles, max_particles);
+        if (budget_us > 0.0f)
+        {
+            printf("governor budget %.0f us: steps over %d, longest step %.1f us, level %d (max %d)\n",
+                    budget_us, steps_over_budget, max_step_us, governor.level, governor_max_level);
+        }
+        printf("avg ticks\t avg emit\t avg compact\t avg ticks per particle\n");
+        printf("%.0f\t %.0f\t %.0f\t %.3f\n",
+                (double)sim_ticks / steps,
+                (double)sim_emit_ticks / steps,
+                (double)sim_compact_ticks / steps,
+                (particle_steps > 0.0) ? (double)sim_ticks / particle_steps : 0.0);
+
+        printf("\nzone                     count\t avg ticks per step\t avg ticks per zone\n");
+        for (int i = 0; i < zone_num; i++)
+        {
+            if (zone_count[i] == 0) continue;
+            printf("%-24s %llu\t %.0f\t %.0f\n", trace_zone_name(i), (unsigned long long)zone_count[i],
+                    (double)zone_cycles[i] / steps, (double)zone_cycles[i] / zone_count[i]);
+        }
+
+        if (perf)
+        {
+            print_zone_perf(trace_perf_counters(), zone_perf, zone_count, zone_num, steps);
+        }
+    }
+
+#ifdef FXVM_STATS
+    FXVM_Stats vm_stats = *fxvm_stats(&vm);
+    if (parallel)
+    {
+        for (int i = 0; i < job_system.worker_num; i++)
+        {
+            fxvm_stats_merge(&vm_stats, fxvm_stats(&job_system.workers[i].vm));
+        }
+    }
+    print_vm_stats(&vm_stats, PS, files, file_num);
+#endif
+
+    printf("\n");
+    mem_print_usage();
+
+    if (parallel)
+    {
+        job_system_shutdown(&job_system);
+        delete[] sim_jobs;
+    }
+    free_emitter_scheduler(&scheduler);
+    for (int i = 0; i < file_num; i++)
+    {
+        if (instances > 0) free_emitter_batch(&batches[i]);
+        free_particle_system(&PS[i]);
+    }
+    free(batches);
+    mem_free(E);
+    free(PS);
+    free(files);
+
+    int64_t leaked = mem_usage(MEM_TAG_NUM).live;
+    if (leaked != 0) printf("Error: %lld bytes still allocated after freeing the systems\n", (long long)leaked);
+    return 0;
+}
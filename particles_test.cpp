@@ -0,0 +1,601 @@
+// The opcode statistics are checked too, the define changes the layout of FXVM_Machine.
+#define FXVM_STATS
+#define FXVM_IMPL
+#define FXVM_COMPILER_IMPL
+#define FXVM_CAPTURE_IMPL
+#define JOB_SYSTEM_IMPL
+#define TRACE_IMPL
+#define PERF_COUNTERS_IMPL
+#define MEMTRACK_IMPL
+#define DRAW_SORT_IMPL
+#define PARTICLE_DRAW_IMPL
+#define PARTICLE_SIM_IMPL
+#include "particle_sim.h"
+#include "draw_sort.h"
+#include "particle_draw.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+/*
+ * Regression tests, e.g. ./particles-test or ./particles-test batch/ to run the tests whose name starts
+ * with batch/. Prints every failed check and exits with 1 if there was one.
+ */
+
+static int test_failures;
+
+#define TEST_CHECK(cond, ...) \
+    do { \
+        if (!(cond)) \
+        { \
+            printf("Error: %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            test_failures++; \
+        } \
+    } while (0)
+
+static void test_report_error(const char *err)
+{
+    printf("Error: %s\n", err);
+    test_failures++;
+}
+
+static const char *test_systems[] = {
+    "particle_systems/example.psys",
+    "particle_systems/explosion.psys",
+    "particle_systems/simple.psys",
+    "particle_systems/explosion_sparks.psys",
+};
+
+// A batch of one emitter draws the random numbers in the same order as an Emitter_Instance, so the two
+// have to agree particle for particle.
+static void test_batch_matches_instance()
+{
+    const float dt = 0.01666f;
+    const int steps = 300;
+    for (const char *filename : test_systems)
+    {
+        Particle_System PS = load_particle_system(filename);
+        vec3 origin = vec3{1.0f, 0.0f, -2.0f};
+
+        FXVM_Machine vm = fxvm_new();
+        Emitter_Instance *E = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, 1, sizeof(Emitter_Instance));
+        *E = new_emitter(&PS, origin);
+        Emitter_Batch B = new_emitter_batch(&PS);
+        add_batch_emitter(&B, origin);
+
+        int mismatches = 0;
+        for (int step = 0; step < steps && mismatches == 0; step++)
+        {
+            pcg32_srandom_r(&vm.rng, step, 1);
+            simulate(&vm, &PS, E, dt);
+            pcg32_srandom_r(&vm.rng, step, 1);
+            simulate_batch(&vm, &B, dt);
+
+            if (E->particles_alive != B.particles_alive)
+            {
+                TEST_CHECK(false, "%s step %d: %d particles alive, batch %d", filename, step, E->particles_alive, B.particles_alive);
+                mismatches++;
+                continue;
+            }
+            TEST_CHECK(fabsf(E->life - B.emitter_time[0]) < 1e-4f, "%s step %d: emitter time %f, batch %f", filename, step, E->life, B.emitter_time[0]);
+            for (int i = 0; i < E->particles_alive && mismatches == 0; i++)
+            {
+                vec3 d = E->P.position[i] - B.P.position[i];
+                float diff = fabsf(d.x) + fabsf(d.y) + fabsf(d.z);
+                if (diff > 1e-3f)
+                {
+                    TEST_CHECK(false, "%s step %d: particle %d is %f away from the batch one", filename, step, i, diff);
+                    mismatches++;
+                }
+            }
+        }
+
+        mem_free(E);
+        free_emitter_batch(&B);
+        free_particle_system(&PS);
+    }
+}
+
+// Emitters of a non-looping system that finish at different times are retired, and every particle
+// left still belongs to the emitter it was spawned by.
+static void test_batch_retire()
+{
+    const float dt = 0.01666f;
+    const int emitter_num = 16;
+    Particle_System PS = load_particle_system("particle_systems/simple.psys");
+    PS.emitter.loop = false;
+    PS.emitter.life = 0.5f;
+
+    FXVM_Machine vm = fxvm_new();
+    Emitter_Batch B = new_emitter_batch(&PS);
+    for (int e = 0; e < emitter_num; e++)
+    {
+        add_batch_emitter(&B, vec3{(float)e * 10.0f, 0.0f, 0.0f});
+        B.emitter_time[e] = -0.25f * e;
+    }
+
+    int counts[emitter_num];
+    int last_emitter_num = B.emitter_num;
+    for (int step = 0; step < 2000 && B.emitter_num > 0; step++)
+    {
+        simulate_batch(&vm, &B, dt);
+        TEST_CHECK(B.emitter_num <= last_emitter_num, "step %d: %d emitters, were %d", step, B.emitter_num, last_emitter_num);
+        last_emitter_num = B.emitter_num;
+
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < B.particles_alive; i++)
+        {
+            int e = B.P.emitter_index[i];
+            if (e < 0 || e >= B.emitter_num)
+            {
+                TEST_CHECK(false, "step %d: particle %d has emitter %d of %d", step, i, e, B.emitter_num);
+                break;
+            }
+            counts[e]++;
+            // Emitters keep their order, and are 10 apart, so every particle stays near its own one.
+            float dx = B.P.position[i].x - B.emitter_position[e].x;
+            TEST_CHECK(fabsf(dx) < 5.0f, "step %d: particle %d is %f away from emitter %d", step, i, dx, e);
+        }
+        for (int e = 0; e < B.emitter_num; e++)
+        {
+            TEST_CHECK(counts[e] == B.emitter_particles_alive[e], "step %d: emitter %d has %d particles, counted %d",
+                       step, e, B.emitter_particles_alive[e], counts[e]);
+        }
+    }
+    TEST_CHECK(B.emitter_num == 0, "%d emitters left", B.emitter_num);
+
+    free_emitter_batch(&B);
+    free_particle_system(&PS);
+}
+
+// Once async_simulation_pause() returns, the simulation thread must not step until it is resumed, also when
+// it is paused again right after a resume.
+static void test_async_pause_resume()
+{
+    const float sim_dt = 0.001f;
+    Particle_System PS = load_particle_system("particle_systems/simple.psys");
+    Emitter_Instance *E = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, 1, sizeof(Emitter_Instance));
+    *E = new_emitter(&PS, vec3{0.0f, 0.0f, 0.0f});
+
+    Job_System job_system;
+    job_system_init(&job_system, 1);
+    Simulate_Job *jobs = new Simulate_Job[1];
+    jobs[0].PS = &PS;
+    jobs[0].E = E;
+    jobs[0].dt = sim_dt;
+
+    Async_Simulation sim;
+    async_simulation_start(&sim, &job_system, jobs, 1, sim_dt);
+    async_simulation_pause(&sim);
+    for (int round = 0; round < 200; round++)
+    {
+        async_simulation_resume(&sim);
+        // From no wait at all to a few steps, to hit the simulation thread anywhere on its way out of the pause.
+        if (round % 4 != 0) std::this_thread::sleep_for(std::chrono::microseconds(250 * (round % 9)));
+        async_simulation_acquire(&sim);
+        async_simulation_pause(&sim);
+
+        float life = E->life;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        if (E->life != life)
+        {
+            TEST_CHECK(false, "round %d: emitter time went from %f to %f while paused", round, life, E->life);
+            break;
+        }
+    }
+    async_simulation_resume(&sim);
+    async_simulation_stop(&sim);
+    job_system_shutdown(&job_system);
+
+    delete[] jobs;
+    mem_free(E);
+    free_particle_system(&PS);
+}
+
+// The type of a swizzle is its length. x is encoded as 0 in the mask, so counting the non-zero lanes of
+// the mask gave e.g. a.yx the type float.
+static void test_swizzle_type()
+{
+    static const char *swizzles[] = { "x", "y", "xy", "yx", "xx", "zxy", "xyx", "wzyx", "xxxx", "xyzw" };
+    for (const char *swizzle : swizzles)
+    {
+        char source[64];
+        int len = snprintf(source, sizeof(source), "a.%s;\n", swizzle);
+
+        FXVM_Compiler compiler = { };
+        compiler.report_error = test_report_error;
+        register_attribute(&compiler, "a", FXTYP_F4);
+        bool ok = compile(&compiler, source, source + len) && compiler.error_num == 0;
+        TEST_CHECK(ok, "%s does not compile", source);
+        if (ok)
+        {
+            FXVM_Ast *root = compiler.ast;
+            FXVM_Ast *expr = root->root.nodes[root->root.node_num - 1];
+            TEST_CHECK(expr->kind == FXAST_EXPR_SWIZZLE, "a.%s is not a swizzle", swizzle);
+            TEST_CHECK(expr->type == (FXVM_Type)strlen(swizzle), "a.%s has type %s", swizzle, type_to_string(expr->type));
+        }
+        mem_free(compiler.codegen.buffer);
+        free_compiler(&compiler);
+    }
+}
+
+static bool compile_test_program(FXVM_Program *program, const char *source, FXVM_Type attribute_type)
+{
+    FXVM_Compiler compiler = { };
+    compiler.report_error = test_report_error;
+    register_attribute(&compiler, "a", attribute_type);
+    register_attribute(&compiler, "b", attribute_type);
+    bool ok = compile(&compiler, source, source + strlen(source)) && compiler.error_num == 0;
+    if (ok)
+    {
+        FXVM_Bytecode bytecode = { compiler.codegen.buffer_len, compiler.codegen.buffer };
+        *program = fxvm_program_new(bytecode);
+    }
+    else
+    {
+        mem_free(compiler.codegen.buffer);
+    }
+    free_compiler(&compiler);
+    return ok;
+}
+
+// Every instruction counts at the width of its operands, dot and normalize included, and those two
+// compute over all four components at width 4.
+static void test_stats_width()
+{
+    enum { INSTANCES = 40, GROUP = 16 };
+    static const FXVM_Type types[5] = { FXTYP_NONE, FXTYP_F1, FXTYP_F2, FXTYP_F3, FXTYP_F4 };
+    struct Op_Case { const char *source; FXVM_BytecodeOp op; int min_width; };
+    static const Op_Case cases[] = {
+        { "a + b;", FXOP_ADD, 1 },
+        { "a * b;", FXOP_MUL, 1 },
+        { "dot(a, b);", FXOP_DOT, 2 },
+        { "normalize(a);", FXOP_NORMALIZE, 2 },
+    };
+
+    float a[INSTANCES * 4], b[INSTANCES * 4];
+    for (int i = 0; i < INSTANCES * 4; i++)
+    {
+        a[i] = (float)(i % 4 + 1);
+        b[i] = 1.0f;
+    }
+    FXVM_AttributeBindings bindings = { };
+    bind_attribute(&bindings, 0, FXTYP_F4, 4 * sizeof(float), a);
+    bind_attribute(&bindings, 1, FXTYP_F4, 4 * sizeof(float), b);
+
+    for (const Op_Case &c : cases)
+    {
+        for (int w = c.min_width; w <= 4; w++)
+        {
+            FXVM_Program program = { };
+            if (!compile_test_program(&program, c.source, types[w]))
+            {
+                TEST_CHECK(false, "%s does not compile at width %d", c.source, w);
+                continue;
+            }
+
+            FXVM_Machine vm = fxvm_new();
+            vm.bindings = &bindings;
+            FXVM_State S[GROUP];
+            float result = 0.0f;
+            for (int i = 0; i < INSTANCES; i += GROUP)
+            {
+                int n = (INSTANCES - i < GROUP) ? INSTANCES - i : GROUP;
+                exec<GROUP>(&vm, S, i, n, &program);
+                if (i == 0) result = S[0].r[0].v[0];
+            }
+
+            const FXVM_Stats *stats = fxvm_stats(&vm);
+            for (int k = 0; k < 4; k++)
+            {
+                uint64_t expected = (k == w - 1) ? INSTANCES : 0;
+                TEST_CHECK(stats->op_instances[c.op][k] == expected, "%s at width %d: %llu instructions counted at width %d, expected %llu",
+                           c.source, w, (unsigned long long)stats->op_instances[c.op][k], k + 1, (unsigned long long)expected);
+            }
+
+            // a is (1, 2, 3, 4) and b is (1, 1, 1, 1), cut to the width.
+            if (c.op == FXOP_DOT)
+            {
+                float expected = (float)(w * (w + 1) / 2);
+                TEST_CHECK(fabsf(result - expected) < 1e-5f, "dot at width %d is %f, expected %f", w, result, expected);
+            }
+            if (c.op == FXOP_NORMALIZE)
+            {
+                float expected = 1.0f / sqrtf((float)(w * (w + 1) * (2 * w + 1) / 6));
+                TEST_CHECK(fabsf(result - expected) < 1e-3f, "normalize at width %d has x %f, expected %f", w, result, expected);
+            }
+            fxvm_program_free(&program);
+        }
+    }
+}
+
+// The particle limit evicts the oldest particles after the dead ones were compacted away, by the age
+// the last update left in life_01, which has to move with the particles.
+static void test_evict_oldest()
+{
+    enum { DEAD = 20, LIVE = 30, LIMIT = 20 };
+    Particle_System PS = load_particle_system("particle_systems/simple.psys");
+    FXVM_Machine vm = fxvm_new();
+    Emitter_Instance *E = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, 1, sizeof(Emitter_Instance));
+    *E = new_emitter(&PS, vec3{0.0f, 0.0f, 0.0f});
+    // Past its life with particles left, so it emits none.
+    E->life = PS.emitter.life + 1.0f;
+
+    // As the last update left them: the dead ones first, then live ones of ages 1, 3, .. 59 out of 64 seconds,
+    // in mixed order and one bucket of the eviction histogram apart.
+    Particles *P = &E->P;
+    for (int i = 0; i < DEAD + LIVE; i++)
+    {
+        float age = (i < DEAD) ? 64.0f : (float)(2 * ((i * 7) % LIVE) + 1);
+        P->life_max[i] = 64.0f;
+        P->life_seconds[i] = 64.0f - age;
+        P->life_01[i] = age / 64.0f;
+        P->position[i] = vec3{age, 0.0f, 0.0f};
+    }
+    E->particles_alive = DEAD + LIVE;
+    E->particles_dead = DEAD;
+    E->particle_limit = LIMIT;
+
+    simulate_emitter(&vm, &PS, E, 0.0f);
+
+    TEST_CHECK(E->particles_alive == LIMIT, "%d particles left, limit %d", E->particles_alive, LIMIT);
+    // The youngest LIMIT live ones stay, ages 1 to 2 * LIMIT - 1.
+    for (int i = 0; i < E->particles_alive; i++)
+    {
+        float age = P->life_max[i] - P->life_seconds[i];
+        TEST_CHECK(age < 2.0f * LIMIT, "particle %d of age %.0f survived the eviction", i, age);
+        TEST_CHECK(P->position[i].x == age, "particle %d of age %.0f has the position of age %.0f", i, age, P->position[i].x);
+    }
+
+    mem_free(E);
+    free_particle_system(&PS);
+}
+
+// Counts the particles in [0, count) whose closed form position or speed is out of bounds.
+template <class PARTICLES>
+static int closed_form_outside(PARTICLES *P, int count, float drag, const Particle_Bounds *bounds)
+{
+    const float eps = 1e-3f;
+    int outside = 0;
+    for (int i = 0; i < count; i++)
+    {
+        vec3 p, v;
+        particle_closed_form(P->position[i], P->velocity[i], P->acceleration[i], drag, P->life_max[i] - P->life_seconds[i], &p, &v);
+        bool inside = p.x >= bounds->min.x - eps && p.y >= bounds->min.y - eps && p.z >= bounds->min.z - eps
+                && p.x <= bounds->max.x + eps && p.y <= bounds->max.y + eps && p.z <= bounds->max.z + eps
+                && sqrtf(dot(v, v)) <= bounds->max_speed + eps;
+        outside += !inside;
+    }
+    return outside;
+}
+
+// Closed form bounds are computed per emitter from what its particles spawned with, they still have to
+// contain every particle through a few emitter loops. The emitters move, the bounds must not grow over
+// the whole path.
+static void test_closed_form_bounds()
+{
+    const float dt = 0.01666f;
+    const int steps = 600;
+    const float speed = 5.0f;
+    for (const char *filename : test_systems)
+    {
+        Particle_System PS = load_particle_system(filename);
+        PS.closed_form = true;
+        vec3 origin = vec3{1.0f, 0.0f, -2.0f};
+
+        FXVM_Machine vm = fxvm_new();
+        Emitter_Instance *E = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, 1, sizeof(Emitter_Instance));
+        *E = new_emitter(&PS, origin);
+        Emitter_Batch B = new_emitter_batch(&PS);
+        add_batch_emitter(&B, origin);
+        add_batch_emitter(&B, vec3{-3.0f, 1.0f, 0.0f});
+
+        int instance_outside = 0;
+        int batch_outside = 0;
+        for (int step = 0; step < steps; step++)
+        {
+            E->position.x += speed * dt;
+            B.emitter_position[0].x += speed * dt;
+            simulate(&vm, &PS, E, dt);
+            simulate_batch(&vm, &B, dt);
+            instance_outside += closed_form_outside(&E->P, E->particles_alive, PS.emitter.drag, &E->bounds);
+            batch_outside += closed_form_outside(&B.P, B.particles_alive, PS.emitter.drag, &B.bounds);
+        }
+        TEST_CHECK(instance_outside == 0, "%s: %d particle steps outside the emitter bounds", filename, instance_outside);
+        TEST_CHECK(batch_outside == 0, "%s: %d particle steps outside the batch bounds", filename, batch_outside);
+        float half_path = origin.x + 0.5f * speed * dt * steps;
+        TEST_CHECK(E->particles_alive == 0 || E->bounds.min.x > half_path,
+                "%s: the emitter bounds start at x %.1f, behind the first half of its path", filename, E->bounds.min.x);
+
+        free_emitter_batch(&B);
+        mem_free(E);
+        free_particle_system(&PS);
+    }
+}
+
+static bool write_test_file(const char *filename, const char *text)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) return false;
+    fputs(text, f);
+    fclose(f);
+    return true;
+}
+
+// The closed form acceleration runs once at spawn, the loader rejects programs reading attributes that
+// change over the life of a particle.
+static void test_closed_form_rejects_varying()
+{
+    const char *filename = "particles-test-closed-form.psys";
+    struct { const char *acceleration; bool loads; } cases[] = {
+        {"vec3(0, -0.2, 0);", true},
+        {"vec3(0, -0.2 * particle_random.x, 0);", true},
+        {"vec3(0, -0.2 * particle_life, 0);", false},
+        {"-particle_velocity;", false},
+    };
+    for (auto &c : cases)
+    {
+        char text[256];
+        snprintf(text, sizeof(text), "closed_form = true\nacceleration = {{\n    %s\n}}\n", c.acceleration);
+        if (!write_test_file(filename, text))
+        {
+            test_report_error("can not write particles-test-closed-form.psys");
+            return;
+        }
+        Particle_System PS = load_particle_system(filename);
+        bool loads = PS.closed_form;
+        TEST_CHECK(loads == c.loads, "closed form acceleration %s %s", c.acceleration, loads ? "loads" : "is rejected");
+        free_particle_system(&PS);
+    }
+    remove(filename);
+}
+
+static Perf_Sample perf_sample(uint64_t value, uint64_t time_enabled, uint64_t time_running)
+{
+    Perf_Sample sample = { };
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) sample.value[c] = value;
+    sample.time_enabled = time_enabled;
+    sample.time_running = time_running;
+    return sample;
+}
+
+// The difference of two reads is scaled by its own share of running time. Scaling the running totals of
+// each read first makes a read taken while the group was mostly descheduled larger than a later one.
+static void test_perf_sample_sub()
+{
+    struct Sub_Case { Perf_Sample a, b; uint64_t expected; };
+    Sub_Case cases[] = {
+        { perf_sample(1500, 200, 100), perf_sample(1000, 100, 50), 1000 },  // counting half of the time
+        { perf_sample(1500, 200, 125), perf_sample(1000, 100, 25), 500 },   // counting all of the time in between
+        { perf_sample(1500, 200, 200), perf_sample(1000, 100, 100), 500 },  // no multiplexing
+        { perf_sample(1000, 200, 50), perf_sample(1000, 100, 50), 0 },      // not scheduled in between
+        { perf_sample(900, 200, 150), perf_sample(1000, 100, 50), 0 },      // clamped
+    };
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        Perf_Sample d = perf_sample_sub(cases[i].a, cases[i].b);
+        for (int c = 0; c < PERF_COUNTER_NUM; c++)
+        {
+            TEST_CHECK(d.value[c] == cases[i].expected, "case %d: %s is %llu, expected %llu", i, perf_counter_names[c],
+                       (unsigned long long)d.value[c], (unsigned long long)cases[i].expected);
+        }
+        TEST_CHECK(d.time_running == d.time_enabled, "case %d: the difference is not scaled to the time enabled", i);
+    }
+
+    // Differences of differences, as of the zone totals of trace.h, are not scaled again.
+    Perf_Sample d0 = perf_sample_sub(perf_sample(1500, 200, 100), perf_sample(1000, 100, 50));
+    Perf_Sample d1 = perf_sample_sub(perf_sample(2000, 400, 110), perf_sample(1500, 200, 100));
+    Perf_Sample total = d0;
+    for (int c = 0; c < PERF_COUNTER_NUM; c++) total.value[c] += d1.value[c];
+    total.time_enabled += d1.time_enabled;
+    total.time_running += d1.time_running;
+    Perf_Sample d = perf_sample_sub(total, d0);
+    TEST_CHECK(d.value[0] == d1.value[0], "difference of totals %llu, expected %llu", (unsigned long long)d.value[0], (unsigned long long)d1.value[0]);
+}
+// Mean xz distance of the live particles from the emitter, closed form systems evaluated at their age.
+static float spawn_spread(const Particle_System *PS, const Emitter_Instance *E)
+{
+    const Particles *P = &E->P;
+    float sum = 0.0f;
+    int live = 0;
+    for (int i = 0; i < E->particles_alive; i++)
+    {
+        if (P->life_seconds[i] <= 0.01f) continue;
+        vec3 p = P->position[i];
+        vec3 v = P->velocity[i];
+        if (PS->closed_form) particle_closed_form(p, v, P->acceleration[i], PS->emitter.drag, P->life_max[i] - P->life_seconds[i], &p, &v);
+        vec3 d = p - E->position;
+        sum += sqrtf(d.x * d.x + d.z * d.z);
+        live++;
+    }
+    return (live > 0) ? sum / (float)live : 0.0f;
+}
+
+// prewarm_emitter() has to leave an emitter where stepping it would, over many seeds: as many live
+// particles, the emitter at the same point of its loop, and the particles as far out. Times in the middle
+// of the emission, of the cooldown and a couple of loops in.
+static void test_prewarm_matches_steps()
+{
+    const float dt = 0.01666f;
+    const float seconds[] = { 1.0f, 3.05f, 5.0f };
+    const int seeds = 20;
+    for (const char *filename : test_systems)
+    {
+        Particle_System PS = load_particle_system(filename);
+        Emitter_Instance *stepped = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, 1, sizeof(Emitter_Instance));
+        Emitter_Instance *prewarmed = (Emitter_Instance*)mem_calloc(MEM_EMITTERS, 1, sizeof(Emitter_Instance));
+        FXVM_Machine vm = fxvm_new();
+        for (float T : seconds)
+        {
+            int steps = (int)(T / dt + 0.5f);
+            float live[2] = { }, life[2] = { }, spread[2] = { };
+            for (int seed = 0; seed < seeds; seed++)
+            {
+                pcg32_srandom_r(&vm.rng, seed, 1);
+                *stepped = new_emitter(&PS, vec3{1.0f, 0.0f, -2.0f});
+                *prewarmed = *stepped;
+                for (int step = 0; step < steps; step++) simulate(&vm, &PS, stepped, dt);
+                prewarm_emitter(&vm, &PS, prewarmed, T, dt);
+
+                // prewarm_emitter() compacts at the end, simulate() leaves the last step's dead.
+                live[0] += (float)(stepped->particles_alive - stepped->particles_dead);
+                live[1] += (float)(prewarmed->particles_alive - prewarmed->particles_dead);
+                life[0] += stepped->life;
+                life[1] += prewarmed->life;
+                spread[0] += spawn_spread(&PS, stepped);
+                spread[1] += spawn_spread(&PS, prewarmed);
+            }
+            for (int i = 0; i < 2; i++) live[i] /= seeds, life[i] /= seeds, spread[i] /= seeds;
+
+            TEST_CHECK(fabsf(live[1] - live[0]) <= 0.03f * live[0] + 1.0f,
+                    "%s at %.2f s: %.1f particles prewarmed, %.1f stepped", filename, T, live[1], live[0]);
+            TEST_CHECK(fabsf(life[1] - life[0]) <= dt,
+                    "%s at %.2f s: emitter life %.3f prewarmed, %.3f stepped", filename, T, life[1], life[0]);
+            TEST_CHECK(fabsf(spread[1] - spread[0]) <= 0.05f * spread[0] + 0.01f,
+                    "%s at %.2f s: particles %.3f out prewarmed, %.3f stepped", filename, T, spread[1], spread[0]);
+        }
+        mem_free(prewarmed);
+        mem_free(stepped);
+        free_particle_system(&PS);
+    }
+}
+
+struct Test
+{
+    const char *name;
+    void (*fn)();
+};
+
+static Test tests[] = {
+    {"batch/matches_instance", test_batch_matches_instance},
+    {"batch/retire", test_batch_retire},
+    {"async/pause_resume", test_async_pause_resume},
+    {"compiler/swizzle_type", test_swizzle_type},
+    {"vm/stats_width", test_stats_width},
+    {"perf/sample_sub", test_perf_sample_sub},
+    {"sim/evict_oldest", test_evict_oldest},
+    {"sim/closed_form_bounds", test_closed_form_bounds},
+    {"sim/closed_form_rejects_varying", test_closed_form_rejects_varying},
+    {"sim/prewarm_matches_steps", test_prewarm_matches_steps},
+};
+
+int main(int argc, char **argv)
+{
+    const char *filter = (argc > 1) ? argv[1] : nullptr;
+    int run = 0;
+    for (Test &test : tests)
+    {
+        if (filter && strncmp(test.name, filter, strlen(filter)) != 0) continue;
+        int failures = test_failures;
+        test.fn();
+        printf("%-40s %s\n", test.name, (test_failures == failures) ? "ok" : "FAILED");
+        run++;
+    }
+    printf("%d tests, %d failed checks\n", run, test_failures);
+    return (test_failures > 0) ? 1 : 0;
+}
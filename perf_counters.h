@@ -0,0 +1,223 @@
+#ifndef PERF_COUNTERS
+
+/*
+ * Hardware performance counters of the calling thread, read with perf_event_open on Linux.
+ *
+ * The counters are opened as one group, so they are enabled together and read with one system call.
+ * Counters the kernel or the CPU does not support, or that perf_event_paranoid forbids, are left out
+ * and read as 0. perf_counters_open only fails when none of them can be opened, error then says why.
+ * On other platforms no counters are available.
+ */
+
+#include <cstdint>
+
+enum Perf_Counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_NUM
+};
+
+extern const char *perf_counter_names[PERF_COUNTER_NUM];
+
+// A read holds the raw counts, and the time the group was enabled and the time it was counting, which
+// are less when the kernel multiplexes counters. The differences of perf_sample_sub are scaled up to the
+// time enabled, and have time_running == time_enabled.
+struct Perf_Sample
+{
+    uint64_t value[PERF_COUNTER_NUM];
+    uint64_t time_enabled;
+    uint64_t time_running;
+};
+
+struct Perf_Counters
+{
+    int group_fd;                       // -1 when no counter is open
+    int fd[PERF_COUNTER_NUM];
+    int read_index[PERF_COUNTER_NUM];   // position in the group read, -1 if the counter is unavailable
+    int open_num;
+    char error[128];
+};
+
+bool perf_counters_open(Perf_Counters *pc);
+void perf_counters_close(Perf_Counters *pc);
+bool perf_counter_available(const Perf_Counters *pc, int counter);
+Perf_Sample perf_counters_read(const Perf_Counters *pc);
+
+// The counts from b to a, the later read. Each difference is scaled by the share of the time between the
+// two reads the group was counting, and is 0 if it was not counting at all.
+inline Perf_Sample perf_sample_sub(Perf_Sample a, Perf_Sample b)
+{
+    Perf_Sample result = { };
+    if (a.time_running <= b.time_running || a.time_enabled < b.time_enabled) return result;
+    uint64_t enabled = a.time_enabled - b.time_enabled;
+    uint64_t running = a.time_running - b.time_running;
+    double scale = (enabled > running) ? (double)enabled / (double)running : 1.0;
+    for (int i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+        if (a.value[i] > b.value[i]) result.value[i] = (uint64_t)((a.value[i] - b.value[i]) * scale);
+    }
+    result.time_enabled = enabled;
+    result.time_running = enabled;
+    return result;
+}
+
+#ifdef PERF_COUNTERS_IMPL
+
+#include <cstdio>
+#include <cstring>
+
+const char *perf_counter_names[PERF_COUNTER_NUM] = {
+    "cycles",
+    "instructions",
+    "l1d_misses",
+    "llc_misses",
+    "branch_misses",
+};
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int perf_event_open(perf_event_attr *attr, int group_fd)
+{
+    // This thread, any CPU.
+    return (int)syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+bool perf_counters_open(Perf_Counters *pc)
+{
+    static const uint32_t types[PERF_COUNTER_NUM] = {
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+    };
+    static const uint64_t configs[PERF_COUNTER_NUM] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    *pc = { };
+    pc->group_fd = -1;
+    int first_errno = 0;
+    for (int i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+        pc->fd[i] = -1;
+        pc->read_index[i] = -1;
+
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // The members follow the leader, which is enabled once the whole group is open.
+        attr.disabled = (pc->group_fd == -1);
+
+        int fd = perf_event_open(&attr, pc->group_fd);
+        if (fd == -1)
+        {
+            if (!first_errno) first_errno = errno;
+            continue;
+        }
+        if (pc->group_fd == -1) pc->group_fd = fd;
+        pc->fd[i] = fd;
+        pc->read_index[i] = pc->open_num++;
+    }
+
+    if (pc->group_fd == -1)
+    {
+        snprintf(pc->error, sizeof(pc->error), "perf_event_open failed: %s", strerror(first_errno));
+        return false;
+    }
+    ioctl(pc->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pc->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+void perf_counters_close(Perf_Counters *pc)
+{
+    for (int i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+        if (pc->fd[i] != -1) close(pc->fd[i]);
+        pc->fd[i] = -1;
+        pc->read_index[i] = -1;
+    }
+    pc->group_fd = -1;
+    pc->open_num = 0;
+}
+
+Perf_Sample perf_counters_read(const Perf_Counters *pc)
+{
+    Perf_Sample result = { };
+    if (pc->group_fd == -1) return result;
+
+    // nr, time_enabled, time_running, value[nr]
+    uint64_t data[3 + PERF_COUNTER_NUM];
+    ssize_t size = read(pc->group_fd, data, sizeof(data));
+    if (size < (ssize_t)(sizeof(uint64_t) * 3) || data[2] == 0) return result;
+
+    uint64_t nr = data[0];
+    result.time_enabled = data[1];
+    result.time_running = data[2];
+    for (int i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+        int index = pc->read_index[i];
+        if (index < 0 || (uint64_t)index >= nr) continue;
+        result.value[i] = data[3 + index];
+    }
+    return result;
+}
+
+#else
+
+bool perf_counters_open(Perf_Counters *pc)
+{
+    *pc = { };
+    pc->group_fd = -1;
+    for (int i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+        pc->fd[i] = -1;
+        pc->read_index[i] = -1;
+    }
+    snprintf(pc->error, sizeof(pc->error), "hardware counters are only supported on Linux");
+    return false;
+}
+
+void perf_counters_close(Perf_Counters *pc)
+{
+    (void)pc;
+}
+
+Perf_Sample perf_counters_read(const Perf_Counters *pc)
+{
+    (void)pc;
+    Perf_Sample result = { };
+    return result;
+}
+
+#endif
+
+bool perf_counter_available(const Perf_Counters *pc, int counter)
+{
+    return pc->read_index[counter] >= 0;
+}
+
+#endif // PERF_COUNTERS_IMPL
+
+#define PERF_COUNTERS
+#endif
@@ -0,0 +1,385 @@
+#ifndef TRACE_ZONES
+
+/*
+ * Scoped zone tracing.
+ *
+ *     void emit(...)
+ *     {
+ *         TRACE_ZONE("emit");
+ *         ...
+ *     }
+ *
+ * A zone takes a timestamp when it is entered and when it leaves its scope. Every thread owns a ring
+ * buffer of events and a table of per-zone totals, only the owning thread writes to them, so recording
+ * takes no locks. The totals (cycles and count per zone) are always kept. Events are only recorded
+ * between trace_capture_start and trace_capture_stop, and trace_write_chrome_json writes them in the
+ * Chrome trace event format, which chrome://tracing and https://ui.perfetto.dev open.
+ *
+ * The ring keeps the last TRACE_RING_SIZE events of each thread, older ones are overwritten. Write the
+ * trace after stopping the capture, events written concurrently with trace_write_chrome_json may be torn.
+ *
+ * trace_perf_counters_enable makes the zones also read the hardware counters (perf_counters.h) of their
+ * thread on entry and exit, and add the differences to per-zone totals. A read is a system call, so
+ * this costs far more than the timestamps and is meant for profiling runs only. Threads whose counters
+ * can not be opened record no counter values.
+ */
+
+#include "perf_counters.h"
+
+#include <atomic>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+enum { TRACE_MAX_ZONES = 128, TRACE_MAX_THREADS = 64, TRACE_RING_SIZE = 1 << 16 };
+
+struct Trace_Event
+{
+    uint64_t begin;
+    uint64_t end;
+    int zone;
+};
+
+struct Trace_Thread
+{
+    int id;
+    char name[32];
+
+    // Number of events written so far, the ring index is head % TRACE_RING_SIZE.
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> zone_cycles[TRACE_MAX_ZONES];
+    std::atomic<uint64_t> zone_count[TRACE_MAX_ZONES];
+    std::atomic<uint64_t> zone_perf[TRACE_MAX_ZONES][PERF_COUNTER_NUM];
+    std::atomic<uint64_t> zone_perf_time[TRACE_MAX_ZONES]; // time enabled of the counts in zone_perf
+
+    // Opened on the first zone after trace_perf_counters_enable, perf_state is -1 if that failed.
+    int perf_state;
+    Perf_Counters perf;
+
+    Trace_Event events[TRACE_RING_SIZE];
+};
+
+extern thread_local Trace_Thread *trace_current_thread;
+extern std::atomic<bool> trace_capture_enabled;
+extern std::atomic<bool> trace_perf_enabled;
+
+// Returns the id of the zone with this name, registering it on first use. The name is not copied.
+int trace_zone_id(const char *name);
+const char* trace_zone_name(int zone);
+int trace_zone_num();
+
+Trace_Thread* trace_register_thread();
+// Names the calling thread in the written traces.
+void trace_set_thread_name(const char *name);
+
+void trace_capture_start();
+void trace_capture_stop();
+bool trace_capturing();
+bool trace_write_chrome_json(const char *filename);
+
+// Sums of all threads, since the start of the program.
+uint64_t trace_zone_total_cycles(int zone);
+uint64_t trace_zone_total_count(int zone);
+Perf_Sample trace_zone_total_perf(int zone);
+
+// Returns false if the calling thread has no hardware counters, error (if not null) then says why.
+bool trace_perf_counters_enable(bool enable, const char **error);
+// Reads the counters of the calling thread, opening them first if needed. False if there are none.
+bool trace_perf_begin(Perf_Sample *sample);
+void trace_perf_end(int zone, const Perf_Sample *begin);
+// The counters of the calling thread, null if they are not open.
+const Perf_Counters* trace_perf_counters();
+
+// Returns the end timestamp. perf_begin is null if the zone did not sample the counters.
+inline uint64_t trace_zone_end(int zone, uint64_t begin, const Perf_Sample *perf_begin = nullptr)
+{
+    uint64_t end = __rdtsc();
+    if (perf_begin) trace_perf_end(zone, perf_begin);
+    Trace_Thread *t = trace_current_thread ? trace_current_thread : trace_register_thread();
+    if (!t) return end;
+
+    // Single writer, so no read-modify-write is needed. The atomics only keep concurrent readers defined.
+    t->zone_cycles[zone].store(t->zone_cycles[zone].load(std::memory_order_relaxed) + (end - begin), std::memory_order_relaxed);
+    t->zone_count[zone].store(t->zone_count[zone].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (trace_capture_enabled.load(std::memory_order_relaxed))
+    {
+        uint64_t head = t->head.load(std::memory_order_relaxed);
+        Trace_Event *e = &t->events[head % TRACE_RING_SIZE];
+        e->begin = begin;
+        e->end = end;
+        e->zone = zone;
+        t->head.store(head + 1, std::memory_order_release);
+    }
+    return end;
+}
+
+struct Trace_Scope
+{
+    int zone;
+    bool perf;
+    uint64_t begin;
+    Perf_Sample perf_begin;
+
+    Trace_Scope(int zone) : zone(zone), perf(false)
+    {
+        if (trace_perf_enabled.load(std::memory_order_relaxed)) perf = trace_perf_begin(&perf_begin);
+        begin = __rdtsc();
+    }
+    ~Trace_Scope() { if (zone >= 0) finish(); }
+
+    // Ends the zone before the end of the scope, returns the end timestamp.
+    uint64_t finish()
+    {
+        uint64_t end = trace_zone_end(zone, begin, perf ? &perf_begin : nullptr);
+        zone = -1;
+        return end;
+    }
+};
+
+#define TRACE_CONCAT2(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_ZONE(name)\
+    static const int TRACE_CONCAT(trace_zone_, __LINE__) = trace_zone_id(name);\
+    Trace_Scope TRACE_CONCAT(trace_scope_, __LINE__)(TRACE_CONCAT(trace_zone_, __LINE__))
+
+#ifdef TRACE_IMPL
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+thread_local Trace_Thread *trace_current_thread = nullptr;
+std::atomic<bool> trace_capture_enabled(false);
+std::atomic<bool> trace_perf_enabled(false);
+
+static std::mutex trace_mutex;
+static const char *trace_zone_names[TRACE_MAX_ZONES];
+static std::atomic<int> trace_zone_count(0);
+static Trace_Thread *trace_threads[TRACE_MAX_THREADS];
+static std::atomic<int> trace_thread_count(0);
+
+// Timestamps of the capture start and stop, to convert ticks to microseconds.
+static uint64_t trace_start_ticks;
+static uint64_t trace_stop_ticks;
+static std::chrono::steady_clock::time_point trace_start_time;
+static std::chrono::steady_clock::time_point trace_stop_time;
+
+int trace_zone_id(const char *name)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    int num = trace_zone_count.load();
+    for (int i = 0; i < num; i++)
+    {
+        if (strcmp(trace_zone_names[i], name) == 0) return i;
+    }
+    if (num == TRACE_MAX_ZONES)
+    {
+        printf("ERROR: too many trace zones, %s is counted as %s\n", name, trace_zone_names[num - 1]);
+        return num - 1;
+    }
+    trace_zone_names[num] = name;
+    trace_zone_count.store(num + 1);
+    return num;
+}
+
+const char* trace_zone_name(int zone)
+{
+    return trace_zone_names[zone];
+}
+
+int trace_zone_num()
+{
+    return trace_zone_count.load();
+}
+
+Trace_Thread* trace_register_thread()
+{
+    if (trace_current_thread) return trace_current_thread;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    int num = trace_thread_count.load();
+    if (num == TRACE_MAX_THREADS) return nullptr;
+
+    Trace_Thread *t = (Trace_Thread*)calloc(1, sizeof(Trace_Thread));
+    t->id = num;
+    snprintf(t->name, sizeof(t->name), "thread %d", num);
+    trace_threads[num] = t;
+    trace_thread_count.store(num + 1);
+    trace_current_thread = t;
+    return t;
+}
+
+void trace_set_thread_name(const char *name)
+{
+    Trace_Thread *t = trace_register_thread();
+    if (!t) return;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    snprintf(t->name, sizeof(t->name), "%s", name);
+}
+
+void trace_capture_start()
+{
+    trace_start_time = std::chrono::steady_clock::now();
+    trace_start_ticks = __rdtsc();
+    trace_stop_ticks = 0;
+    trace_capture_enabled.store(true);
+}
+
+void trace_capture_stop()
+{
+    trace_capture_enabled.store(false);
+    trace_stop_time = std::chrono::steady_clock::now();
+    trace_stop_ticks = __rdtsc();
+}
+
+bool trace_capturing()
+{
+    return trace_capture_enabled.load();
+}
+
+bool trace_write_chrome_json(const char *filename)
+{
+    uint64_t stop_ticks = trace_stop_ticks;
+    std::chrono::steady_clock::time_point stop_time = trace_stop_time;
+    if (trace_capture_enabled.load() || stop_ticks == 0)
+    {
+        stop_time = std::chrono::steady_clock::now();
+        stop_ticks = __rdtsc();
+    }
+    double us = std::chrono::duration<double, std::micro>(stop_time - trace_start_time).count();
+    if (stop_ticks <= trace_start_ticks || us <= 0.0)
+    {
+        printf("ERROR: no trace captured\n");
+        return false;
+    }
+    double us_per_tick = us / (double)(stop_ticks - trace_start_ticks);
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        printf("ERROR: could not open %s for writing\n", filename);
+        return false;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    int thread_num = trace_thread_count.load();
+    for (int ti = 0; ti < thread_num; ti++)
+    {
+        Trace_Thread *t = trace_threads[ti];
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", t->id, t->name);
+        first = false;
+
+        uint64_t head = t->head.load(std::memory_order_acquire);
+        uint64_t tail = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = tail; i < head; i++)
+        {
+            Trace_Event e = t->events[i % TRACE_RING_SIZE];
+            if (e.begin < trace_start_ticks || e.end > stop_ticks) continue;
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    trace_zone_names[e.zone], t->id,
+                    (double)(e.begin - trace_start_ticks) * us_per_tick,
+                    (double)(e.end - e.begin) * us_per_tick);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return true;
+}
+
+uint64_t trace_zone_total_cycles(int zone)
+{
+    uint64_t total = 0;
+    int thread_num = trace_thread_count.load();
+    for (int i = 0; i < thread_num; i++)
+    {
+        total += trace_threads[i]->zone_cycles[zone].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+Perf_Sample trace_zone_total_perf(int zone)
+{
+    Perf_Sample total = { };
+    int thread_num = trace_thread_count.load();
+    for (int i = 0; i < thread_num; i++)
+    {
+        for (int c = 0; c < PERF_COUNTER_NUM; c++)
+        {
+            total.value[c] += trace_threads[i]->zone_perf[zone][c].load(std::memory_order_relaxed);
+        }
+        total.time_enabled += trace_threads[i]->zone_perf_time[zone].load(std::memory_order_relaxed);
+    }
+    // The sums are scaled already.
+    total.time_running = total.time_enabled;
+    return total;
+}
+
+bool trace_perf_begin(Perf_Sample *sample)
+{
+    Trace_Thread *t = trace_register_thread();
+    if (!t || t->perf_state < 0) return false;
+    if (t->perf_state == 0)
+    {
+        t->perf_state = perf_counters_open(&t->perf) ? 1 : -1;
+        if (t->perf_state < 0) return false;
+    }
+    *sample = perf_counters_read(&t->perf);
+    return true;
+}
+
+void trace_perf_end(int zone, const Perf_Sample *begin)
+{
+    Trace_Thread *t = trace_current_thread;
+    Perf_Sample delta = perf_sample_sub(perf_counters_read(&t->perf), *begin);
+    for (int c = 0; c < PERF_COUNTER_NUM; c++)
+    {
+        t->zone_perf[zone][c].store(t->zone_perf[zone][c].load(std::memory_order_relaxed) + delta.value[c], std::memory_order_relaxed);
+    }
+    t->zone_perf_time[zone].store(t->zone_perf_time[zone].load(std::memory_order_relaxed) + delta.time_enabled, std::memory_order_relaxed);
+}
+
+const Perf_Counters* trace_perf_counters()
+{
+    Trace_Thread *t = trace_current_thread;
+    return (t && t->perf_state > 0) ? &t->perf : nullptr;
+}
+
+bool trace_perf_counters_enable(bool enable, const char **error)
+{
+    trace_perf_enabled.store(enable);
+    if (!enable) return true;
+
+    Perf_Sample sample;
+    if (trace_perf_begin(&sample)) return true;
+    if (error)
+    {
+        Trace_Thread *t = trace_current_thread;
+        *error = t ? t->perf.error : "too many threads";
+    }
+    return false;
+}
+
+uint64_t trace_zone_total_count(int zone)
+{
+    uint64_t total = 0;
+    int thread_num = trace_thread_count.load();
+    for (int i = 0; i < thread_num; i++)
+    {
+        total += trace_threads[i]->zone_count[zone].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+#endif // TRACE_IMPL
+
+#define TRACE_ZONES
+#endif